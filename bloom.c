@@ -155,7 +155,7 @@ bloomtable_load(FILE * const fi)
   const size_t nr = fread(raw_bf, sizeof(raw_bf[0]), raw_size, fi);
   assert(nr == raw_size);
   // scan and generate interval index
-  uint32_t offsets[TABLE_MAX_BARRELS/BLOOMTABLE_INTERVAL];
+  uint32_t offsets[TABLE_LIMIT_BARRELS/BLOOMTABLE_INTERVAL];
   uint32_t nr_offsets = 0u;
   const uint8_t *ptr = raw_bf;
   uint32_t i = 0u;
@@ -165,6 +165,7 @@ bloomtable_load(FILE * const fi)
     assert(praw > ptr);
     assert(bf_len);
     if ((i % BLOOMTABLE_INTERVAL) == 0u) {
+      assert(i < TABLE_LIMIT_BARRELS);
       offsets[i/BLOOMTABLE_INTERVAL] = (ptr - raw_bf);
       nr_offsets++;
     }
@@ -222,12 +223,13 @@ bloomtable_free(struct BloomTable * const bt)
 bloomcontainer_build(struct BloomTable * const bt, const int raw_fd,
     const uint64_t off_raw, struct Stat * const stat)
 {
-  const uint64_t pages_cap = TABLE_ALIGN;
+  // at most one page per barrel: the units of one table
+  const uint64_t pages_cap = BARREL_ALIGN * (bt->nr_bf + 1u);
   uint8_t *const pages = huge_alloc(pages_cap);
   assert(pages);
 
   uint8_t *page = pages;
-  uint16_t index_last[TABLE_MAX_BARRELS] = {0};
+  uint16_t index_last[TABLE_LIMIT_BARRELS] = {0};
 
   uint64_t current_page = 0;
   uint64_t off_page = 0;
@@ -301,12 +303,13 @@ bloomcontainer_update(struct BloomContainer * const bc, struct BloomTable * cons
     const int new_raw_fd, const uint64_t new_off_raw, struct Stat * const stat)
 {
   assert(bc->nr_barrels == bt->nr_bf);
-  const uint64_t pages_cap = TABLE_ALIGN;
+  // at most one page per barrel: the units of one table
+  const uint64_t pages_cap = BARREL_ALIGN * (bt->nr_bf + 1u);
   uint8_t *const pages = huge_alloc(pages_cap);
   assert(pages);
 
   uint8_t *page = pages;
-  uint16_t index_last[TABLE_MAX_BARRELS] = {0};
+  uint16_t index_last[TABLE_LIMIT_BARRELS] = {0};
 
   uint64_t current_page = 0;
   uint64_t off_page = 0;
@@ -489,9 +492,13 @@ bloomcontainer_match_nr(struct BloomContainer * const bc, const uint8_t *const p
 bloomcontainer_match(struct BloomContainer * const bc, const uint32_t index, const uint64_t hv)
 {
   uint8_t boxpage[BARREL_ALIGN] __attribute__((aligned(4096)));
+  const uint64_t t0 = stat_stage_begin();
   const bool rf = bloomcontainer_fetch_raw(bc, (uint64_t)index, boxpage);
   assert(rf);
+  stat_stage_end(STAT_STAGE_FETCH_BC, t0);
+  const uint64_t t1 = stat_stage_begin();
   uint8_t *ptr = boxpage;
+  uint64_t bits = 0;
   for (;;) {
     const uint16_t *pid = (typeof(pid))ptr;
     const uint16_t id = *pid;
@@ -499,13 +506,16 @@ bloomcontainer_match(struct BloomContainer * const bc, const uint32_t index, con
     if (id == index) {
       // match one by one
       uint8_t *pbox = (typeof(pbox))(ptr + sizeof(*pid) + sizeof(*plen));
-      return bloomcontainer_match_nr(bc, pbox, hv);
+      bits = bloomcontainer_match_nr(bc, pbox, hv);
+      break;
     } else if (id < index) { // next
       ptr += (sizeof(*pid) + sizeof(*plen) + *plen);
     } else { // id > index
-      return 0;
+      break;
     }
   }
+  stat_stage_end(STAT_STAGE_BLOOM, t1);
+  return bits;
 }
 
   void
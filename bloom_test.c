@@ -190,8 +190,8 @@ containertest(void)
   struct BloomTable *bts[8];
   struct BloomContainer *bcs[8];
   uint8_t hash[20];
-  struct Stat stat;
-  bzero(&stat, sizeof(stat));
+  struct Stat stat[STAT_NR_SHARDS];
+  stat_initial(stat);
 
   // bf & bt
   for (uint64_t z = 0; z < 8; z++) { // level
@@ -211,7 +211,7 @@ containertest(void)
   // bc
   const int rawfd = open("/tmp/bctest", O_CREAT | O_TRUNC | O_RDWR | O_LARGEFILE, 00666);
   assert(rawfd >= 0);
-  bcs[0] = bloomcontainer_build(bts[0], rawfd, 0, &stat);
+  bcs[0] = bloomcontainer_build(bts[0], rawfd, 0, stat);
   assert(bcs[0]);
   uint64_t match=0;
   uint64_t nomatch =0;
@@ -229,7 +229,7 @@ containertest(void)
   printf("match %lu, nomatch %lu (m/n should < 1%%)\n", match, nomatch);
   printf("build[0] ok\n");
 
-  bcs[1] = bloomcontainer_update(bcs[0], bts[1], rawfd, 0, &stat);
+  bcs[1] = bloomcontainer_update(bcs[0], bts[1], rawfd, 0, stat);
   printf("update[1] ok\n");
   uint64_t match01[4]={0};
   for (uint64_t i = 0; i < xcap; i++) {
@@ -248,17 +248,17 @@ containertest(void)
   }
   printf("match1:%lu, 2:%lu\n", match01[1], match01[2]);
 
-  bcs[2] = bloomcontainer_update(bcs[1], bts[2], rawfd, 0, &stat);
+  bcs[2] = bloomcontainer_update(bcs[1], bts[2], rawfd, 0, stat);
   printf("update[2] ok\n");
-  bcs[3] = bloomcontainer_update(bcs[2], bts[3], rawfd, 0, &stat);
+  bcs[3] = bloomcontainer_update(bcs[2], bts[3], rawfd, 0, stat);
   printf("update[3] ok\n");
-  bcs[4] = bloomcontainer_update(bcs[3], bts[4], rawfd, 0, &stat);
+  bcs[4] = bloomcontainer_update(bcs[3], bts[4], rawfd, 0, stat);
   printf("update[4] ok\n");
-  bcs[5] = bloomcontainer_update(bcs[4], bts[5], rawfd, 0, &stat);
+  bcs[5] = bloomcontainer_update(bcs[4], bts[5], rawfd, 0, stat);
   printf("update[5] ok\n");
-  bcs[6] = bloomcontainer_update(bcs[5], bts[6], rawfd, 0, &stat);
+  bcs[6] = bloomcontainer_update(bcs[5], bts[6], rawfd, 0, stat);
   printf("update[6] ok\n");
-  bcs[7] = bloomcontainer_update(bcs[6], bts[7], rawfd, 0, &stat);
+  bcs[7] = bloomcontainer_update(bcs[6], bts[7], rawfd, 0, stat);
   printf("update[7] ok\n");
 
   // match
@@ -284,6 +284,7 @@ containertest(void)
   printf("match count[0-7]:%lu %lu %lu %lu %lu %lu %lu %lu mismatch %lu\n",
       mc[0], mc[1], mc[2], mc[3], mc[4], mc[5], mc[6], mc[7], mismatch);
   printf("containertest: passed\n");
+  stat_destroy(stat);
 }
 
   int
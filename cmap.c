@@ -19,27 +19,121 @@
 #include <assert.h>
 #include <string.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <time.h>
 
 #include "table.h"
 #include "generator.h"
+#include "debug.h"
 #include "cmap.h"
 
+// default unit: one table
 #define CONTAINER_UNIT_SIZE ((TABLE_ALIGN))
+// wait for more releases before discarding
+#define CONTAINER_DISCARD_BATCH_USEC ((10000))
 
+// bits are scanned 64 at a time; the array is padded to whole words
+  static inline size_t
+containermap_nr_bytes(const uint64_t nr_units)
+{
+  return ((nr_units + 63u) >> 6) << 3;
+}
+
+  static inline uint64_t
+containermap_word(const struct ContainerMap * const cm, const uint64_t w)
+{
+  uint64_t word;
+  memcpy(&word, &(cm->bits[w << 3]), sizeof(word));
+  return word;
+}
+
+  static inline bool
+containermap_test(const struct ContainerMap * const cm, const uint64_t id)
+{
+  return (cm->bits[id >> 3] & (1u << (id & 7u))) ? true : false;
+}
+
+  static inline void
+containermap_set(struct ContainerMap * const cm, const uint64_t id)
+{
+  cm->bits[id >> 3] |= (uint8_t)(1u << (id & 7u));
+  cm->nr_used++;
+}
+
+// first free unit at or after 'from'; nr_units if none
+  static uint64_t
+containermap_find_free(const struct ContainerMap * const cm, const uint64_t from)
+{
+  if (from >= cm->nr_units) return cm->nr_units;
+  const uint64_t nr_words = (cm->nr_units + 63u) >> 6;
+  uint64_t w = from >> 6;
+  uint64_t free_bits = (~containermap_word(cm, w)) & (UINT64_MAX << (from & 63u));
+  while (free_bits == 0) {
+    w++;
+    if (w >= nr_words) return cm->nr_units;
+    free_bits = ~containermap_word(cm, w);
+  }
+  const uint64_t id = (w << 6) + (uint64_t)__builtin_ctzll(free_bits);
+  return (id < cm->nr_units) ? id : cm->nr_units;
+}
+
+// resolve CONTAINER_IO_DEFAULT
   static int
-containermap_open_raw(const char * const raw_fn, const off_t cap_hint)
+containermap_io_resolve(const bool blkdev, const int io_mode)
+{
+  if (io_mode != CONTAINER_IO_DEFAULT) return io_mode;
+  return blkdev ? CONTAINER_IO_DIRECT_SYNC : CONTAINER_IO_BUFFERED;
+}
+
+  static int
+containermap_io_flags(const int io_mode)
+{
+  switch (io_mode) {
+    case CONTAINER_IO_BUFFERED: return 0;
+    case CONTAINER_IO_DIRECT: return O_DIRECT;
+    case CONTAINER_IO_DIRECT_DSYNC: return O_DIRECT | O_DSYNC;
+    case CONTAINER_IO_DIRECT_SYNC: return O_DIRECT | O_SYNC;
+    default: assert(false); return 0;
+  }
+}
+
+  const char *
+containermap_io_name(const int io_mode)
+{
+  switch (io_mode) {
+    case CONTAINER_IO_DEFAULT: return "default";
+    case CONTAINER_IO_BUFFERED: return "buffered";
+    case CONTAINER_IO_DIRECT: return "direct";
+    case CONTAINER_IO_DIRECT_DSYNC: return "direct+dsync";
+    case CONTAINER_IO_DIRECT_SYNC: return "direct+sync";
+    default: return "unknown";
+  }
+}
+
+// *pio_mode: in: requested, out: in use
+  static int
+containermap_open_raw(const char * const raw_fn, const off_t cap_hint, int * const pio_mode)
 {
   struct stat rawst;
   int raw_fd = -1;
   assert(raw_fn);
   const int rst0 = stat(raw_fn, &rawst); // test filename
   if ((rst0 == 0) && S_ISBLK(rawst.st_mode)) { // blk device
-    const int blk_flags = O_RDWR | O_LARGEFILE | O_SYNC | O_DIRECT;
+    *pio_mode = containermap_io_resolve(true, *pio_mode);
+    const int blk_flags = O_RDWR | O_LARGEFILE | containermap_io_flags(*pio_mode);
     raw_fd = open(raw_fn, blk_flags);
     if (raw_fd < 0) return -1;
   } else { // is a normal file anyway
+    *pio_mode = containermap_io_resolve(false, *pio_mode);
     const int normal_flags = O_CREAT | O_RDWR | O_LARGEFILE;
-    raw_fd = open(raw_fn, normal_flags, 00644);
+    raw_fd = open(raw_fn, normal_flags | containermap_io_flags(*pio_mode), 00644);
+    if ((raw_fd < 0) && (errno == EINVAL) && (*pio_mode != CONTAINER_IO_BUFFERED)) {
+      // the file system has no O_DIRECT
+      fprintf(stderr, "%s: %s does not support %s, using buffered I/O\n",
+          __func__, raw_fn, containermap_io_name(*pio_mode));
+      *pio_mode = CONTAINER_IO_BUFFERED;
+      raw_fd = open(raw_fn, normal_flags, 00644);
+    }
     if (raw_fd < 0) return -1;
     const int rst1 = stat(raw_fn, &rawst);
     assert(rst1 == 0);
@@ -61,38 +155,57 @@ containermap_probe(struct ContainerMap * const cm, const int raw_fd)
   assert(0 == r);
   if (S_ISBLK(st.st_mode)) { // block device
     ioctl(raw_fd, BLKGETSIZE64, &(cm->total_cap));
-    cm->discard = true;
+    cm->blkdev = true;
   } else { // regular file
     cm->total_cap = st.st_size;
-    cm->discard = false;
+    cm->blkdev = false;
   }
-  cm->nr_units = cm->total_cap / CONTAINER_UNIT_SIZE;
+  cm->discard = true;
+  cm->nr_units = cm->total_cap / cm->unit_size;
   return (cm->nr_units > 0) && (cm->total_cap > 0);
 }
 
+// unit_size: multiple of BARREL_ALIGN, at least TABLE_ALIGN
+// io_mode: CONTAINER_IO_*; all I/O buffers are BARREL_ALIGN aligned, so direct I/O is safe
   struct ContainerMap *
-containermap_create(const char * const raw_fn, const uint64_t cap_hint)
+containermap_create_unit(const char * const raw_fn, const uint64_t cap_hint, const uint64_t unit_size,
+    const int io_mode)
 {
+  assert((unit_size >= TABLE_ALIGN) && ((unit_size % BARREL_ALIGN) == 0));
   struct ContainerMap cm0;
   bzero(&cm0, sizeof(cm0));
+  cm0.unit_size = unit_size;
   assert(sizeof(off_t) == sizeof(uint64_t));
-  const int raw_fd = containermap_open_raw(raw_fn, (off_t)cap_hint);
+  int mode = io_mode;
+  const int raw_fd = containermap_open_raw(raw_fn, (off_t)cap_hint, &mode);
   if (raw_fd < 0) return NULL;
   const bool rp = containermap_probe(&cm0, raw_fd);
   if (rp == false) return NULL;
 
-  const size_t nr_bytes = (cm0.nr_units + 7u) >> 3;
+  const size_t nr_bytes = containermap_nr_bytes(cm0.nr_units);
   struct ContainerMap * const cm = (typeof(cm))malloc(sizeof(*cm) + nr_bytes);
   bzero(cm, sizeof(*cm) + nr_bytes);
   cm->nr_units = cm0.nr_units;
+  cm->unit_size = unit_size;
   cm->nr_used = 0;
   cm->total_cap = cm0.total_cap;
   cm->discard = cm0.discard;
+  cm->blkdev = cm0.blkdev;
+  cm->io_mode = mode;
   cm->raw_fd = raw_fd;
+  cm->cursor = random_uint64() % cm->nr_units;
   pthread_mutex_init(&(cm->mutex_cm), NULL);
+  pthread_cond_init(&(cm->cond_cm), NULL);
+  pthread_cond_init(&(cm->cond_discard), NULL);
   return cm;
 }
 
+  struct ContainerMap *
+containermap_create(const char * const raw_fn, const uint64_t cap_hint)
+{
+  return containermap_create_unit(raw_fn, cap_hint, CONTAINER_UNIT_SIZE, CONTAINER_IO_DEFAULT);
+}
+
   struct ContainerMap *
 containermap_load(const char * const meta_fn, const char * const raw_fn)
 {
@@ -109,7 +222,9 @@ containermap_load(const char * const meta_fn, const char * const raw_fn)
   // get device
   struct ContainerMap cm0;
   bzero(&cm0, sizeof(cm0));
-  const int raw_fd = containermap_open_raw(raw_fn, nr_units * CONTAINER_UNIT_SIZE);
+  cm0.unit_size = CONTAINER_UNIT_SIZE;
+  int mode = CONTAINER_IO_DEFAULT;
+  const int raw_fd = containermap_open_raw(raw_fn, nr_units * CONTAINER_UNIT_SIZE, &mode);
   assert(raw_fd >= 0);
   const bool rp = containermap_probe(&cm0, raw_fd);
   assert(rp == true);
@@ -117,8 +232,8 @@ containermap_load(const char * const meta_fn, const char * const raw_fn)
   assert(cm0.nr_units >= nr_units);
 
   const size_t nr_bytes = (nr_units + 7) >> 3;
-  struct ContainerMap * const cm = (typeof(cm))malloc(sizeof(*cm) + nr_bytes);
-  bzero(cm, sizeof(*cm) + nr_bytes);
+  struct ContainerMap * const cm = (typeof(cm))malloc(sizeof(*cm) + containermap_nr_bytes(nr_units));
+  bzero(cm, sizeof(*cm) + containermap_nr_bytes(nr_units));
   // 2: nr_used
   const size_t nus = fread(&(cm->nr_used), sizeof(cm->nr_used), 1, cmap_in);
   assert(nus == 1);
@@ -127,10 +242,16 @@ containermap_load(const char * const meta_fn, const char * const raw_fn)
   assert(nby == nr_bytes);
   // copy values
   cm->nr_units = nr_units;
+  cm->unit_size = CONTAINER_UNIT_SIZE;
   cm->total_cap = cm0.total_cap;
   cm->discard = cm0.discard;
+  cm->blkdev = cm0.blkdev;
+  cm->io_mode = mode;
   cm->raw_fd = raw_fd;
+  cm->cursor = random_uint64() % cm->nr_units;
   pthread_mutex_init(&(cm->mutex_cm), NULL);
+  pthread_cond_init(&(cm->cond_cm), NULL);
+  pthread_cond_init(&(cm->cond_discard), NULL);
   fclose(cmap_in);
   return cm;
 }
@@ -195,48 +316,246 @@ containermap_show(struct ContainerMap * const cm)
   fflush(stdout);
 }
 
+// next-fit from the cursor, wrapping around once
 // return device offset within the reasonable range
   uint64_t
 containermap_alloc(struct ContainerMap * const cm)
 {
   pthread_mutex_lock(&(cm->mutex_cm));
-  const uint64_t rid = random_uint64();
+  uint64_t id = containermap_find_free(cm, cm->cursor);
+  if (id == cm->nr_units) {
+    id = containermap_find_free(cm, 0);
+  }
+  if (id < cm->nr_units) { // hit
+    containermap_set(cm, id);
+    cm->cursor = id + 1;
+    pthread_mutex_unlock(&(cm->mutex_cm));
+    return (id * cm->unit_size);
+  }
+  // full
+  pthread_mutex_unlock(&(cm->mutex_cm));
+  // on full returning invalid offset > last byte
+  return (cm->nr_units + 100u) * cm->unit_size;
+}
 
-  for (uint64_t i = 0; i < cm->nr_units; i++) {
-    const uint64_t id = (i + rid) % cm->nr_units;
-    const uint8_t byte = cm->bits[id >> 3];
-    const uint8_t bit = byte & (1u << (id & 7u));
-    if (bit == 0) { // hit
-      const uint8_t new_byte = byte | (1u << (id & 7u));
-      cm->bits[id >> 3] = new_byte;
-      cm->nr_used++;
+// nr adjacent units; return the offset of the first one
+// returns an invalid offset (like containermap_alloc) if there is no such run
+  uint64_t
+containermap_alloc_contig(struct ContainerMap * const cm, const uint64_t nr)
+{
+  assert(nr && (nr <= 64));
+  pthread_mutex_lock(&(cm->mutex_cm));
+  const uint64_t start = cm->cursor;
+  uint64_t pos = start;
+  bool wrapped = false;
+  while ((wrapped == false) || (pos < start)) {
+    const uint64_t id = containermap_find_free(cm, pos);
+    if ((id + nr) > cm->nr_units) {
+      if (wrapped) break;
+      wrapped = true;
+      pos = 0;
+      continue;
+    }
+    if (wrapped && (id >= start)) break;
+    uint64_t len = 1;
+    while ((len < nr) && (containermap_test(cm, id + len) == false)) {
+      len++;
+    }
+    if (len == nr) { // hit
+      for (uint64_t i = 0; i < nr; i++) {
+        containermap_set(cm, id + i);
+      }
+      cm->cursor = id + nr;
       pthread_mutex_unlock(&(cm->mutex_cm));
-      return (id * CONTAINER_UNIT_SIZE);
+      return (id * cm->unit_size);
     }
+    pos = id + len + 1;
   }
-  // full
   pthread_mutex_unlock(&(cm->mutex_cm));
-  // on full returning invalid offset > last byte
-  return (cm->nr_units + 100u) * CONTAINER_UNIT_SIZE;
+  return (cm->nr_units + 100u) * cm->unit_size;
 }
 
+// block until some unit is released or timeout (seconds)
+  void
+containermap_wait(struct ContainerMap * const cm, const uint64_t nr, const double timeout)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  const double t = ((double)ts.tv_sec) + (((double)ts.tv_nsec) * 1e-9) + timeout;
+  ts.tv_sec = (time_t)t;
+  ts.tv_nsec = (long)((t - (double)ts.tv_sec) * 1e9);
+  pthread_mutex_lock(&(cm->mutex_cm));
+  if ((cm->nr_units - cm->nr_used) < nr) {
+    pthread_cond_timedwait(&(cm->cond_cm), &(cm->mutex_cm), &ts);
+  }
+  pthread_mutex_unlock(&(cm->mutex_cm));
+}
+
+// TRIM for block devices, punch a hole in regular files
+  static void
+containermap_discard_range(struct ContainerMap * const cm, const uint64_t offset, const uint64_t length)
+{
+  if (cm->blkdev) {
+    const uint64_t range[2] = {offset, length};
+    ioctl(cm->raw_fd, BLKDISCARD, range);
+  } else {
+    fallocate(cm->raw_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length);
+  }
+}
+
+// with the discard thread, a released unit stays allocated until it is discarded
   bool
 containermap_release(struct ContainerMap * const cm, const uint64_t offset)
 {
   pthread_mutex_lock(&(cm->mutex_cm));
-  assert((offset & (CONTAINER_UNIT_SIZE - 1u)) == 0);
-  const uint64_t id = offset / CONTAINER_UNIT_SIZE;
+  assert((offset % cm->unit_size) == 0);
+  const uint64_t id = offset / cm->unit_size;
   assert(id < cm->nr_units);
-  const uint8_t byte = cm->bits[id >> 3];
-  const uint8_t new_byte = byte & (~ (1u << (id & 7u)));
-  assert(new_byte < byte);
-  cm->bits[id >> 3] = new_byte;
-  cm->nr_used--;
+  assert(containermap_test(cm, id));
+  if (cm->pending) { // queue it
+    assert((cm->pending[id >> 3] & (1u << (id & 7u))) == 0);
+    cm->pending[id >> 3] |= (uint8_t)(1u << (id & 7u));
+    cm->nr_pending++;
+    pthread_cond_signal(&(cm->cond_discard));
+    pthread_mutex_unlock(&(cm->mutex_cm));
+    return true;
+  }
   if ((cm->discard == true) && (cm->raw_fd >= 0)) { // issue TRIM
-    const uint64_t range[2] = {offset, CONTAINER_UNIT_SIZE};
-    ioctl(cm->raw_fd, BLKDISCARD, range);
+    containermap_discard_range(cm, offset, cm->unit_size);
+  }
+  cm->bits[id >> 3] &= (uint8_t)(~(1u << (id & 7u)));
+  cm->nr_used--;
+  pthread_cond_broadcast(&(cm->cond_cm));
+  pthread_mutex_unlock(&(cm->mutex_cm));
+  return true;
+}
+
+// take the first run of pending units (at most max_nr); return its length
+// the units are still marked pending and used
+  static uint64_t
+containermap_pending_run(struct ContainerMap * const cm, const uint64_t max_nr, uint64_t * const pid)
+{
+  const uint64_t nr_words = (cm->nr_units + 63u) >> 6;
+  for (uint64_t w = 0; w < nr_words; w++) {
+    uint64_t word;
+    memcpy(&word, &(cm->pending[w << 3]), sizeof(word));
+    if (word == 0) continue;
+    const uint64_t id = (w << 6) + (uint64_t)__builtin_ctzll(word);
+    uint64_t len = 1;
+    while ((len < max_nr) && ((id + len) < cm->nr_units)
+        && (cm->pending[(id + len) >> 3] & (1u << ((id + len) & 7u)))) {
+      len++;
+    }
+    *pid = id;
+    return len;
+  }
+  return 0;
+}
+
+  static void
+containermap_discard_done(struct ContainerMap * const cm, const uint64_t id0, const uint64_t len)
+{
+  for (uint64_t id = id0; id < (id0 + len); id++) {
+    cm->pending[id >> 3] &= (uint8_t)(~(1u << (id & 7u)));
+    cm->bits[id >> 3] &= (uint8_t)(~(1u << (id & 7u)));
+  }
+  cm->nr_pending -= len;
+  cm->nr_used -= len;
+  pthread_cond_broadcast(&(cm->cond_cm));
+}
+
+// coalesce the queued units into runs and discard them at a limited rate
+  static void *
+containermap_discard_thread(void * const ptr)
+{
+  struct ContainerMap * const cm = (typeof(cm))ptr;
+  const uint64_t max_nr = (cm->discard_rate && (cm->discard_rate < (cm->unit_size * 64u)))
+    ? ((cm->discard_rate + cm->unit_size - 1u) / cm->unit_size) : 64u;
+  pthread_mutex_lock(&(cm->mutex_cm));
+  while (true) {
+    if (cm->nr_pending == 0) {
+      if (cm->discard_stop) break;
+      pthread_cond_wait(&(cm->cond_discard), &(cm->mutex_cm));
+      if (cm->discard_stop == false) { // let a batch of releases arrive
+        pthread_mutex_unlock(&(cm->mutex_cm));
+        usleep(CONTAINER_DISCARD_BATCH_USEC);
+        pthread_mutex_lock(&(cm->mutex_cm));
+      }
+      continue;
+    }
+    uint64_t id = 0;
+    const uint64_t len = containermap_pending_run(cm, max_nr, &id);
+    assert(len);
+    pthread_mutex_unlock(&(cm->mutex_cm));
+    const double sec0 = debug_time_sec();
+    if (cm->discard) {
+      containermap_discard_range(cm, id * cm->unit_size, len * cm->unit_size);
+    }
+    pthread_mutex_lock(&(cm->mutex_cm));
+    containermap_discard_done(cm, id, len);
+    cm->nr_discard_ops++;
+    cm->nr_discarded += len;
+    if (cm->discard_rate && cm->discard && (cm->discard_stop == false)) { // throttle
+      const double sec = ((double)(len * cm->unit_size)) / ((double)cm->discard_rate);
+      const double sec1 = debug_time_sec();
+      if ((sec1 - sec0) < sec) {
+        pthread_mutex_unlock(&(cm->mutex_cm));
+        usleep((useconds_t)((sec - (sec1 - sec0)) * 1e6));
+        pthread_mutex_lock(&(cm->mutex_cm));
+      }
+    }
   }
   pthread_mutex_unlock(&(cm->mutex_cm));
+  pthread_exit(NULL);
+  return NULL;
+}
+
+// release becomes asynchronous; rate: bytes per second, 0 for unlimited
+  void
+containermap_discard_start(struct ContainerMap * const cm, const bool discard, const uint64_t rate)
+{
+  assert(cm->pending == NULL);
+  cm->pending = (typeof(cm->pending))malloc(containermap_nr_bytes(cm->nr_units));
+  assert(cm->pending);
+  bzero(cm->pending, containermap_nr_bytes(cm->nr_units));
+  cm->discard = discard;
+  cm->discard_rate = rate;
+  cm->discard_stop = false;
+  const int rc = pthread_create(&(cm->t_discard), NULL, containermap_discard_thread, cm);
+  assert(rc == 0);
+  pthread_setname_np(cm->t_discard, "Discard");
+}
+
+// the queue is drained before returning
+  static void
+containermap_discard_stop(struct ContainerMap * const cm)
+{
+  pthread_mutex_lock(&(cm->mutex_cm));
+  cm->discard_stop = true;
+  pthread_cond_signal(&(cm->cond_discard));
+  pthread_mutex_unlock(&(cm->mutex_cm));
+  pthread_join(cm->t_discard, NULL);
+  free(cm->pending);
+  cm->pending = NULL;
+}
+
+// used when rebuilding the map from the manifest
+  bool
+containermap_mark_used(struct ContainerMap * const cm, const uint64_t offset)
+{
+  pthread_mutex_lock(&(cm->mutex_cm));
+  assert((offset % cm->unit_size) == 0);
+  const uint64_t id = offset / cm->unit_size;
+  assert(id < cm->nr_units);
+  const uint8_t byte = cm->bits[id >> 3];
+  const uint8_t new_byte = byte | (1u << (id & 7u));
+  if (new_byte == byte) {
+    pthread_mutex_unlock(&(cm->mutex_cm));
+    return false;
+  }
+  cm->bits[id >> 3] = new_byte;
+  cm->nr_used++;
+  pthread_mutex_unlock(&(cm->mutex_cm));
   return true;
 }
 
@@ -244,6 +563,9 @@ containermap_release(struct ContainerMap * const cm, const uint64_t offset)
 containermap_destroy(struct ContainerMap * const cm)
 {
   assert(cm);
+  if (cm->pending) {
+    containermap_discard_stop(cm);
+  }
   close(cm->raw_fd);
   free(cm);
 }
@@ -9,19 +9,49 @@
 #include <stdint.h>
 #include <pthread.h>
 
+// I/O mode of the raw device or file
+enum ContainerIO {
+  CONTAINER_IO_DEFAULT = 0,   // block device: direct+sync, regular file: buffered
+  CONTAINER_IO_BUFFERED,
+  CONTAINER_IO_DIRECT,
+  CONTAINER_IO_DIRECT_DSYNC,
+  CONTAINER_IO_DIRECT_SYNC,
+};
+
 struct ContainerMap {
   uint64_t nr_units;
+  uint64_t unit_size;     // bytes of a unit, TABLE_ALIGN by default
   uint64_t nr_used;
   uint64_t total_cap;
-  bool discard;
+  bool discard;                  // give released units back to the device
+  bool blkdev;
+  int io_mode;                   // CONTAINER_IO_*, resolved
   int raw_fd;
+  uint64_t cursor;               // next-fit position
   pthread_mutex_t mutex_cm;      // lock on operating on ContainerMap
+  pthread_cond_t cond_cm;        // signaled on release
+  // asynchronous discard, see containermap_discard_start()
+  uint8_t * pending;             // released, not yet discarded (still counted in nr_used)
+  uint64_t nr_pending;
+  uint64_t discard_rate;         // bytes per second, 0: unlimited
+  uint64_t nr_discard_ops;
+  uint64_t nr_discarded;         // units
+  bool discard_stop;
+  pthread_cond_t cond_discard;
+  pthread_t t_discard;
   uint8_t bits[];
 };
 
   struct ContainerMap *
 containermap_create(const char * const raw_fn, const uint64_t cap_hint);
 
+  struct ContainerMap *
+containermap_create_unit(const char * const raw_fn, const uint64_t cap_hint, const uint64_t unit_size,
+    const int io_mode);
+
+  const char *
+containermap_io_name(const int io_mode);
+
   struct ContainerMap *
 containermap_load(const char * const meta_fn, const char * const raw_fn);
 
@@ -34,9 +64,21 @@ containermap_show(struct ContainerMap * const cm);
   uint64_t
 containermap_alloc(struct ContainerMap * const cm);
 
+  uint64_t
+containermap_alloc_contig(struct ContainerMap * const cm, const uint64_t nr);
+
+  void
+containermap_wait(struct ContainerMap * const cm, const uint64_t nr, const double timeout);
+
   bool
 containermap_release(struct ContainerMap * const cm, const uint64_t offset);
 
+  void
+containermap_discard_start(struct ContainerMap * const cm, const bool discard, const uint64_t rate);
+
+  bool
+containermap_mark_used(struct ContainerMap * const cm, const uint64_t offset);
+
   void
 containermap_destroy(struct ContainerMap * const cm);
 
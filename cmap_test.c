@@ -15,6 +15,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sys/stat.h>
 
 #include "cmap.h"
 
@@ -63,11 +64,100 @@ cmap_test(void)
   containermap_destroy(cm1);
 }
 
+  static void
+cmap_contig_test(void)
+{
+  const char * const raw_fn = "/tmp/raw_test_contig";
+  const uint64_t unit = UINT64_C(1024 * 1024) * 32;
+  const uint64_t nr_units = 100; // not a multiple of 64
+  unlink(raw_fn);
+  struct ContainerMap * const cm = containermap_create(raw_fn, unit * nr_units);
+  assert(cm);
+  assert(cm->nr_units == nr_units);
+  // fill up, every unit exactly once
+  uint8_t seen[100] = {0};
+  for (uint64_t i = 0; i < nr_units; i++) {
+    const uint64_t off = containermap_alloc(cm);
+    assert(off < cm->total_cap);
+    assert(seen[off / unit] == 0);
+    seen[off / unit] = 1;
+  }
+  assert(containermap_alloc(cm) > cm->total_cap);
+  assert(containermap_alloc_contig(cm, 2) > cm->total_cap);
+  // a hole of 8 across a word boundary
+  for (uint64_t i = 60; i < 68; i++) {
+    containermap_release(cm, i * unit);
+  }
+  // scattered holes
+  containermap_release(cm, 3 * unit);
+  containermap_release(cm, 5 * unit);
+  assert(containermap_alloc_contig(cm, 9) > cm->total_cap);
+  assert(containermap_alloc_contig(cm, 8) == (60 * unit));
+  assert(containermap_alloc_contig(cm, 2) > cm->total_cap);
+  // released units can be waited for
+  containermap_wait(cm, 1, 0.1);
+  const uint64_t off1 = containermap_alloc(cm);
+  const uint64_t off2 = containermap_alloc(cm);
+  assert(((off1 == (3 * unit)) && (off2 == (5 * unit))) || ((off1 == (5 * unit)) && (off2 == (3 * unit))));
+  assert(cm->nr_used == nr_units);
+  containermap_destroy(cm);
+  unlink(raw_fn);
+}
+
+  static void
+cmap_discard_test(void)
+{
+  const char * const raw_fn = "/tmp/raw_test_discard";
+  const uint64_t unit = UINT64_C(1024 * 1024) * 32;
+  const uint64_t nr_units = 16;
+  unlink(raw_fn);
+  struct ContainerMap * const cm = containermap_create(raw_fn, unit * nr_units);
+  assert(cm);
+  containermap_discard_start(cm, true, 0);
+  uint64_t offs[16];
+  for (uint64_t i = 0; i < nr_units; i++) {
+    offs[i] = containermap_alloc(cm);
+    assert(offs[i] < cm->total_cap);
+  }
+  // fill the first 4 units
+  uint8_t * const buf = (typeof(buf))malloc(unit);
+  memset(buf, 0x5a, unit);
+  for (uint64_t i = 0; i < 4; i++) {
+    const ssize_t nw = pwrite(cm->raw_fd, buf, unit, (off_t)(i * unit));
+    assert(nw == (ssize_t)unit);
+  }
+  fsync(cm->raw_fd);
+  struct stat st0;
+  fstat(cm->raw_fd, &st0);
+  // released units are not reusable before they are discarded
+  for (uint64_t i = 0; i < 4; i++) {
+    containermap_release(cm, i * unit);
+  }
+  while (containermap_unused(cm) < 4) {
+    containermap_wait(cm, 4, 0.1);
+  }
+  assert(cm->nr_discarded == 4);
+  assert(cm->nr_discard_ops <= 4);
+  struct stat st1;
+  fstat(cm->raw_fd, &st1);
+  assert(st1.st_blocks < st0.st_blocks);
+  const ssize_t nr = pread(cm->raw_fd, buf, 4096, (off_t)unit);
+  assert(nr == 4096);
+  for (uint64_t i = 0; i < 4096; i++) {
+    assert(buf[i] == 0);
+  }
+  free(buf);
+  containermap_destroy(cm);
+  unlink(raw_fn);
+}
+
 int
 main(int argc, char ** argv)
 {
   (void)argc;
   (void)argv;
   cmap_test();
+  cmap_contig_test();
+  cmap_discard_test();
   return 0;
 }
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <zlib.h>
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include "codec.h"
+
+// favor speed: barrels are compressed on every dump
+#define CODEC_ZLIB_LEVEL ((1))
+#define CODEC_ZSTD_LEVEL ((1))
+
+static const char * codec_names[CODEC_NR] = {"none", "zlib", "lz4", "zstd"};
+
+  bool
+codec_available(const int codec)
+{
+  switch (codec) {
+    case CODEC_NONE: return true;
+    case CODEC_ZLIB: return true;
+#ifdef USE_LZ4
+    case CODEC_LZ4: return true;
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD: return true;
+#endif
+    default: return false;
+  }
+}
+
+  const char *
+codec_name(const int codec)
+{
+  return ((codec >= 0) && (codec < CODEC_NR)) ? codec_names[codec] : "unknown";
+}
+
+  int
+codec_parse(const char * const name)
+{
+  for (int i = 0; i < CODEC_NR; i++) {
+    if (strcmp(name, codec_names[i]) == 0) return i;
+  }
+  return -1;
+}
+
+  static uint64_t
+codec_zlib_compress(const struct CodecDict * const dict, const uint8_t * const src, const uint64_t len,
+    uint8_t * const dst, const uint64_t cap)
+{
+  if (dict == NULL) {
+    uLongf clen = (uLongf)cap;
+    const int r = compress2(dst, &clen, src, (uLong)len, CODEC_ZLIB_LEVEL);
+    return (r == Z_OK) ? ((uint64_t)clen) : 0;
+  }
+  z_stream zs;
+  bzero(&zs, sizeof(zs));
+  const int ri = deflateInit(&zs, CODEC_ZLIB_LEVEL);
+  assert(ri == Z_OK);
+  deflateSetDictionary(&zs, dict->data, dict->size);
+  zs.next_in = (Bytef *)src;
+  zs.avail_in = (uInt)len;
+  zs.next_out = dst;
+  zs.avail_out = (uInt)cap;
+  const int r = deflate(&zs, Z_FINISH);
+  const uint64_t clen = zs.total_out;
+  deflateEnd(&zs);
+  return (r == Z_STREAM_END) ? clen : 0;
+}
+
+  static uint64_t
+codec_zlib_decompress(const struct CodecDict * const dict, const uint8_t * const src, const uint64_t len,
+    uint8_t * const dst, const uint64_t cap)
+{
+  if (dict == NULL) {
+    uLongf rlen = (uLongf)cap;
+    const int r = uncompress(dst, &rlen, src, (uLong)len);
+    return (r == Z_OK) ? ((uint64_t)rlen) : 0;
+  }
+  z_stream zs;
+  bzero(&zs, sizeof(zs));
+  const int ri = inflateInit(&zs);
+  assert(ri == Z_OK);
+  zs.next_in = (Bytef *)src;
+  zs.avail_in = (uInt)len;
+  zs.next_out = dst;
+  zs.avail_out = (uInt)cap;
+  int r = inflate(&zs, Z_FINISH);
+  if (r == Z_NEED_DICT) {
+    inflateSetDictionary(&zs, dict->data, dict->size);
+    r = inflate(&zs, Z_FINISH);
+  }
+  const uint64_t rlen = zs.total_out;
+  inflateEnd(&zs);
+  return (r == Z_STREAM_END) ? rlen : 0;
+}
+
+#ifdef USE_LZ4
+  static uint64_t
+codec_lz4_compress(const struct CodecDict * const dict, const uint8_t * const src, const uint64_t len,
+    uint8_t * const dst, const uint64_t cap)
+{
+  if (dict == NULL) {
+    const int r = LZ4_compress_default((const char *)src, (char *)dst, (int)len, (int)cap);
+    return (r > 0) ? ((uint64_t)r) : 0;
+  }
+  LZ4_stream_t * const ls = LZ4_createStream();
+  assert(ls);
+  LZ4_loadDict(ls, (const char *)dict->data, (int)dict->size);
+  const int r = LZ4_compress_fast_continue(ls, (const char *)src, (char *)dst, (int)len, (int)cap, 1);
+  LZ4_freeStream(ls);
+  return (r > 0) ? ((uint64_t)r) : 0;
+}
+
+  static uint64_t
+codec_lz4_decompress(const struct CodecDict * const dict, const uint8_t * const src, const uint64_t len,
+    uint8_t * const dst, const uint64_t cap)
+{
+  const int r = dict ?
+    LZ4_decompress_safe_usingDict((const char *)src, (char *)dst, (int)len, (int)cap,
+        (const char *)dict->data, (int)dict->size) :
+    LZ4_decompress_safe((const char *)src, (char *)dst, (int)len, (int)cap);
+  return (r > 0) ? ((uint64_t)r) : 0;
+}
+#endif
+
+#ifdef USE_ZSTD
+  static uint64_t
+codec_zstd_compress(const struct CodecDict * const dict, const uint8_t * const src, const uint64_t len,
+    uint8_t * const dst, const uint64_t cap)
+{
+  if (dict == NULL) {
+    const size_t r = ZSTD_compress(dst, cap, src, len, CODEC_ZSTD_LEVEL);
+    return ZSTD_isError(r) ? 0 : ((uint64_t)r);
+  }
+  ZSTD_CCtx * const cctx = ZSTD_createCCtx();
+  assert(cctx);
+  const size_t r = ZSTD_compress_usingCDict(cctx, dst, cap, src, len, (const ZSTD_CDict *)dict->cdict);
+  ZSTD_freeCCtx(cctx);
+  return ZSTD_isError(r) ? 0 : ((uint64_t)r);
+}
+
+  static uint64_t
+codec_zstd_decompress(const struct CodecDict * const dict, const uint8_t * const src, const uint64_t len,
+    uint8_t * const dst, const uint64_t cap)
+{
+  if (dict == NULL) {
+    const size_t r = ZSTD_decompress(dst, cap, src, len);
+    return ZSTD_isError(r) ? 0 : ((uint64_t)r);
+  }
+  ZSTD_DCtx * const dctx = ZSTD_createDCtx();
+  assert(dctx);
+  const size_t r = ZSTD_decompress_usingDDict(dctx, dst, cap, src, len, (const ZSTD_DDict *)dict->ddict);
+  ZSTD_freeDCtx(dctx);
+  return ZSTD_isError(r) ? 0 : ((uint64_t)r);
+}
+#endif
+
+  uint64_t
+codec_compress(const int codec, const struct CodecDict * const dict, const uint8_t * const src,
+    const uint64_t len, uint8_t * const dst, const uint64_t cap)
+{
+  assert((dict == NULL) || (dict->codec == codec));
+  switch (codec) {
+    case CODEC_ZLIB: return codec_zlib_compress(dict, src, len, dst, cap);
+#ifdef USE_LZ4
+    case CODEC_LZ4: return codec_lz4_compress(dict, src, len, dst, cap);
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD: return codec_zstd_compress(dict, src, len, dst, cap);
+#endif
+    default: return 0;
+  }
+}
+
+  uint64_t
+codec_decompress(const int codec, const struct CodecDict * const dict, const uint8_t * const src,
+    const uint64_t len, uint8_t * const dst, const uint64_t cap)
+{
+  assert((dict == NULL) || (dict->codec == codec));
+  switch (codec) {
+    case CODEC_ZLIB: return codec_zlib_decompress(dict, src, len, dst, cap);
+#ifdef USE_LZ4
+    case CODEC_LZ4: return codec_lz4_decompress(dict, src, len, dst, cap);
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD: return codec_zstd_decompress(dict, src, len, dst, cap);
+#endif
+    default: return 0;
+  }
+}
+
+  static struct CodecDict *
+codec_dict_new(const int codec, const uint64_t id, const uint8_t * const data, const uint32_t size)
+{
+  assert(codec_available(codec) && (codec != CODEC_NONE) && size);
+  struct CodecDict * const dict = (typeof(dict))malloc(sizeof(*dict) + size);
+  assert(dict);
+  bzero(dict, sizeof(*dict));
+  dict->id = id;
+  dict->codec = codec;
+  dict->size = size;
+  memcpy(dict->data, data, size);
+#ifdef USE_ZSTD
+  if (codec == CODEC_ZSTD) {
+    dict->cdict = ZSTD_createCDict(dict->data, size, CODEC_ZSTD_LEVEL);
+    dict->ddict = ZSTD_createDDict(dict->data, size);
+    assert(dict->cdict && dict->ddict);
+  }
+#endif
+  return dict;
+}
+
+  struct CodecDict *
+codec_dict_train(const int codec, const uint64_t id, const uint8_t * const samples,
+    const uint64_t * const sizes, const uint64_t nr_samples, const uint64_t cap)
+{
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < nr_samples; i++) {
+    total += sizes[i];
+  }
+  // too little to learn from
+  if ((nr_samples < 8) || (total < cap)) return NULL;
+#ifdef USE_ZSTD
+  if (codec == CODEC_ZSTD) {
+    uint8_t * const buf = (typeof(buf))malloc(cap);
+    assert(buf);
+    assert(sizeof(size_t) == sizeof(sizes[0]));
+    const size_t r = ZDICT_trainFromBuffer(buf, cap, samples, (const size_t *)sizes, (unsigned)nr_samples);
+    struct CodecDict * const dict = ZDICT_isError(r) ? NULL : codec_dict_new(codec, id, buf, (uint32_t)r);
+    free(buf);
+    return dict;
+  }
+#endif
+  // the most recent samples as content; matches nearer the end are cheaper
+  return codec_dict_new(codec, id, samples + total - cap, (uint32_t)cap);
+}
+
+// format: codec, size, data
+  bool
+codec_dict_dump(const struct CodecDict * const dict, FILE * const fo)
+{
+  const uint32_t head[2] = {(uint32_t)dict->codec, dict->size};
+  const size_t nh = fwrite(head, sizeof(head), 1, fo);
+  const size_t nd = fwrite(dict->data, dict->size, 1, fo);
+  return ((nh == 1) && (nd == 1)) ? true : false;
+}
+
+  struct CodecDict *
+codec_dict_load(FILE * const fi, const uint64_t id)
+{
+  uint32_t head[2];
+  const size_t nh = fread(head, sizeof(head), 1, fi);
+  if ((nh != 1) || (head[1] == 0) || (codec_available((int)head[0]) == false)) return NULL;
+  uint8_t * const buf = (typeof(buf))malloc(head[1]);
+  assert(buf);
+  const size_t nd = fread(buf, head[1], 1, fi);
+  struct CodecDict * const dict = (nd == 1) ? codec_dict_new((int)head[0], id, buf, head[1]) : NULL;
+  free(buf);
+  return dict;
+}
+
+  void
+codec_dict_free(struct CodecDict * const dict)
+{
+#ifdef USE_ZSTD
+  if (dict->cdict) ZSTD_freeCDict((ZSTD_CDict *)dict->cdict);
+  if (dict->ddict) ZSTD_freeDDict((ZSTD_DDict *)dict->ddict);
+#endif
+  free(dict);
+}
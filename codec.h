@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// block compressors for barrels.
+// zlib is always built; lz4 and zstd need -DUSE_LZ4 / -DUSE_ZSTD, see Makefile
+enum Codec {
+  CODEC_NONE = 0,
+  CODEC_ZLIB,
+  CODEC_LZ4,
+  CODEC_ZSTD,
+  CODEC_NR,
+};
+
+// a dictionary shared by many barrels.
+// zstd trains one from the samples; zlib and lz4 use the samples as raw content
+struct CodecDict {
+  uint64_t id;
+  int codec;
+  uint64_t refs;            // maintained by the owner
+  struct CodecDict * next;  // for the owner's list
+  void * cdict;             // prepared zstd dictionaries
+  void * ddict;
+  uint32_t size;
+  uint8_t data[];
+};
+
+  bool
+codec_available(const int codec);
+
+  const char *
+codec_name(const int codec);
+
+// return CODEC_* or -1 for unknown names
+  int
+codec_parse(const char * const name);
+
+// return compressed bytes, 0 if it does not fit in cap
+  uint64_t
+codec_compress(const int codec, const struct CodecDict * const dict, const uint8_t * const src,
+    const uint64_t len, uint8_t * const dst, const uint64_t cap);
+
+// return decompressed bytes, 0 on error
+  uint64_t
+codec_decompress(const int codec, const struct CodecDict * const dict, const uint8_t * const src,
+    const uint64_t len, uint8_t * const dst, const uint64_t cap);
+
+// samples: nr_samples pieces of sizes[i] bytes back to back; return NULL if too few
+  struct CodecDict *
+codec_dict_train(const int codec, const uint64_t id, const uint8_t * const samples,
+    const uint64_t * const sizes, const uint64_t nr_samples, const uint64_t cap);
+
+  bool
+codec_dict_dump(const struct CodecDict * const dict, FILE * const fo);
+
+  struct CodecDict *
+codec_dict_load(FILE * const fi, const uint64_t id);
+
+  void
+codec_dict_free(struct CodecDict * const dict);
@@ -32,6 +32,11 @@
 #include "cmap.h"
 #include "generator.h"
 #include "conc.h"
+#include "manifest.h"
+#include "vlog.h"
+#include "ratelimit.h"
+#include "negcache.h"
+#include "rowcache.h"
 
 #include "db.h"
 
@@ -44,8 +49,12 @@ struct Container { // a container of tables
 
 struct VirtualContainer {
   uint64_t start_bit; // 2^bit -> horizontal barrel groups
+  uint64_t path;      // sub_vc ids from root, 3 bits each
   struct Container cc;
   struct VirtualContainer *sub_vc[8];
+  // a leaf: live bytes as last estimated with leaf_count tables, see leaf_nr_out()
+  uint64_t leaf_live;
+  uint64_t leaf_count;
 };
 
 /**
@@ -56,6 +65,8 @@ struct VirtualContainer {
  * Level-9:   2GB:128GB
  * Level-12:  16GB:1TB
  * Level-15:  128GB:8TB
+ * Level-18:  1TB:64TB
+ * Level-21:  8TB:512TB
  */
 
 #define BC_START_BIT      ((UINT64_C(12)))
@@ -63,32 +74,132 @@ struct VirtualContainer {
 // NR = 8
 #define DB_COMPACTION_NR         ((UINT64_C(8)))
 #define DB_COMPACTION_THREADS_NR ((UINT64_C(4)))
-#define DB_FEED_UNIT ((TABLE_MAX_BARRELS/8))
-#define DB_FEED_NR   ((TABLE_MAX_BARRELS/DB_FEED_UNIT))
+// feed threads, each reads 1/8 of an input table
+#define DB_FEED_NR   ((UINT64_C(8)))
+// a leaf with this many tables may be merged in place, see leaf_nr_out()
+#define DB_LEAF_NR     ((UINT64_C(8)))
+// barrels of each table merged to estimate the live data of a leaf; a 2MB arena
+#define DB_LEAF_SAMPLE ((UINT64_C(512)))
+// new tables of a leaf merge dumped at a time
+#define DB_LEAF_ROUND  ((UINT64_C(8)))
+// a leaf is sampled again after this many new tables; the ones in between count as full
+#define DB_LEAF_RESAMPLE ((UINT64_C(4)))
+// default levels of a new store, see "nr_levels"; the deepest level splits into a new one when it fills, see db_grow()
 #define DB_NR_LEVELS ((5))
+// write a fresh manifest when the log grows beyond this
+#define DB_MANIFEST_CHECKPOINT_NR ((UINT64_C(4096)))
+// MANIFEST_VLOG records per commit group
+#define DB_VLOG_GROUP ((UINT64_C(128)))
+#define DB_VLOG_THRESHOLD ((UINT64_C(1024)))
+#define DB_VLOG_RETRY     ((UINT64_C(10)))
+// a device without a configured rate is limited from this rate (MB/s) once lookups are too slow
+#define DB_IO_RATE_DEFAULT ((UINT64_C(512)))
+// the configured rates are scaled by a factor in [MIN, 1], see db_io_tune()
+#define DB_IO_FACTOR_MIN ((0.05))
+// with tiering, levels above this fall back to the fastest device with room, the deeper ones to the slowest
+#define DB_TIER_HOT ((UINT64_C(2)))
+// a compressed table takes (measured ratio * MARGIN) times the raw capacity, up to FILL_MAX
+#define DB_COMPRESS_MARGIN   ((0.75))
+#define DB_COMPRESS_FILL_MAX ((2.5))
+// one dictionary per level, trained from a compaction's output every DB_DICT_RETRAIN compactions
+#define DB_DICT_SIZE     ((UINT64_C(16384)))
+#define DB_DICT_SAMPLES  ((UINT64_C(1) << 20)) // bytes of sampled items
+#define DB_DICT_STRIDE   ((UINT64_C(61)))      // sample one in 61 barrels
+#define DB_DICT_RETRAIN  ((UINT64_C(32)))
 
 struct ContainerMapConf {
   char * raw_fn[6]; // at most 6 raw files
   uint64_t hints[6]; // corresponds to raw_fn
+  int io_mode[6]; // CONTAINER_IO_*
   uint64_t bc_id;
-  uint64_t data_id[DB_NR_LEVELS]; // at most 5 levels
+  uint64_t data_id[DB_MAX_LEVELS]; // 5 in the file, the deeper ones from "deep_dev"
+  uint64_t data_devs[DB_MAX_LEVELS]; // bitmap of the devices a level stripes over, data_id included
+  // options
+  uint64_t packed_meta; // MBs reserved after each table for its metadata, 0: separate files
+  uint64_t discard;     // 1: TRIM/punch-hole released containers (default)
+  uint64_t discard_rate; // MB/s, 0: unlimited
+  uint64_t vlog_dev;    // device of the value log, UINT64_MAX: no key-value separation
+  uint64_t vlog_threshold; // bytes, larger values go to the value log
+  int codec;            // CODEC_* of the barrels in new tables
+  uint64_t table_scale[DB_MAX_LEVELS]; // units per table of each level, 1 -- TABLE_MAX_SCALE
+  uint64_t nr_levels;   // of a new store, 2 -- DB_MAX_LEVELS; a loaded one keeps its own
+  uint64_t max_levels;  // 2 -- DB_MAX_LEVELS
+  uint64_t tiering;     // 1: new tables move to another device when theirs is short of room (default)
+  uint64_t read_rate[6];  // MB/s of compaction reads by device, 0: unlimited
+  uint64_t write_rate[6]; // MB/s of table dumps and BloomContainers by device, 0: unlimited
+  uint64_t io_target;   // us, the p99 of lookups the rates are tuned for, 0: fixed rates
+  uint64_t stat_interval; // seconds between the lines of the STAT file, 0: no file
+  uint64_t trace;         // 1: compaction events to TRACE
+  uint64_t stage_sample;  // time the stages of one in this many lookups, 0: off
+  uint64_t full_metaindex; // 1: new tables index all their overflown barrels, see table_set_full_metaindex()
+  uint64_t neg_cache;     // missed keys to remember, 0: no negative cache
+  uint64_t row_cache;     // MB of found KeyValues to keep, 0: no row cache
+  uint64_t root_images;   // newest tables of the root read from memory, 0: off
 };
 
 struct DB {
   char * persist_dir;
   double sec_start;
   FILE * log;
-  struct Table *active_table[2];
-  struct ContainerMap *cms[DB_NR_LEVELS];
+  struct Table *active_table[3]; // [2]: what [1] spilled to be retained, dumped right after it
+  struct ContainerMap *cms[DB_MAX_LEVELS];
+  uint64_t devs[DB_MAX_LEVELS]; // bitmap of the devices of a level, taken in turn by new tables
   struct ContainerMap *cm_bc;
   struct ContainerMap *cms_dump[6];
+  uint64_t dev_lat[6]; // us to write a unit, a moving average by device; 0: not measured yet
+  uint64_t dev_depth[6];     // table dumps in flight
+  uint64_t dev_nr_dumps[6];
+  uint64_t dev_depth_sum[6]; // of the depth seen by each dump
+  uint64_t nr_dumped0;       // memtables dumped since open, they take the devices of level 0 in turn
+  uint64_t nr_stat_clean;    // db_stat_clean() calls since open, see DBStat.nr_clean
+  uint64_t nr_striped[DB_MAX_LEVELS]; // new tables of the other levels since open, see db_cm_next()
+  bool room_kick;            // the dumper waits for room, see db_room_compaction()
+  // compaction I/O by device, see db_io_tune()
+  struct RateLimit rl_read[6];
+  struct RateLimit rl_write[6];
+  uint64_t read_rate[6];   // bytes per second as configured, 0: unlimited
+  uint64_t write_rate[6];
+  uint64_t io_target;      // us
+  double io_factor;
+  uint64_t io_p99;         // of the last second
+  struct Hist * lat_get;      // lookups since the last tuning, NULL: not tuned
+  // periodic export, see db_stat_tick()
+  uint64_t stat_interval;     // seconds
+  FILE * stat_out;            // NULL: off
+  struct DBStat * stat_last;  // of the last line
+  struct DBStat * stat_now;
+  FILE * trace;               // compaction events, see db_trace(); NULL: off
+  uint64_t nr_traced;         // ids of the traced compactions
+  uint64_t stage_sample;      // see db_stage_sample()
+  bool full_mi;               // for new tables
+  uint64_t root_images;       // see db_root_images()
+  struct NegCache * negcache; // recently missed keys, NULL: off
+  struct RowCache * rowcache; // recently found KeyValues, NULL: off
+  bool tiering;
   struct VirtualContainer *vcroot;
+  struct Manifest *manifest;
+  uint64_t unit_size;  // of all ContainerMaps, fixed at creation
+  uint64_t meta_cap;   // space for packed metadata in a unit, 0: not packed
+  uint64_t table_scale[DB_MAX_LEVELS]; // units per table, fixed at creation
+  uint64_t nr_levels;  // the last one is merged in place, grows up to max_levels
+  uint64_t max_levels;
+  struct VLog *vlog;   // NULL: values are always in the tables
+  struct VLogDrops *vdrops_active; // overwritten in the active tables
+  uint64_t vlog_threshold;
+  int codec;           // CODEC_*
+  uint64_t zratio;     // raw:compressed bytes of compressed barrels, in percent
+  struct CodecDict * dicts;                    // loaded, each referenced by tables
+  struct CodecDict * dict_level[DB_MAX_LEVELS]; // for new tables, holds a reference
+  uint64_t dict_age[DB_MAX_LEVELS];             // compactions since trained
+  bool dict_training[DB_MAX_LEVELS];            // one compaction of the level trains at a time
 
   // locks
   pthread_mutex_t mutex_active;  // lock on dumpping active table
   pthread_mutex_t mutex_current; // lock on operating on active and vcroot
   pthread_mutex_t mutex_root; // lock on compacting root
   pthread_mutex_t mutex_token[DB_COMPACTION_NR];
+  pthread_mutex_t mutex_manifest; // serialize version edits and checkpoints
+  pthread_mutex_t mutex_dict; // dicts and refs
 
   // rwlock
   struct RWLock rwlock;
@@ -110,7 +221,16 @@ struct DB {
   uint64_t compaction_token;
   uint64_t compaction_running_counter;
   // stat
-  struct Stat stat;
+  struct Stat stat[STAT_NR_SHARDS];
+};
+
+// the phases of a compaction, in the order of STAT_LAT_COMP_*
+enum DBPhase {
+  DB_PHASE_FEED = 0,
+  DB_PHASE_BUILD,
+  DB_PHASE_DUMP,
+  DB_PHASE_UPDATE,
+  DB_PHASE_NR,
 };
 
 struct Compaction {
@@ -118,14 +238,19 @@ struct Compaction {
   uint64_t start_bit;
   uint64_t sub_bit; // +3
   bool gen_bc;
+  bool leaf;         // merge a leaf in place: sub_bit == start_bit
   uint64_t nr_feed;
+  uint64_t nr_out;   // 8, or as many as a merged leaf needs
+  uint64_t out_lo;   // the new tables in memory: [out_lo, out_hi)
+  uint64_t out_hi;
   uint64_t feed_id;
+  uint64_t feed_unit;  // barrels per feed thread
   uint64_t feed_token;
   uint64_t bt_token;
   uint64_t dump_token;
   uint64_t bc_token;
   // cms
-  struct ContainerMap * cm_to;
+  struct ContainerMap * cms_to[DB_CONTAINER_NR]; // of each new table
   // pointers
   struct DB * db;
   struct VirtualContainer * vc;
@@ -134,21 +259,36 @@ struct Compaction {
   // level(n)
   struct MetaTable *mts_old[DB_CONTAINER_NR];
   uint64_t mtids_old[DB_CONTAINER_NR];
+  struct VLogDrops *vdrops; // values overwritten by the merge
+  struct CodecDict *dict;   // of the new tables, holds a reference
   // tmp
-  struct Table * tables[8];
+  struct Table * tables[DB_CONTAINER_NR];
   // level(n+1)
-  struct MetaTable *mts_new[8];
-  uint64_t mtids_new[8];
+  struct MetaTable *mts_new[DB_CONTAINER_NR];
+  uint64_t mtids_new[DB_CONTAINER_NR];
+  uint64_t offs_new[DB_CONTAINER_NR];
+  struct BloomTable *bts_new[DB_CONTAINER_NR]; // leaf: for its BloomContainer
   // BC
   struct BloomContainer *mbcs_old[8];
   struct BloomContainer *mbcs_new[8];
+  struct BloomContainer *bc_self; // of vc, released with its last table
+  // trace, see compaction_phase()
+  uint64_t trace_id;   // 0: not traced
+  uint64_t cpu_last;   // of the compaction thread at the end of the last phase
+  uint64_t cpu_usec[DB_PHASE_NR]; // of the worker threads in the current phase
+  uint64_t nr_read;    // bytes of the input tables
+  uint64_t nr_replaced; // items dropped for a newer version
+  uint64_t sizes_new[DB_CONTAINER_NR]; // bytes written for each new table
 };
 
 
-#define DB_META_MAIN             ("META")
-#define DB_META_CMAP_PREFIX      ("CONTAINER_MAP")
+#define DB_META_MAIN             ("META") // legacy text dump
+#define DB_META_CMAP_PREFIX      ("CONTAINER_MAP") // legacy
+#define DB_META_MANIFEST         ("MANIFEST")
 #define DB_META_ACTIVE_TABLE     ("ACTIVE_TABLE")
 #define DB_META_LOG              ("LOG")
+#define DB_META_STAT             ("STAT") // JSON lines, see db_stat_tick()
+#define DB_META_TRACE            ("TRACE") // JSON lines, see db_trace()
 #define DB_META_BACKUP_DIR       ("META_BACKUP")
 
 
@@ -159,25 +299,94 @@ db_generate_meta_fn(struct DB * const db, const uint64_t mtid, char * const path
   sprintf(path, "%s/%02lx/%016lx", db->persist_dir, mtid % 256, mtid);
 }
 
+  static inline uint64_t
+db_level_barrels(const struct DB * const db, const uint64_t level)
+{
+  assert(level < DB_MAX_LEVELS);
+  return TABLE_SCALE_BARRELS(db->table_scale[level]);
+}
+
+// packed metadata fills the units of a table after its barrels
+  static uint64_t
+db_meta_cap(const struct DB * const db, const uint64_t nr_barrels)
+{
+  if (db->meta_cap == 0) return 0;
+  return (TABLE_UNITS(nr_barrels) * db->unit_size) - (BARREL_ALIGN * nr_barrels);
+}
+
+// off is only used for packed tables
   static struct MetaTable *
-db_load_metatable(struct DB * const db, const uint64_t mtid, const int raw_fd, const bool load_bf)
+db_load_metatable(struct DB * const db, const uint64_t start_bit, const uint64_t mtid, const int raw_fd,
+    const uint64_t off, const uint64_t nr_barrels, const bool packed, const bool load_bf)
 {
-  char metafn[2048];
-  db_generate_meta_fn(db, mtid, metafn);
-  struct MetaTable * const mt = metatable_load(metafn, raw_fd, load_bf, &(db->stat));
+  struct MetaTable * mt = NULL;
+  if (packed) {
+    assert(db->meta_cap);
+    mt = metatable_load_packed(raw_fd, off, nr_barrels, db_meta_cap(db, nr_barrels), load_bf, db->stat);
+  } else {
+    char metafn[2048];
+    db_generate_meta_fn(db, mtid, metafn);
+    mt = metatable_load(metafn, raw_fd, nr_barrels, load_bf, db->stat);
+  }
   assert(mt);
   mt->mtid = mtid;
+  mt->start_bit = start_bit;
   return mt;
 }
 
   static void
-db_destory_metatable(struct DB * const db, const uint64_t mtid)
+db_destory_metatable(struct DB * const db, const struct MetaTable * const mt)
 {
+  if (mt->packed) return; // released with its container
   char metafn[2048];
-  db_generate_meta_fn(db, mtid, metafn);
+  db_generate_meta_fn(db, mt->mtid, metafn);
   unlink(metafn);
 }
 
+// a dictionary is a file named by its id, like the metadata of a table
+// return it with a new reference, loaded on first use
+  static struct CodecDict *
+db_dict_get(struct DB * const db, const uint64_t id)
+{
+  pthread_mutex_lock(&(db->mutex_dict));
+  struct CodecDict * dict = db->dicts;
+  while (dict && (dict->id != id)) dict = dict->next;
+  if (dict == NULL) {
+    char dictfn[2048];
+    db_generate_meta_fn(db, id, dictfn);
+    FILE * const fi = fopen(dictfn, "rb");
+    assert(fi);
+    dict = codec_dict_load(fi, id);
+    assert(dict);
+    fclose(fi);
+    dict->next = db->dicts;
+    db->dicts = dict;
+  }
+  dict->refs++;
+  pthread_mutex_unlock(&(db->mutex_dict));
+  return dict;
+}
+
+// the file is removed with the last reference, after the tables using it are dropped
+  static void
+db_dict_put(struct DB * const db, struct CodecDict * const dict)
+{
+  if (dict == NULL) return;
+  pthread_mutex_lock(&(db->mutex_dict));
+  assert(dict->refs);
+  dict->refs--;
+  if (dict->refs == 0) {
+    struct CodecDict ** iter = &(db->dicts);
+    while (*iter != dict) iter = &((*iter)->next);
+    *iter = dict->next;
+    char dictfn[2048];
+    db_generate_meta_fn(db, dict->id, dictfn);
+    unlink(dictfn);
+    codec_dict_free(dict);
+  }
+  pthread_mutex_unlock(&(db->mutex_dict));
+}
+
   static struct BloomContainer *
 db_load_bloomcontainer_meta(struct DB * const db, const uint64_t mtid)
 {
@@ -200,6 +409,8 @@ db_dump_bloomcontainer_meta(struct DB * const db, const uint64_t mtid, struct Bl
   FILE * const fo = fopen(bcmeta_fn, "wb");
   assert(fo);
   const bool r = bloomcontainer_dump_meta(bc, fo);
+  fflush(fo);
+  fsync(fileno(fo));
   fclose(fo);
   return r;
 }
@@ -240,13 +451,33 @@ db_log_diff(struct DB * const db, const double sec0, const char * const msg, ...
   fprintf(db->log, "%s%s\n", head, tail);
 }
 
+// one event in a line of TRACE: {"ev":...}
+  static void
+db_trace(struct DB * const db, const char * const msg, ...)
+{
+  if (db->trace == NULL) return;
+  char line[4096];
+  va_list varg;
+  va_start(varg, msg);
+  vsnprintf(line, sizeof(line), msg, varg);
+  va_end(varg);
+  fprintf(db->trace, "%s\n", line);
+}
+
+  static double
+db_trace_sec(struct DB * const db, const uint64_t usec)
+{
+  return (((double)usec) / 1000000.0) - db->sec_start;
+}
+
   static struct VirtualContainer *
-vc_create(const uint64_t start_bit)
+vc_create(const uint64_t start_bit, const uint64_t path)
 {
   struct VirtualContainer * const vc = (typeof(vc))malloc(sizeof(*vc));
   assert(vc);
   bzero(vc, sizeof(*vc));
   vc->start_bit = start_bit;
+  vc->path = path;
   return vc;
 }
 
@@ -268,6 +499,23 @@ vc_insert_internal(struct VirtualContainer *const vc, struct MetaTable *const mt
   return true;
 }
 
+// remove the oldest nr tables; must used under lock aquired on vc
+  static void
+vc_drop_front(struct VirtualContainer * const vc, const uint64_t nr)
+{
+  assert(nr <= vc->cc.count);
+  const uint64_t nr_keep = vc->cc.count - nr;
+  // shift
+  for (uint64_t i = 0; i < nr_keep; i++) {
+    vc->cc.metatables[i] = vc->cc.metatables[i + nr];
+  }
+  // NULL
+  for (uint64_t i = nr_keep; i < DB_CONTAINER_NR; i++) {
+    vc->cc.metatables[i] = NULL;
+  }
+  vc->cc.count = nr_keep;
+}
+
   static void
 vc_recursive_free(struct VirtualContainer * const vc)
 {
@@ -283,30 +531,33 @@ vc_recursive_free(struct VirtualContainer * const vc)
 }
 
 // return 8 ... (DB_CONTAINER_NR) for compaction, 0 for NO compaction
+// cap: DB_COMPACTION_CAP scaled by the compression and the table size, see db_compaction_cap()
   static uint64_t
-vc_count_feed(struct VirtualContainer * const vc)
+vc_count_feed(struct VirtualContainer * const vc, const uint64_t cap)
 {
   if (vc == NULL) return 0;
   uint64_t vc_cap = 0;
   for (uint64_t j = 0; j < vc->cc.count; j++) {
     assert(vc->cc.metatables[j]);
     vc_cap += (vc->cc.metatables[j]->mfh.volume);
-    if (vc_cap >= DB_COMPACTION_CAP) {
+    if (vc_cap >= cap) {
       return (j + 1);
     }
   }
-  return 0;
+  // tables written before the cap grew
+  return (vc->cc.count == DB_CONTAINER_NR) ? DB_CONTAINER_NR : 0;
 }
 
 // pick from 8 vcs; return NULL for no compaction
   static struct VirtualContainer *
-vc_pick_compaction(struct VirtualContainer * const * const vcs, const uint64_t start, const uint64_t inc)
+vc_pick_compaction(struct VirtualContainer * const * const vcs, const uint64_t start, const uint64_t inc,
+    const uint64_t cap)
 {
   uint64_t max_id = 8;
   uint64_t max_height = 0;
   for (uint64_t i = start; i < 8; i += inc) {
     if (vcs[i] == NULL) continue;
-    const uint64_t height = vc_count_feed(vcs[i]);
+    const uint64_t height = vc_count_feed(vcs[i], cap);
     if (height > max_height) {
       max_height = height;
       max_id = i;
@@ -332,41 +583,9 @@ vc_pick_full(struct VirtualContainer * const * const vcs, const uint64_t start,
   return NULL;
 }
 
-  static bool
-recursive_dump(struct VirtualContainer * const vc, FILE * const out)
-{
-  // only the metatable's id is dumpped :)
-  if (vc) {
-    fprintf(out, "[ %lu\n", vc->start_bit);
-    if (vc->cc.bc) {
-      fprintf(out, "<!\n");
-    } else {
-      fprintf(out, "<\n");
-    }
-    // dump at most 8 MetaTable
-    for (uint64_t j = 0; j < vc->cc.count; j++) {
-      if (vc->cc.metatables[j]) {
-        const uint64_t mtid = vc->cc.metatables[j]->mtid;
-        fprintf(out, "%016lx\n", mtid);
-      }
-    }
-    if (vc->cc.bc) {
-      fprintf(out, ">!%016lx\n", vc->cc.bc->mtid);
-    } else {
-      fprintf(out, ">\n");
-    }
-    for (uint64_t j = 0; j < 8; j++) {
-      recursive_dump(vc->sub_vc[j], out);
-    }
-    fprintf(out, "]\n");
-  } else {
-    fprintf(out, "[]\n");
-  }
-  return true;
-}
-
+// legacy: load the text dump written before the manifest
   static struct VirtualContainer *
-recursive_parse(FILE * const in, const uint64_t start_bit, struct DB * const db)
+recursive_parse(FILE * const in, const uint64_t start_bit, const uint64_t path, struct DB * const db)
 {
   char buf[128];
   fgets(buf, 120, in);
@@ -374,7 +593,7 @@ recursive_parse(FILE * const in, const uint64_t start_bit, struct DB * const db)
   if (buf[1] == ']') {
     return NULL;
   }
-  struct VirtualContainer *vc = vc_create(start_bit);
+  struct VirtualContainer *vc = vc_create(start_bit, path);
   fgets(buf, 28, in);
   assert(buf[0] == '<');
   // '<!' : bloomcontainer
@@ -387,7 +606,7 @@ recursive_parse(FILE * const in, const uint64_t start_bit, struct DB * const db)
     const uint64_t mtid = strtoull(buf, NULL, 16);
     assert(db->cms[start_bit/3]);
     const int raw_fd = db->cms[start_bit/3]->raw_fd;
-    struct MetaTable * const mt = db_load_metatable(db, mtid, raw_fd, load_bf);
+    struct MetaTable * const mt = db_load_metatable(db, start_bit, mtid, raw_fd, 0, TABLE_NR_BARRELS, false, load_bf);
     assert(mt);
     vc->cc.count++;
     vc->cc.metatables[j] = mt;
@@ -405,13 +624,73 @@ recursive_parse(FILE * const in, const uint64_t start_bit, struct DB * const db)
     vc->cc.bc = bc;
   }
   for (uint64_t i = 0; i < 8; i++) {
-    vc->sub_vc[i] = recursive_parse(in, start_bit + 3, db);
+    vc->sub_vc[i] = recursive_parse(in, start_bit + 3, (path << 3) | i, db);
   }
   fgets(buf, 28, in);
   assert(buf[0] == ']');
   return vc;
 }
 
+// the value log lives on one device, fixed at its first use
+  static void
+db_vlog_touch(struct DB * const db, const uint64_t dev)
+{
+  if (db->vlog) {
+    assert(db->vlog->dev == dev);
+    return;
+  }
+  assert((dev < 6) && db->cms_dump[dev]);
+  db->vlog = vlog_create(db->cms_dump[dev], (uint32_t)dev, db->vlog_threshold);
+  assert(db->vlog);
+  db->vdrops_active = vlog_drops_new(db->vlog);
+  if (db->active_table[0]) {
+    table_set_vdrop(db->active_table[0], vlog_drops_add, db->vdrops_active);
+  }
+}
+
+// logical capacity of a new table relative to an uncompressed one
+  static double
+db_table_fill(struct DB * const db)
+{
+  if (db->codec == CODEC_NONE) return 1.0;
+  const double fill = ((double)db->zratio) * DB_COMPRESS_MARGIN / 100.0;
+  if (fill < 1.0) return 1.0;
+  return (fill > DB_COMPRESS_FILL_MAX) ? DB_COMPRESS_FILL_MAX : fill;
+}
+
+// compaction threads read it while db_grow() adds one
+  static inline uint64_t
+db_nr_levels(const struct DB * const db)
+{
+  return __atomic_load_n(&(db->nr_levels), __ATOMIC_ACQUIRE);
+}
+
+// the deepest level is merged in place; it gets deeper with the data, see db_grow()
+  static inline bool
+db_is_leaf(const struct DB * const db, const uint64_t start_bit)
+{
+  return ((start_bit / 3u) + 1u) >= db_nr_levels(db);
+}
+
+// for a container at start_bit: sized to fill the larger tables below it
+  static uint64_t
+db_compaction_cap(struct DB * const db, const uint64_t start_bit)
+{
+  const uint64_t level = ((start_bit/3 + 1) < DB_MAX_LEVELS) ? (start_bit/3 + 1) : (DB_MAX_LEVELS - 1);
+  return (uint64_t)(((double)DB_COMPACTION_CAP) * db_table_fill(db) * ((double)db->table_scale[level]));
+}
+
+  static struct Table *
+db_active_table_new(struct DB * const db)
+{
+  struct Table * const table = table_alloc_codec(db->codec, db_level_barrels(db, 0), db_table_fill(db), 15.0);
+  table_set_full_metaindex(table, db->full_mi);
+  if (db->vlog) {
+    table_set_vdrop(table, vlog_drops_add, db->vdrops_active);
+  }
+  return table;
+}
+
   static void
 db_initial(struct DB * const db, const char * const meta_dir, struct ContainerMapConf * const cm_conf)
 {
@@ -421,21 +700,48 @@ db_initial(struct DB * const db, const char * const meta_dir, struct ContainerMa
 
   // set cms
   assert(cm_conf);
-  for (uint64_t i = 0; i < DB_NR_LEVELS; i++) {
+  for (uint64_t i = 0; i < DB_MAX_LEVELS; i++) {
     db->cms[i] = db->cms_dump[cm_conf->data_id[i]];
     assert(db->cms[i]);
+    db->devs[i] = cm_conf->data_devs[i];
+  }
+  db->max_levels = (cm_conf->max_levels > db->nr_levels) ? cm_conf->max_levels : db->nr_levels;
+  db->tiering = cm_conf->tiering ? true : false;
+  // compaction I/O
+  for (uint64_t i = 0; i < 6; i++) {
+    db->read_rate[i] = cm_conf->read_rate[i] * UINT64_C(1024) * UINT64_C(1024);
+    db->write_rate[i] = cm_conf->write_rate[i] * UINT64_C(1024) * UINT64_C(1024);
+    ratelimit_initial(&(db->rl_read[i]), db->read_rate[i]);
+    ratelimit_initial(&(db->rl_write[i]), db->write_rate[i]);
+  }
+  db->io_factor = 1.0;
+  db->io_target = cm_conf->io_target;
+  if (db->io_target) {
+    db->lat_get = latency_initial();
   }
   db->cm_bc = db->cms_dump[cm_conf->bc_id]; // hi?
   assert(db->cm_bc);
-
+  // value log
+  db->vlog_threshold = cm_conf->vlog_threshold;
+  // compression
+  assert(codec_available(cm_conf->codec));
+  db->codec = cm_conf->codec;
+  db->zratio = 100;
+  if (cm_conf->vlog_dev != UINT64_MAX) {
+    db_vlog_touch(db, cm_conf->vlog_dev);
+  }
   // active tables
-  db->active_table[0] = table_alloc_default(15.0);
+  db->full_mi = cm_conf->full_metaindex ? true : false;
+  db->root_images = cm_conf->root_images;
+  db->active_table[0] = db_active_table_new(db);
   db->active_table[1] = NULL;
 
   // threading vars
   pthread_mutex_init(&(db->mutex_active), NULL);
   pthread_mutex_init(&(db->mutex_current), NULL);
   pthread_mutex_init(&(db->mutex_root), NULL);
+  pthread_mutex_init(&(db->mutex_manifest), NULL);
+  pthread_mutex_init(&(db->mutex_dict), NULL);
   for (uint64_t i = 0; i < DB_COMPACTION_NR; i++) {
     pthread_mutex_init(&(db->mutex_token[i]), NULL);
   }
@@ -454,64 +760,234 @@ db_initial(struct DB * const db, const char * const meta_dir, struct ContainerMa
   sprintf(path, "%s/%s", db->persist_dir, DB_META_LOG);
   FILE * const log = fopen(path, "a"); // NULL is OK
   db->log = log;
+  if (cm_conf->stat_interval) {
+    sprintf(path, "%s/%s", db->persist_dir, DB_META_STAT);
+    db->stat_out = fopen(path, "a");
+    db->stat_interval = cm_conf->stat_interval;
+    db->stat_last = (typeof(db->stat_last))malloc(sizeof(*(db->stat_last)));
+    db->stat_now = (typeof(db->stat_now))malloc(sizeof(*(db->stat_now)));
+    assert(db->stat_last && db->stat_now);
+    bzero(db->stat_last, sizeof(*(db->stat_last)));
+  }
+  db->stage_sample = cm_conf->stage_sample;
+  if (cm_conf->neg_cache) {
+    db->negcache = negcache_new(cm_conf->neg_cache);
+  }
+  if (cm_conf->row_cache) {
+    db->rowcache = rowcache_new(cm_conf->row_cache << 20);
+  }
+  if (cm_conf->trace) {
+    sprintf(path, "%s/%s", db->persist_dir, DB_META_TRACE);
+    db->trace = fopen(path, "a");
+  }
 
   // running
   db->sec_start = debug_time_sec();
   db->closing = false;
+
+  // released containers are discarded in background
+  for (uint64_t i = 0; (i < 6) && db->cms_dump[i]; i++) {
+    db_log(db, "CM[%lu] %s: %lu units of %luMB, %s I/O", i, cm_conf->raw_fn[i], db->cms_dump[i]->nr_units,
+        db->cms_dump[i]->unit_size >> 20, containermap_io_name(db->cms_dump[i]->io_mode));
+    containermap_discard_start(db->cms_dump[i], cm_conf->discard?true:false,
+        cm_conf->discard_rate * UINT64_C(1024) * UINT64_C(1024));
+  }
+  db_log(db, "TABLE units per level: %lu %lu %lu %lu %lu %lu %lu %lu", db->table_scale[0], db->table_scale[1],
+      db->table_scale[2], db->table_scale[3], db->table_scale[4], db->table_scale[5], db->table_scale[6],
+      db->table_scale[7]);
+  db_log(db, "LEVELS %lu, up to %lu", db->nr_levels, db->max_levels);
+  if (db->vlog) {
+    db_log(db, "VLOG on CM[%u], values > %lu bytes", db->vlog->dev, db->vlog->threshold);
+  }
+}
+
+  static uint32_t
+db_dev_id(struct DB * const db, const int raw_fd)
+{
+  for (uint32_t i = 0; (i < 6) && db->cms_dump[i]; i++) {
+    if (db->cms_dump[i]->raw_fd == raw_fd) return i;
+  }
+  assert(false);
+  return 0;
+}
+
+  static struct ContainerMap *
+db_cm_of_fd(struct DB * const db, const int raw_fd)
+{
+  return db->cms_dump[db_dev_id(db, raw_fd)];
+}
+
+  static void
+db_record_add(struct DB * const db, struct ManifestRecord * const rec, const struct VirtualContainer * const vc,
+    const struct MetaTable * const mt, const struct BloomContainer * const bc)
+{
+  bzero(rec, sizeof(*rec));
+  rec->type = MANIFEST_ADD;
+  rec->start_bit = (uint16_t)vc->start_bit;
+  rec->path = vc->path;
+  rec->mtid = mt->mtid;
+  rec->off = mt->mfh.off;
+  rec->dev = db_dev_id(db, mt->raw_fd);
+  rec->flags = mt->packed?MANIFEST_FLAG_PACKED:0;
+  assert(mt->dict_id <= UINT32_MAX);
+  rec->arg = (uint32_t)mt->dict_id;
+  if (bc) {
+    rec->bc_mtid = bc->mtid;
+    rec->bc_off = bc->off_raw;
+  }
+}
+
+  static void
+db_record_drop(struct ManifestRecord * const rec, const struct VirtualContainer * const vc, const uint64_t nr)
+{
+  bzero(rec, sizeof(*rec));
+  rec->type = MANIFEST_DROP;
+  rec->start_bit = (uint16_t)vc->start_bit;
+  rec->path = vc->path;
+  rec->arg = (uint32_t)nr;
+}
+
+// 4 bits per level: (scale - 1), so 0 is the fixed 32MB layout
+  static uint32_t
+db_format_scales(const struct DB * const db)
+{
+  uint32_t arg = 0;
+  for (uint64_t i = 0; i < DB_MAX_LEVELS; i++) {
+    arg |= (uint32_t)((db->table_scale[i] - 1u) << (i * 4u));
+  }
+  return arg;
+}
+
+  static void
+db_record_format(struct DB * const db, struct ManifestRecord * const rec)
+{
+  bzero(rec, sizeof(*rec));
+  rec->type = MANIFEST_FORMAT;
+  rec->start_bit = (uint16_t)((db->nr_levels - 1u) * 3u);
+  rec->off = db->unit_size;
+  rec->arg = db_format_scales(db);
+}
+
+  static void
+db_record_commit(struct DB * const db, struct ManifestRecord * const rec)
+{
+  bzero(rec, sizeof(*rec));
+  rec->type = MANIFEST_COMMIT;
+  rec->mtid = db->next_mtid;
+}
+
+// must hold mutex_manifest; recs[nr] is reserved for the commit record
+  static void
+db_manifest_commit(struct DB * const db, struct ManifestRecord * const recs, const uint64_t nr)
+{
+  db_record_commit(db, &(recs[nr]));
+  const bool ra = manifest_append(db->manifest, recs, nr + 1);
+  assert(ra);
+}
+
+// must hold mutex_manifest; log the changed value-log segments, then give the dead ones back
+  static void
+db_vlog_commit(struct DB * const db)
+{
+  if (db->vlog == NULL) return;
+  struct ManifestRecord recs[DB_VLOG_GROUP + 1];
+  uint64_t cursor = 0;
+  for (;;) {
+    const uint64_t nr = vlog_records(db->vlog, recs, DB_VLOG_GROUP, &cursor, false);
+    if (nr == 0) break;
+    db_manifest_commit(db, recs, nr);
+  }
+  vlog_release_dead(db->vlog);
+}
+
+// one commit group for each non-empty vc
+  static void
+manifest_snapshot_vc(struct DB * const db, struct Manifest * const mf, struct VirtualContainer * const vc)
+{
+  if (vc == NULL) return;
+  if (vc->cc.count) {
+    struct ManifestRecord recs[DB_CONTAINER_NR + 1];
+    for (uint64_t j = 0; j < vc->cc.count; j++) {
+      db_record_add(db, &(recs[j]), vc, vc->cc.metatables[j], vc->cc.bc);
+    }
+    db_record_commit(db, &(recs[vc->cc.count]));
+    const bool ra = manifest_append(mf, recs, vc->cc.count + 1);
+    assert(ra);
+  }
+  for (uint64_t i = 0; i < 8; i++) {
+    manifest_snapshot_vc(db, mf, vc->sub_vc[i]);
+  }
 }
 
-// backup db metadata
+// write the whole tree into a new manifest and switch to it
   static bool
-db_dump_meta(struct DB * const db)
+db_checkpoint(struct DB * const db)
 {
-  char path_meta[256];
+  char path_new[256];
+  char path_rel[256];
+  char path_tmp[256];
   char path_sym[256];
+  char path_old[256];
 
   const double sec0 = debug_time_sec();
   // prepare files
-  sprintf(path_meta, "%s/%s/%s-%018.6lf", db->persist_dir, DB_META_BACKUP_DIR, DB_META_MAIN, sec0);
-  FILE * const meta_out = fopen(path_meta, "w");
-  assert(meta_out);
-
-  const uint64_t ticket = rwlock_reader_lock(&(db->rwlock));
-  // dump meta
-  // write vc
-  const bool r_meta = recursive_dump(db->vcroot, meta_out);
-  assert(r_meta);
-  // write mtid
+  sprintf(path_new, "%s/%s/%s-%018.6lf", db->persist_dir, DB_META_BACKUP_DIR, DB_META_MANIFEST, sec0);
+  struct Manifest * const mf = manifest_create(path_new);
+  assert(mf);
+
+  // the tree is only changed under mutex_manifest; readers are not blocked
+  pthread_mutex_lock(&(db->mutex_manifest));
+  struct ManifestRecord rf[2];
+  db_record_format(db, &(rf[0]));
+  db_record_commit(db, &(rf[1]));
+  const bool rf1 = manifest_append(mf, rf, 2);
+  assert(rf1);
+  manifest_snapshot_vc(db, mf, db->vcroot);
+  if (db->vlog) {
+    struct ManifestRecord recs[DB_VLOG_GROUP + 1];
+    uint64_t cursor = 0;
+    uint64_t nr = 0;
+    while ((nr = vlog_records(db->vlog, recs, DB_VLOG_GROUP, &cursor, true))) {
+      db_record_commit(db, &(recs[nr]));
+      const bool rv = manifest_append(mf, recs, nr + 1);
+      assert(rv);
+    }
+  }
+  struct ManifestRecord rc;
+  db_record_commit(db, &rc);
+  const bool ra = manifest_append(mf, &rc, 1);
+  assert(ra);
   const uint64_t db_next_mtid = db->next_mtid;
-  fprintf(meta_out, "%lu\n", db_next_mtid);
-  fclose(meta_out);
 
-  // create symlink for newest meta
-  sprintf(path_sym, "%s/%s", db->persist_dir, DB_META_MAIN);
-  if (access(path_sym, F_OK) == 0) {
-    const int ru = unlink(path_sym);
-    assert(ru == 0);
-  }
-  sprintf(path_meta, "./%s/%s-%018.6lf", DB_META_BACKUP_DIR, DB_META_MAIN, sec0);
-  const int rsm = symlink(path_meta, path_sym);
+  // atomically replace the symlink
+  sprintf(path_sym, "%s/%s", db->persist_dir, DB_META_MANIFEST);
+  sprintf(path_tmp, "%s/%s.tmp", db->persist_dir, DB_META_MANIFEST);
+  sprintf(path_rel, "./%s/%s-%018.6lf", DB_META_BACKUP_DIR, DB_META_MANIFEST, sec0);
+  const ssize_t nl = readlink(path_sym, path_old, sizeof(path_old) - 1);
+  unlink(path_tmp);
+  const int rsm = symlink(path_rel, path_tmp);
   assert(rsm == 0);
-
-  // dump container-maps
-  for (int i = 0; db->cms_dump[i]; i++) {
-    char path_cm_dump[256];
-    sprintf(path_cm_dump, "%s/%s/%s-%01d-%018.6lf", db->persist_dir, DB_META_BACKUP_DIR, DB_META_CMAP_PREFIX, i, sec0);
-    containermap_dump(db->cms_dump[i], path_cm_dump);
-    // create symlink for newest meta
-    sprintf(path_sym, "%s/%s-%01d", db->persist_dir, DB_META_CMAP_PREFIX, i);
-    if (access(path_sym, F_OK) == 0) {
-      const int ru = unlink(path_sym);
-      assert(ru == 0);
+  const int rrn = rename(path_tmp, path_sym);
+  assert(rrn == 0);
+  struct Manifest * const mf_old = db->manifest;
+  db->manifest = mf;
+  pthread_mutex_unlock(&(db->mutex_manifest));
+
+  // the old manifest is covered by the new one
+  if (mf_old) {
+    manifest_close(mf_old);
+  }
+  if ((nl > 0) && ((size_t)nl < sizeof(path_old))) {
+    path_old[nl] = '\0';
+    if (strcmp(path_old, path_rel) != 0) {
+      char path_old_abs[512];
+      sprintf(path_old_abs, "%s/%s", db->persist_dir, path_old);
+      unlink(path_old_abs);
     }
-    sprintf(path_cm_dump, "./%s/%s-%01d-%018.6lf", DB_META_BACKUP_DIR, DB_META_CMAP_PREFIX, i, sec0);
-    const int rs = symlink(path_cm_dump, path_sym);
-    assert(rs == 0);
   }
 
   // done
-  rwlock_reader_unlock(&(db->rwlock), ticket);
-  db_log_diff(db, sec0, "Dumping Metadata Finished (%06lx)", db_next_mtid);
+  db_log_diff(db, sec0, "Checkpoint Manifest Finished (%06lx)", db_next_mtid);
   fflush(db->log);
   return true;
 }
@@ -526,11 +1002,50 @@ db_free(struct DB * const db)
   if (db->active_table[1]) {
     table_free(db->active_table[1]);
   }
+  if (db->active_table[2]) {
+    table_free(db->active_table[2]);
+  }
   vc_recursive_free(db->vcroot);
+  if (db->manifest) {
+    manifest_close(db->manifest);
+  }
+  if (db->vlog) {
+    vlog_show(db->vlog, db->log);
+    vlog_destroy(db->vlog);
+    free(db->vdrops_active);
+  }
+  // files are kept for the next open
+  while (db->dicts) {
+    struct CodecDict * const dict = db->dicts;
+    db->dicts = dict->next;
+    codec_dict_free(dict);
+  }
+  for (int i = 0; db->cms_dump[i]; i++) {
+    db_log(db, "CM[%d] discarded %lu units in %lu ops, %lu pending", i, db->cms_dump[i]->nr_discarded,
+        db->cms_dump[i]->nr_discard_ops, db->cms_dump[i]->nr_pending);
+  }
+  if (db->lat_get) {
+    free(db->lat_get);
+  }
+  if (db->stat_out) {
+    fclose(db->stat_out);
+  }
+  if (db->trace) {
+    fclose(db->trace);
+  }
+  if (db->negcache) {
+    negcache_free(db->negcache);
+  }
+  if (db->rowcache) {
+    rowcache_free(db->rowcache);
+  }
+  free(db->stat_last);
+  free(db->stat_now);
   fclose(db->log);
   for (int i = 0; db->cms_dump[i]; i++) {
     containermap_destroy(db->cms_dump[i]);
   }
+  stat_destroy(db->stat);
   free(db);
   return;
 }
@@ -542,24 +1057,117 @@ db_aquire_mtid(struct DB * const db)
   return mtid;
 }
 
+// room for nr_units and for the output of one more compaction of the level
+  static bool
+db_cm_has_room(struct DB * const db, struct ContainerMap * const cm, const uint64_t level, const uint64_t nr_units)
+{
+  const uint64_t reserve = 8u * db->table_scale[level];
+  return (containermap_unused(cm) >= (nr_units + reserve)) ? true : false;
+}
+
+// the device for nr_units of new tables of a level: the configured one while it has room.
+// otherwise the hot levels take the fastest device with room and the others the slowest,
+// so that the fast devices are kept for the hot levels
+  static struct ContainerMap *
+db_cm_place(struct DB * const db, const uint64_t level, const uint64_t nr_units)
+{
+  struct ContainerMap * const cm0 = db->cms[level];
+  if ((db->tiering == false) || db_cm_has_room(db, cm0, level, nr_units)) return cm0;
+
+  const bool hot = (level < DB_TIER_HOT) ? true : false;
+  uint64_t best = 6;
+  for (uint64_t i = 0; (i < 6) && db->cms_dump[i]; i++) {
+    if (db_cm_has_room(db, db->cms_dump[i], level, nr_units) == false) continue;
+    if ((best == 6) || (hot && (db->dev_lat[i] < db->dev_lat[best])) ||
+        ((hot == false) && (db->dev_lat[i] > db->dev_lat[best]))) {
+      best = i;
+    }
+  }
+  return (best < 6) ? db->cms_dump[best] : cm0;
+}
+
+// the device for the seq-th new table of a level: the devices of the level in turn
+  static struct ContainerMap *
+db_cm_stripe(struct DB * const db, const uint64_t level, const uint64_t seq, const uint64_t nr_units)
+{
+  const uint64_t devs = db->devs[level];
+  const uint64_t nr = (uint64_t)__builtin_popcountl(devs);
+  if (nr <= 1) return db_cm_place(db, level, nr_units);
+  uint64_t k = seq % nr;
+  uint64_t dev = 0;
+  for (dev = 0; dev < 6; dev++) {
+    if (((devs >> dev) & 1u) && ((k--) == 0)) break;
+  }
+  struct ContainerMap * const cm = db->cms_dump[dev];
+  if ((db->tiering == false) || db_cm_has_room(db, cm, level, nr_units)) return cm;
+  return db_cm_place(db, level, nr_units);
+}
+
+// the device for the next new table of a level below 0: the turns go on across compactions
+  static struct ContainerMap *
+db_cm_next(struct DB * const db, const uint64_t level)
+{
+  const uint64_t seq = __sync_fetch_and_add(&(db->nr_striped[level]), 1);
+  return db_cm_stripe(db, level, seq, db->table_scale[level]);
+}
+
+// nr_units adjacent units for one table or BloomContainer
   static uint64_t
-db_cmap_safe_alloc(struct DB * const db, struct ContainerMap * const cm)
+db_cmap_safe_alloc(struct DB * const db, struct ContainerMap * const cm, const uint64_t nr_units)
 {
   while(db->closing == false) {
-    const uint64_t off = containermap_alloc(cm);
+    const uint64_t off = (nr_units == 1) ? containermap_alloc(cm) : containermap_alloc_contig(cm, nr_units);
     if (off < cm->total_cap) {
       return off;
-    } else {
-      sleep(1);
+    } else { // wait for a release; a run can be missing even with enough free units
+      containermap_wait(cm, (nr_units == 1) ? 1 : UINT64_MAX, 1.0);
+    }
+  }
+  return (nr_units == 1) ? containermap_alloc(cm) : containermap_alloc_contig(cm, nr_units);
+}
+
+// adjacent tables if possible, so that they can be read sequentially later
+  static void
+db_cmap_safe_alloc_contig(struct DB * const db, struct ContainerMap * const cm,
+    const uint64_t nr, const uint64_t nr_units, uint64_t * const offs)
+{
+  const uint64_t off0 = containermap_alloc_contig(cm, nr * nr_units);
+  if (off0 < cm->total_cap) {
+    for (uint64_t i = 0; i < nr; i++) {
+      offs[i] = off0 + (cm->unit_size * nr_units * i);
+    }
+    stat_inc(&(db->stat->nr_alloc_contig));
+  } else {
+    for (uint64_t i = 0; i < nr; i++) {
+      offs[i] = db_cmap_safe_alloc(db, cm, nr_units);
     }
   }
-  return containermap_alloc(cm);
+}
+
+  static void
+db_cmap_release(struct ContainerMap * const cm, const uint64_t off, const uint64_t nr_units)
+{
+  for (uint64_t i = 0; i < nr_units; i++) {
+    containermap_release(cm, off + (cm->unit_size * i));
+  }
+}
+
+  static bool
+db_cmap_mark_used(struct ContainerMap * const cm, const uint64_t off, const uint64_t nr_units)
+{
+  for (uint64_t i = 0; i < nr_units; i++) {
+    if (containermap_mark_used(cm, off + (cm->unit_size * i)) == false) return false;
+  }
+  return true;
 }
 
 // takes 0.5s on average
 // assume table has been detached from db (like memtable => imm)
-  static uint64_t
-db_table_dump(struct DB * const db, struct Table * const table, const uint64_t start_bit)
+// off_main: allocated by the caller from cm, see db_cm_place()
+// return the MetaTable without bloom-filter, or NULL if the table cannot be retained (left as it was)
+  static struct MetaTable *
+db_table_dump(struct DB * const db, struct Table * const table, const uint64_t start_bit,
+    struct ContainerMap * const cm, const uint64_t off_main)
 {
   const double sec0 = debug_time_sec();
   // aquire a uniq mtid;
@@ -572,32 +1180,56 @@ db_table_dump(struct DB * const db, struct Table * const table, const uint64_t s
   const bool rr = table_retain(table);
   // logging on failed retaining
   if (rr == false) {
-    //char buffer[4096];
-    //table_analysis_verbose(table, buffer);
-    db_log(db, "DUMP @%lu [%8lx FAILED!!]\n%s", start_bit/3, mtid, "");
-    assert(false);
+    db_log(db, "DUMP @%lu [%8lx FAILED: not retained, %lu bytes, %lu over]", start_bit/3, mtid,
+        table->volume, table->over);
+    return NULL;
+  }
+  // a sample of the compression; racy updates only lose samples
+  if (table->zsize) {
+    const uint64_t zratio = table->zvolume * 100u / table->zsize;
+    db->zratio = ((db->zratio * 7u) + zratio) / 8u;
   }
 
   // analysis and log
   char buffer[1024];
   table_analysis_short(table, buffer);
 
-  // alloc data area from containermap for items
-  struct ContainerMap * const cm = db->cms[start_bit/3];
-  const uint64_t off_main = db_cmap_safe_alloc(db, cm);
   assert(off_main < cm->total_cap);
 
-  // dump table data
-  const uint64_t nr_items = table_dump_barrels(table, cm->raw_fd, off_main);
-
-  // dump meta
-  char metafn[2048];
-  db_generate_meta_fn(db, mtid, metafn);
-  const bool rdm = table_dump_meta(table, metafn, off_main);
-  assert(rdm);
-  db_log_diff(db, sec0, "DUMP @%lu [%8lx #%08lx] [%08lu] %s",
-      start_bit/3, mtid, off_main/TABLE_ALIGN, nr_items, buffer);
-  return mtid;
+  // a table with oversized metadata falls back to a meta file
+  const uint64_t meta_cap = db_meta_cap(db, table->nr_barrels);
+  const bool packed = meta_cap && (table_meta_size(table) <= meta_cap);
+  uint64_t nr_items = 0;
+  const uint32_t dev = db_dev_id(db, cm->raw_fd);
+  const uint64_t depth = __sync_add_and_fetch(&(db->dev_depth[dev]), 1);
+  __sync_fetch_and_add(&(db->dev_depth_sum[dev]), depth);
+  __sync_fetch_and_add(&(db->dev_nr_dumps[dev]), 1);
+  nr_items = packed ? table_dump_packed(table, cm->raw_fd, off_main, meta_cap) :
+    table_dump_barrels(table, cm->raw_fd, off_main);
+  // durable before it can be referenced by the manifest
+  const uint64_t usec_sync = debug_time_usec();
+  fdatasync(cm->raw_fd);
+  // the writes and the sync, not the pacing or a meta file elsewhere
+  const uint64_t usec_dev = table->usec_write + (debug_time_usec() - usec_sync);
+  if (packed == false) {
+    char metafn[2048];
+    db_generate_meta_fn(db, mtid, metafn);
+    const bool rdm = table_dump_meta(table, metafn, off_main);
+    assert(rdm);
+  }
+  __sync_sub_and_fetch(&(db->dev_depth[dev]), 1);
+  // a sample of the device speed for db_cm_place(); racy like zratio
+  const uint64_t lat = usec_dev / TABLE_UNITS(table->nr_barrels);
+  db->dev_lat[dev] = db->dev_lat[dev] ? (((db->dev_lat[dev] * 7u) + lat) / 8u) : (lat + 1u);
+  db_log_diff(db, sec0, "DUMP @%lu [%8lx #%u:%08lx] [%08lu] %s%s",
+      start_bit/3, mtid, dev, off_main/cm->unit_size, nr_items, buffer, packed?" packed":"");
+  struct MetaTable * const mt = db_load_metatable(db, start_bit, mtid, cm->raw_fd, off_main, table->nr_barrels, packed,
+      false);
+  if (table->dict) {
+    mt->dict_id = table->dict->id;
+    mt->dict = db_dict_get(db, mt->dict_id);
+  }
+  return mt;
 }
 
   static uint64_t
@@ -612,60 +1244,111 @@ compaction_select_table(const uint8_t * const hash, const uint64_t start_bit)
   return tid;
 }
 
+// the new tables of a leaf are told apart by hash bits 0 -- 31: the bits above the leaf's start_bit are
+// used by no level, barrel or bloom-filter, the ones below are the same for all its items.
+// multiply-shift splits them evenly for any nr_out, unlike a modulo
+  static uint64_t
+leaf_select_table(const uint8_t * const hash, const uint64_t nr_out)
+{
+  const uint64_t hv = *((const uint32_t *)hash);
+  return (hv * nr_out) >> 32;
+}
+
   static void
 compaction_initial(struct Compaction * const comp, struct DB * const db,
-    struct VirtualContainer * const vc, const uint64_t nr_feed)
+    struct VirtualContainer * const vc, const uint64_t nr_feed, const uint64_t nr_out, const bool leaf)
 {
   bzero(comp, sizeof(*comp));
+  comp->leaf = leaf;
   comp->start_bit = vc->start_bit;
-  comp->sub_bit = vc->start_bit + 3;
+  comp->sub_bit = comp->leaf ? vc->start_bit : (vc->start_bit + 3);
   comp->gen_bc = (comp->sub_bit >= BC_START_BIT)?true:false;
   assert(nr_feed <= vc->cc.count);
   assert(vc->cc.count <= DB_CONTAINER_NR);
+  assert(comp->leaf ? (nr_out < DB_CONTAINER_NR) : (nr_out == 8));
   comp->nr_feed = nr_feed;
+  comp->nr_out = nr_out;
   comp->db = db;
   comp->vc = vc;
-  comp->cm_to = db->cms[comp->sub_bit/3];
+  for (uint64_t i = 0; i < nr_out; i++) {
+    comp->cms_to[i] = db_cm_next(db, comp->sub_bit/3);
+  }
 
-  // alloc arenas
-  uint8_t * const arena = huge_alloc(TABLE_ALIGN);
+  // alloc arenas, for one table of the input level
+  const uint64_t nr_barrels_from = db_level_barrels(db, comp->start_bit/3);
+  comp->feed_unit = (nr_barrels_from + 1u) / DB_FEED_NR;
+  uint8_t * const arena = huge_alloc(BARREL_ALIGN * (nr_barrels_from + 1u));
   assert(arena);
   comp->arena = arena;
   // old mts & mtids
   for (uint64_t i = 0; i < nr_feed; i++) {
     struct MetaTable * const mt = vc->cc.metatables[i];
-    assert(mt);
+    assert(mt && (mt->nr_barrels == nr_barrels_from));
     comp->mts_old[i] = mt;
     comp->mtids_old[i] = mt->mtid;
   }
 
-  // new tables
-  for (uint64_t i = 0; i < 8u; i++) {
-    struct Table * const table = table_alloc_default(1.8);
-    assert(table);
-    comp->tables[i] = table;
+  if (db->vlog) {
+    comp->vdrops = vlog_drops_new(db->vlog);
   }
 
+  // a leaf replaces its own bc
+  if (comp->leaf) {
+    comp->bc_self = vc->cc.bc;
+    return;
+  }
   // mbcs_old (if exists else NULL)
   for (uint64_t i = 0; i < 8u; i++) {
     if (vc->sub_vc[i] == NULL) {
-      vc->sub_vc[i] = vc_create(comp->sub_bit);
+      vc->sub_vc[i] = vc_create(comp->sub_bit, (vc->path << 3) | i);
     }
     comp->mbcs_old[i] = vc->sub_vc[i]->cc.bc;
   }
 }
 
+// new tables [lo, hi)
+  static void
+compaction_alloc_tables(struct Compaction * const comp, const uint64_t lo, const uint64_t hi)
+{
+  struct DB * const db = comp->db;
+  assert((lo < hi) && (hi <= comp->nr_out));
+  comp->out_lo = lo;
+  comp->out_hi = hi;
+  // ValuePtr items are small: their Item headers cost more than their volume
+  const double item_factor = db->vlog ? 4.0 : 1.8;
+  // a leaf table takes every version from nr_feed/nr_out inputs; replaced items stay in the mempool
+  const double nr_in = comp->leaf ? (((double)comp->nr_feed) * 1.2 / ((double)comp->nr_out)) : 1.0;
+  const double mempool_factor = item_factor * ((nr_in > 1.0) ? nr_in : 1.0);
+  const double fill = db_table_fill(db);
+  const uint64_t nr_barrels_to = db_level_barrels(db, comp->sub_bit/3);
+  for (uint64_t i = lo; i < hi; i++) {
+    struct Table * const table = table_alloc_codec(db->codec, nr_barrels_to, fill, mempool_factor);
+    assert(table);
+    table_set_full_metaindex(table, db->full_mi);
+    if (comp->vdrops) {
+      table_set_vdrop(table, vlog_drops_add, comp->vdrops);
+    }
+    comp->tables[i] = table;
+  }
+}
+
   static bool
 compaction_feed(struct Compaction * const comp)
 {
-  const uint64_t token = __sync_fetch_and_add(&(comp->feed_token), DB_FEED_UNIT);
-  assert(token < TABLE_MAX_BARRELS);
+  const uint64_t unit = comp->feed_unit;
+  const uint64_t token = __sync_fetch_and_add(&(comp->feed_token), unit);
   struct MetaTable * const mt = comp->mts_old[comp->feed_id];
-  if (token >= TABLE_NR_BARRELS) return true;
-  const uint64_t nr_fetch = ((TABLE_NR_BARRELS - token) < DB_FEED_UNIT) ? (TABLE_NR_BARRELS - token) : DB_FEED_UNIT;
+  assert(token <= mt->nr_barrels);
+  if (token >= mt->nr_barrels) return true;
+  const uint64_t nr_fetch = ((mt->nr_barrels - token) < unit) ? (mt->nr_barrels - token) : unit;
   uint8_t * const arena = comp->arena + (token * BARREL_ALIGN);
-  assert((token + nr_fetch) <= TABLE_NR_BARRELS);
-  metatable_feed_barrels_to_tables(mt, token, nr_fetch, arena, comp->tables, compaction_select_table, comp->sub_bit);
+  ratelimit_take(&(comp->db->rl_read[db_dev_id(comp->db, mt->raw_fd)]), nr_fetch * BARREL_ALIGN);
+  __sync_fetch_and_add(&(comp->nr_read), nr_fetch * BARREL_ALIGN);
+  if (comp->leaf) {
+    metatable_feed_barrels_to_tables(mt, token, nr_fetch, arena, comp->tables, leaf_select_table, comp->nr_out);
+  } else {
+    metatable_feed_barrels_to_tables(mt, token, nr_fetch, arena, comp->tables, compaction_select_table, comp->sub_bit);
+  }
   return true;
 }
 
@@ -673,7 +1356,9 @@ compaction_feed(struct Compaction * const comp)
 thread_compaction_feed(void * const p)
 {
   struct Compaction * const comp = (typeof(comp))p;
+  const uint64_t cpu0 = debug_cpu_usec();
   compaction_feed(comp);
+  __sync_fetch_and_add(&(comp->cpu_usec[DB_PHASE_FEED]), debug_cpu_usec() - cpu0);
   pthread_exit(NULL);
 }
 
@@ -687,10 +1372,8 @@ compaction_feed_all(struct Compaction * const comp)
     // parallel feed threads
     conc_fork_reduce(DB_FEED_NR, thread_compaction_feed, comp);
     db_log_diff(comp->db, sec0, "FEED @%lu [%8lx #%08lx]",
-      comp->start_bit/3, comp->mts_old[i]->mtid, comp->mts_old[i]->mfh.off/TABLE_ALIGN);
+      comp->start_bit/3, comp->mts_old[i]->mtid, comp->mts_old[i]->mfh.off/comp->db->unit_size);
   }
-  // free feed arenas
-  huge_free(comp->arena, TABLE_ALIGN);
 }
 
   static void *
@@ -698,16 +1381,18 @@ thread_compaction_bt(void * const p)
 {
   struct Compaction * const comp = (typeof(comp))p;
   const uint64_t i = __sync_fetch_and_add(&(comp->bt_token), 1);
-  assert(i < 8);
+  assert(i < comp->out_hi);
+  const uint64_t cpu0 = debug_cpu_usec();
   table_build_bloomtable(comp->tables[i]);
+  __sync_fetch_and_add(&(comp->cpu_usec[DB_PHASE_BUILD]), debug_cpu_usec() - cpu0);
   pthread_exit(NULL);
 }
 
   static void
 compaction_build_bt_all(struct Compaction * const comp)
 {
-  comp->bt_token = 0;
-  conc_fork_reduce(8, thread_compaction_bt, comp);
+  comp->bt_token = comp->out_lo;
+  conc_fork_reduce(comp->out_hi - comp->out_lo, thread_compaction_bt, comp);
 }
 
   static void *
@@ -715,33 +1400,55 @@ thread_compaction_dump(void * const p)
 {
   struct Compaction * const comp = (typeof(comp))p;
   const uint64_t i = __sync_fetch_and_add(&(comp->dump_token), 1);
-  assert(i < 8);
-  const uint64_t mtid = db_table_dump(comp->db, comp->tables[i], comp->sub_bit);
-  comp->mtids_new[i] = mtid;
-  struct MetaTable * const mt = db_load_metatable(comp->db, mtid, comp->cm_to->raw_fd, false);
+  assert(i < comp->out_hi);
+  struct DB * const db = comp->db;
+  const uint64_t cpu0 = debug_cpu_usec();
+  table_set_rate_limit(comp->tables[i], &(db->rl_write[db_dev_id(db, comp->cms_to[i]->raw_fd)]));
+  struct MetaTable * const mt = db_table_dump(db, comp->tables[i], comp->sub_bit, comp->cms_to[i], comp->offs_new[i]);
+  // the feed stops short of a table that cannot be retained, see compaction_main()
   assert(mt);
+  comp->mtids_new[i] = mt->mtid;
   comp->mts_new[i] = mt;
-  stat_inc_n(&(comp->db->stat.nr_write[comp->sub_bit]), TABLE_MAX_BARRELS);
+  stat_inc_n(&(comp->db->stat->nr_write[comp->sub_bit]), comp->tables[i]->nr_barrels + 1u);
+  comp->sizes_new[i] = (comp->tables[i]->nr_barrels + 1u) * BARREL_ALIGN;
+  __sync_fetch_and_add(&(comp->nr_replaced), comp->tables[i]->nr_replaced);
   assert(mt->bt == NULL);
   if (comp->gen_bc == false) {
     mt->bt = comp->tables[i]->bt;
   }
+  __sync_fetch_and_add(&(comp->cpu_usec[DB_PHASE_DUMP]), debug_cpu_usec() - cpu0);
   pthread_exit(NULL);
 }
 
+// a bc update reads the old pages and writes them again with the new filters; paced before it is issued,
+// the pages written are estimated from the bytes of the filters and a 4-byte header each
+  static void
+db_io_take_bc(struct DB * const db, const struct BloomContainer * const old_bc, const struct BloomTable * const bt)
+{
+  const uint32_t dev = db_dev_id(db, db->cm_bc->raw_fd);
+  const uint64_t nr_old = old_bc ? old_bc->nr_index : 0;
+  if (nr_old) {
+    ratelimit_take(&(db->rl_read[dev]), nr_old * BARREL_ALIGN);
+  }
+  const uint64_t nr_new = (bt->nr_bytes + (bt->nr_bf * UINT64_C(4)) + BARREL_ALIGN - 1u) / BARREL_ALIGN;
+  ratelimit_take(&(db->rl_write[dev]), (nr_old + nr_new) * BARREL_ALIGN);
+}
+
   static struct BloomContainer *
 compaction_update_bc(struct DB * const db, struct BloomContainer * const old_bc, struct BloomTable * const bloomtable)
 {
   const double sec0 = debug_time_sec();
-  const uint64_t off_bc = db_cmap_safe_alloc(db, db->cm_bc);
+  const uint64_t off_bc = db_cmap_safe_alloc(db, db->cm_bc, TABLE_UNITS(bloomtable->nr_bf));
   assert(off_bc < db->cm_bc->total_cap);
   const uint64_t mtid_bc = db_aquire_mtid(db);
   const int raw_fd = db->cm_bc->raw_fd;
 
+  db_io_take_bc(db, old_bc, bloomtable);
   struct BloomContainer * const new_bc = (old_bc == NULL)?
-    bloomcontainer_build(bloomtable, raw_fd, off_bc, &(db->stat)):
-    bloomcontainer_update(old_bc, bloomtable, raw_fd, off_bc, &(db->stat));
+    bloomcontainer_build(bloomtable, raw_fd, off_bc, db->stat):
+    bloomcontainer_update(old_bc, bloomtable, raw_fd, off_bc, db->stat);
   assert(new_bc);
+  fdatasync(raw_fd);
   new_bc->mtid = mtid_bc;
   const uint64_t count = new_bc->nr_bf_per_box;
   assert(count > 0);
@@ -749,7 +1456,7 @@ compaction_update_bc(struct DB * const db, struct BloomContainer * const old_bc,
   const bool r = db_dump_bloomcontainer_meta(db, mtid_bc, new_bc);
   assert(r);
   db_log_diff(db, sec0, "BC   *%1lu [%8lx #%08lx] {%4u}",
-      count, mtid_bc, off_bc/TABLE_ALIGN, new_bc->nr_index);
+      count, mtid_bc, off_bc/db->unit_size, new_bc->nr_index);
   return new_bc;
 }
 
@@ -759,82 +1466,354 @@ thread_compaction_bc(void * const p)
   struct Compaction * const comp = (typeof(comp))p;
   const uint64_t i = __sync_fetch_and_add(&(comp->bc_token), 1);
   assert(i < 8);
+  const uint64_t cpu0 = debug_cpu_usec();
   struct BloomContainer * const new_bc = compaction_update_bc(comp->db, comp->mbcs_old[i], comp->tables[i]->bt);
   comp->mbcs_new[i] = new_bc;
+  __sync_fetch_and_add(&(comp->cpu_usec[DB_PHASE_DUMP]), debug_cpu_usec() - cpu0);
   pthread_exit(NULL);
 }
 
   static void
 compaction_dump_and_bc_all(struct Compaction * const comp)
 {
-  comp->dump_token = 0;
+  const uint64_t lo = comp->out_lo;
+  const uint64_t nr = comp->out_hi - lo;
+  comp->dump_token = lo;
   comp->bc_token = 0;
-  pthread_t thd[8];
+  // a leaf builds one bc for all its tables later
+  const bool gen_bc = comp->gen_bc && (comp->leaf == false);
+  // the 8 siblings are placed together, unless they stripe over several devices
+  const uint64_t nr_units = TABLE_UNITS(comp->tables[lo]->nr_barrels);
+  bool striped = false;
+  for (uint64_t i = lo + 1u; i < comp->out_hi; i++) {
+    if (comp->cms_to[i] != comp->cms_to[lo]) striped = true;
+  }
+  if (striped) {
+    for (uint64_t i = lo; i < comp->out_hi; i++) {
+      comp->offs_new[i] = db_cmap_safe_alloc(comp->db, comp->cms_to[i], nr_units);
+    }
+  } else {
+    db_cmap_safe_alloc_contig(comp->db, comp->cms_to[lo], nr, nr_units, &(comp->offs_new[lo]));
+  }
+  pthread_t thd[DB_LEAF_ROUND];
   pthread_t thb[8];
+  assert(nr <= DB_LEAF_ROUND);
   pthread_attr_t attr;
   pthread_attr_init(&attr);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-  for (uint64_t j = 0; j < 8; j++) {
+  for (uint64_t j = 0; j < nr; j++) {
     pthread_create(&(thd[j]), &attr, thread_compaction_dump, comp);
-    if (comp->gen_bc == true) {
+    if (gen_bc == true) {
       pthread_create(&(thb[j]), &attr, thread_compaction_bc, comp);
     }
   }
-  for (uint64_t j = 0; j < 8; j++) {
+  for (uint64_t j = 0; j < nr; j++) {
     pthread_join(thd[j], NULL);
-    if (comp->gen_bc == true) {
+    if (gen_bc == true) {
       pthread_join(thb[j], NULL);
     }
   }
 }
 
+// one bc for all the new tables of a leaf; the intermediate ones are never referenced
   static void
-compaction_update_vc(struct Compaction * const comp)
+compaction_leaf_bc(struct Compaction * const comp)
 {
-  const uint64_t ticket = rwlock_writer_lock(&(comp->db->rwlock));
+  struct DB * const db = comp->db;
+  const double sec0 = debug_time_sec();
+  const int raw_fd = db->cm_bc->raw_fd;
+  const uint64_t nr_units = TABLE_UNITS(comp->bts_new[0]->nr_bf);
+  struct BloomContainer * bc = NULL;
+  for (uint64_t i = 0; i < comp->nr_out; i++) {
+    const uint64_t off_bc = db_cmap_safe_alloc(db, db->cm_bc, nr_units);
+    assert(off_bc < db->cm_bc->total_cap);
+    db_io_take_bc(db, bc, comp->bts_new[i]);
+    struct BloomContainer * const bc1 = bc ?
+      bloomcontainer_update(bc, comp->bts_new[i], raw_fd, off_bc, db->stat) :
+      bloomcontainer_build(comp->bts_new[i], raw_fd, off_bc, db->stat);
+    assert(bc1);
+    if (bc) {
+      db_cmap_release(db->cm_bc, bc->off_raw, nr_units);
+      bloomcontainer_free(bc);
+    }
+    bc = bc1;
+  }
+  fdatasync(raw_fd);
+  bc->mtid = db_aquire_mtid(db);
+  const bool r = db_dump_bloomcontainer_meta(db, bc->mtid, bc);
+  assert(r);
+  comp->mbcs_new[0] = bc;
+  db_log_diff(db, sec0, "BC   *%1u [%8lx #%08lx] {%4u}",
+      bc->nr_bf_per_box, bc->mtid, bc->off_raw/db->unit_size, bc->nr_index);
+}
 
+// the merged tables are dropped before the new ones take their place
+  static void
+compaction_update_leaf(struct Compaction * const comp)
+{
+  struct DB * const db = comp->db;
   struct VirtualContainer * const vc = comp->vc;
-  // insert new mts
-  for (uint64_t i = 0; i < 8; i++) {
-    const bool ri = vc_insert_internal(vc->sub_vc[i], comp->mts_new[i], comp->mbcs_new[i]);
-    assert(ri);
+  struct ManifestRecord recs[DB_CONTAINER_NR + 2];
+  db_record_drop(&(recs[0]), vc, comp->nr_feed);
+  for (uint64_t i = 0; i < comp->nr_out; i++) {
+    db_record_add(db, &(recs[i + 1]), vc, comp->mts_new[i], comp->mbcs_new[0]);
   }
+  pthread_mutex_lock(&(db->mutex_manifest));
+  db_manifest_commit(db, recs, comp->nr_out + 1);
 
-  const uint64_t nr_keep = vc->cc.count - comp->nr_feed;
-  // shift
-  for (uint64_t i = 0; i < nr_keep; i++) {
-    vc->cc.metatables[i] = vc->cc.metatables[i + comp->nr_feed];
+  const uint64_t ticket = rwlock_writer_lock(&(db->rwlock));
+  vc_drop_front(vc, comp->nr_feed);
+  for (uint64_t i = 0; i < comp->nr_out; i++) {
+    const bool ri = vc_insert_internal(vc, comp->mts_new[i], comp->mbcs_new[0]);
+    assert(ri);
   }
-  // NULL
-  for (uint64_t i = nr_keep; i < DB_CONTAINER_NR; i++) {
-    vc->cc.metatables[i] = NULL;
+  rwlock_writer_unlock(&(db->rwlock), ticket);
+  if (comp->vdrops) {
+    vlog_drops_apply(db->vlog, comp->vdrops);
+    db_vlog_commit(db);
   }
-  vc->cc.count = nr_keep;
+  pthread_mutex_unlock(&(db->mutex_manifest));
+}
 
-  rwlock_writer_unlock(&(comp->db->rwlock), ticket);
+  static void
+compaction_update_vc(struct Compaction * const comp)
+{
+  struct DB * const db = comp->db;
+  struct VirtualContainer * const vc = comp->vc;
+  if (comp->leaf) {
+    compaction_update_leaf(comp);
+    return;
+  }
+  // log the edit first
+  struct ManifestRecord recs[8 + 2];
+  for (uint64_t i = 0; i < 8; i++) {
+    db_record_add(db, &(recs[i]), vc->sub_vc[i], comp->mts_new[i], comp->mbcs_new[i]);
+  }
+  db_record_drop(&(recs[8]), vc, comp->nr_feed);
+  pthread_mutex_lock(&(db->mutex_manifest));
+  db_manifest_commit(db, recs, 9);
+
+  const uint64_t ticket = rwlock_writer_lock(&(db->rwlock));
+  // insert new mts
+  for (uint64_t i = 0; i < 8; i++) {
+    const bool ri = vc_insert_internal(vc->sub_vc[i], comp->mts_new[i], comp->mbcs_new[i]);
+    assert(ri);
+  }
+  vc_drop_front(vc, comp->nr_feed);
+  // a bc keeps the dropped tables' filters until it is empty, see recursive_lookup()
+  if ((vc->cc.count == 0) && vc->cc.bc) {
+    comp->bc_self = vc->cc.bc;
+    vc->cc.bc = NULL;
+  }
+  rwlock_writer_unlock(&(db->rwlock), ticket);
+  // no reader can see the dropped values now
+  if (comp->vdrops) {
+    vlog_drops_apply(db->vlog, comp->vdrops);
+    db_vlog_commit(db);
+  }
+  pthread_mutex_unlock(&(db->mutex_manifest));
 }
 
   static void
 compaction_free_old(struct Compaction * const comp)
 {
+  // the arena is sized by the old tables
+  const uint64_t arena_size = BARREL_ALIGN * (comp->mts_old[0]->nr_barrels + 1u);
   // free n
   for (uint64_t i = 0; i < comp->nr_feed; i++) {
-    containermap_release(comp->db->cms[comp->start_bit/3], comp->mts_old[i]->mfh.off);
+    db_cmap_release(db_cm_of_fd(comp->db, comp->mts_old[i]->raw_fd), comp->mts_old[i]->mfh.off,
+        TABLE_UNITS(comp->mts_old[i]->nr_barrels));
+    db_destory_metatable(comp->db, comp->mts_old[i]);
+    db_dict_put(comp->db, comp->mts_old[i]->dict);
     metatable_free(comp->mts_old[i]);
-    db_destory_metatable(comp->db, comp->mtids_old[i]);
   }
 
   // free n+1
   for (uint64_t i = 0; i < 8; i++) {
     if (comp->mbcs_old[i]) {
-      containermap_release(comp->db->cm_bc, comp->mbcs_old[i]->off_raw);
+      db_cmap_release(comp->db->cm_bc, comp->mbcs_old[i]->off_raw, TABLE_UNITS(comp->mbcs_old[i]->nr_barrels));
       bloomcontainer_free(comp->mbcs_old[i]);
     }
+  }
+  if (comp->bc_self) {
+    db_cmap_release(comp->db->cm_bc, comp->bc_self->off_raw, TABLE_UNITS(comp->bc_self->nr_barrels));
+    bloomcontainer_free(comp->bc_self);
+  }
+  for (uint64_t i = 0; i < comp->nr_out; i++) {
+    if (comp->tables[i] == NULL) continue; // leaf: freed after each round
     if (comp->gen_bc == false) { // keep bloomtable
       comp->tables[i]->bt = NULL;
     }
     table_free(comp->tables[i]);
   }
+  // free feed arenas
+  huge_free(comp->arena, arena_size);
+  if (comp->vdrops) {
+    free(comp->vdrops);
+  }
+  db_dict_put(comp->db, comp->dict);
+}
+
+// a new dictionary from samples of the merged tables; NULL if too few
+  static struct CodecDict *
+compaction_dict_train(struct Compaction * const comp)
+{
+  struct DB * const db = comp->db;
+  uint8_t * const samples = (typeof(samples))malloc(DB_DICT_SAMPLES);
+  const uint64_t max = DB_DICT_SAMPLES / 16;
+  uint64_t * const sizes = (typeof(sizes))malloc(sizeof(sizes[0]) * max);
+  assert(samples && sizes);
+  uint64_t nr = 0;
+  uint64_t bytes = 0;
+  const uint64_t lo = comp->out_lo;
+  const uint64_t nr_tables = comp->out_hi - lo;
+  for (uint64_t i = 0; i < nr_tables; i++) {
+    const uint64_t cap = (DB_DICT_SAMPLES * (i + 1) / nr_tables) - bytes;
+    const uint64_t nr_i = table_sample_items(comp->tables[lo + i], DB_DICT_STRIDE, samples + bytes, cap,
+        sizes + nr, max - nr);
+    for (uint64_t j = nr; j < (nr + nr_i); j++) {
+      bytes += sizes[j];
+    }
+    nr += nr_i;
+  }
+  const uint64_t id = db_aquire_mtid(db);
+  struct CodecDict * const dict = codec_dict_train(db->codec, id, samples, sizes, nr, DB_DICT_SIZE);
+  free(samples);
+  free(sizes);
+  if (dict == NULL) return NULL;
+  // durable before any table refers to it
+  char dictfn[2048];
+  db_generate_meta_fn(db, id, dictfn);
+  FILE * const fo = fopen(dictfn, "wb");
+  assert(fo);
+  const bool rd = codec_dict_dump(dict, fo);
+  assert(rd);
+  fflush(fo);
+  fsync(fileno(fo));
+  fclose(fo);
+  return dict;
+}
+
+// the new tables share the dictionary of their level
+  static void
+compaction_dict(struct Compaction * const comp)
+{
+  struct DB * const db = comp->db;
+  if (db->codec == CODEC_NONE) return;
+  const uint64_t level = comp->sub_bit / 3;
+  pthread_mutex_lock(&(db->mutex_dict));
+  const bool stale = (db->dict_level[level] == NULL) || (db->dict_age[level] >= DB_DICT_RETRAIN);
+  if (stale && (db->dict_training[level] == false)) { // others go on with the old one (or none) meanwhile
+    db->dict_age[level] = 0;
+    db->dict_training[level] = true;
+    pthread_mutex_unlock(&(db->mutex_dict));
+    struct CodecDict * const dict = compaction_dict_train(comp);
+    pthread_mutex_lock(&(db->mutex_dict));
+    if (dict) {
+      dict->refs = 1;
+      dict->next = db->dicts;
+      db->dicts = dict;
+      struct CodecDict * const old = db->dict_level[level];
+      db->dict_level[level] = dict;
+      pthread_mutex_unlock(&(db->mutex_dict));
+      db_dict_put(db, old);
+      pthread_mutex_lock(&(db->mutex_dict));
+    }
+    db->dict_training[level] = false;
+  }
+  db->dict_age[level]++;
+  comp->dict = db->dict_level[level];
+  if (comp->dict) {
+    comp->dict->refs++;
+  }
+  pthread_mutex_unlock(&(db->mutex_dict));
+  for (uint64_t i = comp->out_lo; i < comp->out_hi; i++) {
+    table_set_dict(comp->tables[i], comp->dict);
+  }
+}
+
+  static void
+compaction_trace_start(struct Compaction * const comp)
+{
+  struct DB * const db = comp->db;
+  if (db->trace == NULL) return;
+  comp->trace_id = __sync_add_and_fetch(&(db->nr_traced), 1);
+  comp->cpu_last = debug_cpu_usec();
+  char in[1024] = {0};
+  for (uint64_t i = 0, n = 0; i < comp->nr_feed; i++) {
+    n += sprintf(in + n, "%s%lu", i ? "," : "", comp->mtids_old[i]);
+  }
+  db_trace(db, "{\"ev\":\"start\",\"id\":%lu,\"sec\":%.6lf,\"kind\":\"%s\",\"level\":%lu,\"path\":\"%lx\",\"in\":[%s]}",
+      comp->trace_id, debug_time_sec() - db->sec_start, comp->leaf ? "leaf" : "comp", comp->start_bit / 3u,
+      comp->vc->path, in);
+}
+
+// the phase ran from usec0 until now; return now
+  static uint64_t
+compaction_phase(struct Compaction * const comp, const enum DBPhase phase, const uint64_t usec0)
+{
+  struct DB * const db = comp->db;
+  const uint64_t usec = stat_lat_since(db->stat, (enum StatLat)(STAT_LAT_COMP_FEED + phase), usec0);
+  if (comp->trace_id == 0) return usec;
+  static const char * const names[DB_PHASE_NR] = {"feed", "build", "dump", "update"};
+  const uint64_t cpu = debug_cpu_usec();
+  const uint64_t cpu_phase = comp->cpu_usec[phase] + (cpu - comp->cpu_last);
+  comp->cpu_last = cpu;
+  comp->cpu_usec[phase] = 0;
+  db_trace(db, "{\"ev\":\"phase\",\"id\":%lu,\"phase\":\"%s\",\"start\":%.6lf,\"end\":%.6lf,\"cpu_us\":%lu}",
+      comp->trace_id, names[phase], db_trace_sec(db, usec0), db_trace_sec(db, usec), cpu_phase);
+  return usec;
+}
+
+// an "out" event for each new table, then the totals
+  static void
+compaction_trace_end(struct Compaction * const comp)
+{
+  struct DB * const db = comp->db;
+  if (comp->trace_id == 0) return;
+  const double sec = debug_time_sec() - db->sec_start;
+  const uint64_t level = comp->sub_bit / 3u;
+  char out[1024] = {0};
+  uint64_t nr_written = 0;
+  for (uint64_t i = 0, n = 0; i < comp->nr_out; i++) {
+    const uint64_t path = comp->leaf ? comp->vc->path : ((comp->vc->path << 3) | i);
+    db_trace(db, "{\"ev\":\"out\",\"id\":%lu,\"sec\":%.6lf,\"kind\":\"%s\",\"level\":%lu,\"path\":\"%lx\",\"mtid\":%lu,"
+        "\"bytes\":%lu}", comp->trace_id, sec, comp->leaf ? "leaf" : "comp", level, path, comp->mtids_new[i],
+        comp->sizes_new[i]);
+    n += sprintf(out + n, "%s%lu", i ? "," : "", comp->mtids_new[i]);
+    nr_written += comp->sizes_new[i];
+  }
+  char in[1024] = {0};
+  for (uint64_t i = 0, n = 0; i < comp->nr_feed; i++) {
+    n += sprintf(in + n, "%s%lu", i ? "," : "", comp->mtids_old[i]);
+  }
+  db_trace(db, "{\"ev\":\"end\",\"id\":%lu,\"sec\":%.6lf,\"read\":%lu,\"write\":%lu,\"replaced\":%lu,"
+      "\"in\":[%s],\"out\":[%s]}", comp->trace_id, sec, comp->nr_read, nr_written, comp->nr_replaced, in, out);
+  fflush(db->trace);
+}
+
+// a table refused some of the feed, see table_insert_rawitem_mt()
+  static bool
+compaction_refused(const struct Compaction * const comp)
+{
+  for (uint64_t i = comp->out_lo; i < comp->out_hi; i++) {
+    if (comp->tables[i]->refused) return true;
+  }
+  return false;
+}
+
+// the new tables of a failed attempt; the inputs are left as they are
+  static void
+compaction_undo(struct Compaction * const comp)
+{
+  for (uint64_t i = 0; i < comp->nr_out; i++) {
+    table_free(comp->tables[i]);
+    comp->tables[i] = NULL;
+  }
+  if (comp->vdrops) {
+    free(comp->vdrops);
+    comp->vdrops = vlog_drops_new(comp->db->vlog);
+  }
 }
 
   static void
@@ -842,40 +1821,242 @@ compaction_main(struct DB * const db, struct VirtualContainer * const vc, const
 {
   struct Compaction comp;
   const double sec0 = debug_time_sec();
-  compaction_initial(&comp, db, vc, nr_feed);
-  // feed (must sequential)
-  compaction_feed_all(&comp);
+  compaction_initial(&comp, db, vc, nr_feed, 8, false);
+  compaction_trace_start(&comp);
+  uint64_t usec = debug_time_usec();
+  // feed (must sequential); if a sub-table cannot be retained, the older half of the inputs is fed again
+  for (;;) {
+    compaction_alloc_tables(&comp, 0, 8);
+    compaction_feed_all(&comp);
+    if (compaction_refused(&comp) == false) break;
+    assert(comp.nr_feed > 1); // one table always fits in its 8 sub-tables
+    db_log(db, "COMP @%lu %2lu refused, retry with %2lu", vc->start_bit/3u, comp.nr_feed, comp.nr_feed / 2u);
+    compaction_undo(&comp);
+    comp.nr_feed /= 2u;
+  }
+  compaction_dict(&comp);
+  usec = compaction_phase(&comp, DB_PHASE_FEED, usec);
   // build bt
   compaction_build_bt_all(&comp);
+  usec = compaction_phase(&comp, DB_PHASE_BUILD, usec);
   // dump table and bc
   compaction_dump_and_bc_all(&comp);
+  usec = compaction_phase(&comp, DB_PHASE_DUMP, usec);
   // apply changes
   compaction_update_vc(&comp);
   // free old
   compaction_free_old(&comp);
+  compaction_phase(&comp, DB_PHASE_UPDATE, usec);
+  compaction_trace_end(&comp);
   // log
-  db_log_diff(db, sec0, "COMP @%lu %2lu", vc->start_bit/3u, nr_feed);
-  stat_inc(&(db->stat.nr_compaction));
+  db_log_diff(db, sec0, "COMP @%lu %2lu", vc->start_bit/3u, comp.nr_feed);
+  stat_inc(&(db->stat->nr_compaction));
+}
+
+// as much as a compaction into the leaf puts in a table, with the leaf's slack taken out
+  static double
+leaf_table_cap(struct DB * const db, const struct VirtualContainer * const vc)
+{
+  return ((double)db_compaction_cap(db, vc->start_bit - 3u)) / 8.0 / 1.1;
+}
+
+  static uint64_t
+leaf_tables_for(struct DB * const db, const struct VirtualContainer * const vc, const double live)
+{
+  return ((uint64_t)(live / leaf_table_cap(db, vc))) + 1u;
 }
 
+// after the feed: the tables the merged data needs, nr_out if they all can be dumped
+  static uint64_t
+leaf_nr_fit(struct Compaction * const comp)
+{
+  uint64_t live = 0;
+  bool full = false;
+  for (uint64_t i = 0; i < comp->nr_out; i++) {
+    live += comp->tables[i]->volume + comp->tables[i]->refused;
+    if (table_full(comp->tables[i])) full = true;
+  }
+  comp->vc->leaf_live = live;
+  comp->vc->leaf_count = comp->vc->cc.count;
+  if (full == false) return comp->nr_out;
+  const uint64_t nr_fit = leaf_tables_for(comp->db, comp->vc, (double)live);
+  return (nr_fit > comp->nr_out) ? nr_fit : (comp->nr_out + 1u);
+}
+
+// merge all tables of a leaf into nr_out tables. the inputs are fed once; the new tables are dumped
+// DB_LEAF_ROUND at a time. a low estimate is retried with more tables, or the leaf is left as it is
+// if the merge would not save any
   static void
-recursive_compaction(struct DB * const db, struct VirtualContainer * const vc)
+leaf_compaction(struct DB * const db, struct VirtualContainer * const vc, const uint64_t nr_out_est)
 {
-  assert(vc);
-  // disable compaction for last level
-  if (vc->start_bit >= BC_START_BIT) return;
+  struct Compaction comp;
+  const double sec0 = debug_time_sec();
+  const uint64_t nr_feed = vc->cc.count;
+  uint64_t nr_out = nr_out_est;
+  compaction_initial(&comp, db, vc, nr_feed, nr_out, true);
+  compaction_trace_start(&comp);
+  uint64_t usec = debug_time_usec();
+  for (;;) {
+    compaction_alloc_tables(&comp, 0, nr_out);
+    compaction_feed_all(&comp);
+    const uint64_t nr_fit = leaf_nr_fit(&comp);
+    if (nr_fit == nr_out) break;
+    db_log(db, "LEAF @%lu %2lu -> %2lu short, needs %2lu", vc->start_bit/3u, nr_feed, nr_out, nr_fit);
+    compaction_undo(&comp);
+    if (nr_fit >= nr_feed) {
+      comp.nr_out = 0;
+      compaction_trace_end(&comp);
+      huge_free(comp.arena, BARREL_ALIGN * (comp.mts_old[0]->nr_barrels + 1u));
+      if (comp.vdrops) {
+        free(comp.vdrops);
+      }
+      return;
+    }
+    for (uint64_t i = nr_out; i < nr_fit; i++) {
+      comp.cms_to[i] = db_cm_next(db, comp.sub_bit/3);
+    }
+    nr_out = nr_fit;
+    comp.nr_out = nr_out;
+  }
+  compaction_dict(&comp);
+  usec = compaction_phase(&comp, DB_PHASE_FEED, usec);
+  for (uint64_t lo = 0; lo < nr_out; lo += DB_LEAF_ROUND) {
+    const uint64_t hi = ((lo + DB_LEAF_ROUND) < nr_out) ? (lo + DB_LEAF_ROUND) : nr_out;
+    comp.out_lo = lo;
+    comp.out_hi = hi;
+    compaction_build_bt_all(&comp);
+    usec = compaction_phase(&comp, DB_PHASE_BUILD, usec);
+    compaction_dump_and_bc_all(&comp);
+    usec = compaction_phase(&comp, DB_PHASE_DUMP, usec);
+    for (uint64_t i = lo; i < hi; i++) {
+      if (comp.gen_bc) { // else kept by the new mt
+        comp.bts_new[i] = comp.tables[i]->bt;
+      }
+      comp.tables[i]->bt = NULL;
+      table_free(comp.tables[i]);
+      comp.tables[i] = NULL;
+    }
+  }
+  // a leaf above BC_START_BIT has none, see "nr_levels"
+  if (comp.gen_bc) {
+    compaction_leaf_bc(&comp);
+    for (uint64_t i = 0; i < nr_out; i++) {
+      bloomtable_free(comp.bts_new[i]);
+    }
+  }
+  compaction_update_vc(&comp);
+  // the merged volume is exact; no sample is needed until new tables come in
+  vc->leaf_count = nr_out;
+  compaction_free_old(&comp);
+  compaction_phase(&comp, DB_PHASE_UPDATE, usec);
+  compaction_trace_end(&comp);
+  db_log_diff(db, sec0, "LEAF @%lu %2lu -> %2lu", vc->start_bit/3u, nr_feed, nr_out);
+  stat_inc(&(db->stat->nr_compaction));
+}
 
-  const uint64_t nr_input = vc_count_feed(vc);
-  if (nr_input == 0) { return; }
+// return the number of tables the live data of a leaf fits in, 0 if it has fewer than nr_min tables.
+// the live data is estimated by merging the first DB_LEAF_SAMPLE barrels of every table. the estimate
+// is kept in the vc: up to DB_LEAF_RESAMPLE tables added since are counted as full instead
+  static uint64_t
+leaf_nr_out(struct DB * const db, struct VirtualContainer * const vc, const uint64_t nr_min)
+{
+  const uint64_t count = vc->cc.count;
+  if (count < nr_min) return 0;
+  const double per_table = leaf_table_cap(db, vc);
+  // the bound is too coarse for the early merges, see db_room_compaction()
+  if ((nr_min >= DB_LEAF_NR) && vc->leaf_count && (count >= vc->leaf_count) &&
+      (count < (vc->leaf_count + DB_LEAF_RESAMPLE))) {
+    const double live = ((double)vc->leaf_live) + (((double)(count - vc->leaf_count)) * per_table);
+    return leaf_tables_for(db, vc, live);
+  }
+  const uint64_t nr_barrels = vc->cc.metatables[0]->nr_barrels;
+  const uint64_t nr_sample = DB_LEAF_SAMPLE;
+  assert(nr_sample < nr_barrels);
+  // room for every sampled item, even with no overwrite at all
+  const double factor = (((double)(count * nr_sample * 2u)) / ((double)nr_barrels)) * (db->vlog ? 4.0 : 1.8);
+  struct Table * const table = table_alloc_codec(CODEC_NONE, nr_barrels, 1.0, factor);
+  assert(table);
+  struct Table * tables[1] = {table};
+  uint8_t * const arena = huge_alloc(BARREL_ALIGN * nr_sample);
+  assert(arena);
+  for (uint64_t i = 0; i < count; i++) { // oldest first, as in compaction
+    const bool r = metatable_feed_barrels_to_tables(vc->cc.metatables[i], 0, nr_sample, arena, tables,
+        leaf_select_table, 1);
+    assert(r);
+  }
+  const double live = ((double)table->volume) * ((double)nr_barrels) / ((double)nr_sample);
+  huge_free(arena, BARREL_ALIGN * nr_sample);
+  table_free(table);
+  vc->leaf_live = (uint64_t)live;
+  vc->leaf_count = count;
+  return leaf_tables_for(db, vc, live);
+}
 
-  compaction_main(db, vc, nr_input);
+// the last level becomes the second last; its containers will compact into the new one.
+// return false at max_levels
+  static bool
+db_grow(struct DB * const db, const uint64_t level)
+{
+  pthread_mutex_lock(&(db->mutex_manifest));
+  if (db->nr_levels > (level + 1u)) { // by another thread
+    pthread_mutex_unlock(&(db->mutex_manifest));
+    return true;
+  }
+  if (db->nr_levels >= db->max_levels) {
+    pthread_mutex_unlock(&(db->mutex_manifest));
+    return false;
+  }
+  __sync_add_and_fetch(&(db->nr_levels), 1);
+  struct ManifestRecord recs[2];
+  db_record_format(db, &(recs[0]));
+  db_manifest_commit(db, recs, 1);
+  pthread_mutex_unlock(&(db->mutex_manifest));
+  db_log(db, "GROW %lu levels", db->nr_levels);
+  return true;
+}
+
+  static void
+recursive_compaction(struct DB * const db, struct VirtualContainer * const vc);
+
+// every leaf just fed with nr_min tables or more is checked; return false if the sub_vcs are not leaves.
+// a leaf is merged when that halves its tables; one about to fill splits into a new level if it may,
+// else it is merged anyway
+  static bool
+leaf_compaction_sub(struct DB * const db, struct VirtualContainer * const vc, const uint64_t start, const uint64_t inc,
+    const uint64_t nr_min)
+{
+  if (db_is_leaf(db, vc->start_bit + 3u) == false) return false;
+  for (uint64_t i = start; i < 8u; i += inc) {
+    struct VirtualContainer * const sub = vc->sub_vc[i];
+    if (sub == NULL) continue;
+    const uint64_t nr_out = leaf_nr_out(db, sub, nr_min);
+    if (nr_out == 0) continue;
+    const uint64_t count = sub->cc.count;
+    const bool full = (count >= (DB_CONTAINER_NR - 1u)) ? true : false;
+    if ((nr_out * 2u) <= count) {
+      leaf_compaction(db, sub, nr_out);
+    } else if (full && db_grow(db, sub->start_bit / 3u)) {
+      recursive_compaction(db, sub);
+    } else if (full && (nr_out < count)) {
+      leaf_compaction(db, sub, nr_out);
+    }
+  }
+  return true;
+}
+
+// after vc has been compacted; start/inc: the sub_vcs owned by the caller
+  static void
+compaction_sub(struct DB * const db, struct VirtualContainer * const vc, const uint64_t start, const uint64_t inc)
+{
+  if (leaf_compaction_sub(db, vc, start, inc, DB_LEAF_NR)) return;
 
   // select most significant sub_vc
-  struct VirtualContainer * const vc1 = vc_pick_compaction(vc->sub_vc, 0, 1);
+  struct VirtualContainer * const vc1 = vc_pick_compaction(vc->sub_vc, start, inc,
+      db_compaction_cap(db, vc->start_bit + 3));
   if (vc1) {
     recursive_compaction(db, vc1);
     for (;;) {
-      struct VirtualContainer * const vcf = vc_pick_full(vc->sub_vc, 0, 1);
+      struct VirtualContainer * const vcf = vc_pick_full(vc->sub_vc, start, inc);
       if (vcf) {
         recursive_compaction(db, vcf);
       } else {
@@ -886,11 +2067,30 @@ recursive_compaction(struct DB * const db, struct VirtualContainer * const vc)
 }
 
   static void
-db_root_compaction(struct DB * const db, const uint64_t token)
+recursive_compaction(struct DB * const db, struct VirtualContainer * const vc)
+{
+  assert(vc);
+  // the last level is merged in place, see leaf_compaction_sub()
+  if (db_is_leaf(db, vc->start_bit)) return;
+
+  const uint64_t cap = db_compaction_cap(db, vc->start_bit);
+  uint64_t nr_input = vc_count_feed(vc, cap);
+  // a bc is released with the last table only: once due, a container with one is drained until it is gone
+  while (nr_input) {
+    compaction_main(db, vc, nr_input);
+    compaction_sub(db, vc, 0, 1);
+    if (vc->cc.bc == NULL) break;
+    nr_input = vc_count_feed(vc, cap);
+    if (nr_input == 0) {
+      nr_input = vc->cc.count;
+    }
+  }
+}
+
+  static void
+db_root_compaction(struct DB * const db, const uint64_t token, const uint64_t nr_input)
 {
   struct VirtualContainer * const vc = db->vcroot;
-  const uint64_t nr_input = vc_count_feed(vc);
-  if (nr_input == 0) { return; }
 
   compaction_main(db, vc, nr_input);
 
@@ -898,25 +2098,92 @@ db_root_compaction(struct DB * const db, const uint64_t token)
   pthread_mutex_lock(&(db->mutex_current));
   pthread_cond_broadcast(&(db->cond_root_producer));
   pthread_mutex_unlock(&(db->mutex_current));
-  pthread_mutex_unlock(&(db->mutex_root));
+  // leaves right below the root are merged before the next root compaction can add to them
+  const bool leaf1 = db_is_leaf(db, vc->start_bit + 3u);
+  if (leaf1 == false) {
+    pthread_mutex_unlock(&(db->mutex_root));
+  }
 
   // lock the child tree
   pthread_mutex_lock(&(db->mutex_token[token]));
-  struct VirtualContainer * const vc1 = vc_pick_compaction(vc->sub_vc, token, DB_COMPACTION_NR);
-  if (vc1) {
-    recursive_compaction(db, vc1);
-    for (;;) {
-      struct VirtualContainer * const vcf = vc_pick_full(vc->sub_vc, token, DB_COMPACTION_NR);
-      if (vcf) {
-        recursive_compaction(db, vcf);
-      } else {
-        break;
-      }
-    }
-  }
+  compaction_sub(db, vc, token, DB_COMPACTION_NR);
 
   // finish
   pthread_mutex_unlock(&(db->mutex_token[token]));
+  if (leaf1) {
+    pthread_mutex_unlock(&(db->mutex_root));
+  }
+}
+
+  static void
+db_room_walk(struct DB * const db, struct VirtualContainer * const vc, const uint64_t start, const uint64_t inc)
+{
+  if (vc == NULL) return;
+  if (leaf_compaction_sub(db, vc, start, inc, 2)) return;
+  for (uint64_t i = start; i < 8u; i += inc) {
+    db_room_walk(db, vc->sub_vc[i], 0, 1);
+  }
+}
+
+// while the dumper waits for room: every leaf that halves is merged now rather than at DB_LEAF_NR tables.
+// under mutex_root, like the leaves right below the root
+  static void
+db_room_compaction(struct DB * const db)
+{
+  for (uint64_t t = 0; t < DB_COMPACTION_NR; t++) {
+    pthread_mutex_lock(&(db->mutex_token[t]));
+    db_room_walk(db, db->vcroot, t, DB_COMPACTION_NR);
+    pthread_mutex_unlock(&(db->mutex_token[t]));
+  }
+}
+
+// rate: as configured in bytes per second; 0 stays unlimited until the factor drops
+  static void
+db_io_set(struct RateLimit * const rl, const uint64_t rate, const double factor)
+{
+  if ((rate == 0) && (factor >= 1.0)) {
+    ratelimit_set(rl, 0);
+    return;
+  }
+  const double base = (double)(rate ? rate : (DB_IO_RATE_DEFAULT * UINT64_C(1024) * UINT64_C(1024)));
+  ratelimit_set(rl, (uint64_t)(base * factor));
+}
+
+// every second: scale the compaction rates down while the p99 of lookups is over the target, up otherwise
+  static void
+db_io_tune(struct DB * const db)
+{
+  if (db->lat_get == NULL) return;
+  // the lookups keep recording into lat_get
+  struct Hist hist;
+  hist_take(&hist, db->lat_get);
+  const uint64_t p99 = hist_percentile(&hist, 0.99);
+  db->io_p99 = p99;
+  const double factor0 = db->io_factor;
+  if (p99 > db->io_target) {
+    db->io_factor = (factor0 * 0.75 < DB_IO_FACTOR_MIN) ? DB_IO_FACTOR_MIN : (factor0 * 0.75);
+  } else {
+    db->io_factor = (factor0 * 1.1 > 1.0) ? 1.0 : (factor0 * 1.1);
+  }
+  if (db->io_factor == factor0) return;
+  for (uint64_t i = 0; (i < 6) && db->cms_dump[i]; i++) {
+    db_io_set(&(db->rl_read[i]), db->read_rate[i], db->io_factor);
+    db_io_set(&(db->rl_write[i]), db->write_rate[i], db->io_factor);
+  }
+}
+
+// every stat_interval seconds: a line with the counts of the interval
+  static void
+db_stat_tick(struct DB * const db)
+{
+  if (db->stat_out == NULL) return;
+  if ((debug_time_sec() - db->sec_start - db->stat_last->sec) < (((double)db->stat_interval) - 0.5)) return;
+  db_stat_snapshot(db, db->stat_now);
+  db_stat_export(db->stat_now, db->stat_last, DB_STAT_JSON, db->stat_out);
+  fflush(db->stat_out);
+  struct DBStat * const tmp = db->stat_last;
+  db->stat_last = db->stat_now;
+  db->stat_now = tmp;
 }
 
   static void *
@@ -926,14 +2193,15 @@ thread_meta_dumper(void *ptr)
 
   conc_set_affinity_n(1);
   do {
-    const uint64_t last_mtid = db->next_mtid;
-    for (uint64_t i = 0; i < 100; i++) {
+    for (uint64_t i = 0; i < 600; i++) {
       if (db->closing || db->need_dump_meta) break;
-      sleep(6);
+      if (manifest_nr_records(db->manifest) >= DB_MANIFEST_CHECKPOINT_NR) break;
+      sleep(1);
+      db_io_tune(db);
+      db_stat_tick(db);
     }
-    const uint64_t next_mtid = db->next_mtid;
-    if (next_mtid != last_mtid) {
-      db_dump_meta(db);
+    if (db->need_dump_meta || (manifest_nr_records(db->manifest) >= DB_MANIFEST_CHECKPOINT_NR)) {
+      db_checkpoint(db);
     }
     db->need_dump_meta = false;
   } while (false == db->closing);
@@ -952,19 +2220,33 @@ thread_compaction(void *ptr)
     assert(token < DB_COMPACTION_NR);
     // wait for work, using 'current'
     pthread_mutex_lock(&(db->mutex_current));
-    while ((db->closing == false) && (vc_count_feed(db->vcroot) == 0)) {
+    while ((db->closing == false) && (db->room_kick == false) &&
+        (vc_count_feed(db->vcroot, db_compaction_cap(db, 0)) == 0)) {
       pthread_cond_broadcast(&(db->cond_root_producer));
       pthread_cond_wait(&(db->cond_root_consumer), &(db->mutex_current));
     }
-    if (db->closing && (vc_count_feed(db->vcroot) == 0)) {
+    if (db->closing && (vc_count_feed(db->vcroot, db_compaction_cap(db, 0)) == 0)) {
       pthread_mutex_unlock(&(db->mutex_current));
       pthread_mutex_unlock(&(db->mutex_root));
       break;
     }
+    // a kick is taken by one thread: the root is compacted below its cap if that frees as many units as
+    // it takes (one in each sub_vc), else the leaves are merged early
+    uint64_t nr_input = vc_count_feed(db->vcroot, db_compaction_cap(db, 0));
+    const bool room = (nr_input == 0) ? true : false;
+    if (room) {
+      db->room_kick = false;
+      nr_input = (db->vcroot->cc.count >= 8u) ? db->vcroot->cc.count : 0;
+    }
     pthread_mutex_unlock(&(db->mutex_current));
-    conc_set_affinity_n(token);
     __sync_fetch_and_add(&(db->compaction_running_counter), 1);
-    db_root_compaction(db, token);
+    if (nr_input == 0) {
+      db_room_compaction(db);
+      pthread_mutex_unlock(&(db->mutex_root));
+    } else {
+      conc_set_affinity_n(token);
+      db_root_compaction(db, token, nr_input);
+    }
     __sync_fetch_and_sub(&(db->compaction_running_counter), 1);
   }
 
@@ -972,6 +2254,153 @@ thread_compaction(void *ptr)
   return NULL;
 }
 
+// the newest root_images tables of the root are read from the memory they were dumped from;
+// return the next one that still has its image, NULL: none.
+// under the writer lock: lookups read the images under the reader lock, and the compactions never do
+  static struct MetaTable *
+db_root_images(struct DB * const db)
+{
+  struct Container * const cc = &(db->vcroot->cc);
+  uint64_t nr = 0;
+  for (uint64_t i = cc->count; i > 0; i--) {
+    struct MetaTable * const mt = cc->metatables[i - 1u];
+    if (mt->image == NULL) continue;
+    if (nr == db->root_images) return mt;
+    nr++;
+  }
+  return NULL;
+}
+
+// the device for the next level-0 table. while none has room, the dumper kicks a compaction thread
+// every second and waits; another device may get room meanwhile. NULL: closing with no room
+  static struct ContainerMap *
+db_dump_place(struct DB * const db)
+{
+  const uint64_t scale0 = db->table_scale[0];
+  struct ContainerMap * cm0 = db_cm_stripe(db, 0, db->nr_dumped0, scale0);
+  if (db_cm_has_room(db, cm0, 0, scale0)) return cm0;
+  db_log(db, "CM[%u] is near full, waiting for compaction", db_dev_id(db, cm0->raw_fd));
+  while (db->closing == false) {
+    pthread_mutex_lock(&(db->mutex_current));
+    db->room_kick = true;
+    pthread_cond_broadcast(&(db->cond_root_consumer));
+    pthread_mutex_unlock(&(db->mutex_current));
+    containermap_wait(cm0, scale0 + (8u * scale0), 1.0);
+    cm0 = db_cm_stripe(db, 0, db->nr_dumped0, scale0);
+    if (db_cm_has_room(db, cm0, 0, scale0)) return cm0;
+  }
+  return db_cm_has_room(db, cm0, 0, scale0) ? cm0 : NULL;
+}
+
+// no room for the table at close: it is lost, as in a crash before the dump
+  static void
+db_dump_lost(struct DB * const db, struct Table * const table1)
+{
+  db_log(db, "DUMP @0 [FAILED: no room at close, %lu bytes lost]", table1->volume);
+  const uint64_t ticket = rwlock_writer_lock(&(db->rwlock));
+  db->active_table[1] = NULL;
+  rwlock_writer_unlock(&(db->rwlock), ticket);
+  table_free(table1);
+}
+
+// dump active_table[1]; a table that cannot be retained spills into active_table[2] first,
+// which takes its place once it is in the root and is dumped next
+  static void
+db_dump_active(struct DB * const db)
+{
+  struct Table * const table1 = db->active_table[1];
+  if (table1->volume == 0) { // empty at closing
+    const uint64_t ticket2 = rwlock_writer_lock(&(db->rwlock));
+    db->active_table[1] = NULL;
+    rwlock_writer_unlock(&(db->rwlock), ticket2);
+    table_free(table1);
+    return;
+  }
+  // build bt
+  const bool rbt = table_build_bloomtable(table1);
+  assert(rbt);
+  // the separated values first
+  if (db->vlog) {
+    vlog_flush(db->vlog);
+  }
+  // the writers wait, rather than lose the table, until a compaction makes room
+  const uint64_t scale0 = db->table_scale[0];
+  struct ContainerMap * const cm0 = db_dump_place(db);
+  const uint64_t off_main = cm0 ? db_cmap_safe_alloc(db, cm0, scale0) : UINT64_MAX;
+  if ((cm0 == NULL) || (off_main >= cm0->total_cap)) {
+    db_dump_lost(db, table1);
+    return;
+  }
+  // dump
+  if (db->root_images) {
+    uint8_t * const image = huge_alloc(BARREL_ALIGN * (table1->nr_barrels + 1u));
+    assert(image);
+    table_set_image(table1, image);
+  }
+  struct MetaTable * mt = db_table_dump(db, table1, 0, cm0, off_main);
+  if (mt == NULL) {
+    // too skewed: the lookups see the spilled items in active_table[2] from now on
+    const uint64_t ticket1 = rwlock_writer_lock(&(db->rwlock));
+    assert(db->active_table[2] == NULL);
+    db->active_table[2] = table_spill(table1);
+    rwlock_writer_unlock(&(db->rwlock), ticket1);
+    db_log(db, "DUMP @0 [%lu bytes spilled]", db->active_table[2] ? db->active_table[2]->volume : 0);
+    // no barrel is over its cap now: nothing moves out
+    mt = db_table_dump(db, table1, 0, cm0, off_main);
+    assert(mt);
+  }
+  mt->image = table1->image;
+  table_set_image(table1, NULL);
+  stat_inc_n(&(db->stat->nr_write[0]), table1->nr_barrels);
+  db_trace(db, "{\"ev\":\"out\",\"id\":0,\"sec\":%.6lf,\"kind\":\"dump\",\"level\":0,\"path\":\"0\","
+      "\"mtid\":%lu,\"bytes\":%lu}",
+      debug_time_sec() - db->sec_start, mt->mtid, table1->nr_barrels * BARREL_ALIGN);
+  mt->bt = table1->bt;
+  // mark active_table[1]->bt == NULL before free it
+
+  // wait for room
+  pthread_mutex_lock(&(db->mutex_current));
+  while (db->vcroot->cc.count == DB_CONTAINER_NR) {
+    pthread_cond_wait(&(db->cond_root_producer), &(db->mutex_current));
+  }
+  pthread_mutex_unlock(&(db->mutex_current));
+
+  // insert
+  struct ManifestRecord recs[2];
+  db_record_add(db, &(recs[0]), db->vcroot, mt, NULL);
+  pthread_mutex_lock(&(db->mutex_manifest));
+  db_vlog_commit(db); // new segments before the table
+  db_manifest_commit(db, recs, 1);
+  const uint64_t ticket2 = rwlock_writer_lock(&(db->rwlock));
+  const bool ri = vc_insert_internal(db->vcroot, mt, NULL);
+  assert(ri);
+  struct MetaTable * const mt_image = db_root_images(db);
+  uint8_t * const image_old = mt_image ? mt_image->image : NULL;
+  if (mt_image) mt_image->image = NULL;
+  stat_inc(&(db->stat->nr_active_dumped));
+  db->nr_dumped0++;
+  // alert compaction thread if have work to be done
+  if (db->vcroot->cc.count >= 8) {
+    pthread_mutex_lock(&(db->mutex_current));
+    pthread_cond_broadcast(&(db->cond_root_consumer));
+    pthread_mutex_unlock(&(db->mutex_current));
+  }
+  db->active_table[1] = db->active_table[2];
+  db->active_table[2] = NULL;
+  rwlock_writer_unlock(&(db->rwlock), ticket2);
+  // no lookup can be reading it now
+  if (image_old) huge_free(image_old, BARREL_ALIGN * (mt_image->nr_barrels + 1u));
+  if (db->vlog) {
+    vlog_drops_apply(db->vlog, db->vdrops_active);
+    db_vlog_commit(db);
+  }
+  pthread_mutex_unlock(&(db->mutex_manifest));
+
+  // post process
+  table1->bt = NULL;
+  table_free(table1);
+}
+
 // pthread
   static void *
 thread_active_dumper(void *ptr)
@@ -997,57 +2426,16 @@ thread_active_dumper(void *ptr)
     if (db->closing) {
       db->active_table[0] = NULL;
     } else {
-      db->active_table[0] = table_alloc_default(15.0);
+      db->active_table[0] = db_active_table_new(db);
     }
     rwlock_writer_unlock(&(db->rwlock), ticket1);
     // notify writers
     pthread_cond_broadcast(&(db->cond_writer));
     pthread_mutex_unlock(&(db->mutex_active));
 
-    struct Table * const table1 = db->active_table[1];
-    if (containermap_unused(db->cms[0]) < 8u) {
-      db_log(db, "ContainerMap is near full, dropping current active-table");
-      sleep(10);
-      const uint64_t ticket2 = rwlock_writer_lock(&(db->rwlock));
-      db->active_table[1] = NULL;
-      rwlock_writer_unlock(&(db->rwlock), ticket2);
-    } else if (table1->volume > 0) {
-      // build bt
-      const bool rbt = table_build_bloomtable(table1);
-      assert(rbt);
-      // dump
-      const uint64_t mtid = db_table_dump(db, table1, 0);
-      struct MetaTable * const mt = db_load_metatable(db, mtid, db->cms[0]->raw_fd, false);
-      assert(mt);
-      stat_inc_n(&(db->stat.nr_write[0]), TABLE_NR_BARRELS);
-      mt->bt = table1->bt;
-      // mark active_table[1]->bt == NULL before free it
-
-      // wait for room
-      pthread_mutex_lock(&(db->mutex_current));
-      while (db->vcroot->cc.count == DB_CONTAINER_NR) {
-        pthread_cond_wait(&(db->cond_root_producer), &(db->mutex_current));
-      }
-      pthread_mutex_unlock(&(db->mutex_current));
-
-      // insert
-      const uint64_t ticket2 = rwlock_writer_lock(&(db->rwlock));
-      const bool ri = vc_insert_internal(db->vcroot, mt, NULL);
-      assert(ri);
-      stat_inc(&(db->stat.nr_active_dumped));
-      // alert compaction thread if have work to be done
-      if (db->vcroot->cc.count >= 8) {
-        pthread_mutex_lock(&(db->mutex_current));
-        pthread_cond_broadcast(&(db->cond_root_consumer));
-        pthread_mutex_unlock(&(db->mutex_current));
-      }
-      db->active_table[1] = NULL;
-      rwlock_writer_unlock(&(db->rwlock), ticket2);
-
-      // post process
-      table1->bt = NULL;
+    while (db->active_table[1]) {
+      db_dump_active(db);
     }
-    table_free(table1);
   }
   pthread_exit(NULL);
   return NULL;
@@ -1056,12 +2444,14 @@ thread_active_dumper(void *ptr)
   static void
 db_wait_active_table(struct DB * const db)
 {
+  const uint64_t usec0 = debug_time_usec();
   pthread_mutex_lock(&(db->mutex_active));
   while (table_full(db->active_table[0])) {
     pthread_cond_signal(&(db->cond_active));
     pthread_cond_wait(&(db->cond_writer), &(db->mutex_active));
   }
   pthread_mutex_unlock(&(db->mutex_active));
+  stat_lat_since(db->stat, STAT_LAT_SET_STALL, usec0);
 }
 
   static struct KeyValue *
@@ -1072,26 +2462,34 @@ recursive_lookup(struct Stat * const stat, struct VirtualContainer * const vc, c
   // test if using bloomcontainer
   uint64_t bitmap = UINT64_MAX;
   if (vc->cc.bc) {
-    const uint64_t index = table_select_barrel(hash);
+    const uint64_t index = table_select_barrel(hash, vc->cc.bc->nr_barrels);
     assert(index < UINT64_C(0x100000000));
     const uint64_t *phv = ((const uint64_t*)(&(hash[12])));
     const uint64_t hv = *phv;
-    bitmap = bloomcontainer_match(vc->cc.bc, (uint32_t)index, hv);
-    stat_inc(&(stat->nr_fetch_bc));
+    // the first filters may belong to tables already dropped by a compaction
+    const uint64_t nr_dropped = vc->cc.bc->nr_bf_per_box - vc->cc.count;
+    const uint64_t usec0 = STAT_HOT ? debug_time_usec() : 0;
+    bitmap = bloomcontainer_match(vc->cc.bc, (uint32_t)index, hv) >> nr_dropped;
+    stat_hot_inc(&(stat->nr_fetch_bc));
+    if (STAT_HOT) stat_lat_since(stat, STAT_LAT_FETCH_BC, usec0);
   }
   for (int64_t j = vc->cc.count - 1; j >= 0; j--) {
     struct MetaTable * const mt = vc->cc.metatables[j];
     if (mt == NULL) continue;
 
     if ((bitmap & (1u << j)) == 0u) {
-      stat_inc(&(stat->nr_true_negative));
+      stat_hot_inc(&(stat->nr_true_negative));
+      stat_hot_inc(&(stat->nr_bc_negative[vc->start_bit]));
       continue; // skip
     }
     struct KeyValue * const kv = metatable_lookup(mt, klen, key, hash);
     if (kv) {
-      stat_inc(&(stat->nr_get_vc_hit[vc->start_bit]));
+      stat_hot_inc(&(stat->nr_get_vc_hit[vc->start_bit]));
       return kv;
     }
+    if (vc->cc.bc) {
+      stat_hot_inc(&(stat->nr_bc_false[vc->start_bit]));
+    }
   }
   // in sub_vc
   const uint64_t sub_id = compaction_select_table(hash, vc->start_bit + 3);
@@ -1102,43 +2500,219 @@ recursive_lookup(struct Stat * const stat, struct VirtualContainer * const vc, c
   }
 }
 
-  struct KeyValue *
-db_lookup(struct DB * const db, const uint16_t klen, const uint8_t * const key)
+// replace a ValuePtr with the value; under the reader lock, so the segment can not be released.
+// NULL if the value can not be read
+  static struct KeyValue *
+db_vlog_fetch(struct DB * const db, struct KeyValue * const kv)
+{
+  if ((kv == NULL) || ((kv->flags & KV_FLAG_VPTR) == 0)) return kv;
+  assert(db->vlog);
+  struct ValuePtr vp;
+  assert(kv->vlen == sizeof(vp));
+  memcpy(&vp, kv->pv, sizeof(vp));
+  struct KeyValue * const kv1 = (typeof(kv1))malloc(sizeof(*kv1) + kv->klen + vp.len);
+  assert(kv1);
+  kv1->klen = kv->klen;
+  kv1->flags = 0;
+  kv1->vlen = vp.len;
+  kv1->pk = kv1->kv;
+  kv1->pv = kv1->kv + kv1->klen;
+  memcpy(kv1->pk, kv->pk, kv->klen);
+  const bool rr = vlog_read(db->vlog, &vp, kv1->pv);
+  free(kv);
+  if (rr == false) {
+    db_log(db, "VLOG read failed #%u:%lx+%u", vp.dev, vp.off, vp.len);
+    free(kv1);
+    return NULL;
+  }
+  return kv1;
+}
+
+// ref: a hit in the row cache is the cached copy itself, see db_lookup_ref()
+  static struct KeyValue *
+db_lookup_internal(struct DB * const db, const uint16_t klen, const uint8_t * const key, const bool ref)
 {
   uint8_t hash[HASHBYTES] __attribute__ ((aligned(8)));
+  const uint64_t t0 = stat_stage_begin();
   SHA1(key, klen, hash);
-
-  stat_inc(&(db->stat.nr_get));
+  stat_stage_end(STAT_STAGE_HASH, t0);
+
+  stat_hot_inc(&(db->stat->nr_get));
+  // a recent miss, with no insert of the key since
+  uint64_t neg_ver = 0;
+  if (db->negcache) {
+    if (negcache_match(db->negcache, hash)) {
+      stat_hot_inc(&(db->stat->nr_get_miss));
+      stat_hot_inc(&(db->stat->nr_get_neg));
+      return NULL;
+    }
+    neg_ver = negcache_version(db->negcache, hash);
+  }
+  // before the active tables: an insert found there could have been invalidated since
+  const uint64_t row_ver = db->rowcache ? rowcache_version(db->rowcache, hash) : 0;
+  const uint64_t t1 = stat_stage_begin();
   const uint64_t ticket = rwlock_reader_lock(&(db->rwlock));
+  stat_stage_end(STAT_STAGE_LOCK, t1);
   // 1st lookup at active table[0]
-  // 2nd lookup at active table[1]
-  for (uint64_t i = 0; i < 2; i++) {
+  // 2nd lookup at active table[1], then what it spilled (if any)
+  const uint64_t t2 = stat_stage_begin();
+  for (uint64_t i = 0; i < 3; i++) {
     struct Table *t = db->active_table[i];
     if (t == NULL) continue;
     // immutable item
     struct KeyValue * const kv = table_lookup(t, klen, key, hash);
     if (kv) {
+      stat_stage_end(STAT_STAGE_ACTIVE, t2);
+      const uint64_t t3 = stat_stage_begin();
+      struct KeyValue * const kv1 = db_vlog_fetch(db, kv);
+      if (db->vlog) stat_stage_end(STAT_STAGE_VLOG, t3);
       rwlock_reader_unlock(&(db->rwlock), ticket);
-      stat_inc(&(db->stat.nr_get_at_hit[i]));
-      return kv;
+      stat_hot_inc(&(db->stat->nr_get_at_hit[i ? 1 : 0]));
+      return kv1;
+    }
+  }
+  stat_stage_end(STAT_STAGE_ACTIVE, t2);
+
+  // the items below the active tables are cached
+  if (db->rowcache) {
+    const struct KeyValue * const kvr = rowcache_get(db->rowcache, hash, klen, key);
+    if (kvr) {
+      rwlock_reader_unlock(&(db->rwlock), ticket);
+      stat_hot_inc(&(db->stat->nr_get_row));
+      if (ref) return (struct KeyValue *)kvr;
+      struct KeyValue * const kvc = (typeof(kvc))malloc(sizeof(*kvc) + kvr->klen + kvr->vlen);
+      assert(kvc);
+      kvc->klen = kvr->klen;
+      kvc->flags = 0;
+      kvc->vlen = kvr->vlen;
+      kvc->pk = kvc->kv;
+      kvc->pv = kvc->kv + kvc->klen;
+      memcpy(kvc->kv, kvr->kv, kvr->klen + kvr->vlen);
+      rowcache_release(kvr);
+      return kvc;
     }
   }
 
   // 3rd lookup into vcroot
-  struct KeyValue * const kv2 = recursive_lookup(&(db->stat), db->vcroot, klen, key, hash);
+  struct KeyValue * const kv = recursive_lookup(db->stat, db->vcroot, klen, key, hash);
+  const bool found = kv ? true : false;
+  const uint64_t t3 = stat_stage_begin();
+  struct KeyValue * const kv2 = db_vlog_fetch(db, kv);
+  if (db->vlog) stat_stage_end(STAT_STAGE_VLOG, t3);
   rwlock_reader_unlock(&(db->rwlock), ticket);
   if (kv2 == NULL) {
-    stat_inc(&(db->stat.nr_get_miss));
+    stat_hot_inc(&(db->stat->nr_get_miss));
+    // not a miss when the value could not be read
+    if (db->negcache && (found == false)) negcache_add(db->negcache, hash, neg_ver);
+  } else if (db->rowcache) {
+    rowcache_put(db->rowcache, hash, kv2, row_ver);
   }
   return kv2;
 }
 
+// one in DB_LOOKUP_SAMPLE lookups of a thread is also recorded for db_io_tune(); fewer writes to the shared histogram
+#define DB_LOOKUP_SAMPLE ((UINT64_C(16)))
+static __thread uint64_t db_nr_lookup = 0;
+
+  static struct KeyValue *
+db_lookup_sampled(struct DB * const db, const uint16_t klen, const uint8_t * const key, const bool ref)
+{
+  const uint64_t nr = db_nr_lookup++;
+  const bool sample = db->lat_get && ((nr % DB_LOOKUP_SAMPLE) == 0);
+  if ((STAT_HOT == 0) && (sample == false)) return db_lookup_internal(db, klen, key, ref);
+  const bool staged = db->stage_sample && ((nr % db->stage_sample) == 0);
+  if (staged) stat_stage_sample_begin();
+  const uint64_t usec0 = debug_time_usec();
+  const uint64_t t0 = stat_stage_begin();
+  struct KeyValue * const kv = db_lookup_internal(db, klen, key, ref);
+  stat_stage_end(STAT_STAGE_TOTAL, t0);
+  const uint64_t usec = debug_time_usec() - usec0;
+  if (staged) stat_stage_sample_end(db->stat);
+  if (STAT_HOT) stat_lat(db->stat, kv ? STAT_LAT_GET_HIT : STAT_LAT_GET_MISS, usec);
+  if (sample) latency_record(usec, db->lat_get);
+  return kv;
+}
+
+  struct KeyValue *
+db_lookup(struct DB * const db, const uint16_t klen, const uint8_t * const key)
+{
+  return db_lookup_sampled(db, klen, key, false);
+}
+
+  const struct KeyValue *
+db_lookup_ref(struct DB * const db, const uint16_t klen, const uint8_t * const key)
+{
+  return db_lookup_sampled(db, klen, key, true);
+}
+
+  void
+db_release(const struct KeyValue * const kv)
+{
+  if (kv->flags & KV_FLAG_CACHED) {
+    rowcache_release(kv);
+  } else {
+    free((void *)kv);
+  }
+}
+
+// the overwritten values of the active table are never referenced by other tables
+  static void
+db_vlog_reclaim(struct DB * const db)
+{
+  pthread_mutex_lock(&(db->mutex_manifest));
+  vlog_drops_apply(db->vlog, db->vdrops_active);
+  db_vlog_commit(db);
+  pthread_mutex_unlock(&(db->mutex_manifest));
+}
+
+// a KeyValue as stored in the tables
+struct KeyValuePrep {
+  struct KeyValue kv;
+  struct ValuePtr vp;
+  uint8_t hash[HASHBYTES] __attribute__ ((aligned(8))); // of the key, for the table and the caches
+};
+
+// large values are appended to the value log and replaced by a ValuePtr
+// return false if the item can not be stored
   static bool
-db_insert_try(struct DB * const db, struct KeyValue * const kv)
+db_kv_prepare(struct DB * const db, const struct KeyValue * const kv, struct KeyValuePrep * const prep)
+{
+  prep->kv.klen = kv->klen;
+  prep->kv.flags = 0;
+  prep->kv.vlen = kv->vlen;
+  prep->kv.pk = kv->pk;
+  prep->kv.pv = kv->pv;
+  SHA1(kv->pk, kv->klen, prep->hash);
+  if (db->vlog && ((kv->vlen > db->vlog->threshold) || (false == table_kv_fits(&(prep->kv))))) {
+    prep->kv.flags = KV_FLAG_VPTR;
+    prep->kv.vlen = sizeof(prep->vp);
+    prep->kv.pv = (uint8_t *)(&(prep->vp));
+    if (false == table_kv_fits(&(prep->kv))) return false;
+    // out of space: take back the values overwritten in the active table and retry
+    for (uint64_t i = 0; i < DB_VLOG_RETRY; i++) {
+      if (vlog_append(db->vlog, kv->pv, kv->vlen, &(prep->vp))) return true;
+      db_vlog_reclaim(db);
+      containermap_wait(db->vlog->cm, 1, 1.0);
+    }
+    return false;
+  }
+  return table_kv_fits(&(prep->kv));
+}
+
+// once the item can be found
+  static inline void
+db_cache_invalidate(struct DB * const db, const uint8_t * const hash)
+{
+  if (db->negcache) negcache_invalidate(db->negcache, hash);
+  if (db->rowcache) rowcache_invalidate(db->rowcache, hash);
+}
+
+  static bool
+db_insert_try(struct DB * const db, const struct KeyValuePrep * const prep)
 {
   const uint64_t ticket = rwlock_writer_lock(&(db->rwlock));
   struct Table *at = db->active_table[0];
-  const bool ri = table_insert_kv_safe(at, kv);
+  const bool ri = table_insert_kv_hash_safe(at, &(prep->kv), prep->hash);
   rwlock_writer_unlock(&(db->rwlock), ticket);
   return ri;
 }
@@ -1146,35 +2720,52 @@ db_insert_try(struct DB * const db, struct KeyValue * const kv)
   bool
 db_insert(struct DB * const db, struct KeyValue * const kv)
 {
-  stat_inc(&(db->stat.nr_set));
-  while (false == db_insert_try(db, kv)) {
+  struct KeyValuePrep prep;
+  if (false == db_kv_prepare(db, kv, &prep)) return false;
+  const uint64_t usec0 = debug_time_usec();
+  stat_inc(&(db->stat->nr_set));
+  while (false == db_insert_try(db, &prep)) {
     db_wait_active_table(db);
-    stat_inc(&(db->stat.nr_set_retry));
+    stat_inc(&(db->stat->nr_set_retry));
   }
+  db_cache_invalidate(db, prep.hash);
+  stat_lat_since(db->stat, STAT_LAT_SET, usec0);
   return true;
 }
 
+// items that can not be stored are skipped and false is returned
   bool
 db_multi_insert(struct DB * const db, const uint64_t nr_items, const struct KeyValue * const kvs)
 {
+  struct KeyValuePrep * const preps = (typeof(preps))malloc(sizeof(preps[0]) * nr_items);
+  assert(preps);
+  uint64_t nr_ok = 0;
+  for (uint64_t j = 0; j < nr_items; j++) {
+    if (db_kv_prepare(db, &(kvs[j]), &(preps[nr_ok]))) nr_ok++;
+  }
+  const uint64_t usec0 = debug_time_usec();
   uint64_t i = 0;
-  while (i < nr_items) {
+  while (i < nr_ok) {
     const uint64_t ticket = rwlock_writer_lock(&(db->rwlock));
     struct Table *at = db->active_table[0];
-    while (i < nr_items) {
-      const struct KeyValue * const kv = &(kvs[i]);
-      const bool ri = table_insert_kv_safe(at, kv);
+    while (i < nr_ok) {
+      const bool ri = table_insert_kv_hash_safe(at, &(preps[i].kv), preps[i].hash);
       if (ri == true) { i++; } else { break; }
     }
     rwlock_writer_unlock(&(db->rwlock), ticket);
 
-    if (i < nr_items) {
+    if (i < nr_ok) {
       db_wait_active_table(db);
-      stat_inc(&(db->stat.nr_set_retry));
+      stat_inc(&(db->stat->nr_set_retry));
     }
   }
-  stat_inc_n(&(db->stat.nr_set), nr_items);
-  return true;
+  for (uint64_t j = 0; j < nr_ok; j++) {
+    db_cache_invalidate(db, preps[j].hash);
+  }
+  free(preps);
+  stat_inc_n(&(db->stat->nr_set), nr_ok);
+  stat_lat_since(db->stat, STAT_LAT_SET, usec0);
+  return (nr_ok == nr_items)?true:false;
 }
 
   static bool
@@ -1191,6 +2782,25 @@ db_touch_dir(const char * const root_dir, const char * const sub_dir)
 }
 
 // create empty db
+// all devices share the unit size; a unit larger than a table holds its metadata.
+// a table of a larger scale spans adjacent units
+  static void
+db_create_cms(struct DB * const db, struct ContainerMapConf * const cm_conf)
+{
+  const uint64_t unit_size = db->unit_size;
+  assert(unit_size >= TABLE_ALIGN);
+  for (uint64_t i = 0; i < DB_MAX_LEVELS; i++) {
+    assert(db->table_scale[i] && (db->table_scale[i] <= TABLE_MAX_SCALE));
+  }
+  db->meta_cap = (unit_size > TABLE_ALIGN)?(unit_size - TABLE_META_OFF):0;
+  for (int i = 0; (i < 6) && cm_conf->raw_fn[i]; i++) {
+    struct ContainerMap * const cm = containermap_create_unit(cm_conf->raw_fn[i], cm_conf->hints[i], unit_size,
+        cm_conf->io_mode[i]);
+    assert(cm);
+    db->cms_dump[i] = cm;
+  }
+}
+
   static struct DB *
 db_create(const char * const meta_dir, struct ContainerMapConf * const cm_conf)
 {
@@ -1207,31 +2817,250 @@ db_create(const char * const meta_dir, struct ContainerMapConf * const cm_conf)
     if (false == db_touch_dir(meta_dir, sub_dir)) return NULL;
   }
 
-  struct DB * const db = (typeof(db))malloc(sizeof(*db));
+  struct DB * const db = (typeof(db))aligned_alloc(64, sizeof(*db)); // for the stat shards
   bzero(db, sizeof(*db));
+  stat_initial(db->stat);
 
-  for (int i = 0; (i < 6) && cm_conf->raw_fn[i]; i++) {
-    struct ContainerMap * const cm = containermap_create(cm_conf->raw_fn[i], cm_conf->hints[i]);
-    assert(cm);
-    db->cms_dump[i] = cm;
-  }
-
+  db->unit_size = TABLE_ALIGN + (cm_conf->packed_meta * UINT64_C(1024) * UINT64_C(1024));
+  memcpy(db->table_scale, cm_conf->table_scale, sizeof(db->table_scale));
+  db->nr_levels = cm_conf->nr_levels;
+  db_create_cms(db, cm_conf);
   db_initial(db, meta_dir, cm_conf);
 
   // empty vc
-  db->vcroot = vc_create(0);
+  db->vcroot = vc_create(0, 0);
   assert(db->vcroot);
 
   // mtid start from 1
   db->next_mtid = 1;
 
+  // an empty manifest
+  db_checkpoint(db);
+
   // initial anything
   db_log_diff(db, sec0, "Initialized Metadata");
   return db;
 }
 
+// find the vc by its path, create missing ones on the way
+  static struct VirtualContainer *
+db_vc_touch(struct DB * const db, const uint64_t start_bit, const uint64_t path)
+{
+  struct VirtualContainer * vc = db->vcroot;
+  for (uint64_t bit = 3; bit <= start_bit; bit += 3) {
+    const uint64_t sub_path = path >> (start_bit - bit);
+    const uint64_t id = sub_path & 7u;
+    if (vc->sub_vc[id] == NULL) {
+      vc->sub_vc[id] = vc_create(bit, sub_path);
+    }
+    vc = vc->sub_vc[id];
+  }
+  assert(vc->path == path);
+  return vc;
+}
+
+  static bool
+db_manifest_format(void * const ptr, const struct ManifestRecord * const recs, const uint64_t nr)
+{
+  struct DB * const db = (typeof(db))ptr;
+  for (uint64_t i = 0; i < nr; i++) {
+    if (recs[i].type == MANIFEST_FORMAT) {
+      db->unit_size = recs[i].off;
+      for (uint64_t j = 0; j < DB_MAX_LEVELS; j++) {
+        db->table_scale[j] = ((recs[i].arg >> (j * 4u)) & 0xfu) + 1u;
+      }
+      // 0 in the records before the depth could grow
+      db->nr_levels = recs[i].start_bit ? ((recs[i].start_bit / 3u) + 1u) : DB_NR_LEVELS;
+    }
+  }
+  return true;
+}
+
+// replay builds the tree with stubs (mtid/off/raw_fd only).
+// the edits may refer to tables whose files have been removed by later edits.
+  static bool
+db_manifest_apply(void * const ptr, const struct ManifestRecord * const recs, const uint64_t nr)
+{
+  struct DB * const db = (typeof(db))ptr;
+  for (uint64_t i = 0; i < nr; i++) {
+    const struct ManifestRecord * const rec = &(recs[i]);
+    switch (rec->type) {
+      case MANIFEST_ADD: {
+                           struct VirtualContainer * const vc = db_vc_touch(db, rec->start_bit, rec->path);
+                           assert(db->cms_dump[rec->dev]);
+                           struct MetaTable * const mt = (typeof(mt))malloc(sizeof(*mt));
+                           assert(mt);
+                           bzero(mt, sizeof(*mt));
+                           mt->mtid = rec->mtid;
+                           mt->mfh.off = rec->off;
+                           mt->nr_barrels = db_level_barrels(db, rec->start_bit/3);
+                           mt->packed = (rec->flags & MANIFEST_FLAG_PACKED)?true:false;
+                           mt->dict_id = rec->arg;
+                           mt->raw_fd = db->cms_dump[rec->dev]->raw_fd;
+                           struct BloomContainer * bc = vc->cc.bc;
+                           if (bc && (bc->mtid != rec->bc_mtid)) {
+                             bloomcontainer_free(bc);
+                             bc = NULL;
+                           }
+                           if ((bc == NULL) && rec->bc_mtid) {
+                             bc = (typeof(bc))malloc(sizeof(*bc));
+                             assert(bc);
+                             bzero(bc, sizeof(*bc));
+                             bc->mtid = rec->bc_mtid;
+                             bc->off_raw = rec->bc_off;
+                           }
+                           const bool ri = vc_insert_internal(vc, mt, bc);
+                           assert(ri);
+                           break;
+                         }
+      case MANIFEST_DROP: {
+                            struct VirtualContainer * const vc = db_vc_touch(db, rec->start_bit, rec->path);
+                            for (uint64_t j = 0; j < rec->arg; j++) {
+                              metatable_free(vc->cc.metatables[j]);
+                            }
+                            vc_drop_front(vc, rec->arg);
+                            if ((vc->cc.count == 0) && vc->cc.bc) {
+                              bloomcontainer_free(vc->cc.bc);
+                              vc->cc.bc = NULL;
+                            }
+                            break;
+                          }
+      case MANIFEST_FORMAT: {
+                              assert(rec->off == db->unit_size);
+                              assert(rec->arg == db_format_scales(db));
+                              break;
+                            }
+      case MANIFEST_VLOG: {
+                            db_vlog_touch(db, rec->dev);
+                            vlog_restore(db->vlog, rec->off, (uint8_t)rec->arg, rec->mtid);
+                            break;
+                          }
+      case MANIFEST_COMMIT: {
+                              if (rec->mtid > db->next_mtid) {
+                                db->next_mtid = rec->mtid;
+                              }
+                              break;
+                            }
+      default: assert(false);
+    }
+  }
+  return true;
+}
+
+// replace stubs with real MetaTables/BloomContainers and mark the used containers
+  static void
+db_load_stubs(struct DB * const db, struct VirtualContainer * const vc)
+{
+  if (vc == NULL) return;
+  const bool load_bf = (vc->cc.bc == NULL)?true:false;
+  for (uint64_t j = 0; j < vc->cc.count; j++) {
+    struct MetaTable * const stub = vc->cc.metatables[j];
+    struct MetaTable * const mt = db_load_metatable(db, vc->start_bit, stub->mtid, stub->raw_fd, stub->mfh.off,
+        stub->nr_barrels, stub->packed, load_bf);
+    assert(mt->mfh.off == stub->mfh.off);
+    if (stub->dict_id) {
+      mt->dict_id = stub->dict_id;
+      mt->dict = db_dict_get(db, mt->dict_id);
+    }
+    metatable_free(stub);
+    vc->cc.metatables[j] = mt;
+    const bool rm = db_cmap_mark_used(db_cm_of_fd(db, mt->raw_fd), mt->mfh.off, TABLE_UNITS(mt->nr_barrels));
+    assert(rm);
+  }
+  if (vc->cc.bc) {
+    struct BloomContainer * const stub = vc->cc.bc;
+    struct BloomContainer * const bc = db_load_bloomcontainer_meta(db, stub->mtid);
+    assert(bc->off_raw == stub->off_raw);
+    bloomcontainer_free(stub);
+    vc->cc.bc = bc;
+    const bool rm = db_cmap_mark_used(db->cm_bc, bc->off_raw, TABLE_UNITS(bc->nr_barrels));
+    assert(rm);
+  }
+  for (uint64_t i = 0; i < 8; i++) {
+    db_load_stubs(db, vc->sub_vc[i]);
+  }
+}
+
+// after a crash: every table is read for the values of the segments open at the time
+  static void
+db_vlog_recount(struct DB * const db, struct VirtualContainer * const vc)
+{
+  if (vc == NULL) return;
+  for (uint64_t j = 0; j < vc->cc.count; j++) {
+    const bool rw = metatable_walk_vptrs(vc->cc.metatables[j], vlog_recount_add, db->vlog);
+    assert(rw);
+  }
+  for (uint64_t i = 0; i < 8; i++) {
+    db_vlog_recount(db, vc->sub_vc[i]);
+  }
+}
+
+// the dictionary of a level is the newest one its tables use
+  static void
+db_dict_restore(struct DB * const db, struct VirtualContainer * const vc)
+{
+  if (vc == NULL) return;
+  const uint64_t level = vc->start_bit / 3;
+  for (uint64_t j = 0; j < vc->cc.count; j++) {
+    struct CodecDict * const dict = vc->cc.metatables[j]->dict;
+    struct CodecDict * const cur = db->dict_level[level];
+    if (dict && ((cur == NULL) || (dict->id > cur->id))) {
+      db_dict_put(db, cur);
+      db->dict_level[level] = db_dict_get(db, dict->id);
+    }
+  }
+  for (uint64_t i = 0; i < 8; i++) {
+    db_dict_restore(db, vc->sub_vc[i]);
+  }
+}
+
+// ContainerMaps are rebuilt from the live tables, nothing else is trusted
   static struct DB *
-db_load(const char * const meta_dir, struct ContainerMapConf * const cm_conf)
+db_load_manifest(const char * const meta_dir, struct ContainerMapConf * const cm_conf)
+{
+  const double sec0 = debug_time_sec();
+  char path_manifest[2048];
+  sprintf(path_manifest, "%s/%s", meta_dir, DB_META_MANIFEST);
+
+  struct DB * const db = (typeof(db))aligned_alloc(64, sizeof(*db)); // for the stat shards
+  assert(db);
+  bzero(db, sizeof(*db));
+  stat_initial(db->stat);
+
+  // the layout in the manifest overrides cm_conf
+  db->unit_size = TABLE_ALIGN;
+  for (uint64_t i = 0; i < DB_MAX_LEVELS; i++) {
+    db->table_scale[i] = 1;
+  }
+  db->nr_levels = DB_NR_LEVELS;
+  manifest_replay(path_manifest, db_manifest_format, db);
+  db_create_cms(db, cm_conf);
+  db_initial(db, meta_dir, cm_conf);
+
+  db->vcroot = vc_create(0, 0);
+  db->next_mtid = 1;
+  const uint64_t nr_records = manifest_replay(path_manifest, db_manifest_apply, db);
+  db_load_stubs(db, db->vcroot);
+  db_dict_restore(db, db->vcroot);
+  if (db->vlog) {
+    const uint64_t nr_recount = vlog_restore_done(db->vlog);
+    if (nr_recount) {
+      db_vlog_recount(db, db->vcroot);
+      db_log(db, "VLOG recounted %lu segments open at the last run", nr_recount);
+    }
+    vlog_recount_done(db->vlog);
+  }
+
+  db->manifest = manifest_open(path_manifest);
+  assert(db->manifest);
+
+  // initial anything
+  db_log_diff(db, sec0, "Loaded Manifest Done (%lu records)", nr_records);
+  return db;
+}
+
+  static struct DB *
+db_load_legacy(const char * const meta_dir, struct ContainerMapConf * const cm_conf)
 {
   const double sec0 = debug_time_sec();
   char path_meta[2048];
@@ -1248,9 +3077,10 @@ db_load(const char * const meta_dir, struct ContainerMapConf * const cm_conf)
   }
 
   // alloc db and load ContainerMap
-  struct DB * const db = (typeof(db))malloc(sizeof(*db));
+  struct DB * const db = (typeof(db))aligned_alloc(64, sizeof(*db)); // for the stat shards
   assert(db);
   bzero(db, sizeof(*db));
+  stat_initial(db->stat);
 
   // load ContainerMaps
   for (int i = 0; (i < 6) && cm_conf->raw_fn[i]; i++) {
@@ -1260,13 +3090,19 @@ db_load(const char * const meta_dir, struct ContainerMapConf * const cm_conf)
     assert(cm);
     db->cms_dump[i] = cm;
   }
+  db->unit_size = TABLE_ALIGN;
+  db->meta_cap = 0;
+  for (uint64_t i = 0; i < DB_MAX_LEVELS; i++) {
+    db->table_scale[i] = 1;
+  }
+  db->nr_levels = DB_NR_LEVELS;
 
   db_initial(db, meta_dir, cm_conf);
 
   //// LOAD META
   // parse vc
   FILE * const meta_in = fopen(path_meta, "r");
-  struct VirtualContainer * const vcroot = recursive_parse(meta_in, 0, db);
+  struct VirtualContainer * const vcroot = recursive_parse(meta_in, 0, 0, db);
   assert(vcroot);
   db->vcroot = vcroot;
 
@@ -1278,11 +3114,27 @@ db_load(const char * const meta_dir, struct ContainerMapConf * const cm_conf)
   db->next_mtid = mtid;
   fclose(meta_in);
 
+  // convert to manifest
+  db_checkpoint(db);
+
   // initial anything
   db_log_diff(db, sec0, "Loaded Metadata Done");
   return db;
 }
 
+  static struct DB *
+db_load(const char * const meta_dir, struct ContainerMapConf * const cm_conf)
+{
+  assert(cm_conf);
+  char path_manifest[2048];
+  sprintf(path_manifest, "%s/%s", meta_dir, DB_META_MANIFEST);
+  if (0 == access(path_manifest, F_OK)) {
+    return db_load_manifest(meta_dir, cm_conf);
+  } else {
+    return db_load_legacy(meta_dir, cm_conf);
+  }
+}
+
 // get a DB * for GET/SET
 // cap_hint: only ragular files are affected. raw disk/ssd are all seen as its real cap
   void
@@ -1311,11 +3163,33 @@ db_spawn_threads(struct DB * const db)
   // db ready to use
 }
 
+// "buffered", "direct", "direct+dsync" or "direct+sync"; anything else: default
+  static int
+db_parse_io_mode(const char * const str)
+{
+  char name[64];
+  if ((str == NULL) || (sscanf(str, "%63s", name) != 1)) return CONTAINER_IO_DEFAULT;
+  for (int mode = CONTAINER_IO_BUFFERED; mode <= CONTAINER_IO_DIRECT_SYNC; mode++) {
+    if (strcmp(name, containermap_io_name(mode)) == 0) return mode;
+  }
+  return CONTAINER_IO_DEFAULT;
+}
+
   static struct ContainerMapConf *
 db_load_cm_conf(const char * const fn)
 {
   struct ContainerMapConf * const cm_conf = (typeof(cm_conf))malloc(sizeof(*cm_conf));
   bzero(cm_conf, sizeof(*cm_conf));
+  cm_conf->discard = 1;
+  cm_conf->vlog_dev = UINT64_MAX;
+  cm_conf->vlog_threshold = DB_VLOG_THRESHOLD;
+  cm_conf->codec = CODEC_NONE;
+  cm_conf->nr_levels = DB_NR_LEVELS;
+  cm_conf->max_levels = DB_MAX_LEVELS;
+  cm_conf->tiering = 1;
+  for (int i = 0; i < DB_MAX_LEVELS; i++) {
+    cm_conf->table_scale[i] = 1;
+  }
 
   FILE * const fi = fopen(fn, "r");
   char buf[1024];
@@ -1328,11 +3202,13 @@ db_load_cm_conf(const char * const fn)
     char * const peol = strchr(buf, '\n');
     if (peol) {*peol = '\0';}
     cm_conf->raw_fn[i] = strdup(buf);
-    // hint
+    // hint [io-mode]
     buf[0] = 0;
     fgets(buf, 1000, fi);
-    const uint64_t hint = strtoull(buf, NULL, 10);
+    char * pmode = NULL;
+    const uint64_t hint = strtoull(buf, &pmode, 10);
     cm_conf->hints[i] = hint * UINT64_C(1024) * UINT64_C(1024) * UINT64_C(1024); // *GB
+    cm_conf->io_mode[i] = db_parse_io_mode(pmode);
     count++;
   }
 
@@ -1343,13 +3219,129 @@ db_load_cm_conf(const char * const fn)
   const uint64_t bc_id = strtoull(buf, NULL, 10);
   assert(bc_id < count);
   cm_conf->bc_id = bc_id;
-  // 0-4
+  // 0-4; "1,2": striped over storage 1 and 2
   for (int i = 0; i < DB_NR_LEVELS; i++) {
     buf[0] = 0;
     fgets(buf, 1000, fi);
-    const uint64_t id = strtoull(buf, NULL, 10);
+    const char * ptr = buf;
+    char * pend = NULL;
+    const uint64_t id = strtoull(ptr, &pend, 10);
     assert(id < count);
     cm_conf->data_id[i] = id;
+    cm_conf->data_devs[i] = UINT64_C(1) << id;
+    while (*pend == ',') {
+      ptr = pend + 1;
+      const uint64_t id1 = strtoull(ptr, &pend, 10);
+      assert((pend != ptr) && (id1 < count));
+      cm_conf->data_devs[i] |= (UINT64_C(1) << id1);
+    }
+  }
+  // deeper levels stay with the last one unless "deep_dev" says otherwise
+  for (int i = DB_NR_LEVELS; i < DB_MAX_LEVELS; i++) {
+    cm_conf->data_id[i] = cm_conf->data_id[DB_NR_LEVELS - 1];
+    cm_conf->data_devs[i] = cm_conf->data_devs[DB_NR_LEVELS - 1];
+  }
+  // options: "<name> <value>" per line
+  while (fgets(buf, 1000, fi)) {
+    char name[64];
+    char str[64];
+    if (sscanf(buf, "%63s %63s", name, str) != 2) continue;
+    const uint64_t value = strtoull(str, NULL, 10);
+    if (strcmp(name, "packed_meta") == 0) {
+      cm_conf->packed_meta = value;
+    } else if (strcmp(name, "discard") == 0) {
+      cm_conf->discard = value;
+    } else if (strcmp(name, "discard_rate") == 0) {
+      cm_conf->discard_rate = value;
+    } else if (strcmp(name, "vlog_dev") == 0) {
+      assert(value < count);
+      cm_conf->vlog_dev = value;
+    } else if (strcmp(name, "vlog_threshold") == 0) {
+      cm_conf->vlog_threshold = value;
+    } else if (strcmp(name, "table_scale") == 0) {
+      // "1,1,1,2,4": level 0 first, the last one repeats
+      const char * ptr = str;
+      for (int i = 0; i < DB_MAX_LEVELS; i++) {
+        char * pend = NULL;
+        const uint64_t scale = strtoull(ptr, &pend, 10);
+        if (pend == ptr) {
+          cm_conf->table_scale[i] = cm_conf->table_scale[i ? (i - 1) : 0];
+          continue;
+        }
+        assert(scale && (scale <= TABLE_MAX_SCALE));
+        cm_conf->table_scale[i] = scale;
+        ptr = (*pend == ',') ? (pend + 1) : pend;
+      }
+      // the compaction cap of a level must be reachable from the one above
+      for (int i = 1; i < DB_MAX_LEVELS; i++) {
+        const uint64_t max = cm_conf->table_scale[i - 1] * 2u;
+        if (cm_conf->table_scale[i] > max) {
+          fprintf(stderr, "%s: table_scale of level %d clamped to %lu\n", __func__, i, max);
+          cm_conf->table_scale[i] = max;
+        }
+      }
+    } else if (strcmp(name, "deep_dev") == 0) {
+      // "1,1,2": devices of levels 5, 6 and 7, the last one repeats
+      const char * ptr = str;
+      for (int i = DB_NR_LEVELS; i < DB_MAX_LEVELS; i++) {
+        char * pend = NULL;
+        const uint64_t id = strtoull(ptr, &pend, 10);
+        if (pend == ptr) {
+          cm_conf->data_id[i] = cm_conf->data_id[i - 1];
+          cm_conf->data_devs[i] = cm_conf->data_devs[i - 1];
+          continue;
+        }
+        assert(id < count);
+        cm_conf->data_id[i] = id;
+        cm_conf->data_devs[i] = UINT64_C(1) << id;
+        ptr = (*pend == ',') ? (pend + 1) : pend;
+      }
+    } else if (strcmp(name, "nr_levels") == 0) {
+      assert((value >= 2) && (value <= DB_MAX_LEVELS));
+      cm_conf->nr_levels = value;
+    } else if (strcmp(name, "max_levels") == 0) {
+      assert((value >= 2) && (value <= DB_MAX_LEVELS));
+      cm_conf->max_levels = value;
+    } else if (strcmp(name, "tiering") == 0) {
+      cm_conf->tiering = value;
+    } else if ((strcmp(name, "read_rate") == 0) || (strcmp(name, "write_rate") == 0)) {
+      // "200,100": MB/s of storage 0 and 1, the others unlimited
+      uint64_t * const rates = (name[0] == 'r') ? cm_conf->read_rate : cm_conf->write_rate;
+      const char * ptr = str;
+      for (uint64_t i = 0; i < count; i++) {
+        char * pend = NULL;
+        const uint64_t rate = strtoull(ptr, &pend, 10);
+        if (pend == ptr) break;
+        rates[i] = rate;
+        ptr = (*pend == ',') ? (pend + 1) : pend;
+      }
+    } else if (strcmp(name, "io_target") == 0) {
+      cm_conf->io_target = value;
+    } else if (strcmp(name, "stat_interval") == 0) {
+      cm_conf->stat_interval = value;
+    } else if (strcmp(name, "trace") == 0) {
+      cm_conf->trace = value;
+    } else if (strcmp(name, "stage_sample") == 0) {
+      cm_conf->stage_sample = value;
+    } else if (strcmp(name, "full_metaindex") == 0) {
+      cm_conf->full_metaindex = value;
+    } else if (strcmp(name, "neg_cache") == 0) {
+      cm_conf->neg_cache = value;
+    } else if (strcmp(name, "row_cache") == 0) {
+      cm_conf->row_cache = value;
+    } else if (strcmp(name, "root_images") == 0) {
+      assert(value <= DB_CONTAINER_NR);
+      cm_conf->root_images = value;
+    } else if (strcmp(name, "compress") == 0) {
+      const int codec = codec_parse(str);
+      if (codec_available(codec)) {
+        cm_conf->codec = codec;
+      } else {
+        fprintf(stderr, "%s: codec %s is not built in\n", __func__, str);
+      }
+    } else {
+      fprintf(stderr, "%s: unknown option %s\n", __func__, name);
+    }
   }
   fclose(fi);
   return cm_conf;
@@ -1409,8 +3401,12 @@ db_close(struct DB * const db)
   pthread_join(db->t_meta_dumper, NULL);
   db_log(db, "CLOSE: Meta Dummper thread exited");
 
+  // the open value-log segment is sealed with its exact live count
+  if (db->vlog) {
+    vlog_seal(db->vlog);
+  }
   // cheap last dump
-  db_dump_meta(db);
+  db_checkpoint(db);
   db_free(db);
   return;
 }
@@ -1424,16 +3420,256 @@ db_force_dump_meta(struct DB * const db)
   } while (db->need_dump_meta);
 }
 
+  static double
+db_stat_ratio(const uint64_t a, const uint64_t b)
+{
+  return b ? (((double)a) / ((double)b)) : 0.0;
+}
+
   void
 db_stat_show(struct DB * const db, FILE * const fo)
 {
-  stat_show(&(db->stat), fo);
+  stat_show(db->stat, fo);
+  if (db->codec != CODEC_NONE) {
+    uint64_t nr_dicts = 0;
+    pthread_mutex_lock(&(db->mutex_dict));
+    for (struct CodecDict * dict = db->dicts; dict; dict = dict->next) nr_dicts++;
+    pthread_mutex_unlock(&(db->mutex_dict));
+    fprintf(fo, "compress %s ratio %.2lf fill %.2lf dicts %lu\n", codec_name(db->codec),
+        ((double)db->zratio) / 100.0, db_table_fill(db), nr_dicts);
+  }
+  if (db->lat_get) {
+    fprintf(fo, "io factor %.2lf, lookup p99 %lu us, target %lu us\n", db->io_factor, db->io_p99, db->io_target);
+  }
+  for (uint64_t i = 0; (i < 6) && db->cms_dump[i]; i++) {
+    fprintf(fo, "CM[%lu] compaction read %lu MB (%.1lfs paced) write %lu MB (%.1lfs paced)\n", i,
+        db->rl_read[i].nr_bytes >> 20, db->rl_read[i].sec_wait, db->rl_write[i].nr_bytes >> 20,
+        db->rl_write[i].sec_wait);
+    const uint64_t nr_dumps = db->dev_nr_dumps[i];
+    fprintf(fo, "CM[%lu] used %lu/%lu units, write %lu us/unit, %lu dumps, depth %.2lf\n", i,
+        db->cms_dump[i]->nr_used, db->cms_dump[i]->nr_units, db->dev_lat[i], nr_dumps,
+        nr_dumps ? (((double)db->dev_depth_sum[i]) / ((double)nr_dumps)) : 0.0);
+  }
+  struct DBStat * const snap = (typeof(snap))malloc(sizeof(*snap));
+  assert(snap);
+  db_stat_snapshot(db, snap);
+  const struct Stat * const st = &(snap->stat);
+  fprintf(fo, "barrels per table lookup:");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, " L%lu %.3lf", i, db_stat_ratio(st->nr_table_read[i * 3u], st->nr_table_lookup[i * 3u]));
+  }
+  fprintf(fo, "\n");
+  free(snap);
+  if (db->vlog) {
+    vlog_show(db->vlog, fo);
+  }
 }
 
   void
 db_stat_clean(struct DB * const db)
 {
-  bzero(&(db->stat), sizeof(db->stat));
+  stat_clean(db->stat);
+  __sync_add_and_fetch(&(db->nr_stat_clean), 1);
+}
+
+  static void
+db_stat_walk(struct DB * const db, struct VirtualContainer * const vc, struct DBStat * const snap)
+{
+  if (vc == NULL) return;
+  const uint64_t level = vc->start_bit / 3u;
+  assert(level < DB_MAX_LEVELS);
+  snap->nr_tables[level] += vc->cc.count;
+  if (db_is_leaf(db, vc->start_bit) == false) {
+    snap->nr_pending[level] += vc_count_feed(vc, db_compaction_cap(db, vc->start_bit));
+  }
+  for (uint64_t i = 0; i < 8; i++) {
+    db_stat_walk(db, vc->sub_vc[i], snap);
+  }
+}
+
+  void
+db_stat_snapshot(struct DB * const db, struct DBStat * const snap)
+{
+  bzero(snap, sizeof(*snap));
+  snap->sec = debug_time_sec() - db->sec_start;
+  snap->nr_clean = db->nr_stat_clean;
+  __sync_synchronize();
+  stat_sum(db->stat, &(snap->stat));
+  stat_hist_sum(db->stat, &(snap->hist));
+  const uint64_t ticket = rwlock_reader_lock(&(db->rwlock));
+  snap->nr_levels = db_nr_levels(db);
+  db_stat_walk(db, db->vcroot, snap);
+  rwlock_reader_unlock(&(db->rwlock), ticket);
+  snap->nr_compacting = db->compaction_running_counter;
+  for (uint64_t i = 0; (i < DB_STAT_DEVS) && db->cms_dump[i]; i++) {
+    snap->dev_used[i] = db->cms_dump[i]->nr_used;
+    snap->dev_units[i] = db->cms_dump[i]->nr_units;
+    snap->nr_devs = i + 1u;
+  }
+}
+
+  static void
+db_stat_json(const struct DBStat * const snap, const struct DBStat * const prev, FILE * const fo)
+{
+  struct Stat * const st = (typeof(st))malloc(sizeof(*st));
+  struct StatHist * const sh = (typeof(sh))malloc(sizeof(*sh));
+  assert(st && sh);
+  // the counts since a clean in the interval are taken whole
+  if (prev && (prev->nr_clean == snap->nr_clean)) {
+    stat_diff(&(snap->stat), &(prev->stat), st);
+    stat_hist_diff(&(snap->hist), &(prev->hist), sh);
+  } else {
+    memcpy(st, &(snap->stat), sizeof(*st));
+    memcpy(sh, &(snap->hist), sizeof(*sh));
+  }
+  const double interval = snap->sec - (prev ? prev->sec : 0.0);
+  uint64_t nr_hit = st->nr_get_at_hit[0] + st->nr_get_at_hit[1] + st->nr_get_row;
+  uint64_t nr_write = st->nr_write_bc;
+  for (uint64_t i = 0; i < 64; i++) {
+    nr_hit += st->nr_get_vc_hit[i];
+    nr_write += st->nr_write[i];
+  }
+  fprintf(fo, "{\"sec\":%.1lf,\"interval\":%.1lf,\"get\":%lu,\"get_miss\":%lu,\"get_neg\":%lu,\"get_row\":%lu,"
+      "\"set\":%lu,"
+      "\"get_per_sec\":%.1lf,\"set_per_sec\":%.1lf,\"read_amp\":%.4lf,\"write_amp\":%.4lf,\"compaction\":%lu,",
+      snap->sec, interval, st->nr_get, st->nr_get_miss, st->nr_get_neg, st->nr_get_row, st->nr_set,
+      interval > 0.0 ? (((double)st->nr_get) / interval) : 0.0, interval > 0.0 ? (((double)st->nr_set) / interval) : 0.0,
+      db_stat_ratio(st->nr_fetch_barrel + st->nr_fetch_bc + st->nr_fetch_image, nr_hit), db_stat_ratio(nr_write, st->nr_write[0]),
+      st->nr_compaction);
+  fprintf(fo, "\"levels\":%lu,\"tables\":[", snap->nr_levels);
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "%s%lu", i ? "," : "", snap->nr_tables[i]);
+  }
+  fprintf(fo, "],\"pending\":[");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "%s%lu", i ? "," : "", snap->nr_pending[i]);
+  }
+  // barrels read per table lookup
+  fprintf(fo, "],\"reads\":[");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "%s%.4lf", i ? "," : "", db_stat_ratio(st->nr_table_read[i * 3u], st->nr_table_lookup[i * 3u]));
+  }
+  // of the BloomContainers, null where none was probed
+  fprintf(fo, "],\"fpr\":[");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    const uint64_t nr_false = st->nr_bc_false[i * 3u];
+    const uint64_t nr_neg = nr_false + st->nr_bc_negative[i * 3u];
+    if (nr_neg) {
+      fprintf(fo, "%s%.6lf", i ? "," : "", db_stat_ratio(nr_false, nr_neg));
+    } else {
+      fprintf(fo, "%snull", i ? "," : "");
+    }
+  }
+  fprintf(fo, "],\"compacting\":%lu,\"devs\":[", snap->nr_compacting);
+  for (uint64_t i = 0; i < snap->nr_devs; i++) {
+    fprintf(fo, "%s{\"used\":%lu,\"units\":%lu}", i ? "," : "", snap->dev_used[i], snap->dev_units[i]);
+  }
+  fprintf(fo, "],\"lat\":{");
+  bool first = true;
+  for (int i = 0; i < STAT_LAT_NR; i++) {
+    const struct Hist * const hist = &(sh->lat[i]);
+    const uint64_t count = hist_count(hist);
+    if (count == 0) continue;
+    fprintf(fo, "%s\"%s\":{\"count\":%lu,\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}",
+        first ? "" : ",", stat_lat_name(i), count, hist_percentile(hist, 0.5), hist_percentile(hist, 0.99),
+        hist_percentile(hist, 0.999), hist_percentile(hist, 1.0));
+    first = false;
+  }
+  fprintf(fo, "}}\n");
+  free(st);
+  free(sh);
+}
+
+  static void
+db_stat_prom(const struct DBStat * const snap, FILE * const fo)
+{
+  const struct Stat * const st = &(snap->stat);
+  const struct {
+    const char * name;
+    uint64_t value;
+  } counters[] = {
+    {"get", st->nr_get}, {"get_miss", st->nr_get_miss}, {"get_neg_cached", st->nr_get_neg},
+    {"get_row_cached", st->nr_get_row},
+    {"set", st->nr_set}, {"set_retry", st->nr_set_retry},
+    {"fetch_barrel", st->nr_fetch_barrel}, {"fetch_bc", st->nr_fetch_bc}, {"fetch_image", st->nr_fetch_image}, {"compaction", st->nr_compaction},
+    {"active_dumped", st->nr_active_dumped}, {"write_bc_4k", st->nr_write_bc},
+  };
+  for (uint64_t i = 0; i < (sizeof(counters) / sizeof(counters[0])); i++) {
+    fprintf(fo, "# TYPE lsmtrie_%s_total counter\nlsmtrie_%s_total %lu\n", counters[i].name, counters[i].name,
+        counters[i].value);
+  }
+  // by level
+  fprintf(fo, "# TYPE lsmtrie_hit_total counter\n");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "lsmtrie_hit_total{level=\"%lu\"} %lu\n", i, st->nr_get_vc_hit[i * 3u]);
+  }
+  fprintf(fo, "# TYPE lsmtrie_write_4k_total counter\n");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "lsmtrie_write_4k_total{level=\"%lu\"} %lu\n", i, st->nr_write[i * 3u]);
+  }
+  fprintf(fo, "# TYPE lsmtrie_bc_negative_total counter\n");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "lsmtrie_bc_negative_total{level=\"%lu\"} %lu\n", i, st->nr_bc_negative[i * 3u]);
+  }
+  fprintf(fo, "# TYPE lsmtrie_bc_false_positive_total counter\n");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "lsmtrie_bc_false_positive_total{level=\"%lu\"} %lu\n", i, st->nr_bc_false[i * 3u]);
+  }
+  fprintf(fo, "# TYPE lsmtrie_tables gauge\n");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "lsmtrie_tables{level=\"%lu\"} %lu\n", i, snap->nr_tables[i]);
+  }
+  fprintf(fo, "# TYPE lsmtrie_pending_tables gauge\n");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "lsmtrie_pending_tables{level=\"%lu\"} %lu\n", i, snap->nr_pending[i]);
+  }
+  fprintf(fo, "# TYPE lsmtrie_table_lookups_total counter\n");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "lsmtrie_table_lookups_total{level=\"%lu\"} %lu\n", i, st->nr_table_lookup[i * 3u]);
+  }
+  fprintf(fo, "# TYPE lsmtrie_table_reads_total counter\n");
+  for (uint64_t i = 0; i < snap->nr_levels; i++) {
+    fprintf(fo, "lsmtrie_table_reads_total{level=\"%lu\"} %lu\n", i, st->nr_table_read[i * 3u]);
+  }
+  fprintf(fo, "# TYPE lsmtrie_compacting gauge\nlsmtrie_compacting %lu\n", snap->nr_compacting);
+  // by device
+  fprintf(fo, "# TYPE lsmtrie_units_used gauge\n");
+  for (uint64_t i = 0; i < snap->nr_devs; i++) {
+    fprintf(fo, "lsmtrie_units_used{dev=\"%lu\"} %lu\n", i, snap->dev_used[i]);
+  }
+  fprintf(fo, "# TYPE lsmtrie_units gauge\n");
+  for (uint64_t i = 0; i < snap->nr_devs; i++) {
+    fprintf(fo, "lsmtrie_units{dev=\"%lu\"} %lu\n", i, snap->dev_units[i]);
+  }
+  // by operation
+  static const double quantiles[] = {0.5, 0.99, 0.999};
+  fprintf(fo, "# TYPE lsmtrie_latency_us summary\n");
+  for (int i = 0; i < STAT_LAT_NR; i++) {
+    const struct Hist * const hist = &(snap->hist.lat[i]);
+    for (uint64_t j = 0; j < (sizeof(quantiles) / sizeof(quantiles[0])); j++) {
+      fprintf(fo, "lsmtrie_latency_us{op=\"%s\",quantile=\"%g\"} %lu\n", stat_lat_name(i), quantiles[j],
+          hist_percentile(hist, quantiles[j]));
+    }
+    fprintf(fo, "lsmtrie_latency_us_sum{op=\"%s\"} %lu\n", stat_lat_name(i), hist_total(hist));
+    fprintf(fo, "lsmtrie_latency_us_count{op=\"%s\"} %lu\n", stat_lat_name(i), hist_count(hist));
+  }
+}
+
+  void
+db_stat_export(const struct DBStat * const snap, const struct DBStat * const prev, const enum DBStatFormat format,
+    FILE * const fo)
+{
+  if (format == DB_STAT_PROM) {
+    db_stat_prom(snap, fo);
+  } else {
+    db_stat_json(snap, prev, fo);
+  }
+}
+
+  void
+db_stage_sample(struct DB * const db, const uint64_t nr)
+{
+  db->stage_sample = nr;
 }
 
   bool
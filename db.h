@@ -11,6 +11,9 @@
 
 #include "table.h"
 
+// hash bits 0 -- 23 pick the containers, see compaction_select_table()
+#define DB_MAX_LEVELS ((8))
+
   struct DB *
 db_touch(const char * const meta_dir, const char * const cm_conf_fn);
 
@@ -26,6 +29,13 @@ db_multi_insert(struct DB * const db, const uint64_t nr_items, const struct KeyV
 struct KeyValue *
 db_lookup(struct DB * const db, const uint16_t klen, const uint8_t * const key);
 
+// a hit in the row cache is a reference to the cached copy, without copying it; give any result back with db_release()
+const struct KeyValue *
+db_lookup_ref(struct DB * const db, const uint16_t klen, const uint8_t * const key);
+
+void
+db_release(const struct KeyValue * const kv);
+
 //----misc
 
 void
@@ -37,5 +47,40 @@ db_stat_show(struct DB * const db, FILE * const fo);
 void
 db_stat_clean(struct DB * const db);
 
+#define DB_STAT_DEVS   ((6))
+
+// the stats at one point, see db_stat_snapshot()
+struct DBStat {
+  double sec;            // since the db was opened
+  struct Stat stat;      // of all threads
+  struct StatHist hist;
+  uint64_t nr_levels;
+  uint64_t nr_tables[DB_MAX_LEVELS];   // by level
+  uint64_t nr_pending[DB_MAX_LEVELS];  // tables the compactions of a level would take now
+  uint64_t nr_compacting;              // compactions running
+  uint64_t nr_devs;
+  uint64_t dev_used[DB_STAT_DEVS];     // units by device
+  uint64_t dev_units[DB_STAT_DEVS];
+  uint64_t nr_clean;     // db_stat_clean() calls before it
+};
+
+enum DBStatFormat {
+  DB_STAT_JSON = 0, // one object in a line
+  DB_STAT_PROM,     // Prometheus text format
+};
+
+void
+db_stat_snapshot(struct DB * const db, struct DBStat * const snap);
+
+// with prev, the JSON counts and rates are those of the interval since prev, or since a db_stat_clean() in it;
+// Prometheus is always cumulative
+void
+db_stat_export(const struct DBStat * const snap, const struct DBStat * const prev, const enum DBStatFormat format,
+    FILE * const fo);
+
+// time the stages of one in nr lookups of each thread, 0: off; reported by db_stat_show()
+void
+db_stage_sample(struct DB * const db, const uint64_t nr);
+
 bool
 db_doing_compaction(struct DB * const db);
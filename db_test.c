@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "db.h"
+
+// stores of few levels reach the leaves soon, see "nr_levels"
+#define DB_TEST_DIR  "/tmp/db_test"
+#define DB_TEST_VLEN ((UINT64_C(1000)))
+
+// devices of nr_gbs[i] GB (data, data1, data2), then the lines of the BloomContainers and levels 0 to 4
+  static void
+db_test_conf_devs(const uint64_t nr_devs, const uint64_t * const nr_gbs, const char * const levels,
+    const char * const options)
+{
+  static const char * const names[] = {DB_TEST_DIR "/data", DB_TEST_DIR "/data1", DB_TEST_DIR "/data2"};
+  assert(nr_devs <= 3);
+  mkdir(DB_TEST_DIR, 00755);
+  FILE * const fo = fopen(DB_TEST_DIR "/conf", "w");
+  assert(fo);
+  for (uint64_t i = 0; i < nr_devs; i++) {
+    fprintf(fo, "%s\n%lu\n", names[i], nr_gbs[i]);
+  }
+  fprintf(fo, "$\n%s%s", levels, options);
+  fclose(fo);
+}
+
+// a device of nr_gb0 for all the levels, and one of nr_gb1 (if not 0) for tiering
+  static void
+db_test_conf(const uint64_t nr_gb0, const uint64_t nr_gb1, const char * const options)
+{
+  const uint64_t nr_gbs[2] = {nr_gb0, nr_gb1};
+  db_test_conf_devs(nr_gb1 ? 2 : 1, nr_gbs, "0\n0\n0\n0\n0\n0\n", options);
+}
+
+  static void
+db_test_clean(void)
+{
+  const int r = system("rm -rf " DB_TEST_DIR "/meta " DB_TEST_DIR "/data " DB_TEST_DIR "/data1 "
+      DB_TEST_DIR "/data2");
+  (void)r;
+}
+
+  static void
+db_test_value(const uint64_t key, const uint64_t ver, uint8_t * const buf)
+{
+  for (uint64_t i = 0; i < DB_TEST_VLEN; i++) {
+    buf[i] = (uint8_t)((key * 131u) + (ver * 7u) + i);
+  }
+  memcpy(buf, &key, sizeof(key));
+  memcpy(buf + sizeof(key), &ver, sizeof(ver));
+}
+
+// nr_rounds versions of keys [k0, k0 + nr_keys), from ver0 on
+  static void
+db_test_fill(struct DB * const db, const uint64_t k0, const uint64_t nr_keys, const uint64_t ver0,
+    const uint64_t nr_rounds)
+{
+  uint8_t buf[DB_TEST_VLEN];
+  for (uint64_t r = 0; r < nr_rounds; r++) {
+    for (uint64_t k = k0; k < (k0 + nr_keys); k++) {
+      db_test_value(k, ver0 + r, buf);
+      struct KeyValue kv = {.klen = sizeof(k), .vlen = DB_TEST_VLEN, .pk = (uint8_t *)(&k), .pv = buf};
+      const bool ri = db_insert(db, &kv);
+      assert(ri);
+    }
+  }
+}
+
+  static void
+db_test_check(struct DB * const db, const uint64_t k0, const uint64_t nr_keys, const uint64_t ver)
+{
+  uint8_t buf[DB_TEST_VLEN];
+  for (uint64_t k = k0; k < (k0 + nr_keys); k++) {
+    struct KeyValue * const kv = db_lookup(db, sizeof(k), (const uint8_t *)(&k));
+    assert(kv);
+    db_test_value(k, ver, buf);
+    assert((kv->vlen == DB_TEST_VLEN) && (memcmp(kv->pv, buf, DB_TEST_VLEN) == 0));
+    free(kv);
+  }
+}
+
+  static void
+db_test_wait(struct DB * const db)
+{
+  while (db_doing_compaction(db)) {
+    usleep(100000);
+  }
+}
+
+// lines of the LOG with pattern
+  static uint64_t
+db_test_log_count(const char * const pattern)
+{
+  FILE * const fi = fopen(DB_TEST_DIR "/meta/LOG", "r");
+  assert(fi);
+  char buf[4096];
+  uint64_t nr = 0;
+  while (fgets(buf, sizeof(buf), fi)) {
+    if (strstr(buf, pattern)) nr++;
+  }
+  fclose(fi);
+  return nr;
+}
+
+// two levels: the 8 leaves take a table from each root compaction and are merged in place
+  static void
+leaf_test(void)
+{
+  db_test_clean();
+  db_test_conf(4, 0, "nr_levels 2\nmax_levels 2\n");
+  const uint64_t nr_keys = 48000;
+  const uint64_t nr_rounds = 48;
+  struct DB * db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  db_test_fill(db, 0, nr_keys, 0, nr_rounds);
+  db_test_wait(db);
+  db_test_check(db, 0, nr_keys, nr_rounds - 1u);
+  struct DBStat snap;
+  db_stat_snapshot(db, &snap);
+  assert(snap.nr_levels == 2);
+  db_close(db);
+  const uint64_t nr_root = db_test_log_count("COMP @0");
+  const uint64_t nr_leaf = db_test_log_count("LEAF @1");
+  printf("leaf_test: %lu root compactions, %lu leaf merges, %lu tables at level 1\n",
+      nr_root, nr_leaf, snap.nr_tables[1]);
+  // a leaf is checked by the compaction thread that owns it once it has DB_LEAF_NR tables;
+  // its live data fits in one table, the estimate is never short
+  assert(nr_leaf > 0);
+  assert(db_test_log_count("short") == 0);
+  assert(snap.nr_tables[1] <= ((nr_root * 8u) - (nr_leaf * 7u)));
+
+  db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  db_test_check(db, 0, nr_keys, nr_rounds - 1u);
+  db_close(db);
+}
+
+// unique keys: a leaf can not be merged into half of its tables and grows into a new level when it fills.
+// the deeper store is loaded again
+  static void
+grow_test(void)
+{
+  db_test_clean();
+  db_test_conf(16, 0, "nr_levels 2\nmax_levels 3\n");
+  const uint64_t nr_keys = 48000;
+  struct DB * db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  // until a few rounds after the growth
+  struct DBStat snap;
+  uint64_t nr_rounds = 0;
+  for (uint64_t nr_after = 0; nr_after < 4; nr_rounds++) {
+    assert(nr_rounds < 200);
+    db_test_fill(db, nr_rounds * nr_keys, nr_keys, nr_rounds, 1);
+    db_stat_snapshot(db, &snap);
+    if (snap.nr_levels == 3) nr_after++;
+  }
+  db_test_wait(db);
+  db_stat_snapshot(db, &snap);
+  db_close(db);
+  printf("grow_test: %lu rounds, %lu levels, %lu %lu tables at level 1 and 2\n", nr_rounds, snap.nr_levels,
+      snap.nr_tables[1], snap.nr_tables[2]);
+  assert(db_test_log_count("GROW 3 levels") == 1);
+  assert((snap.nr_levels == 3) && snap.nr_tables[2]);
+
+  db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  db_stat_snapshot(db, &snap);
+  assert((snap.nr_levels == 3) && snap.nr_tables[2]);
+  for (uint64_t r = 0; r < nr_rounds; r++) {
+    db_test_check(db, r * nr_keys, nr_keys, r);
+  }
+  db_close(db);
+}
+
+// the level-0 device is too small for the data: the new tables go to the other one
+  static void
+place_test(void)
+{
+  db_test_clean();
+  db_test_conf(1, 4, "nr_levels 2\nmax_levels 2\ntiering 1\n");
+  const uint64_t nr_keys = 48000;
+  const uint64_t nr_rounds = 32;
+  struct DB * db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  for (uint64_t r = 0; r < nr_rounds; r++) {
+    db_test_fill(db, r * nr_keys, nr_keys, r, 1);
+  }
+  db_test_wait(db);
+  struct DBStat snap;
+  db_stat_snapshot(db, &snap);
+  db_close(db);
+  printf("place_test: %lu %lu units used on device 0 and 1\n", snap.dev_used[0], snap.dev_used[1]);
+  assert((snap.nr_devs == 2) && snap.dev_used[1]);
+
+  db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  for (uint64_t r = 0; r < nr_rounds; r++) {
+    db_test_check(db, r * nr_keys, nr_keys, r);
+  }
+  db_close(db);
+}
+
+// one small device and no tiering: the leaves fill it before they are due for a merge.
+// the dumper has the root compacted and the leaves merged early instead of waiting forever
+  static void
+room_test(void)
+{
+  db_test_clean();
+  db_test_conf(1, 0, "nr_levels 2\nmax_levels 2\ntiering 0\n");
+  const uint64_t nr_keys = 48000;
+  const uint64_t nr_rounds = 48;
+  alarm(600);
+  struct DB * db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  db_test_fill(db, 0, nr_keys, 0, nr_rounds);
+  db_test_wait(db);
+  db_test_check(db, 0, nr_keys, nr_rounds - 1u);
+  db_close(db);
+  alarm(0);
+  const uint64_t nr_wait = db_test_log_count("near full");
+  printf("room_test: %lu waits for room\n", nr_wait);
+  assert(nr_wait);
+  assert(db_test_log_count("FAILED") == 0);
+}
+
+// the leaves live on "1,2": a merge writes one table, and the merges take the two devices in turn
+// instead of all starting over at the first one
+  static void
+stripe_test(void)
+{
+  db_test_clean();
+  const uint64_t nr_gbs[3] = {4, 2, 2};
+  db_test_conf_devs(3, nr_gbs, "0\n0\n1,2\n1,2\n1,2\n1,2\n", "nr_levels 2\nmax_levels 2\n");
+  const uint64_t nr_keys = 48000;
+  const uint64_t nr_rounds = 48;
+  struct DB * db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  db_test_fill(db, 0, nr_keys, 0, nr_rounds);
+  db_test_wait(db);
+  db_test_check(db, 0, nr_keys, nr_rounds - 1u);
+  db_close(db);
+  const uint64_t nr_leaf = db_test_log_count("LEAF @1");
+  const uint64_t nr_dev1 = db_test_log_count(" #1:");
+  const uint64_t nr_dev2 = db_test_log_count(" #2:");
+  printf("stripe_test: %lu leaf merges, %lu %lu tables dumped to device 1 and 2\n", nr_leaf, nr_dev1, nr_dev2);
+  // every table of level 1 is dumped by a root compaction or a leaf merge, one sequence for both
+  assert(nr_leaf > 0);
+  assert(((nr_dev1 > nr_dev2) ? (nr_dev1 - nr_dev2) : (nr_dev2 - nr_dev1)) <= 1);
+
+  db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  db_test_check(db, 0, nr_keys, nr_rounds - 1u);
+  db_close(db);
+}
+
+// keys [k0, k0 + nr_keys) to version ver in batches of db_multi_insert()
+  static void
+db_test_fill_multi(struct DB * const db, const uint64_t k0, const uint64_t nr_keys, const uint64_t ver)
+{
+  uint64_t keys[100];
+  uint8_t bufs[100][DB_TEST_VLEN];
+  struct KeyValue kvs[100];
+  for (uint64_t k = k0; k < (k0 + nr_keys); k += 100) {
+    const uint64_t nr = ((k0 + nr_keys - k) < 100) ? (k0 + nr_keys - k) : 100;
+    for (uint64_t i = 0; i < nr; i++) {
+      keys[i] = k + i;
+      db_test_value(keys[i], ver, bufs[i]);
+      kvs[i] = (struct KeyValue){.klen = sizeof(keys[i]), .vlen = DB_TEST_VLEN, .pk = (uint8_t *)(&(keys[i])),
+        .pv = bufs[i]};
+    }
+    const bool ri = db_multi_insert(db, nr, kvs);
+    assert(ri);
+  }
+}
+
+// the keys looked up below the active tables are kept in the row cache until they are overwritten,
+// by db_insert() or db_multi_insert(); the new values are found after they leave the active tables
+  static void
+row_test(void)
+{
+  db_test_clean();
+  db_test_conf(4, 0, "row_cache 16\n");
+  const uint64_t nr_keys = 1000;
+  // past the active tables
+  const uint64_t nr_fill = 144000;
+  struct DB * const db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  db_test_fill(db, 0, nr_keys, 0, 1);
+  db_test_fill(db, nr_keys, nr_fill, 0, 1);
+  db_test_wait(db);
+  struct DBStat * const snaps = (typeof(snaps))malloc(sizeof(*snaps) * 3);
+  assert(snaps);
+  db_test_check(db, 0, nr_keys, 0);
+  db_stat_snapshot(db, &(snaps[0]));
+  db_test_check(db, 0, nr_keys, 0);
+  db_stat_snapshot(db, &(snaps[1]));
+  assert((snaps[1].stat.nr_get_row - snaps[0].stat.nr_get_row) == nr_keys);
+
+  db_test_fill(db, 0, nr_keys / 2, 1, 1);
+  db_test_fill_multi(db, nr_keys / 2, nr_keys / 2, 1);
+  db_test_fill(db, nr_keys, nr_fill, 1, 1);
+  db_test_wait(db);
+  db_test_check(db, 0, nr_keys, 1);
+  db_test_check(db, 0, nr_keys, 1);
+  db_stat_snapshot(db, &(snaps[2]));
+  assert((snaps[2].stat.nr_get_row - snaps[1].stat.nr_get_row) == nr_keys);
+  printf("row_test: %lu keys overwritten, no stale hit\n", nr_keys);
+  free(snaps);
+  db_close(db);
+}
+
+// the value after prefix in the exported text, asserted to be there
+  static uint64_t
+db_test_export_value(const char * const text, const char * const prefix)
+{
+  const char * const p = strstr(text, prefix);
+  assert(p);
+  return strtoull(p + strlen(prefix), NULL, 10);
+}
+
+// Prometheus summaries carry a sum, and a JSON interval across a db_stat_clean() counts from the clean
+  static void
+export_test(void)
+{
+  db_test_clean();
+  db_test_conf(1, 0, "");
+  const uint64_t nr_keys = 2000;
+  struct DB * const db = db_touch(DB_TEST_DIR "/meta", DB_TEST_DIR "/conf");
+  assert(db);
+  db_test_fill(db, 0, nr_keys, 0, 1);
+  db_test_check(db, 0, nr_keys, 0);
+  struct DBStat * const snaps = (typeof(snaps))malloc(sizeof(*snaps) * 2);
+  assert(snaps);
+  db_stat_snapshot(db, &(snaps[0]));
+  char * text = NULL;
+  size_t size = 0;
+  FILE * fo = open_memstream(&text, &size);
+  assert(fo);
+  db_stat_export(&(snaps[0]), NULL, DB_STAT_PROM, fo);
+  fclose(fo);
+  assert(db_test_export_value(text, "\nlsmtrie_get_total ") == nr_keys);
+  assert(db_test_export_value(text, "lsmtrie_latency_us_count{op=\"get_hit\"} ") == nr_keys);
+  const uint64_t sum = db_test_export_value(text, "lsmtrie_latency_us_sum{op=\"get_hit\"} ");
+  assert(sum == hist_total(&(snaps[0].hist.lat[STAT_LAT_GET_HIT])));
+  free(text);
+
+  db_stat_clean(db);
+  db_test_check(db, 0, 10, 0);
+  db_stat_snapshot(db, &(snaps[1]));
+  fo = open_memstream(&text, &size);
+  assert(fo);
+  db_stat_export(&(snaps[1]), &(snaps[0]), DB_STAT_JSON, fo);
+  fclose(fo);
+  assert(db_test_export_value(text, "\"get\":") == 10);
+  assert(db_test_export_value(text, "\"get_hit\":{\"count\":") == 10);
+  printf("export_test: %lu us in %lu lookups\n", sum, nr_keys);
+  free(text);
+  free(snaps);
+  db_close(db);
+}
+
+int
+main(int argc, char ** argv)
+{
+  (void)argc;
+  (void)argv;
+  leaf_test();
+  grow_test();
+  place_test();
+  room_test();
+  stripe_test();
+  export_test();
+  row_test();
+  db_test_clean();
+  return 0;
+}
@@ -8,11 +8,15 @@
 #define _LARGEFILE64_SOURCE
 
 #include <sys/time.h>
+#include <time.h>
 #include <stdio.h>
 #include <execinfo.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <unistd.h>
+
+#include "debug.h"
 
   uint64_t
 debug_time_usec(void)
@@ -29,6 +33,29 @@ debug_time_sec(void)
   return ((double)usec) / 1000000.0;
 }
 
+  uint64_t
+debug_cpu_usec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000lu + (ts.tv_nsec / 1000lu);
+}
+
+  double
+debug_tsc_per_nsec(void)
+{
+  static double rate = 0.0;
+  if (rate == 0.0) {
+    const uint64_t usec0 = debug_time_usec();
+    const uint64_t tsc0 = debug_tsc();
+    usleep(10000);
+    const uint64_t tsc1 = debug_tsc();
+    const uint64_t usec1 = debug_time_usec();
+    rate = ((double)(tsc1 - tsc0)) / (((double)(usec1 - usec0)) * 1000.0);
+  }
+  return rate;
+}
+
   uint64_t
 debug_diff_usec(const uint64_t last)
 {
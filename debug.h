@@ -6,6 +6,7 @@
 #pragma once
 
 #include <sys/time.h>
+#include <time.h>
 #include <stdint.h>
 
 uint64_t
@@ -14,6 +15,27 @@ debug_time_usec(void);
 double
 debug_time_sec(void);
 
+// CPU time of the calling thread
+uint64_t
+debug_cpu_usec(void);
+
+// a cheap timestamp: TSC cycles on x86, nanoseconds elsewhere
+  static inline uint64_t
+debug_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000lu + ts.tv_nsec;
+#endif
+}
+
+// debug_tsc() ticks per nanosecond, measured at the first call (takes 10ms)
+double
+debug_tsc_per_nsec(void);
+
 uint64_t
 debug_diff_usec(const uint64_t last);
 
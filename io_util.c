@@ -28,7 +28,7 @@
 #include "generator.h"
 
 static volatile bool running = true;
-static uint32_t * latency = NULL;
+static struct Hist * latency = NULL;
 
 struct RR {
   pthread_t pt;
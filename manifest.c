@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "manifest.h"
+
+// records of one commit are written with a single write()
+#define MANIFEST_MAX_GROUP ((UINT64_C(256)))
+
+struct Manifest {
+  int fd;
+  uint64_t nr_records;
+};
+
+// FNV-1a over everything but the checksum
+  static uint32_t
+manifest_checksum(const struct ManifestRecord * const rec)
+{
+  const uint8_t * const p = (const uint8_t *)rec;
+  uint32_t h = UINT32_C(2166136261);
+  for (uint64_t i = sizeof(rec->checksum); i < sizeof(*rec); i++) {
+    h ^= p[i];
+    h *= UINT32_C(16777619);
+  }
+  return h;
+}
+
+// scan the file and call apply() on each complete commit group
+// return the length of the valid prefix
+  static uint64_t
+manifest_scan(const int fd, uint64_t * const nr_records,
+    bool (*apply)(void * const, const struct ManifestRecord * const, const uint64_t), void * const arg)
+{
+  struct ManifestRecord * const group = (typeof(group))malloc(sizeof(group[0]) * MANIFEST_MAX_GROUP);
+  assert(group);
+  uint64_t nr_group = 0;
+  uint64_t valid = 0;
+  uint64_t pos = 0;
+  uint64_t count = 0;
+  for (;;) {
+    struct ManifestRecord * const rec = &(group[nr_group]);
+    const ssize_t nr = pread(fd, rec, sizeof(*rec), (off_t)pos);
+    if (nr != ((ssize_t)sizeof(*rec))) break; // eof or torn tail
+    if (rec->checksum != manifest_checksum(rec)) break;
+    pos += sizeof(*rec);
+    nr_group++;
+    if (rec->type == MANIFEST_COMMIT) {
+      if (apply) {
+        const bool ra = apply(arg, group, nr_group);
+        assert(ra);
+      }
+      count += nr_group;
+      nr_group = 0;
+      valid = pos;
+    } else if (nr_group >= MANIFEST_MAX_GROUP) {
+      break; // corrupted
+    }
+  }
+  free(group);
+  if (nr_records) *nr_records = count;
+  return valid;
+}
+
+  struct Manifest *
+manifest_create(const char * const fn)
+{
+  const int fd = open(fn, O_CREAT | O_TRUNC | O_RDWR | O_LARGEFILE, 00644);
+  if (fd < 0) return NULL;
+  struct Manifest * const mf = (typeof(mf))malloc(sizeof(*mf));
+  assert(mf);
+  mf->fd = fd;
+  mf->nr_records = 0;
+  return mf;
+}
+
+// open for append; the uncommitted tail (if any) is cut off
+  struct Manifest *
+manifest_open(const char * const fn)
+{
+  const int fd = open(fn, O_RDWR | O_LARGEFILE);
+  if (fd < 0) return NULL;
+  uint64_t nr_records = 0;
+  const uint64_t valid = manifest_scan(fd, &nr_records, NULL, NULL);
+  const int rt = ftruncate(fd, (off_t)valid);
+  assert(rt == 0);
+  const off_t rs = lseek(fd, (off_t)valid, SEEK_SET);
+  assert(rs == (off_t)valid);
+  struct Manifest * const mf = (typeof(mf))malloc(sizeof(*mf));
+  assert(mf);
+  mf->fd = fd;
+  mf->nr_records = nr_records;
+  return mf;
+}
+
+// recs[nr-1] must be a MANIFEST_COMMIT
+  bool
+manifest_append(struct Manifest * const mf, struct ManifestRecord * const recs, const uint64_t nr)
+{
+  assert(nr && (nr <= MANIFEST_MAX_GROUP));
+  assert(recs[nr - 1].type == MANIFEST_COMMIT);
+  for (uint64_t i = 0; i < nr; i++) {
+    recs[i].checksum = manifest_checksum(&(recs[i]));
+  }
+  const size_t bytes = sizeof(recs[0]) * nr;
+  const ssize_t nw = write(mf->fd, recs, bytes);
+  if (nw != ((ssize_t)bytes)) return false;
+  const int rs = fdatasync(mf->fd);
+  if (rs != 0) return false;
+  mf->nr_records += nr;
+  return true;
+}
+
+  uint64_t
+manifest_nr_records(const struct Manifest * const mf)
+{
+  return mf->nr_records;
+}
+
+  void
+manifest_close(struct Manifest * const mf)
+{
+  fsync(mf->fd);
+  close(mf->fd);
+  free(mf);
+}
+
+// return number of records applied
+  uint64_t
+manifest_replay(const char * const fn,
+    bool (*apply)(void * const, const struct ManifestRecord * const, const uint64_t), void * const arg)
+{
+  const int fd = open(fn, O_RDONLY | O_LARGEFILE);
+  if (fd < 0) return 0;
+  uint64_t nr_records = 0;
+  (void)manifest_scan(fd, &nr_records, apply, arg);
+  close(fd);
+  return nr_records;
+}
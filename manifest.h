@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// one version edit; a commit is a group of edits closed by MANIFEST_COMMIT
+enum ManifestType {
+  MANIFEST_ADD = 1,    // append table mtid to vc (start_bit, path), set vc's bc, arg: its dictionary
+  MANIFEST_DROP,       // remove the oldest 'arg' tables of vc
+  MANIFEST_COMMIT,     // end of a commit group, mtid == next_mtid
+  MANIFEST_FORMAT,     // layout of the containers, off == unit size, arg: units per table of each level,
+                       // start_bit: of the last level (0: the first 5 levels)
+  MANIFEST_VLOG,       // value-log segment at (dev, off), arg: VLOG_SEG_*, mtid: live bytes
+};
+
+// flags of MANIFEST_ADD
+#define MANIFEST_FLAG_PACKED ((1u)) // metadata in the container, see table_dump_packed()
+
+struct ManifestRecord {
+  uint32_t checksum;
+  uint16_t type;
+  uint16_t start_bit;
+  uint64_t path;      // 3 bits per level from root, see vc_create()
+  uint64_t mtid;
+  uint64_t off;       // device offset of the table
+  uint64_t bc_mtid;   // 0: no bloom-container
+  uint64_t bc_off;
+  uint32_t dev;       // index of the storage device in cm_conf
+  uint32_t arg;
+  uint32_t flags;
+  uint32_t reserved;
+} __attribute__ ((packed));
+
+struct Manifest;
+
+  struct Manifest *
+manifest_create(const char * const fn);
+
+  struct Manifest *
+manifest_open(const char * const fn);
+
+  bool
+manifest_append(struct Manifest * const mf, struct ManifestRecord * const recs, const uint64_t nr);
+
+  uint64_t
+manifest_nr_records(const struct Manifest * const mf);
+
+  void
+manifest_close(struct Manifest * const mf);
+
+  uint64_t
+manifest_replay(const char * const fn,
+    bool (*apply)(void * const, const struct ManifestRecord * const, const uint64_t), void * const arg);
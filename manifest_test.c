@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "manifest.h"
+
+struct TestCount {
+  uint64_t nr_groups;
+  uint64_t nr_add;
+  uint64_t last_mtid;
+};
+
+  static bool
+test_apply(void * const ptr, const struct ManifestRecord * const recs, const uint64_t nr)
+{
+  struct TestCount * const tc = (typeof(tc))ptr;
+  assert(recs[nr - 1].type == MANIFEST_COMMIT);
+  for (uint64_t i = 0; i < nr; i++) {
+    if (recs[i].type == MANIFEST_ADD) {
+      assert(recs[i].mtid == (tc->last_mtid + 1));
+      tc->last_mtid = recs[i].mtid;
+      tc->nr_add++;
+    }
+  }
+  tc->nr_groups++;
+  return true;
+}
+
+  static void
+manifest_test(void)
+{
+  const char * const fn = "/tmp/manifest_test";
+  struct Manifest * const mf = manifest_create(fn);
+  assert(mf);
+  // 100 groups of 3 ADD + COMMIT
+  uint64_t mtid = 0;
+  for (uint64_t g = 0; g < 100; g++) {
+    struct ManifestRecord recs[4];
+    bzero(recs, sizeof(recs));
+    for (uint64_t i = 0; i < 3; i++) {
+      recs[i].type = MANIFEST_ADD;
+      recs[i].mtid = ++mtid;
+      recs[i].off = mtid << 25;
+    }
+    recs[3].type = MANIFEST_COMMIT;
+    recs[3].mtid = mtid + 1;
+    const bool ra = manifest_append(mf, recs, 4);
+    assert(ra);
+  }
+  assert(manifest_nr_records(mf) == 400);
+  manifest_close(mf);
+
+  struct TestCount tc;
+  bzero(&tc, sizeof(tc));
+  assert(manifest_replay(fn, test_apply, &tc) == 400);
+  assert(tc.nr_groups == 100);
+  assert(tc.nr_add == 300);
+
+  // torn tail: half a record and an uncommitted ADD
+  const int fd = open(fn, O_WRONLY | O_APPEND);
+  assert(fd >= 0);
+  struct ManifestRecord junk[2];
+  bzero(junk, sizeof(junk));
+  junk[0].type = MANIFEST_ADD;
+  const ssize_t nw = write(fd, junk, sizeof(junk[0]) + (sizeof(junk[1]) / 2));
+  assert(nw > 0);
+  close(fd);
+
+  bzero(&tc, sizeof(tc));
+  assert(manifest_replay(fn, test_apply, &tc) == 400);
+  assert(tc.nr_groups == 100);
+
+  // reopen cuts the tail and appends after the last commit
+  struct Manifest * const mf1 = manifest_open(fn);
+  assert(mf1);
+  assert(manifest_nr_records(mf1) == 400);
+  struct ManifestRecord recs[2];
+  bzero(recs, sizeof(recs));
+  recs[0].type = MANIFEST_ADD;
+  recs[0].mtid = ++mtid;
+  recs[1].type = MANIFEST_COMMIT;
+  recs[1].mtid = mtid + 1;
+  assert(manifest_append(mf1, recs, 2));
+  manifest_close(mf1);
+
+  bzero(&tc, sizeof(tc));
+  assert(manifest_replay(fn, test_apply, &tc) == 402);
+  assert(tc.nr_groups == 101);
+  assert(tc.last_mtid == mtid);
+  unlink(fn);
+  printf("manifest_test passed\n");
+}
+
+int
+main(int argc, char ** argv)
+{
+  (void)argc;
+  (void)argv;
+  manifest_test();
+  return 0;
+}
@@ -31,6 +31,9 @@
 #include "debug.h"
 #include "generator.h"
 
+// large values are only stored with a value log (vlog_dev in cm_conf)
+#define MIXED_MAX_VLEN ((UINT64_C(1) << 18))
+
 // one for each thread
 struct DBParams {
   char * tag;
@@ -43,12 +46,13 @@ struct DBParams {
   uint64_t range;
   uint64_t sec; // run time
   uint64_t nr_report;
+  char * prom_fn; // the stats in the Prometheus text format at each report, NULL: none
 };
 
 static const uint64_t nr_configs = 1;
 static struct DBParams pstable[] = {
-  //tag    vlen  meta_dir       cm_conf_fn     th  pw   gen        range                     sec   nr
-  {"Dummy", 100, "lsmtrie_tmp", "cm_conf1.txt", 1, 100, "uniform", UINT64_C(0x100000000000), 3000, 100000},
+  //tag    vlen  meta_dir       cm_conf_fn     th  pw   gen        range                     sec   nr      prom
+  {"Dummy", 100, "lsmtrie_tmp", "cm_conf1.txt", 1, 100, "uniform", UINT64_C(0x100000000000), 3000, 100000, NULL},
 };
 
 // singleton
@@ -61,8 +65,8 @@ struct TestState {
   pthread_mutex_t test_lock;
   struct GenInfo *gi;
   struct DB * db;
-  uint32_t * latency;
-  uint8_t buf[BARREL_ALIGN];
+  struct Hist * latency;
+  uint8_t buf[MIXED_MAX_VLEN];
 };
 
 static struct TestState __ts = {0,0,0,0,false,PTHREAD_MUTEX_INITIALIZER,NULL,NULL,NULL,{0,},};
@@ -80,9 +84,28 @@ show_dbparams(const struct DBParams * const ps)
   printf("    -r #range:      %lu\n", ps->range);
   printf("    -t #sec:        %lu\n", ps->sec);
   printf("    -n #nr_report:  %lu\n", ps->nr_report);
+  printf("    -p #prom_fn:    %s\n",          ps->prom_fn ? ps->prom_fn : "");
   fflush(stdout);
 }
 
+// written to a temporary file and renamed, so a textfile collector never reads half of it
+  static void
+mixed_prom(const struct DBParams * const ps)
+{
+  if (ps->prom_fn == NULL) return;
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", ps->prom_fn);
+  FILE * const fo = fopen(tmp, "w");
+  if (fo == NULL) return;
+  struct DBStat * const snap = (typeof(snap))malloc(sizeof(*snap));
+  assert(snap);
+  db_stat_snapshot(__ts.db, snap);
+  db_stat_export(snap, NULL, DB_STAT_PROM, fo);
+  fclose(fo);
+  rename(tmp, ps->prom_fn);
+  free(snap);
+}
+
   static void
 mixed_worker(const struct DBParams * const ps)
 {
@@ -119,11 +142,11 @@ mixed_worker(const struct DBParams * const ps)
     // read keys
     for (uint64_t i = ps->p_writer; i < 100u; i++) {
       const uint64_t t0 = debug_time_usec();
-      struct KeyValue * const kv = db_lookup(__ts.db, sizeof(keys[i]), (const uint8_t *)(&(keys[i])));
+      const struct KeyValue * const kv = db_lookup_ref(__ts.db, sizeof(keys[i]), (const uint8_t *)(&(keys[i])));
       const uint64_t t1 = debug_time_usec();
       latency_record(t1 - t0, __ts.latency);
       if (kv) {
-        free(kv);
+        db_release(kv);
       }
     }
 
@@ -138,6 +161,7 @@ mixed_worker(const struct DBParams * const ps)
         printf("@@ ops %14lu time %12lf delta %12lf qps %12.2lf\n", nr_100 * 100u, elapsed, udiff, qps);
         __ts.usec_last = usec;
         db_stat_show(__ts.db, stdout);
+        mixed_prom(ps);
         fflush(stdout);
       }
       pthread_mutex_unlock(&(__ts.test_lock));
@@ -246,7 +270,8 @@ mixed_test(const struct DBParams * const p)
   __ts.gi = gen_initial(p->generator, p->range);
   __ts.db = db_touch(p->meta_dir, p->cm_conf_fn);
   assert(__ts.db);
-  memset(__ts.buf, 0x5au, BARREL_ALIGN);
+  assert(p->vlen <= MIXED_MAX_VLEN);
+  memset(__ts.buf, 0x5au, sizeof(__ts.buf));
   __ts.latency = latency_initial();
 
   const uint64_t nth = p->nr_threads;
@@ -272,6 +297,7 @@ mixed_test(const struct DBParams * const p)
   __ts.gi = NULL;
 
   db_stat_show(__ts.db, stdout);
+  mixed_prom(p);
   latency_show("GET", __ts.latency, stdout);
   free(__ts.latency);
   fflush(stdout);
@@ -296,6 +322,7 @@ main(int argc, char ** argv)
           "d:" // meta dir: either load existing db or create new db
           "c:" // cm_conf_fn: the stroage config file
           "g:" // generator c,e,z,x,u
+          "p:" // prom_fn: write the stats in the Prometheus text format there at each report
           "h"  // help
           "l"  // list pre-defined params
           )) != -1) {
@@ -315,6 +342,7 @@ main(int argc, char ** argv)
       case 'd': ps.meta_dir   = strdup(optarg); break;
       case 'c': ps.cm_conf_fn = strdup(optarg); break;
       case 'g': ps.generator  = strdup(optarg); break;
+      case 'p': ps.prom_fn    = strdup(optarg); break;
       case 'h': { show_dbparams(&ps); exit(1); }
       case 'l': {
                   for (uint64_t i = 0; i < nr_configs; i++) {
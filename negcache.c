@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "negcache.h"
+
+  struct NegCache *
+negcache_new(const uint64_t nr)
+{
+  struct NegCache * const nc = (typeof(nc))malloc(sizeof(*nc));
+  assert(nc);
+  uint64_t nr_sets = 1;
+  while ((nr_sets * NEGCACHE_WAYS) < nr) nr_sets <<= 1;
+  nc->nr_sets = nr_sets;
+  nc->vers = (typeof(nc->vers))calloc(nr_sets, sizeof(nc->vers[0]));
+  nc->fps = (typeof(nc->fps))calloc(nr_sets * NEGCACHE_WAYS, sizeof(nc->fps[0]));
+  assert(nc->vers && nc->fps);
+  return nc;
+}
+
+// the first 8 bytes of the hash, never 0
+  static inline uint64_t
+negcache_fp(const uint8_t * const hash)
+{
+  uint64_t fp;
+  memcpy(&fp, hash, sizeof(fp));
+  return fp ? fp : 1u;
+}
+
+  static inline uint64_t
+negcache_set(const struct NegCache * const nc, const uint64_t fp)
+{
+  return (fp >> 32) & (nc->nr_sets - 1u);
+}
+
+  uint64_t
+negcache_version(struct NegCache * const nc, const uint8_t * const hash)
+{
+  const uint64_t set = negcache_set(nc, negcache_fp(hash));
+  const uint64_t ver = nc->vers[set];
+  __sync_synchronize();
+  return ver;
+}
+
+  bool
+negcache_match(struct NegCache * const nc, const uint8_t * const hash)
+{
+  const uint64_t fp = negcache_fp(hash);
+  const uint64_t * const fps = &(nc->fps[negcache_set(nc, fp) * NEGCACHE_WAYS]);
+  for (uint64_t i = 0; i < NEGCACHE_WAYS; i++) {
+    if (fps[i] == fp) return true;
+  }
+  return false;
+}
+
+  void
+negcache_add(struct NegCache * const nc, const uint8_t * const hash, const uint64_t ver)
+{
+  const uint64_t fp = negcache_fp(hash);
+  const uint64_t set = negcache_set(nc, fp);
+  uint64_t * const fps = &(nc->fps[set * NEGCACHE_WAYS]);
+  // an empty way, or else one picked by the fingerprint
+  uint64_t way = fp % NEGCACHE_WAYS;
+  for (uint64_t i = 0; i < NEGCACHE_WAYS; i++) {
+    if (fps[i] == fp) return;
+    if (fps[i] == 0) way = i;
+  }
+  fps[way] = fp;
+  __sync_synchronize();
+  // an insert of the set since the lookup: the key may exist now
+  if (nc->vers[set] != ver) {
+    __sync_bool_compare_and_swap(&(fps[way]), fp, 0);
+  }
+}
+
+  void
+negcache_invalidate(struct NegCache * const nc, const uint8_t * const hash)
+{
+  const uint64_t fp = negcache_fp(hash);
+  const uint64_t set = negcache_set(nc, fp);
+  __sync_add_and_fetch(&(nc->vers[set]), 1);
+  uint64_t * const fps = &(nc->fps[set * NEGCACHE_WAYS]);
+  for (uint64_t i = 0; i < NEGCACHE_WAYS; i++) {
+    __sync_bool_compare_and_swap(&(fps[i]), fp, 0);
+  }
+}
+
+  void
+negcache_free(struct NegCache * const nc)
+{
+  free(nc->vers);
+  free(nc->fps);
+  free(nc);
+}
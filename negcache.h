@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// hashes of recently missed keys: a set-associative table of 64-bit fingerprints, without locks.
+// an insert of a key invalidates its fingerprint; a miss racing with an insert of the same set is not kept
+#define NEGCACHE_WAYS ((UINT64_C(4)))
+
+struct NegCache {
+  uint64_t nr_sets;  // power of 2
+  uint64_t * vers;   // by set, bumped by every invalidation
+  uint64_t * fps;    // NEGCACHE_WAYS by set, 0: empty
+};
+
+// nr: fingerprints to keep, rounded up to NEGCACHE_WAYS times a power of 2
+  struct NegCache *
+negcache_new(const uint64_t nr);
+
+// taken before the lookup, given back to negcache_add()
+  uint64_t
+negcache_version(struct NegCache * const nc, const uint8_t * const hash);
+
+  bool
+negcache_match(struct NegCache * const nc, const uint8_t * const hash);
+
+// after a miss; dropped if the set was invalidated since ver
+  void
+negcache_add(struct NegCache * const nc, const uint8_t * const hash, const uint64_t ver);
+
+// after the key is inserted
+  void
+negcache_invalidate(struct NegCache * const nc, const uint8_t * const hash);
+
+  void
+negcache_free(struct NegCache * const nc);
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <openssl/sha.h>
+
+#include "negcache.h"
+
+#define NC_TEST_NR_THREADS ((4))
+#define NC_TEST_NR_ROUNDS ((UINT64_C(2000)))
+
+  static void
+nc_test_hash(const uint64_t key, uint8_t * const hash)
+{
+  char buf[32];
+  const int len = sprintf(buf, "%016lx", key);
+  SHA1((const uint8_t *)buf, len, hash);
+}
+
+// a miss is kept until the key is inserted; other keys do not match
+  static void
+add_test(void)
+{
+  struct NegCache * const nc = negcache_new(1024);
+  uint8_t hash[20] __attribute__((aligned(8)));
+  for (uint64_t i = 0; i < 256; i++) {
+    nc_test_hash(i, hash);
+    assert(negcache_match(nc, hash) == false);
+    negcache_add(nc, hash, negcache_version(nc, hash));
+    assert(negcache_match(nc, hash));
+  }
+  uint64_t nr_kept = 0;
+  for (uint64_t i = 0; i < 256; i++) {
+    nc_test_hash(i, hash);
+    if (negcache_match(nc, hash)) nr_kept++;
+    nc_test_hash(i + 1000000, hash);
+    assert(negcache_match(nc, hash) == false);
+  }
+  // a set of NEGCACHE_WAYS may evict some of them
+  assert(nr_kept > 200);
+  for (uint64_t i = 0; i < 256; i++) {
+    nc_test_hash(i, hash);
+    negcache_invalidate(nc, hash);
+    assert(negcache_match(nc, hash) == false);
+  }
+  printf("add_test: %lu of 256 misses kept in %lu sets\n", nr_kept, nc->nr_sets);
+  negcache_free(nc);
+}
+
+// an insert between the lookup and the add: the miss is dropped
+  static void
+version_test(void)
+{
+  struct NegCache * const nc = negcache_new(1024);
+  uint8_t hash[20] __attribute__((aligned(8)));
+  nc_test_hash(7, hash);
+  const uint64_t ver = negcache_version(nc, hash);
+  negcache_invalidate(nc, hash);
+  negcache_add(nc, hash, ver);
+  assert(negcache_match(nc, hash) == false);
+  // a lookup after the insert is kept
+  negcache_add(nc, hash, negcache_version(nc, hash));
+  assert(negcache_match(nc, hash));
+  printf("version_test: passed\n");
+  negcache_free(nc);
+}
+
+struct NCTestShared {
+  struct NegCache * nc;
+  uint64_t round;
+  uint64_t held;  // r + 1: the first thread holds its add of round r until the key is inserted
+  uint64_t present[NC_TEST_NR_ROUNDS]; // 1: inserted
+};
+
+struct NCTestArg {
+  struct NCTestShared * shared;
+  uint64_t id;
+};
+
+// a lookup as db_lookup() does it: the version first, then the tables, then the add after a miss
+  static void *
+nc_test_thread(void * const ptr)
+{
+  const struct NCTestArg * const arg = (typeof(arg))ptr;
+  struct NCTestShared * const shared = arg->shared;
+  uint8_t hash[20] __attribute__((aligned(8)));
+  uint8_t hash1[20] __attribute__((aligned(8)));
+  for (;;) {
+    const uint64_t r = __sync_fetch_and_add(&(shared->round), 0);
+    if (r >= NC_TEST_NR_ROUNDS) break;
+    nc_test_hash(r, hash);
+    const uint64_t ver = negcache_version(shared->nc, hash);
+    if (__sync_fetch_and_add(&(shared->present[r]), 0) == 0) {
+      if ((arg->id == 0) && (shared->held != (r + 1u))) {
+        __sync_lock_test_and_set(&(shared->held), r + 1u);
+        while (__sync_fetch_and_add(&(shared->round), 0) == r) sched_yield();
+      }
+      negcache_add(shared->nc, hash, ver);
+    }
+    // never inserted
+    nc_test_hash(r + NC_TEST_NR_ROUNDS, hash1);
+    negcache_add(shared->nc, hash1, negcache_version(shared->nc, hash1));
+  }
+  pthread_exit(NULL);
+}
+
+// the lookups race with the insert of each key: none is left as a miss after its insert
+  static void
+race_test(void)
+{
+  struct NCTestShared * const shared = (typeof(shared))calloc(1, sizeof(*shared));
+  assert(shared);
+  shared->nc = negcache_new(NC_TEST_NR_ROUNDS * 16u);
+  pthread_t ths[NC_TEST_NR_THREADS];
+  struct NCTestArg args[NC_TEST_NR_THREADS];
+  for (uint64_t i = 0; i < NC_TEST_NR_THREADS; i++) {
+    args[i].shared = shared;
+    args[i].id = i;
+    pthread_create(&(ths[i]), NULL, nc_test_thread, &(args[i]));
+  }
+  uint8_t hash[20] __attribute__((aligned(8)));
+  for (uint64_t r = 0; r < NC_TEST_NR_ROUNDS; r++) {
+    nc_test_hash(r, hash);
+    // every insert lands between a lookup and its add
+    while (__sync_fetch_and_add(&(shared->held), 0) != (r + 1u)) sched_yield();
+    // the insert: the item can be found before the cache is invalidated, see db_insert()
+    __sync_bool_compare_and_swap(&(shared->present[r]), 0, 1);
+    negcache_invalidate(shared->nc, hash);
+    __sync_add_and_fetch(&(shared->round), 1);
+  }
+  for (uint64_t i = 0; i < NC_TEST_NR_THREADS; i++) {
+    pthread_join(ths[i], NULL);
+  }
+  uint64_t nr_misses = 0;
+  for (uint64_t r = 0; r < NC_TEST_NR_ROUNDS; r++) {
+    nc_test_hash(r, hash);
+    assert(negcache_match(shared->nc, hash) == false);
+    nc_test_hash(r + NC_TEST_NR_ROUNDS, hash);
+    if (negcache_match(shared->nc, hash)) nr_misses++;
+  }
+  assert(nr_misses);
+  printf("race_test: %lu inserts, no stale miss, %lu misses of other keys kept\n", NC_TEST_NR_ROUNDS, nr_misses);
+  negcache_free(shared->nc);
+  free(shared);
+}
+
+int
+main(int argc, char ** argv)
+{
+  (void)argc;
+  (void)argv;
+  add_test();
+  version_test();
+  race_test();
+  return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "ratelimit.h"
+
+// at most this much of a second can be saved up for a burst
+#define RATELIMIT_BURST ((0.1))
+
+  void
+ratelimit_initial(struct RateLimit * const rl, const uint64_t rate)
+{
+  bzero(rl, sizeof(*rl));
+  rl->rate = rate;
+  rl->sec_last = debug_time_sec();
+  pthread_mutex_init(&(rl->mutex), NULL);
+}
+
+  void
+ratelimit_set(struct RateLimit * const rl, const uint64_t rate)
+{
+  pthread_mutex_lock(&(rl->mutex));
+  rl->rate = rate;
+  pthread_mutex_unlock(&(rl->mutex));
+}
+
+  void
+ratelimit_take(struct RateLimit * const rl, const uint64_t bytes)
+{
+  pthread_mutex_lock(&(rl->mutex));
+  rl->nr_bytes += bytes;
+  if (rl->rate == 0) {
+    pthread_mutex_unlock(&(rl->mutex));
+    return;
+  }
+  const double rate = (double)rl->rate;
+  const double sec = debug_time_sec();
+  const double tokens = rl->tokens + ((sec - rl->sec_last) * rate);
+  const double burst = rate * RATELIMIT_BURST;
+  rl->tokens = ((tokens > burst) ? burst : tokens) - ((double)bytes);
+  rl->sec_last = sec;
+  const double wait = (rl->tokens < 0.0) ? (-rl->tokens / rate) : 0.0;
+  rl->sec_wait += wait;
+  pthread_mutex_unlock(&(rl->mutex));
+  if (wait > 0.0) {
+    usleep((useconds_t)(wait * 1e6));
+  }
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+// token bucket on bytes; a taker may go into debt and sleeps it off
+struct RateLimit {
+  uint64_t rate;        // bytes per second, 0: unlimited
+  double tokens;        // bytes, negative: debt
+  double sec_last;      // last refill
+  uint64_t nr_bytes;    // taken
+  double sec_wait;      // slept by the takers
+  pthread_mutex_t mutex;
+};
+
+  void
+ratelimit_initial(struct RateLimit * const rl, const uint64_t rate);
+
+// takes effect on the next refill
+  void
+ratelimit_set(struct RateLimit * const rl, const uint64_t rate);
+
+// blocks until the bytes are within the rate
+  void
+ratelimit_take(struct RateLimit * const rl, const uint64_t bytes);
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "debug.h"
+#include "ratelimit.h"
+
+#define RL_TEST_MB ((UINT64_C(1) << 20))
+
+// seconds spent taking nr chunks of bytes
+  static double
+rl_test_take(struct RateLimit * const rl, const uint64_t nr, const uint64_t bytes)
+{
+  const double sec0 = debug_time_sec();
+  for (uint64_t i = 0; i < nr; i++) {
+    ratelimit_take(rl, bytes);
+  }
+  return debug_time_sec() - sec0;
+}
+
+// 0 is unlimited: no wait at all, the bytes are still counted
+  static void
+unlimited_test(void)
+{
+  struct RateLimit rl;
+  ratelimit_initial(&rl, 0);
+  const double sec = rl_test_take(&rl, 1000, RL_TEST_MB);
+  assert(sec < 0.1);
+  assert(rl.nr_bytes == (1000 * RL_TEST_MB));
+  assert(rl.sec_wait == 0.0);
+  printf("unlimited_test: 1000 MB in %.3lf s\n", sec);
+}
+
+// a burst of up to RATELIMIT_BURST of a second goes through; the rest is paced at the rate
+  static void
+rate_test(void)
+{
+  struct RateLimit rl;
+  ratelimit_initial(&rl, 10 * RL_TEST_MB);
+  // the bucket fills up to its burst
+  usleep(200000);
+  const double sec_burst = rl_test_take(&rl, 1, RL_TEST_MB);
+  assert(sec_burst < 0.05);
+  // 5 MB more at 10 MB/s
+  const double sec = rl_test_take(&rl, 20, RL_TEST_MB / 4);
+  printf("rate_test: 5 MB at 10 MB/s in %.3lf s, %.3lf s waited\n", sec, rl.sec_wait);
+  assert((sec > 0.4) && (sec < 0.7));
+  assert(rl.sec_wait > 0.4);
+  assert(rl.nr_bytes == (6 * RL_TEST_MB));
+}
+
+// a new rate applies to the next take; 0 lifts the limit
+  static void
+set_test(void)
+{
+  struct RateLimit rl;
+  ratelimit_initial(&rl, 100 * RL_TEST_MB);
+  const double sec0 = rl_test_take(&rl, 20, RL_TEST_MB);
+  ratelimit_set(&rl, 20 * RL_TEST_MB);
+  const double sec1 = rl_test_take(&rl, 10, RL_TEST_MB);
+  ratelimit_set(&rl, 0);
+  const double sec2 = rl_test_take(&rl, 100, RL_TEST_MB);
+  printf("set_test: 20 MB at 100 MB/s in %.3lf s, 10 MB at 20 MB/s in %.3lf s, 100 MB unlimited in %.3lf s\n",
+      sec0, sec1, sec2);
+  assert((sec0 > 0.1) && (sec0 < 0.35));
+  assert((sec1 > 0.35) && (sec1 < 0.7));
+  assert(sec2 < 0.05);
+}
+
+struct RLTestShared {
+  struct RateLimit rl;
+  uint64_t nr;
+  uint64_t bytes;
+};
+
+  static void *
+rl_test_thread(void * const ptr)
+{
+  struct RLTestShared * const shared = (typeof(shared))ptr;
+  rl_test_take(&(shared->rl), shared->nr, shared->bytes);
+  pthread_exit(NULL);
+}
+
+// the takers share one bucket: together they get the rate, not the rate each
+  static void
+shared_test(void)
+{
+  struct RLTestShared shared = {.nr = 20, .bytes = RL_TEST_MB / 4};
+  ratelimit_initial(&(shared.rl), 20 * RL_TEST_MB);
+  const double sec0 = debug_time_sec();
+  pthread_t ths[4];
+  for (uint64_t i = 0; i < 4; i++) {
+    pthread_create(&(ths[i]), NULL, rl_test_thread, &shared);
+  }
+  for (uint64_t i = 0; i < 4; i++) {
+    pthread_join(ths[i], NULL);
+  }
+  const double sec = debug_time_sec() - sec0;
+  printf("shared_test: 4 takers, 20 MB at 20 MB/s in %.3lf s\n", sec);
+  assert(shared.rl.nr_bytes == (20 * RL_TEST_MB));
+  assert((sec > 0.8) && (sec < 1.3));
+}
+
+int
+main(int argc, char ** argv)
+{
+  (void)argc;
+  (void)argv;
+  unlimited_test();
+  rate_test();
+  set_test();
+  shared_test();
+  return 0;
+}
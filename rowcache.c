@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "rowcache.h"
+
+#define ROWCACHE_NR_SHARDS ((UINT64_C(64)))
+// a bucket for every this many bytes of a shard
+#define ROWCACHE_BUCKET_BYTES ((UINT64_C(256)))
+
+struct RowItem {
+  struct RowItem * chain;  // in the bucket
+  struct RowItem * prev;   // lru, the most recent put at the head
+  struct RowItem * next;
+  uint64_t refs;           // the cache holds one while the item is in it
+  uint64_t hot;            // 1: hit since it was put or passed over, see rowcache_evict()
+  uint64_t bytes;
+  uint8_t hash[HASHBYTES];
+  struct KeyValue kv;      // key and value follow
+};
+
+struct RowBucket {
+  uint64_t ver;            // bumped by every invalidation
+  struct RowItem * items;
+};
+
+// lookups share the lock and only mark the items they hit; puts and invalidations take it whole
+struct RowShard {
+  pthread_rwlock_t lock;
+  uint64_t cap;
+  uint64_t bytes;
+  struct RowItem * head;
+  struct RowItem * tail;
+  uint64_t nr_buckets;     // power of 2
+  struct RowBucket * buckets;
+} __attribute__ ((aligned(64)));
+
+struct RowCache {
+  struct RowShard shards[ROWCACHE_NR_SHARDS];
+};
+
+  struct RowCache *
+rowcache_new(const uint64_t cap)
+{
+  struct RowCache * const rc = (typeof(rc))aligned_alloc(64, sizeof(*rc));
+  assert(rc);
+  bzero(rc, sizeof(*rc));
+  const uint64_t cap_shard = cap / ROWCACHE_NR_SHARDS;
+  uint64_t nr_buckets = 16;
+  while ((nr_buckets * ROWCACHE_BUCKET_BYTES) < cap_shard) nr_buckets <<= 1;
+  for (uint64_t i = 0; i < ROWCACHE_NR_SHARDS; i++) {
+    struct RowShard * const shard = &(rc->shards[i]);
+    pthread_rwlock_init(&(shard->lock), NULL);
+    shard->cap = cap_shard;
+    shard->nr_buckets = nr_buckets;
+    shard->buckets = (typeof(shard->buckets))calloc(nr_buckets, sizeof(shard->buckets[0]));
+    assert(shard->buckets);
+  }
+  return rc;
+}
+
+// bytes 8 to 15 of the hash; the negative cache takes the first 8
+  static inline uint64_t
+rowcache_hash64(const uint8_t * const hash)
+{
+  uint64_t h;
+  memcpy(&h, hash + 8, sizeof(h));
+  return h;
+}
+
+  static inline struct RowShard *
+rowcache_shard(struct RowCache * const rc, const uint8_t * const hash)
+{
+  return &(rc->shards[rowcache_hash64(hash) % ROWCACHE_NR_SHARDS]);
+}
+
+  static inline struct RowBucket *
+rowcache_bucket(struct RowShard * const shard, const uint8_t * const hash)
+{
+  const uint64_t h = rowcache_hash64(hash) / ROWCACHE_NR_SHARDS;
+  return &(shard->buckets[h & (shard->nr_buckets - 1u)]);
+}
+
+  static void
+rowcache_lru_unlink(struct RowShard * const shard, struct RowItem * const item)
+{
+  if (item->prev) item->prev->next = item->next;
+  else shard->head = item->next;
+  if (item->next) item->next->prev = item->prev;
+  else shard->tail = item->prev;
+}
+
+  static void
+rowcache_lru_push(struct RowShard * const shard, struct RowItem * const item)
+{
+  item->prev = NULL;
+  item->next = shard->head;
+  if (shard->head) shard->head->prev = item;
+  else shard->tail = item;
+  shard->head = item;
+}
+
+// out of the bucket and the lru; the cache's reference is dropped by the caller, out of the lock
+  static void
+rowcache_unlink(struct RowShard * const shard, struct RowItem * const item)
+{
+  struct RowItem ** pitem = &(rowcache_bucket(shard, item->hash)->items);
+  while (*pitem != item) {
+    assert(*pitem);
+    pitem = &((*pitem)->chain);
+  }
+  *pitem = item->chain;
+  rowcache_lru_unlink(shard, item);
+  shard->bytes -= item->bytes;
+}
+
+  static inline struct RowItem *
+rowcache_item(const struct KeyValue * const kv)
+{
+  return (struct RowItem *)(((uint8_t *)kv) - offsetof(struct RowItem, kv));
+}
+
+  uint64_t
+rowcache_version(struct RowCache * const rc, const uint8_t * const hash)
+{
+  // no lock: compared again under the lock by rowcache_put()
+  struct RowShard * const shard = rowcache_shard(rc, hash);
+  const uint64_t ver = rowcache_bucket(shard, hash)->ver;
+  __sync_synchronize();
+  return ver;
+}
+
+  const struct KeyValue *
+rowcache_get(struct RowCache * const rc, const uint8_t * const hash, const uint16_t klen,
+    const uint8_t * const key)
+{
+  struct RowShard * const shard = rowcache_shard(rc, hash);
+  pthread_rwlock_rdlock(&(shard->lock));
+  struct RowItem * item = rowcache_bucket(shard, hash)->items;
+  while (item) {
+    if ((memcmp(item->hash, hash, HASHBYTES) == 0) && (item->kv.klen == klen)
+        && (memcmp(item->kv.pk, key, klen) == 0)) {
+      // no write to the line while it is marked
+      if (item->hot == 0) __sync_lock_test_and_set(&(item->hot), 1);
+      __sync_add_and_fetch(&(item->refs), 1);
+      break;
+    }
+    item = item->chain;
+  }
+  pthread_rwlock_unlock(&(shard->lock));
+  return item ? &(item->kv) : NULL;
+}
+
+// the least recently put items go first, but one hit since its last pass moves it back to the head
+  static void
+rowcache_evict(struct RowShard * const shard, struct RowItem ** const pdropped)
+{
+  while (shard->bytes > shard->cap) {
+    struct RowItem * const victim = shard->tail;
+    if (victim->hot && (victim != shard->head)) {
+      victim->hot = 0;
+      rowcache_lru_unlink(shard, victim);
+      rowcache_lru_push(shard, victim);
+      continue;
+    }
+    rowcache_unlink(shard, victim);
+    victim->chain = *pdropped;
+    *pdropped = victim;
+  }
+}
+
+// the dropped items are chained for a release out of the lock
+  static void
+rowcache_release_chain(struct RowItem * item)
+{
+  while (item) {
+    struct RowItem * const chain = item->chain;
+    rowcache_release(&(item->kv));
+    item = chain;
+  }
+}
+
+  void
+rowcache_put(struct RowCache * const rc, const uint8_t * const hash, const struct KeyValue * const kv,
+    const uint64_t ver)
+{
+  struct RowShard * const shard = rowcache_shard(rc, hash);
+  const uint64_t bytes = sizeof(struct RowItem) + kv->klen + kv->vlen;
+  if (bytes > shard->cap) return;
+  struct RowItem * const item = (typeof(item))malloc(bytes);
+  assert(item);
+  item->refs = 1;
+  item->hot = 0;
+  item->bytes = bytes;
+  memcpy(item->hash, hash, HASHBYTES);
+  item->kv.klen = kv->klen;
+  item->kv.flags = KV_FLAG_CACHED;
+  item->kv.vlen = kv->vlen;
+  item->kv.pk = item->kv.kv;
+  item->kv.pv = item->kv.kv + kv->klen;
+  memcpy(item->kv.pk, kv->pk, kv->klen);
+  memcpy(item->kv.pv, kv->pv, kv->vlen);
+
+  struct RowItem * dropped = NULL;
+  pthread_rwlock_wrlock(&(shard->lock));
+  struct RowBucket * const bucket = rowcache_bucket(shard, hash);
+  if (bucket->ver != ver) {
+    // an insert of the key since the lookup: the copy may be stale
+    pthread_rwlock_unlock(&(shard->lock));
+    free(item);
+    return;
+  }
+  // a copy put by a racing lookup of the same key
+  for (struct RowItem * iter = bucket->items; iter; iter = iter->chain) {
+    if ((memcmp(iter->hash, hash, HASHBYTES) == 0) && (iter->kv.klen == kv->klen)
+        && (memcmp(iter->kv.pk, kv->pk, kv->klen) == 0)) {
+      rowcache_unlink(shard, iter);
+      iter->chain = dropped;
+      dropped = iter;
+      break;
+    }
+  }
+  item->chain = bucket->items;
+  bucket->items = item;
+  rowcache_lru_push(shard, item);
+  shard->bytes += bytes;
+  rowcache_evict(shard, &dropped);
+  pthread_rwlock_unlock(&(shard->lock));
+  rowcache_release_chain(dropped);
+}
+
+  void
+rowcache_invalidate(struct RowCache * const rc, const uint8_t * const hash)
+{
+  struct RowShard * const shard = rowcache_shard(rc, hash);
+  struct RowItem * dropped = NULL;
+  pthread_rwlock_wrlock(&(shard->lock));
+  struct RowBucket * const bucket = rowcache_bucket(shard, hash);
+  bucket->ver++;
+  struct RowItem * iter = bucket->items;
+  while (iter) {
+    struct RowItem * const chain = iter->chain;
+    if (memcmp(iter->hash, hash, HASHBYTES) == 0) {
+      rowcache_unlink(shard, iter);
+      iter->chain = dropped;
+      dropped = iter;
+    }
+    iter = chain;
+  }
+  pthread_rwlock_unlock(&(shard->lock));
+  rowcache_release_chain(dropped);
+}
+
+  void
+rowcache_release(const struct KeyValue * const kv)
+{
+  assert(kv->flags & KV_FLAG_CACHED);
+  struct RowItem * const item = rowcache_item(kv);
+  if (__sync_sub_and_fetch(&(item->refs), 1) == 0) {
+    free(item);
+  }
+}
+
+  void
+rowcache_free(struct RowCache * const rc)
+{
+  for (uint64_t i = 0; i < ROWCACHE_NR_SHARDS; i++) {
+    struct RowShard * const shard = &(rc->shards[i]);
+    struct RowItem * item = shard->head;
+    while (item) {
+      struct RowItem * const next = item->next;
+      assert(item->refs == 1);
+      free(item);
+      item = next;
+    }
+    free(shard->buckets);
+    pthread_rwlock_destroy(&(shard->lock));
+  }
+  free(rc);
+}
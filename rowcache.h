@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "table.h"
+
+// copies of the KeyValues found in the tables, by the hash of their keys.
+// sharded by the hash and bounded in bytes; the least recently put copies go first, unless hit since (a clock).
+// lookups share the lock of a shard.
+// a hit is a reference to the cached copy (KV_FLAG_CACHED), given back with rowcache_release()
+struct RowCache;
+
+// cap: bytes of all the copies
+  struct RowCache *
+rowcache_new(const uint64_t cap);
+
+// taken before the lookup in the tables, given back to rowcache_put()
+  uint64_t
+rowcache_version(struct RowCache * const rc, const uint8_t * const hash);
+
+  const struct KeyValue *
+rowcache_get(struct RowCache * const rc, const uint8_t * const hash, const uint16_t klen,
+    const uint8_t * const key);
+
+// keeps a copy of kv; skipped if the key was invalidated since ver
+  void
+rowcache_put(struct RowCache * const rc, const uint8_t * const hash, const struct KeyValue * const kv,
+    const uint64_t ver);
+
+// after the key is inserted
+  void
+rowcache_invalidate(struct RowCache * const rc, const uint8_t * const hash);
+
+  void
+rowcache_release(const struct KeyValue * const kv);
+
+// the references handed out must have been released
+  void
+rowcache_free(struct RowCache * const rc);
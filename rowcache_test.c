@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <openssl/sha.h>
+
+#include "rowcache.h"
+
+#define RC_TEST_NR_THREADS ((4))
+#define RC_TEST_NR_ROUNDS ((UINT64_C(2000)))
+#define RC_TEST_VLEN ((UINT64_C(100)))
+
+  static void
+rc_test_hash(const uint64_t key, uint8_t * const hash)
+{
+  SHA1((const uint8_t *)(&key), sizeof(key), hash);
+}
+
+// version ver of the value of key
+  static void
+rc_test_kv(const uint64_t * const pkey, const uint64_t ver, uint8_t * const buf, struct KeyValue * const kv)
+{
+  for (uint64_t i = 0; i < RC_TEST_VLEN; i++) {
+    buf[i] = (uint8_t)(((*pkey) * 131u) + (ver * 7u) + i);
+  }
+  memcpy(buf, &ver, sizeof(ver));
+  kv->klen = sizeof(*pkey);
+  kv->flags = 0;
+  kv->vlen = RC_TEST_VLEN;
+  kv->pk = (uint8_t *)pkey;
+  kv->pv = buf;
+}
+
+// the version of a hit, asserted to be a whole value of key
+  static uint64_t
+rc_test_ver(const struct KeyValue * const kv, const uint64_t key)
+{
+  assert(kv->flags & KV_FLAG_CACHED);
+  uint64_t ver;
+  memcpy(&ver, kv->pv, sizeof(ver));
+  uint8_t buf[RC_TEST_VLEN];
+  struct KeyValue kv0;
+  rc_test_kv(&key, ver, buf, &kv0);
+  assert((kv->klen == sizeof(key)) && (memcmp(kv->pk, &key, sizeof(key)) == 0));
+  assert((kv->vlen == RC_TEST_VLEN) && (memcmp(kv->pv, buf, RC_TEST_VLEN) == 0));
+  return ver;
+}
+
+// set, get, overwrite, get again: an overwrite invalidates the key before the new value is put
+  static void
+get_test(void)
+{
+  struct RowCache * const rc = rowcache_new(UINT64_C(4) << 20);
+  uint8_t hash[20] __attribute__((aligned(8)));
+  uint8_t buf[RC_TEST_VLEN];
+  struct KeyValue kv;
+  for (uint64_t k = 0; k < 256; k++) {
+    rc_test_hash(k, hash);
+    assert(rowcache_get(rc, hash, sizeof(k), (const uint8_t *)(&k)) == NULL);
+    rc_test_kv(&k, 0, buf, &kv);
+    rowcache_put(rc, hash, &kv, rowcache_version(rc, hash));
+  }
+  for (uint64_t k = 0; k < 256; k++) {
+    rc_test_hash(k, hash);
+    const struct KeyValue * const kv0 = rowcache_get(rc, hash, sizeof(k), (const uint8_t *)(&k));
+    assert(kv0 && (rc_test_ver(kv0, k) == 0));
+    // other keys of the same hash do not match
+    const uint64_t k1 = k + 1000000;
+    assert(rowcache_get(rc, hash, sizeof(k1), (const uint8_t *)(&k1)) == NULL);
+    rowcache_invalidate(rc, hash);
+    assert(rowcache_get(rc, hash, sizeof(k), (const uint8_t *)(&k)) == NULL);
+    // a reference outlives the invalidation
+    assert(rc_test_ver(kv0, k) == 0);
+    rowcache_release(kv0);
+    rc_test_kv(&k, 1, buf, &kv);
+    rowcache_put(rc, hash, &kv, rowcache_version(rc, hash));
+  }
+  for (uint64_t k = 0; k < 256; k++) {
+    rc_test_hash(k, hash);
+    const struct KeyValue * const kv1 = rowcache_get(rc, hash, sizeof(k), (const uint8_t *)(&k));
+    assert(kv1 && (rc_test_ver(kv1, k) == 1));
+    rowcache_release(kv1);
+  }
+  printf("get_test: passed\n");
+  rowcache_free(rc);
+}
+
+// the shards are 4KB: the early keys are evicted, but one hit after every put keeps key 0
+  static void
+evict_test(void)
+{
+  struct RowCache * const rc = rowcache_new(UINT64_C(256) << 10);
+  uint8_t hash[20] __attribute__((aligned(8)));
+  uint8_t hash0[20] __attribute__((aligned(8)));
+  uint8_t buf[RC_TEST_VLEN];
+  struct KeyValue kv;
+  const uint64_t k0 = 0;
+  rc_test_hash(k0, hash0);
+  rc_test_kv(&k0, 0, buf, &kv);
+  rowcache_put(rc, hash0, &kv, rowcache_version(rc, hash0));
+  const uint64_t nr_keys = 20000;
+  for (uint64_t k = 1; k < nr_keys; k++) {
+    rc_test_hash(k, hash);
+    rc_test_kv(&k, 0, buf, &kv);
+    rowcache_put(rc, hash, &kv, rowcache_version(rc, hash));
+    const struct KeyValue * const kvh = rowcache_get(rc, hash0, sizeof(k0), (const uint8_t *)(&k0));
+    assert(kvh && (rc_test_ver(kvh, k0) == 0));
+    rowcache_release(kvh);
+  }
+  uint64_t nr_kept = 0;
+  for (uint64_t k = 1; k < nr_keys; k++) {
+    rc_test_hash(k, hash);
+    const struct KeyValue * const kvk = rowcache_get(rc, hash, sizeof(k), (const uint8_t *)(&k));
+    if (kvk) {
+      nr_kept++;
+      rowcache_release(kvk);
+    }
+  }
+  assert(nr_kept && (nr_kept < (nr_keys / 4)));
+  printf("evict_test: %lu of %lu keys kept, and the hit one\n", nr_kept, nr_keys);
+  rowcache_free(rc);
+}
+
+struct RCTestShared {
+  struct RowCache * rc;
+  uint64_t round;
+  uint64_t held;  // r + 1: the first thread holds its put of round r until the key is overwritten
+  uint64_t vers[RC_TEST_NR_ROUNDS]; // the version in the tables
+};
+
+struct RCTestArg {
+  struct RCTestShared * shared;
+  uint64_t id;
+};
+
+// a lookup as db_lookup() does it: the version first, then the tables, then the put of what was found
+  static void *
+rc_test_thread(void * const ptr)
+{
+  const struct RCTestArg * const arg = (typeof(arg))ptr;
+  struct RCTestShared * const shared = arg->shared;
+  uint8_t hash[20] __attribute__((aligned(8)));
+  uint8_t buf[RC_TEST_VLEN];
+  struct KeyValue kv;
+  for (;;) {
+    const uint64_t r = __sync_fetch_and_add(&(shared->round), 0);
+    if (r >= RC_TEST_NR_ROUNDS) break;
+    rc_test_hash(r, hash);
+    // the old value is a hit until the overwrite returns
+    const uint64_t v1 = (__sync_fetch_and_add(&(shared->round), 0) > r) ? 1 : 0;
+    const struct KeyValue * const kvh = rowcache_get(shared->rc, hash, sizeof(r), (const uint8_t *)(&r));
+    if (kvh) {
+      assert(rc_test_ver(kvh, r) >= v1);
+      rowcache_release(kvh);
+    }
+    const uint64_t ver = rowcache_version(shared->rc, hash);
+    const uint64_t vt = __sync_fetch_and_add(&(shared->vers[r]), 0);
+    if ((arg->id == 0) && (shared->held != (r + 1u))) {
+      __sync_lock_test_and_set(&(shared->held), r + 1u);
+      while (__sync_fetch_and_add(&(shared->round), 0) == r) sched_yield();
+    }
+    rc_test_kv(&r, vt, buf, &kv);
+    rowcache_put(shared->rc, hash, &kv, ver);
+  }
+  pthread_exit(NULL);
+}
+
+// the lookups race with the overwrite of each key: none is left with the old value after the overwrite
+  static void
+race_test(void)
+{
+  struct RCTestShared * const shared = (typeof(shared))calloc(1, sizeof(*shared));
+  assert(shared);
+  shared->rc = rowcache_new(UINT64_C(16) << 20);
+  pthread_t ths[RC_TEST_NR_THREADS];
+  struct RCTestArg args[RC_TEST_NR_THREADS];
+  for (uint64_t i = 0; i < RC_TEST_NR_THREADS; i++) {
+    args[i].shared = shared;
+    args[i].id = i;
+    pthread_create(&(ths[i]), NULL, rc_test_thread, &(args[i]));
+  }
+  uint8_t hash[20] __attribute__((aligned(8)));
+  for (uint64_t r = 0; r < RC_TEST_NR_ROUNDS; r++) {
+    rc_test_hash(r, hash);
+    // every overwrite lands between a lookup and its put
+    while (__sync_fetch_and_add(&(shared->held), 0) != (r + 1u)) sched_yield();
+    // the overwrite: the new value can be found before the cache is invalidated, see db_insert()
+    __sync_bool_compare_and_swap(&(shared->vers[r]), 0, 1);
+    rowcache_invalidate(shared->rc, hash);
+    __sync_add_and_fetch(&(shared->round), 1);
+  }
+  for (uint64_t i = 0; i < RC_TEST_NR_THREADS; i++) {
+    pthread_join(ths[i], NULL);
+  }
+  uint64_t nr_hits = 0;
+  for (uint64_t r = 0; r < RC_TEST_NR_ROUNDS; r++) {
+    rc_test_hash(r, hash);
+    const struct KeyValue * const kvh = rowcache_get(shared->rc, hash, sizeof(r), (const uint8_t *)(&r));
+    if (kvh) {
+      assert(rc_test_ver(kvh, r) == 1);
+      rowcache_release(kvh);
+      nr_hits++;
+    }
+  }
+  printf("race_test: %lu overwrites, no stale value, %lu new values cached\n", RC_TEST_NR_ROUNDS, nr_hits);
+  rowcache_free(shared->rc);
+  free(shared);
+}
+
+int
+main(int argc, char ** argv)
+{
+  (void)argc;
+  (void)argv;
+  get_test();
+  evict_test();
+  race_test();
+  return 0;
+}
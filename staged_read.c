@@ -40,6 +40,7 @@ struct DBParams {
   char * cm_conf_fn;
   uint64_t nr_readers;
   uint64_t nr_cycle; // *100
+  uint64_t stage_sample; // time the stages of one in this many lookups, 0: off
 };
 
 // single one
@@ -50,7 +51,7 @@ struct TestState {
   uint64_t time_finish;
   uint64_t nr_all;
   uint8_t buf[BARREL_ALIGN];
-  uint32_t * latency;
+  struct Hist * latency;
   bool test_running;
   uint64_t token;
 };
@@ -66,6 +67,7 @@ show_dbparams(const struct DBParams * const ps)
   printf("    -c #cm_conf_fn: %s\n", ps->cm_conf_fn);
   printf("    -a #nr_readers  %lu\n", ps->nr_readers);
   printf("    -n #cycle(*100):%lu\n", ps->nr_cycle);
+  printf("    -s #stage_sample:%lu\n", ps->stage_sample);
   fflush(stdout);
 }
 
@@ -205,6 +207,7 @@ staged_test(const struct DBParams * const p)
   __ts.gc = generator_new_counter(0);
   __ts.db = db_touch(p->meta_dir, p->cm_conf_fn);
   assert(__ts.db);
+  db_stage_sample(__ts.db, p->stage_sample);
   memset(__ts.buf, 0x5au, BARREL_ALIGN);
   staged_worker(p);
   generator_destroy(__ts.gc);
@@ -213,7 +216,7 @@ staged_test(const struct DBParams * const p)
 
 static const uint64_t nr_configs = 1;
 static struct DBParams pstable[] = {
-  {"XX", 100, "dbtmp", "cm_conf1.txt", 16, 10000},
+  {"XX", 100, "dbtmp", "cm_conf1.txt", 16, 10000, 100},
 };
   int
 main(int argc, char ** argv)
@@ -229,6 +232,7 @@ main(int argc, char ** argv)
           "c:" // cm_conf
           "a:" // nr_threads (user threads)
           "n:" // nr_cycle: #keys to insert before each read phase
+          "s:" // stage_sample: time the stages of one in s lookups
           "h"  // help
           "l"  // list pre-defined params
           )) != -1) {
@@ -243,6 +247,7 @@ main(int argc, char ** argv)
       case 'c': ps.cm_conf_fn = strdup(optarg); break;
       case 'a': ps.nr_readers = strtoull(optarg, NULL, 10); break;
       case 'n': ps.nr_cycle   = strtoull(optarg, NULL, 10); break;
+      case 's': ps.stage_sample = strtoull(optarg, NULL, 10); break;
       case 'h': {
                   show_dbparams(&ps);
                   exit(1);
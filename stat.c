@@ -7,6 +7,7 @@
 #define _GNU_SOURCE
 #define _LARGEFILE64_SOURCE
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,18 +15,186 @@
 #include <assert.h>
 #include <inttypes.h>
 
+#include "debug.h"
 #include "stat.h"
 
+#define STAT_NR_WORDS ((sizeof(struct Stat) / sizeof(uint64_t)))
+// the counters come before the hist pointer
+#define STAT_NR_COUNTERS ((offsetof(struct Stat, hist) / sizeof(uint64_t)))
+
+static uint64_t stat_nr_threads = 0;
+static __thread uint64_t stat_shard = STAT_NR_SHARDS;
+
+// threads take the shards in turn; a shard may still be shared by two threads, hence the atomic add
+  static inline uint64_t
+stat_shard_id(void)
+{
+  if (stat_shard == STAT_NR_SHARDS) {
+    stat_shard = __sync_fetch_and_add(&stat_nr_threads, 1) % STAT_NR_SHARDS;
+  }
+  return stat_shard;
+}
+
+  static inline uint64_t
+stat_shard_offset(void)
+{
+  return stat_shard_id() * STAT_NR_WORDS;
+}
+
+  static inline struct StatHist *
+stat_shard_hist(struct Stat * const stats)
+{
+  return &(stats->hist[stat_shard_id() % STAT_HIST_SHARDS]);
+}
+
+  void
+stat_initial(struct Stat * const stats)
+{
+  bzero(stats, sizeof(*stats) * STAT_NR_SHARDS);
+  stats->hist = (typeof(stats->hist))calloc(STAT_HIST_SHARDS, sizeof(stats->hist[0]));
+  assert(stats->hist);
+}
+
+  void
+stat_destroy(struct Stat * const stats)
+{
+  free(stats->hist);
+  stats->hist = NULL;
+}
+
+  void
+stat_clean(struct Stat * const stats)
+{
+  struct StatHist * const hist = stats->hist;
+  bzero(stats, sizeof(*stats) * STAT_NR_SHARDS);
+  bzero(hist, sizeof(*hist) * STAT_HIST_SHARDS);
+  stats->hist = hist;
+}
+
+  void
+stat_inc(uint64_t *const p) { __sync_fetch_and_add(p + stat_shard_offset(), 1); }
+
+  void
+stat_inc_n(uint64_t *const p, const uint64_t n) { __sync_fetch_and_add(p + stat_shard_offset(), n); }
+
+  void
+stat_lat(struct Stat * const stats, const enum StatLat type, const uint64_t usec)
+{
+  hist_record(&(stat_shard_hist(stats)->lat[type]), usec);
+}
+
+  uint64_t
+stat_lat_since(struct Stat * const stats, const enum StatLat type, const uint64_t usec0)
+{
+  const uint64_t usec = debug_time_usec();
+  stat_lat(stats, type, usec - usec0);
+  return usec;
+}
+
+  void
+stat_sum(const struct Stat * const stats, struct Stat * const out)
+{
+  uint64_t * const sum = (typeof(sum))out;
+  bzero(out, sizeof(*out));
+  for (uint64_t i = 0; i < STAT_NR_SHARDS; i++) {
+    const uint64_t * const shard = (const uint64_t *)(&(stats[i]));
+    for (uint64_t j = 0; j < STAT_NR_COUNTERS; j++) {
+      sum[j] += shard[j];
+    }
+  }
+}
+
   void
-stat_inc(uint64_t *const p) { __sync_fetch_and_add(p, 1); }
+stat_hist_sum(const struct Stat * const stats, struct StatHist * const out)
+{
+  bzero(out, sizeof(*out));
+  for (uint64_t i = 0; i < STAT_HIST_SHARDS; i++) {
+    for (uint64_t j = 0; j < STAT_LAT_NR; j++) {
+      hist_merge(&(out->lat[j]), &(stats->hist[i].lat[j]));
+    }
+    for (uint64_t j = 0; j < STAT_STAGE_NR; j++) {
+      hist_merge(&(out->stage[j]), &(stats->hist[i].stage[j]));
+    }
+  }
+}
+
+__thread bool stat_stage_on = false;
+__thread uint64_t stat_stage_ticks[STAT_STAGE_NR];
 
   void
-stat_inc_n(uint64_t *const p, const uint64_t n) { __sync_fetch_and_add(p, n); }
+stat_stage_sample_begin(void)
+{
+  bzero(stat_stage_ticks, sizeof(stat_stage_ticks));
+  stat_stage_on = true;
+}
+
+  void
+stat_stage_sample_end(struct Stat * const stats)
+{
+  stat_stage_on = false;
+  for (uint64_t i = 0; i < STAT_STAGE_NR; i++) {
+    if (stat_stage_ticks[i]) {
+      hist_record(&(stat_shard_hist(stats)->stage[i]), stat_stage_ticks[i]);
+    }
+  }
+}
+
+  void
+stat_diff(const struct Stat * const a, const struct Stat * const b, struct Stat * const out)
+{
+  const uint64_t * const wa = (const uint64_t *)a;
+  const uint64_t * const wb = (const uint64_t *)b;
+  uint64_t * const wo = (typeof(wo))out;
+  bzero(out, sizeof(*out));
+  for (uint64_t j = 0; j < STAT_NR_COUNTERS; j++) {
+    wo[j] = (wa[j] >= wb[j]) ? (wa[j] - wb[j]) : wa[j];
+  }
+}
+
+  void
+stat_hist_diff(const struct StatHist * const a, const struct StatHist * const b, struct StatHist * const out)
+{
+  for (uint64_t j = 0; j < STAT_LAT_NR; j++) {
+    for (uint64_t k = 0; k < HIST_NR_BUCKETS; k++) {
+      const uint64_t ca = a->lat[j].counts[k];
+      const uint64_t cb = b->lat[j].counts[k];
+      out->lat[j].counts[k] = (ca >= cb) ? (ca - cb) : ca;
+    }
+  }
+  for (uint64_t j = 0; j < STAT_STAGE_NR; j++) {
+    for (uint64_t k = 0; k < HIST_NR_BUCKETS; k++) {
+      const uint64_t ca = a->stage[j].counts[k];
+      const uint64_t cb = b->stage[j].counts[k];
+      out->stage[j].counts[k] = (ca >= cb) ? (ca - cb) : ca;
+    }
+  }
+}
+
+static const char * const stat_lat_names[STAT_LAT_NR] = {
+  "get_hit", "get_miss", "set", "set_stall", "comp_feed", "comp_build", "comp_dump", "comp_update",
+  "fetch_barrel", "fetch_bc",
+};
+
+static const char * const stat_stage_names[STAT_STAGE_NR] = {
+  "stage_lock", "stage_hash", "stage_active", "stage_bloom", "stage_bc", "stage_barrel", "stage_overflow",
+  "stage_parse", "stage_vlog", "stage_total",
+};
+
+  const char *
+stat_lat_name(const enum StatLat type)
+{
+  assert(type < STAT_LAT_NR);
+  return stat_lat_names[type];
+}
 
 void
-stat_show(struct Stat * const stat, FILE * const out)
+stat_show(struct Stat * const stats, FILE * const out)
 {
-  const struct Stat snapshot = *stat;
+  struct Stat snapshot;
+  stat_sum(stats, &snapshot);
+  struct StatHist * const hist = (typeof(hist))malloc(sizeof(*hist));
+  assert(hist);
+  stat_hist_sum(stats, hist);
 
   // hit all
   const uint64_t nr_hit_at = snapshot.nr_get_at_hit[0] + snapshot.nr_get_at_hit[1];
@@ -33,7 +202,7 @@ stat_show(struct Stat * const stat, FILE * const out)
   for (int i = 0; i < 64; i++) {
     nr_hit_vc += snapshot.nr_get_vc_hit[i];
   }
-  const uint64_t nr_hit_all = nr_hit_at + nr_hit_vc;
+  const uint64_t nr_hit_all = nr_hit_at + nr_hit_vc + snapshot.nr_get_row;
 
   // bloom
   const uint64_t nr_all_probes = snapshot.nr_false_positive + snapshot.nr_true_positive + snapshot.nr_true_negative;
@@ -42,7 +211,7 @@ stat_show(struct Stat * const stat, FILE * const out)
   const double fprate = fp * 100.0 / ((double)nr_all_probes);
 
   // read
-  const uint64_t nr_fetch_all = snapshot.nr_fetch_barrel + snapshot.nr_fetch_bc;
+  const uint64_t nr_fetch_all = snapshot.nr_fetch_barrel + snapshot.nr_fetch_bc + snapshot.nr_fetch_image;
   const double all_fetch_eff = ((double)nr_hit_vc) * 100.0 / ((double)nr_fetch_all);
   const double read_amp = ((double)nr_fetch_all) / ((double)nr_hit_all);
 
@@ -55,21 +224,45 @@ stat_show(struct Stat * const stat, FILE * const out)
   const uint64_t nr_write_all = snapshot.nr_write_bc + nr_write_table;
   const double write_amp = ((double)nr_write_all) / ((double)snapshot.nr_write[0]);
 
+  // per level (3 bits each), at least 5 and down to the deepest one used
+  int nr_levels = 5;
+  for (int i = nr_levels; (i * 3) < 64; i++) {
+    if (snapshot.nr_get_vc_hit[i * 3] || snapshot.nr_write[i * 3]) {
+      nr_levels = i + 1;
+    }
+  }
+
   fprintf(out, "====STAT====\n");
   if (snapshot.nr_get) {
     fprintf(out, "nr_get                 %10lu\n", snapshot.nr_get);
     fprintf(out, "nr_get_miss            %10lu\n", snapshot.nr_get_miss);
+    if (snapshot.nr_get_neg) {
+      fprintf(out, "nr_get_neg_cached      %10lu\n", snapshot.nr_get_neg);
+    }
+    if (snapshot.nr_get_row) {
+      fprintf(out, "nr_get_row_cached      %10lu\n", snapshot.nr_get_row);
+    }
 
     fprintf(out, "nr_get_at_hit[all,0:1] %10lu %10lu %10lu\n",
         nr_hit_at, snapshot.nr_get_at_hit[0], snapshot.nr_get_at_hit[1]);
-    fprintf(out, "nr_get_vc_hit[all,0:4] %10lu %10lu %10lu %10lu %10lu %10lu\n",
-        nr_hit_vc, snapshot.nr_get_vc_hit[0], snapshot.nr_get_vc_hit[3],
-        snapshot.nr_get_vc_hit[6], snapshot.nr_get_vc_hit[9], snapshot.nr_get_vc_hit[12]);
+    fprintf(out, "nr_get_vc_hit[all,0:%d] %10lu", nr_levels - 1, nr_hit_vc);
+    for (int i = 0; i < nr_levels; i++) {
+      fprintf(out, " %10lu", snapshot.nr_get_vc_hit[i * 3]);
+    }
+    fprintf(out, "\n");
 
     fprintf(out, "nr_hit_all*            %10lu\n", nr_hit_all);
     fprintf(out, "nr_fetch_barrel        %10lu\n", snapshot.nr_fetch_barrel);
     fprintf(out, "nr_fetch_bc            %10lu\n", snapshot.nr_fetch_bc);
     fprintf(out, "nr_fetch_all*          %10lu\n", nr_fetch_all);
+    if (snapshot.nr_fetch_image) {
+      fprintf(out, "nr_fetch_image         %10lu\n", snapshot.nr_fetch_image);
+    }
+    if (snapshot.nr_decompress) {
+      const double usec_avg = ((double)snapshot.usec_decompress) / ((double)snapshot.nr_decompress);
+      fprintf(out, "nr_decompress          %10lu\n", snapshot.nr_decompress);
+      fprintf(out, "decompress_usec[all,avg] %8lu %10.3lf\n", snapshot.usec_decompress, usec_avg);
+    }
 
     fprintf(out, "nr_true_negative       %10lu\n", snapshot.nr_true_negative);
     fprintf(out, "nr_false_positive      %10lu\n", snapshot.nr_false_positive);
@@ -83,117 +276,186 @@ stat_show(struct Stat * const stat, FILE * const out)
     fprintf(out, "nr_set_retry           %10lu\n", snapshot.nr_set_retry);
     fprintf(out, "nr_compaction          %10lu\n", snapshot.nr_compaction);
     fprintf(out, "nr_active_dumped       %10lu\n", snapshot.nr_active_dumped);
+    fprintf(out, "nr_alloc_contig        %10lu\n", snapshot.nr_alloc_contig);
     fprintf(out, "all_dumped*            %10lu\n", all_dumped);
 
-    fprintf(out, "nr_4K_write[table,0:4] %10lu %10lu %10lu %10lu %10lu %10lu\n",
-        nr_write_table, snapshot.nr_write[0], snapshot.nr_write[3],
-        snapshot.nr_write[6], snapshot.nr_write[9], snapshot.nr_write[12]);
+    fprintf(out, "nr_4K_write[table,0:%d] %10lu", nr_levels - 1, nr_write_table);
+    for (int i = 0; i < nr_levels; i++) {
+      fprintf(out, " %10lu", snapshot.nr_write[i * 3]);
+    }
+    fprintf(out, "\n");
     fprintf(out, "nr_4K_write_bc         %10lu\n", snapshot.nr_write_bc);
     fprintf(out, "nr_4K_write_all*       %10lu\n", nr_write_all);
     fprintf(out, "write_amplification*   %10.4lf\n", write_amp);
   }
+  for (int i = 0; i < STAT_LAT_NR; i++) {
+    hist_show(stat_lat_names[i], &(hist->lat[i]), out);
+  }
+  // in ns, of the lookups that went through the stage
+  if (hist_count(&(hist->stage[STAT_STAGE_TOTAL]))) {
+    const double tsc_per_nsec = debug_tsc_per_nsec();
+    for (int i = 0; i < STAT_STAGE_NR; i++) {
+      hist_show_scaled(stat_stage_names[i], &(hist->stage[i]), tsc_per_nsec, "ns", out);
+    }
+  }
+  free(hist);
 }
 
-#define STAT_COUNTER_CAP ((UINT64_C(100000)))
-#define STAT_COUNTER_NUSEC ((UINT64_C(1)))
-  uint32_t*
-latency_initial(void)
+  uint64_t
+hist_index(const uint64_t usec)
+{
+  if (usec < (UINT64_C(1) << HIST_SUB_BITS)) return usec;
+  const uint64_t e = (uint64_t)(63 - __builtin_clzl(usec));
+  const uint64_t index = ((e - HIST_SUB_BITS + 1u) << HIST_SUB_BITS) + ((usec >> (e - HIST_SUB_BITS)) & 15u);
+  return (index < HIST_NR_BUCKETS) ? index : (HIST_NR_BUCKETS - 1u);
+}
+
+  uint64_t
+hist_value(const uint64_t index)
+{
+  if (index < (UINT64_C(1) << HIST_SUB_BITS)) return index;
+  const uint64_t shift = (index >> HIST_SUB_BITS) - 1u;
+  const uint64_t low = (16u + (index & 15u)) << shift;
+  return low + (UINT64_C(1) << shift) - 1u;
+}
+
+  void
+hist_record(struct Hist * const hist, const uint64_t usec)
 {
-  const uint64_t size = sizeof(uint32_t) * STAT_COUNTER_CAP;
-  void *const m = malloc(size);
-  assert(m);
-  bzero(m, size);
-  return (uint32_t *)m;
+  __sync_add_and_fetch(&(hist->counts[hist_index(usec)]), 1);
 }
 
   void
-latency_record(const uint64_t usec, uint32_t *const counters)
+hist_merge(struct Hist * const to, const struct Hist * const from)
 {
-  const uint64_t id = usec/STAT_COUNTER_NUSEC;
-  if (id < STAT_COUNTER_CAP) {
-    __sync_add_and_fetch(&(counters[id]), 1);
+  for (uint64_t i = 0; i < HIST_NR_BUCKETS; i++) {
+    to->counts[i] += from->counts[i];
   }
 }
 
   void
-latency_show(const char * const tag, uint32_t *const counters, FILE * const out)
+hist_take(struct Hist * const to, struct Hist * const from)
 {
-  uint64_t sum = 0;
-  uint64_t max = 0;
-  // sum & max
-  for (uint64_t i = 0; i < STAT_COUNTER_CAP; i++) {
-    if (counters[i] > 0) {
-      sum += counters[i];
-      max = i;
-    }
+  for (uint64_t i = 0; i < HIST_NR_BUCKETS; i++) {
+    to->counts[i] = __atomic_exchange_n(&(from->counts[i]), 0, __ATOMIC_RELAXED);
   }
-  if (sum == 0) return;
-  fprintf(out, "====Latency Stat:%s\n", tag);
-  fprintf(out, "[x<L<x+%lu] %10s %10s\n", STAT_COUNTER_NUSEC, "[COUNT]", "[%]");
+}
 
-  // 1/1024
-  const uint64_t c1 = sum >> 10;
-  const double sumd = (double)sum;
-  const double d1 = sumd * 0.01;
+  uint64_t
+hist_count(const struct Hist * const hist)
+{
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < HIST_NR_BUCKETS; i++) {
+    sum += hist->counts[i];
+  }
+  return sum;
+}
 
-  const uint64_t p95 = (uint64_t)(sumd * 0.95);
-  const uint64_t p99 = (uint64_t)(sumd * 0.99);
-  const uint64_t p999 = (uint64_t)(sumd * 0.999);
-  uint64_t i95=0, i99=0, i999=0;
+  uint64_t
+hist_total(const struct Hist * const hist)
+{
+  uint64_t total = 0;
+  for (uint64_t i = 0; i < HIST_NR_BUCKETS; i++) {
+    if (hist->counts[i] == 0) continue;
+    const uint64_t low = i ? (hist_value(i - 1u) + 1u) : 0;
+    total += hist->counts[i] * ((low + hist_value(i)) / 2u);
+  }
+  return total;
+}
 
+  uint64_t
+hist_percentile(const struct Hist * const hist, const double fraction)
+{
+  const uint64_t sum = hist_count(hist);
+  if (sum == 0) return 0;
+  const uint64_t target = (uint64_t)(((double)sum) * fraction);
   uint64_t count = 0;
-  for (uint64_t i = 0; i < STAT_COUNTER_CAP; i++) {
-    if (counters[i] > 0) {
-      count += counters[i];
-    }
-
-    if (count && (count >= p95) && (i95 == 0)) i95 = i;
-    if (count && (count >= p99) && (i99 == 0)) i99 = i;
-    if (count && (count >= p999) && (i999 == 0)) i999 = i;
-
-    if (counters[i] > c1) {
-      const double p = ((double)counters[i]) / d1;
-      fprintf(out, "%10lu %10u %10.3lf\n", i * STAT_COUNTER_NUSEC, counters[i], p);
-    }
+  for (uint64_t i = 0; i < HIST_NR_BUCKETS; i++) {
+    count += hist->counts[i];
+    if (count && (count >= target)) return hist_value(i);
   }
-  fprintf(out, "%6s  %8lu us\n%6s  %8lu us\n%6s  %8lu us\n%6s  %8lu us\n",
-      "MAX", max * STAT_COUNTER_NUSEC, "95%", i95 * STAT_COUNTER_NUSEC,
-      "99%", i99 * STAT_COUNTER_NUSEC, "99.9%", i999 * STAT_COUNTER_NUSEC);
+  return hist_value(HIST_NR_BUCKETS - 1u);
 }
 
   void
-latency_95_99_999(uint32_t * const counters, FILE * const out)
+hist_show_scaled(const char * const tag, const struct Hist * const hist, const double scale, const char * const unit,
+    FILE * const out)
 {
   uint64_t sum = 0;
-  uint64_t max = 0;
-  // sum & max
-  for (uint64_t i = 0; i < STAT_COUNTER_CAP; i++) {
-    if (counters[i] > 0) {
-      sum += counters[i];
-      max = i;
-    }
+  double total = 0.0;
+  for (uint64_t i = 0; i < HIST_NR_BUCKETS; i++) {
+    sum += hist->counts[i];
+    total += ((double)hist->counts[i]) * ((double)hist_value(i));
   }
   if (sum == 0) return;
+  fprintf(out, "%-12s %10lu avg %8.1lf p50 %8.0lf p95 %8.0lf p99 %8.0lf p99.9 %8.0lf max %8.0lf %s\n", tag, sum,
+      total / ((double)sum) / scale, ((double)hist_percentile(hist, 0.5)) / scale,
+      ((double)hist_percentile(hist, 0.95)) / scale, ((double)hist_percentile(hist, 0.99)) / scale,
+      ((double)hist_percentile(hist, 0.999)) / scale, ((double)hist_percentile(hist, 1.0)) / scale, unit);
+}
 
-  // 1/1024
-  const double sumd = (double)sum;
+  void
+hist_show(const char * const tag, const struct Hist * const hist, FILE * const out)
+{
+  hist_show_scaled(tag, hist, 1.0, "us", out);
+}
 
-  const uint64_t p95 = (uint64_t)(sumd * 0.95);
-  const uint64_t p99 = (uint64_t)(sumd * 0.99);
-  const uint64_t p999 = (uint64_t)(sumd * 0.999);
-  uint64_t i95=0, i99=0, i999=0;
+  struct Hist *
+latency_initial(void)
+{
+  struct Hist * const hist = (typeof(hist))malloc(sizeof(*hist));
+  assert(hist);
+  bzero(hist, sizeof(*hist));
+  return hist;
+}
 
-  uint64_t count = 0;
-  for (uint64_t i = 0; i < STAT_COUNTER_CAP; i++) {
-    if (counters[i] > 0) {
-      count += counters[i];
-    }
+  void
+latency_record(const uint64_t usec, struct Hist * const hist)
+{
+  hist_record(hist, usec);
+}
 
-    if (count && (count >= p95) && (i95 == 0)) i95 = i;
-    if (count && (count >= p99) && (i99 == 0)) i99 = i;
-    if (count && (count >= p999) && (i999 == 0)) i999 = i;
+  void
+latency_show(const char * const tag, struct Hist * const hist, FILE * const out)
+{
+  const uint64_t sum = hist_count(hist);
+  if (sum == 0) return;
+  fprintf(out, "====Latency Stat:%s\n", tag);
+  fprintf(out, "[L<=x]     %10s %10s\n", "[COUNT]", "[%]");
+
+  // 1/1024
+  const uint64_t c1 = sum >> 10;
+  const double d1 = ((double)sum) * 0.01;
+  for (uint64_t i = 0; i < HIST_NR_BUCKETS; i++) {
+    if (hist->counts[i] > c1) {
+      const double p = ((double)hist->counts[i]) / d1;
+      fprintf(out, "%10lu %10lu %10.3lf\n", hist_value(i), hist->counts[i], p);
+    }
   }
+  fprintf(out, "%6s  %8lu us\n%6s  %8lu us\n%6s  %8lu us\n%6s  %8lu us\n",
+      "MAX", hist_percentile(hist, 1.0), "95%", hist_percentile(hist, 0.95),
+      "99%", hist_percentile(hist, 0.99), "99.9%", hist_percentile(hist, 0.999));
+}
+
+  void
+latency_95_99_999(struct Hist * const hist, FILE * const out)
+{
+  if (hist_count(hist) == 0) return;
   fprintf(out, "%s %6lu %s %6lu %s %6lu %s %6lu\n",
-      "MAX", max * STAT_COUNTER_NUSEC, "95%", i95 * STAT_COUNTER_NUSEC,
-      "99%", i99 * STAT_COUNTER_NUSEC, "99.9%", i999 * STAT_COUNTER_NUSEC);
+      "MAX", hist_percentile(hist, 1.0), "95%", hist_percentile(hist, 0.95),
+      "99%", hist_percentile(hist, 0.99), "99.9%", hist_percentile(hist, 0.999));
+}
+
+  uint64_t
+latency_percentile(struct Hist * const hist, const double fraction)
+{
+  return hist_percentile(hist, fraction);
+}
+
+  void
+latency_reset(struct Hist * const hist)
+{
+  for (uint64_t i = 0; i < HIST_NR_BUCKETS; i++) {
+    __atomic_store_n(&(hist->counts[i]), 0, __ATOMIC_RELAXED);
+  }
 }
@@ -6,48 +6,232 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 
+#include "debug.h"
+
+// counters are sharded by thread: an owner keeps STAT_NR_SHARDS Stats in a row and passes the first,
+// stat_inc() adds to the slot of the calling thread and stat_sum() adds them up.
+// the histograms are too large for that and are sharded fewer ways, see struct StatHist
+#define STAT_NR_SHARDS ((32))
+
+// the counters of lookups; build with -DSTAT_HOT=0 to leave them out
+#ifndef STAT_HOT
+#define STAT_HOT ((1))
+#endif
+
+#define stat_hot_inc(p) do { if (STAT_HOT) stat_inc(p); } while (0)
+#define stat_hot_inc_n(p, n) do { if (STAT_HOT) stat_inc_n((p), (n)); } while (0)
+
+// log-linear histogram of microseconds: exact below 16us, then 16 buckets for each power of two,
+// so a value is off by at most 1/16; covers 2^36us. histograms merge by adding the counts
+#define HIST_SUB_BITS ((4))
+#define HIST_NR_BUCKETS ((528))
+
+struct Hist {
+  uint64_t counts[HIST_NR_BUCKETS];
+};
+
+// the latency histograms of struct Stat
+enum StatLat {
+  STAT_LAT_GET_HIT = 0,
+  STAT_LAT_GET_MISS,
+  STAT_LAT_SET,         // a db_multi_insert() counts as one
+  STAT_LAT_SET_STALL,   // waits for a free active table
+  STAT_LAT_COMP_FEED,   // compaction phases; a leaf compaction has one of each per round
+  STAT_LAT_COMP_BUILD,
+  STAT_LAT_COMP_DUMP,
+  STAT_LAT_COMP_UPDATE,
+  STAT_LAT_FETCH_BARREL,
+  STAT_LAT_FETCH_BC,
+  STAT_LAT_NR,
+};
+
+// the stages of a lookup, timed for one in stage_sample lookups; see stat_stage_end()
+enum StatStage {
+  STAT_STAGE_LOCK = 0,      // rwlock_reader_lock()
+  STAT_STAGE_HASH,          // SHA1
+  STAT_STAGE_ACTIVE,        // the active tables
+  STAT_STAGE_BLOOM,         // bloom-filter checks of the tables and BloomContainers
+  STAT_STAGE_FETCH_BC,      // reading a BloomContainer page
+  STAT_STAGE_FETCH_BARREL,  // reading the first barrel
+  STAT_STAGE_FETCH_OVERFLOW, // reading the barrels an item overflowed to
+  STAT_STAGE_PARSE,         // searching a barrel and copying the item out
+  STAT_STAGE_VLOG,          // reading a separated value
+  STAT_STAGE_TOTAL,
+  STAT_STAGE_NR,
+};
+
 struct Stat {
   uint64_t nr_get;
   uint64_t nr_get_miss;
+  uint64_t nr_get_neg;  // misses answered by the negative cache, see negcache.h
+  uint64_t nr_get_row;  // hits in the row cache, see rowcache.h
   uint64_t nr_get_at_hit[2];
-  uint64_t nr_get_vc_hit[64];
+  uint64_t nr_get_vc_hit[64]; // by start_bit, see stat_show()
 
   uint64_t nr_fetch_barrel;
   uint64_t nr_fetch_bc;
+  uint64_t nr_fetch_image;  // barrels read from the memory of a new table, see MetaTable.image
+  uint64_t nr_decompress;   // compressed barrels read by lookups
+  uint64_t usec_decompress;
 
   uint64_t nr_true_negative;
   uint64_t nr_false_positive;
   uint64_t nr_true_positive;
+  uint64_t nr_bc_negative[64]; // by start_bit: tables ruled out by the BloomContainer
+  uint64_t nr_bc_false[64];    // by start_bit: tables read past the BloomContainer without the key
+  uint64_t nr_table_lookup[64]; // by start_bit: table lookups past the bloom-filters
+  uint64_t nr_table_read[64];   // by start_bit: barrels they read
 
   uint64_t nr_set;
   uint64_t nr_set_retry;
 
   uint64_t nr_compaction;
   uint64_t nr_active_dumped;
+  uint64_t nr_alloc_contig; // compactions with adjacent output tables
 
-  uint64_t nr_write[64];
+  uint64_t nr_write[64];      // by start_bit
   uint64_t nr_write_bc;
+
+  // the first shard only, not a counter: STAT_HIST_SHARDS of them, see stat_initial()
+  struct StatHist * hist;
+} __attribute__ ((aligned(64)));
+
+// a thread records into the histograms of stat shard % STAT_HIST_SHARDS
+#define STAT_HIST_SHARDS ((4))
+
+struct StatHist {
+  struct Hist lat[STAT_LAT_NR]; // by enum StatLat
+  struct Hist stage[STAT_STAGE_NR]; // debug_tsc() ticks by enum StatStage, a sum for each sampled lookup
 };
 
+// stats: STAT_NR_SHARDS in a row, zeroed, with the histograms on the heap
+  void
+stat_initial(struct Stat * const stats);
+
+  void
+stat_destroy(struct Stat * const stats);
+
+// zero the counters and the histograms
+  void
+stat_clean(struct Stat * const stats);
+
   void
 stat_inc(uint64_t *const p);
 
   void
 stat_inc_n(uint64_t *const p, const uint64_t n);
 
+// record usec in the histogram of the operation
+  void
+stat_lat(struct Stat * const stats, const enum StatLat type, const uint64_t usec);
+
+// record the time since usec0 and return the current time, to chain the phases of an operation
+  uint64_t
+stat_lat_since(struct Stat * const stats, const enum StatLat type, const uint64_t usec0);
+
+// the stages of the lookup in progress on this thread
+extern __thread bool stat_stage_on;
+extern __thread uint64_t stat_stage_ticks[STAT_STAGE_NR];
+
+// t0 = stat_stage_begin(); ...; stat_stage_end(STAT_STAGE_X, t0); nothing unless the lookup is sampled
+  static inline uint64_t
+stat_stage_begin(void)
+{
+  return (STAT_HOT && stat_stage_on) ? debug_tsc() : 0;
+}
+
+  static inline void
+stat_stage_end(const enum StatStage stage, const uint64_t t0)
+{
+  if (STAT_HOT && stat_stage_on) stat_stage_ticks[stage] += (debug_tsc() - t0);
+}
+
+// time the stages of the next lookup on this thread
   void
-stat_show(struct Stat * const stat, FILE * const out);
+stat_stage_sample_begin(void);
 
-uint32_t*
+// record the stages into the histograms
+  void
+stat_stage_sample_end(struct Stat * const stats);
+
+// stats: STAT_NR_SHARDS in a row; the counters only, out->hist is NULL
+  void
+stat_sum(const struct Stat * const stats, struct Stat * const out);
+
+  void
+stat_hist_sum(const struct Stat * const stats, struct StatHist * const out);
+
+// out = a - b, for the counts of an interval; a count below that of b was cleaned in between and is taken whole
+  void
+stat_diff(const struct Stat * const a, const struct Stat * const b, struct Stat * const out);
+
+  void
+stat_hist_diff(const struct StatHist * const a, const struct StatHist * const b, struct StatHist * const out);
+
+  const char *
+stat_lat_name(const enum StatLat type);
+
+  void
+stat_show(struct Stat * const stats, FILE * const out);
+
+  uint64_t
+hist_index(const uint64_t usec);
+
+// the largest value of the bucket
+  uint64_t
+hist_value(const uint64_t index);
+
+// thread-safe
+  void
+hist_record(struct Hist * const hist, const uint64_t usec);
+
+  void
+hist_merge(struct Hist * const to, const struct Hist * const from);
+
+// moves the counts of from into to; each bucket is swapped with 0 atomically, so a concurrent
+// hist_record() lands in one of the two and is never lost
+  void
+hist_take(struct Hist * const to, struct Hist * const from);
+
+  uint64_t
+hist_count(const struct Hist * const hist);
+
+// the latency in us at the given fraction (0.99: p99) of the samples; 0 if there are none
+  uint64_t
+hist_percentile(const struct Hist * const hist, const double fraction);
+
+// the sum of the values, each taken at the middle of its bucket
+  uint64_t
+hist_total(const struct Hist * const hist);
+
+// one line: count, average, p50, p95, p99, p99.9 and max; nothing if empty
+  void
+hist_show(const char * const tag, const struct Hist * const hist, FILE * const out);
+
+// the same with the values divided by scale
+  void
+hist_show_scaled(const char * const tag, const struct Hist * const hist, const double scale, const char * const unit,
+    FILE * const out);
+
+// a Hist on the heap, for the test programs
+  struct Hist *
 latency_initial(void);
 
   void
-latency_record(const uint64_t usec, uint32_t *const counters);
+latency_record(const uint64_t usec, struct Hist * const hist);
 
   void
-latency_show(const char * const tag, uint32_t *const counters, FILE * const out);
+latency_show(const char * const tag, struct Hist * const hist, FILE * const out);
+
+  void
+latency_95_99_999(struct Hist * const hist, FILE * const out);
+
+  uint64_t
+latency_percentile(struct Hist * const hist, const double fraction);
 
+// safe against concurrent latency_record(), bucket by bucket
   void
-latency_95_99_999(uint32_t * const counters, FILE * const out);
+latency_reset(struct Hist * const hist);
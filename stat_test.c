@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "stat.h"
+
+#define STAT_TEST_NR_THREADS ((8))
+#define STAT_TEST_NR_RECORDS ((UINT64_C(100000)))
+
+// a value falls in the bucket whose largest value is the first one not below it, off by at most 1/16
+  static void
+index_check(const uint64_t usec)
+{
+  const uint64_t index = hist_index(usec);
+  const uint64_t value = hist_value(index);
+  assert(value >= usec);
+  assert((index == 0) || (hist_value(index - 1u) < usec));
+  assert((value - usec) <= (usec >> HIST_SUB_BITS));
+}
+
+  static void
+index_test(void)
+{
+  for (uint64_t i = 0; i < (UINT64_C(1) << HIST_SUB_BITS); i++) {
+    assert(hist_index(i) == i);
+    assert(hist_value(i) == i);
+  }
+  uint64_t last = 0;
+  for (uint64_t i = 0; i < (UINT64_C(1) << 20); i++) {
+    index_check(i);
+    const uint64_t index = hist_index(i);
+    assert((index == last) || (index == (last + 1u)));
+    last = index;
+  }
+  // the edges of each power of two up to the largest bucket
+  for (uint64_t e = 20; e < 36; e++) {
+    const uint64_t p = UINT64_C(1) << e;
+    index_check(p - 1u);
+    index_check(p);
+    index_check(p + 1u);
+    index_check(p + (p >> 1));
+  }
+  assert(hist_index(UINT64_C(1) << 36) == (HIST_NR_BUCKETS - 1u));
+  assert(hist_index(UINT64_MAX) == (HIST_NR_BUCKETS - 1u));
+  printf("index_test: %u buckets up to %lu us\n", HIST_NR_BUCKETS, hist_value(HIST_NR_BUCKETS - 1u));
+}
+
+// within 1/16 of the exact percentile, rounded up
+  static void
+percentile_check(const struct Hist * const hist, const double fraction, const uint64_t exact)
+{
+  const uint64_t p = hist_percentile(hist, fraction);
+  assert((p >= exact) && ((p - exact) <= (exact >> HIST_SUB_BITS)));
+}
+
+  static void
+percentile_test(void)
+{
+  struct Hist hist = {};
+  assert(hist_percentile(&hist, 0.99) == 0);
+  assert(hist_count(&hist) == 0);
+  hist_record(&hist, 7);
+  assert(hist_percentile(&hist, 0.0) == 7);
+  assert(hist_percentile(&hist, 1.0) == 7);
+  // 1 to 10000
+  bzero(&hist, sizeof(hist));
+  for (uint64_t i = 1; i <= 10000; i++) {
+    hist_record(&hist, i);
+  }
+  assert(hist_count(&hist) == 10000);
+  percentile_check(&hist, 0.5, 5000);
+  percentile_check(&hist, 0.99, 9900);
+  percentile_check(&hist, 0.999, 9990);
+  percentile_check(&hist, 1.0, 10000);
+  // a tail: 99% at 10us, 1% at 100ms
+  bzero(&hist, sizeof(hist));
+  for (uint64_t i = 0; i < 1000; i++) {
+    hist_record(&hist, (i < 990) ? 10 : 100000);
+  }
+  assert(hist_percentile(&hist, 0.5) == 10);
+  assert(hist_percentile(&hist, 0.99) == 10);
+  percentile_check(&hist, 0.995, 100000);
+  printf("percentile_test: p50 %lu p99 %lu p99.9 %lu\n", hist_percentile(&hist, 0.5), hist_percentile(&hist, 0.99),
+      hist_percentile(&hist, 0.999));
+}
+
+// the sum is taken at the bucket middles: exact below 16us, within 1/32 above
+  static void
+total_test(void)
+{
+  struct Hist hist = {};
+  assert(hist_total(&hist) == 0);
+  uint64_t exact = 0;
+  for (uint64_t i = 0; i < 16; i++) {
+    hist_record(&hist, i);
+    exact += i;
+  }
+  assert(hist_total(&hist) == exact);
+  for (uint64_t i = 16; i <= 100000; i += 7) {
+    hist_record(&hist, i);
+    exact += i;
+  }
+  const uint64_t total = hist_total(&hist);
+  const uint64_t err = (total > exact) ? (total - exact) : (exact - total);
+  assert(err <= (exact >> 5));
+  printf("total_test: %lu at the bucket middles, %lu exact\n", total, exact);
+}
+
+// an interval across a stat_clean() counts from 0 instead of wrapping around
+  static void
+diff_test(void)
+{
+  struct Stat a = {};
+  struct Stat b = {};
+  struct Stat d;
+  a.nr_get = 100;
+  b.nr_get = 40;
+  a.nr_set = 5;
+  b.nr_set = 9;
+  stat_diff(&a, &b, &d);
+  assert((d.nr_get == 60) && (d.nr_set == 5));
+  struct StatHist * const ha = (typeof(ha))calloc(3, sizeof(*ha));
+  assert(ha);
+  struct StatHist * const hb = ha + 1;
+  struct StatHist * const hd = ha + 2;
+  hist_record(&(ha->lat[STAT_LAT_SET]), 10);
+  hist_record(&(ha->lat[STAT_LAT_SET]), 10);
+  hist_record(&(hb->lat[STAT_LAT_SET]), 10);
+  hist_record(&(hb->lat[STAT_LAT_SET]), 20);
+  stat_hist_diff(ha, hb, hd);
+  assert(hist_count(&(hd->lat[STAT_LAT_SET])) == 1);
+  assert(hd->lat[STAT_LAT_SET].counts[hist_index(10)] == 1);
+  assert(hd->lat[STAT_LAT_SET].counts[hist_index(20)] == 0);
+  free(ha);
+  printf("diff_test: passed\n");
+}
+
+struct StatTestShared {
+  struct Stat stat[STAT_NR_SHARDS];
+  struct Hist hist;
+};
+
+  static void *
+stat_test_thread(void * const ptr)
+{
+  struct StatTestShared * const shared = (typeof(shared))ptr;
+  for (uint64_t i = 0; i < STAT_TEST_NR_RECORDS; i++) {
+    stat_lat(shared->stat, STAT_LAT_GET_HIT, i & 1023u);
+    stat_inc(&(shared->stat->nr_get));
+    hist_record(&(shared->hist), i & 1023u);
+  }
+  pthread_exit(NULL);
+}
+
+// the threads record into the shards while the main thread takes the shared histogram away:
+// every record is counted once, in the taken or the remaining counts
+  static void
+shard_test(void)
+{
+  struct StatTestShared * const shared = (typeof(shared))aligned_alloc(64, sizeof(*shared)); // for the stat shards
+  assert(shared);
+  bzero(shared, sizeof(*shared));
+  stat_initial(shared->stat);
+  pthread_t ths[STAT_TEST_NR_THREADS];
+  for (uint64_t i = 0; i < STAT_TEST_NR_THREADS; i++) {
+    pthread_create(&(ths[i]), NULL, stat_test_thread, shared);
+  }
+  struct Hist taken = {};
+  uint64_t nr_taken = 0;
+  for (uint64_t i = 0; i < 100; i++) {
+    hist_take(&taken, &(shared->hist));
+    nr_taken += hist_count(&taken);
+    usleep(100);
+  }
+  for (uint64_t i = 0; i < STAT_TEST_NR_THREADS; i++) {
+    pthread_join(ths[i], NULL);
+  }
+  const uint64_t nr_all = STAT_TEST_NR_THREADS * STAT_TEST_NR_RECORDS;
+  assert((nr_taken + hist_count(&(shared->hist))) == nr_all);
+
+  struct Stat sum;
+  stat_sum(shared->stat, &sum);
+  assert((sum.nr_get == nr_all) && (sum.hist == NULL));
+  struct StatHist * const sh = (typeof(sh))malloc(sizeof(*sh));
+  assert(sh);
+  stat_hist_sum(shared->stat, sh);
+  assert(hist_count(&(sh->lat[STAT_LAT_GET_HIT])) == nr_all);
+  assert(hist_count(&(sh->lat[STAT_LAT_GET_MISS])) == 0);
+  percentile_check(&(sh->lat[STAT_LAT_GET_HIT]), 1.0, 1023);
+
+  stat_clean(shared->stat);
+  stat_sum(shared->stat, &sum);
+  stat_hist_sum(shared->stat, sh);
+  assert((sum.nr_get == 0) && (hist_count(&(sh->lat[STAT_LAT_GET_HIT])) == 0));
+  printf("shard_test: %lu records, %lu taken on the fly, %zu bytes of counters per shard\n", nr_all, nr_taken,
+      sizeof(struct Stat));
+  free(sh);
+  stat_destroy(shared->stat);
+  free(shared);
+}
+
+int
+main(int argc, char ** argv)
+{
+  (void)argc;
+  (void)argv;
+  index_test();
+  percentile_test();
+  total_test();
+  diff_test();
+  shard_test();
+  return 0;
+}
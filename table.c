@@ -8,6 +8,7 @@
 #define _LARGEFILE64_SOURCE
 
 #include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -21,6 +22,10 @@
 #include <openssl/sha.h>
 #include <inttypes.h>
 #include <malloc.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include <errno.h>
 
 #include "coding.h"
 #include "mempool.h"
@@ -32,8 +37,25 @@
 
 #define BARREL_CAP ((BARREL_ALIGN - sizeof(struct MetaIndex)))
 #define TABLE_VOLUME_PERCENT ((0.75))  // reduce this for large values
+// a table is full once its overflow is over 1/TABLE_OVER_RATIO of the free space, see table_full()
+#define TABLE_OVER_RATIO ((UINT64_C(2)))
 #define METAINDEX_PERCENT ((0.99))
 #define METAINDEX_MAX_NR ((UINT64_C(2048)))
+// larger items go to the value log, see table_kv_fits()
+#define ITEM_MAX_VOLUME ((BARREL_CAP / 2))
+// the encoded vlen of a ValuePtr item carries this bit
+#define RAW_VLEN_VPTR ((UINT16_C(0x8000)))
+// a compressed barrel holds at most this many raw bytes
+#define BARREL_RAW_MAX ((BARREL_CAP * 4))
+// compressed barrel: [codec:u8][clen:u16][rlen:u16][clen bytes]
+// the codec byte carries BARREL_ZDICT if the table's dictionary is used
+#define BARREL_ZDICT ((UINT8_C(0x80)))
+#define BARREL_ZHDR ((UINT64_C(5)))
+#define BARREL_ZBOUND ((BARREL_RAW_MAX + BARREL_ALIGN))
+// set in the id of the on-disk MetaIndex of a compressed barrel
+#define METAINDEX_ZIP ((UINT16_C(0x8000)))
+// set in the rid when items of hash min are on both sides; without it, hash min stays in the barrel
+#define METAINDEX_TIE ((UINT16_C(0x8000)))
 
 struct Item {
   struct Item * next;
@@ -41,6 +63,7 @@ struct Item {
   uint16_t volume;
   uint16_t klen;
   uint16_t vlen;
+  uint16_t flags; // KV_FLAG_*
   uint8_t hash[HASHBYTES];
   uint8_t kv[]; // len(kv) == klen + vlen
 };
@@ -49,6 +72,7 @@ struct Item {
 struct RawItem {
   uint16_t klen;
   uint16_t vlen;
+  uint16_t flags;
   const uint8_t *pk;
   const uint8_t *pv;
   const uint8_t *limit;
@@ -62,7 +86,9 @@ struct Barrel {  // a barrel of items
   uint16_t id;
   uint16_t rid; // == id if no overflown
   uint16_t nr_out;
+  uint16_t size; // bytes in the slot, see barrel_size()
   uint32_t min;
+  bool tie;      // items of hash min moved out too
 };
 
 struct MetaIndex {
@@ -89,7 +115,7 @@ item_hash_bf(const struct Item * const item)
   static uint32_t
 __hash_order(const uint8_t * const hash, const uint16_t bid)
 {
-  assert(bid < TABLE_NR_BARRELS);
+  assert(bid < TABLE_LIMIT_BARRELS);
   const uint32_t * const phv = (typeof(phv))(&(hash[12]));
   const uint32_t hv = *phv;
   const uint16_t shift = bid % (sizeof(hv) * 8); // % 32
@@ -134,7 +160,8 @@ item_identical_key(const uint16_t klen, const uint8_t * const pk, const struct I
   return (memcmp(pk, i->kv, klen) == 0) ? true : false;
 }
 
-  static uint16_t
+// return the removed item or NULL
+  static struct Item *
 item_erase(struct Item ** const items, struct Item * const item)
 {
   struct Item **iter = items;
@@ -142,26 +169,26 @@ item_erase(struct Item ** const items, struct Item * const item)
     const bool identical = item_identical(*iter, item);
     if (identical) {
       // remove
-      const uint16_t victim_volume = (*iter)->volume;
+      struct Item * const victim = *iter;
       *iter = (*iter)->next;
-      return victim_volume;
+      return victim;
     }
     iter = &((*iter)->next);
   }
-  return 0;
+  return NULL;
 }
 
-// return 0 if no eviction
-// return the length of the victim item if replaced
-  static inline uint16_t
+// return NULL if no eviction
+// return the victim item if replaced
+  static inline struct Item *
 item_insert(struct Item ** const items, struct Item * const item)
 {
   // erase (one) identical item
-  const uint16_t victim_volume = item_erase(items, item);
+  struct Item * const victim = item_erase(items, item);
   // insert in front
   item->next = *items;
   (*items) = item;
-  return victim_volume;
+  return victim;
 }
 
   static struct Item *
@@ -187,7 +214,8 @@ item_encode(struct Item * item, uint8_t * const ptr)
   memcpy(pk, item->kv, item->klen);
 
   uint8_t * const pvlen = pk + item->klen;
-  uint8_t * const pv = encode_uint16(pvlen, item->vlen);
+  const uint16_t raw_vlen = (item->flags & KV_FLAG_VPTR) ? (item->vlen | RAW_VLEN_VPTR) : item->vlen;
+  uint8_t * const pv = encode_uint16(pvlen, raw_vlen);
   memcpy(pv, item->kv + item->klen, item->vlen);
 
   uint8_t * const pnext = pv + item->vlen;
@@ -203,6 +231,7 @@ item_to_keyvalue(struct Item * const item)
   struct KeyValue * const kv = (typeof(kv))malloc(msize);
   assert(kv);
   kv->klen = item->klen;
+  kv->flags = item->flags;
   kv->vlen = item->vlen;
   kv->pk = kv->kv;
   kv->pv = kv->kv + kv->klen;
@@ -211,7 +240,7 @@ item_to_keyvalue(struct Item * const item)
 }
 
   static bool
-rawitem_init(struct RawItem * const raw, const uint8_t * const ptr)
+rawitem_init(struct RawItem * const raw, const uint8_t * const ptr, const uint64_t len)
 {
   assert(raw);
   assert(ptr);
@@ -225,10 +254,11 @@ rawitem_init(struct RawItem * const raw, const uint8_t * const ptr)
   const uint8_t * const pv = decode_uint16(pvlen, &vlen);
   // assume pv is ok
   raw->klen = klen;
-  raw->vlen = vlen;
+  raw->vlen = vlen & (~RAW_VLEN_VPTR);
+  raw->flags = (vlen & RAW_VLEN_VPTR) ? KV_FLAG_VPTR : 0;
   raw->pk = pk;
   raw->pv = pv;
-  raw->limit = ptr + ((long)BARREL_CAP);
+  raw->limit = ptr + ((long)len);
   return true;
 }
 
@@ -250,7 +280,8 @@ rawitem_next(struct RawItem * const rawitem)
   const uint8_t * const pv = decode_uint16(pvlen, &vlen);
   // assume pv is ok
   rawitem->klen = klen;
-  rawitem->vlen = vlen;
+  rawitem->vlen = vlen & (~RAW_VLEN_VPTR);
+  rawitem->flags = (vlen & RAW_VLEN_VPTR) ? KV_FLAG_VPTR : 0;
   rawitem->pk = pk;
   rawitem->pv = pv;
   return true;
@@ -264,6 +295,7 @@ rawitem_to_keyvalue(struct RawItem * const ri)
   struct KeyValue * const kv = (typeof(kv))malloc(msize);
   assert(kv);
   kv->klen = ri->klen;
+  kv->flags = ri->flags;
   kv->vlen = ri->vlen;
   kv->pk = kv->kv;
   kv->pv = kv->kv + kv->klen;
@@ -272,6 +304,17 @@ rawitem_to_keyvalue(struct RawItem * const ri)
   return kv;
 }
 
+// encoded size
+  static uint64_t
+item_volume(const uint64_t klen, const uint64_t vlen, const uint16_t flags)
+{
+  uint8_t buf[16];
+  const uint16_t raw_vlen = (flags & KV_FLAG_VPTR) ? (((uint16_t)vlen) | RAW_VLEN_VPTR) : ((uint16_t)vlen);
+  uint8_t * const p1 = encode_uint16(buf, (uint16_t)klen);
+  uint8_t * const p2 = encode_uint16(p1, raw_vlen);
+  return klen + vlen + (p2 - buf);
+}
+
 // no hash!
   static struct Item *
 rawitem_to_item(const struct RawItem * const ri, struct Mempool * const mempool, const uint8_t * const hash)
@@ -284,6 +327,7 @@ rawitem_to_item(const struct RawItem * const ri, struct Mempool * const mempool,
   // rb leave empty
   item->klen = ri->klen;
   item->vlen = ri->vlen;
+  item->flags = ri->flags;
   memcpy(item->kv, ri->pk, item->klen);
   memcpy(item->kv + item->klen, ri->pv, item->vlen);
   // SHA1
@@ -292,35 +336,33 @@ rawitem_to_item(const struct RawItem * const ri, struct Mempool * const mempool,
   } else {
     SHA1(item->kv, item->klen, item->hash);
   }
-  uint8_t buf[16];
-  uint8_t * const p1 = encode_uint16(buf, item->klen);
-  uint8_t * const p2 = encode_uint16(p1, item->vlen);
-  const uint16_t volume = item->klen + item->vlen + (p2 - buf);
-  item->volume = volume;
+  item->volume = item_volume(item->klen, item->vlen, item->flags);
   return item;
 }
 
-// for insert
+// for insert; hash: of the key, computed if NULL
   static struct Item *
-keyvalue_to_item(const struct KeyValue * const kv, struct Mempool * const mempool)
+keyvalue_to_item(const struct KeyValue * const kv, struct Mempool * const mempool, const uint8_t * const hash)
 {
   assert(mempool);
+  assert(table_kv_fits(kv));
   const size_t msize = sizeof(struct Item) + kv->klen + kv->vlen;
   struct Item * const item = (typeof(item))mempool_alloc(mempool, msize);
   if (item == NULL) return NULL;
   bzero(item, msize);
   // rb leave empty
   item->klen = kv->klen;
-  item->vlen = kv->vlen;
+  item->vlen = (uint16_t)kv->vlen;
+  item->flags = kv->flags & KV_FLAG_VPTR;
   memcpy(item->kv, kv->pk, item->klen);
   memcpy(item->kv + item->klen, kv->pv, item->vlen);
   // SHA1
-  SHA1(item->kv, item->klen, item->hash);
-  uint8_t buf[16];
-  uint8_t * const p1 = encode_uint16(buf, item->klen);
-  uint8_t * const p2 = encode_uint16(p1, item->vlen);
-  const uint16_t volume = item->klen + item->vlen + (p2 - buf);
-  item->volume = volume;
+  if (hash) {
+    memcpy(item->hash, hash, HASHBYTES);
+  } else {
+    SHA1(item->kv, item->klen, item->hash);
+  }
+  item->volume = item_volume(item->klen, item->vlen, item->flags);
   return item;
 }
 
@@ -370,17 +412,23 @@ barrel_to_array(struct Barrel * const barrel, struct Item ** const items)
 barrel_erase(struct Barrel * const barrel, struct Item * const item)
 {
   const uint32_t hid = item_hash_ht(item);
-  const uint16_t volume = item_erase(&(barrel->items[hid]), item);
-  barrel->volume -= volume;
+  struct Item * const victim = item_erase(&(barrel->items[hid]), item);
+  if (victim) {
+    barrel->volume -= victim->volume;
+  }
 }
 
-  static inline void
+// return the replaced item or NULL
+  static inline struct Item *
 barrel_insert(struct Barrel * const barrel, struct Item * const item)
 {
   const uint32_t hid = item_hash_ht(item);
-  const uint16_t victim_volume = item_insert(&(barrel->items[hid]), item);
+  struct Item * const victim = item_insert(&(barrel->items[hid]), item);
   barrel->volume += item->volume;
-  barrel->volume -= victim_volume;
+  if (victim) {
+    barrel->volume -= victim->volume;
+  }
+  return victim;
 }
 
 // keyhead: need kv (only need key), klen
@@ -392,22 +440,73 @@ barrel_lookup(struct Barrel * const barrel, const uint16_t klen,
   return item_lookup(barrel->items[hid], klen, pk);
 }
 
-  static uint16_t
-barrel_dump_buffer(struct Barrel * const barrel, uint8_t * const buffer)
+// serialize items; return the end of raw bytes
+  static uint8_t *
+barrel_encode(struct Barrel * const barrel, uint8_t * const buffer, const uint64_t cap,
+    uint16_t * const nr_items)
 {
-  // serialize data
   uint8_t *ptr = buffer;
-  uint16_t nr_items = 0;
+  uint16_t count = 0;
   for (uint64_t i = 0; i < BARREL_NR_HT; i++) {
     struct Item * iter = barrel->items[i];
     while (iter) {
       uint8_t * const pnext = item_encode(iter, ptr);
-      assert(pnext <= (buffer + (long)BARREL_CAP));
+      assert(pnext <= (buffer + (long)cap));
       ptr = pnext;
       iter = iter->next;
-      nr_items++;
+      count++;
     }
   }
+  if (nr_items) *nr_items = count;
+  return ptr;
+}
+
+// compress into dst (BARREL_ZHDR + compressed bytes); return 0 if not within cap
+  static uint64_t
+barrel_compress(const struct Table * const table, struct Barrel * const barrel, uint8_t * const dst,
+    const uint64_t cap, uint16_t * const nr_items)
+{
+  assert(barrel->volume <= BARREL_RAW_MAX);
+  uint8_t raw[BARREL_RAW_MAX];
+  uint8_t * const end = barrel_encode(barrel, raw, BARREL_RAW_MAX, nr_items);
+  const uint64_t rlen = end - raw;
+  const uint64_t clen = codec_compress(table->codec, table->dict, raw, rlen, dst + BARREL_ZHDR, cap - BARREL_ZHDR);
+  if (clen == 0) return 0;
+  dst[0] = (uint8_t)table->codec | (table->dict ? BARREL_ZDICT : 0);
+  const uint16_t clen16 = (uint16_t)clen;
+  const uint16_t rlen16 = (uint16_t)rlen;
+  memcpy(dst + 1, &clen16, sizeof(clen16));
+  memcpy(dst + 3, &rlen16, sizeof(rlen16));
+  return BARREL_ZHDR + clen;
+}
+
+// bytes taken in a slot: the raw items if they fit, else the compressed form
+  static uint16_t
+barrel_size(const struct Table * const table, struct Barrel * const barrel)
+{
+  if ((barrel->volume <= BARREL_CAP) || (table->codec == CODEC_NONE) || (barrel->volume > BARREL_RAW_MAX)) {
+    return barrel->volume;
+  }
+  uint8_t out[BARREL_ZBOUND];
+  const uint64_t zsize = barrel_compress(table, barrel, out, BARREL_ZBOUND, NULL);
+  return ((zsize == 0) || (zsize >= barrel->volume)) ? barrel->volume : ((uint16_t)zsize);
+}
+
+  static uint16_t
+barrel_dump_buffer(const struct Table * const table, struct Barrel * const barrel, uint8_t * const buffer)
+{
+  uint16_t nr_items = 0;
+  bool zip = false;
+  uint8_t *ptr = buffer;
+  if (barrel->volume <= BARREL_CAP) {
+    ptr = barrel_encode(barrel, buffer, BARREL_CAP, &nr_items);
+  } else {
+    // made to fit by table_retain()
+    const uint64_t zsize = barrel_compress(table, barrel, buffer, BARREL_CAP, &nr_items);
+    assert(zsize);
+    ptr = buffer + zsize;
+    zip = true;
+  }
   assert(ptr >= buffer);
 
   // get ride of valgrind warning
@@ -418,8 +517,8 @@ barrel_dump_buffer(struct Barrel * const barrel, uint8_t * const buffer)
   // put metadata
   ptr = buffer + ((long)BARREL_CAP);
   struct MetaIndex * const mi = (typeof(mi))ptr;
-  mi->id = barrel->id;
-  mi->rid = barrel->rid;
+  mi->id = zip ? (barrel->id | METAINDEX_ZIP) : barrel->id;
+  mi->rid = barrel->tie ? (barrel->rid | METAINDEX_TIE) : barrel->rid;
   mi->min = barrel->min;
   return nr_items;
 }
@@ -460,44 +559,47 @@ __find_metaindex(const uint64_t nr_mi, const struct MetaIndex * const mis, const
   static struct BloomFilter *
 barrel_create_bf(struct Barrel * const barrel, struct Mempool * const mempool)
 {
-  struct Item *items[BARREL_CAP] = {0};
-  const uint16_t item_count = barrel_to_array(barrel, items);
-  assert(item_count < BARREL_CAP);
+  const uint16_t item_count = barrel_count(barrel);
   struct BloomFilter * const bf = bloom_create(item_count, mempool);
   assert(bf);
 
-  for (uint16_t i = 0; i < item_count; i++) {
-    const uint64_t hv = item_hash_bf(items[i]);
-    bloom_update(bf, hv);
+  for (uint64_t i = 0; i < BARREL_NR_HT; i++) {
+    struct Item * iter = barrel->items[i];
+    while (iter) {
+      bloom_update(bf, item_hash_bf(iter));
+      iter = iter->next;
+    }
   }
   return bf;
 }
 
 // for table->barrels[?]
   uint16_t
-table_select_barrel(const uint8_t * const hash)
+table_select_barrel(const uint8_t * const hash, const uint64_t nr_barrels)
 {
   // using the 4~7 bits of the hash value
   const uint8_t * const start_byte = &(hash[4]);
   const uint64_t hv = *((uint64_t *)start_byte);
-  const uint16_t bid = (typeof(bid))(hv % TABLE_NR_BARRELS);
+  const uint16_t bid = (typeof(bid))(hv % nr_barrels);
   return bid;
 }
 
   static bool
 table_initial(struct Table * const table, const uint64_t capacity)
 {
-  const uint64_t main_space = sizeof(struct Barrel) * TABLE_MAX_BARRELS;
+  const uint64_t main_space = sizeof(struct Barrel) * (table->nr_barrels + 1u);
   assert(table->mempool);
   table->barrels = (typeof(table->barrels))mempool_alloc(table->mempool, main_space);
   if (table->barrels == NULL) { return false; }
   bzero(table->barrels, main_space);
-  for (uint16_t i = 0u; i < TABLE_NR_BARRELS; i++) {
+  for (uint16_t i = 0u; i < table->nr_barrels; i++) {
     table->barrels[i].id = i;
     table->barrels[i].rid = i;
   }
 
   table->volume = 0;
+  table->nr_replaced = 0;
+  table->over = 0;
   table->capacity = capacity;
   table->bt = NULL;
   if (table->io_buffer == NULL) {
@@ -512,13 +614,15 @@ table_initial(struct Table * const table, const uint64_t capacity)
 }
 
   struct Table *
-table_alloc_new(const double cap_percent, const double mempool_factor)
+table_alloc_new(const uint64_t nr_barrels, const double cap_percent, const double mempool_factor)
 {
+  assert((nr_barrels < TABLE_LIMIT_BARRELS) && ((nr_barrels + 1u) % TABLE_MAX_BARRELS) == 0);
   struct Table * const table = (typeof(table))malloc(sizeof(*table));
   assert(table);
   bzero(table, sizeof(*table));
+  table->nr_barrels = nr_barrels;
 
-  const double cap_max = (double)(TABLE_NR_BARRELS * BARREL_CAP);
+  const double cap_max = (double)(nr_barrels * BARREL_CAP);
   const uint64_t msize = (uint64_t)(cap_max * mempool_factor);
   table->mempool = mempool_new(msize);
 
@@ -531,7 +635,17 @@ table_alloc_new(const double cap_percent, const double mempool_factor)
   struct Table *
 table_alloc_default(const double mempool_factor)
 {
-  return table_alloc_new(TABLE_VOLUME_PERCENT, mempool_factor);
+  return table_alloc_new(TABLE_NR_BARRELS, TABLE_VOLUME_PERCENT, mempool_factor);
+}
+
+// fill: expected compression of the barrels, scales the capacity and the mempool
+  struct Table *
+table_alloc_codec(const int codec, const uint64_t nr_barrels, const double fill, const double mempool_factor)
+{
+  assert(codec_available(codec) && (fill >= 1.0));
+  struct Table * const table = table_alloc_new(nr_barrels, TABLE_VOLUME_PERCENT * fill, mempool_factor * fill);
+  table->codec = codec;
+  return table;
 }
 
   void
@@ -547,10 +661,107 @@ table_free(struct Table * const table)
   free(table);
 }
 
+// bytes a barrel has to move out in table_retain(); compressed barrels are not counted
+  static inline uint64_t
+table_barrel_over(const struct Table * const table, const uint16_t volume)
+{
+  return ((table->codec == CODEC_NONE) && (volume > BARREL_CAP)) ? (volume - BARREL_CAP) : 0;
+}
+
+// free bytes in the barrels below the cap
+  static inline uint64_t
+table_space(const struct Table * const table)
+{
+  return (table->nr_barrels * BARREL_CAP) + table->over - table->volume;
+}
+
+// also full when the overflow is too much for the free space: table_retain() could fail
   bool
 table_full(const struct Table *const table)
 {
-  return (table->volume >= table->capacity)?true:false;
+  if (table->volume >= table->capacity) return true;
+  return ((table->over * TABLE_OVER_RATIO) > table_space(table)) ? true : false;
+}
+
+// vdrop(arg, ptr) is called when an item holding a ValuePtr is replaced by a newer one
+  void
+table_set_vdrop(struct Table * const table, void (*vdrop)(void * const, const struct ValuePtr * const),
+    void * const arg)
+{
+  table->vdrop = vdrop;
+  table->vdrop_arg = arg;
+}
+
+// the dump of the table is paced by wlimit, which must outlive the dump
+  void
+table_set_rate_limit(struct Table * const table, struct RateLimit * const wlimit)
+{
+  table->wlimit = wlimit;
+}
+
+// full: index every overflown barrel instead of METAINDEX_PERCENT of the lookups,
+// so that a lookup never reads a barrel just to find its items moved out
+  void
+table_set_full_metaindex(struct Table * const table, const bool full)
+{
+  table->full_mi = full;
+}
+
+// image: BARREL_ALIGN bytes for each barrel, filled by the dump with the barrels as written;
+// huge_alloc()ed with one more barrel, like the compaction arenas
+  void
+table_set_image(struct Table * const table, uint8_t * const image)
+{
+  table->image = image;
+}
+
+// barrels are compressed against dict, which must outlive the table and its MetaTable
+  void
+table_set_dict(struct Table * const table, struct CodecDict * const dict)
+{
+  assert((dict == NULL) || (dict->codec == table->codec));
+  table->dict = dict;
+}
+
+// encoded items of every stride-th barrel, one sample per item, for training a dictionary
+// return the number of samples
+  uint64_t
+table_sample_items(struct Table * const table, const uint64_t stride, uint8_t * const buf,
+    const uint64_t cap, uint64_t * const sizes, const uint64_t max)
+{
+  uint64_t nr = 0;
+  uint8_t * ptr = buf;
+  for (uint64_t bid = 0; bid < table->nr_barrels; bid += stride) {
+    struct Barrel * const barrel = &(table->barrels[bid]);
+    for (uint64_t i = 0; i < BARREL_NR_HT; i++) {
+      for (struct Item * iter = barrel->items[i]; iter; iter = iter->next) {
+        if ((nr >= max) || ((ptr + iter->volume) > (buf + cap))) return nr;
+        uint8_t * const pnext = item_encode(iter, ptr);
+        sizes[nr++] = pnext - ptr;
+        ptr = pnext;
+      }
+    }
+  }
+  return nr;
+}
+
+// small enough to be stored in a barrel
+  bool
+table_kv_fits(const struct KeyValue * const kv)
+{
+  if ((kv->klen == 0) || (kv->vlen >= RAW_VLEN_VPTR)) return false;
+  return (item_volume(kv->klen, kv->vlen, kv->flags) <= ITEM_MAX_VOLUME)?true:false;
+}
+
+  static inline void
+table_victim(struct Table * const table, struct Item * const victim)
+{
+  if (victim && table->vdrop && (victim->flags & KV_FLAG_VPTR)) {
+    struct ValuePtr vp;
+    assert(victim->vlen == sizeof(vp));
+    memcpy(&vp, victim->kv + victim->klen, sizeof(vp));
+    table->vdrop(table->vdrop_arg, &vp);
+  }
 }
 
 // insert anyway
@@ -558,31 +769,43 @@ table_full(const struct Table *const table)
 table_insert_item(struct Table * const table, struct Item * const item)
 {
   // assume hash value has been generated
-  const uint16_t barrel_id = table_select_barrel(item->hash);
+  const uint16_t barrel_id = table_select_barrel(item->hash, table->nr_barrels);
   struct Barrel * const barrel = &table->barrels[barrel_id];
   const uint16_t vol0 = barrel->volume;
-  barrel_insert(barrel, item);
+  struct Item * const victim = barrel_insert(barrel, item);
   const uint16_t vol1 = barrel->volume;
   table->volume += (vol1 - vol0);
+  table->over += table_barrel_over(table, vol1) - table_barrel_over(table, vol0);
+  if (victim) table->nr_replaced++;
+  table_victim(table, victim);
 }
 
 // thread safe insert (for compaction feed)
   static void
 table_insert_item_mt(struct Table * const table, struct Item * const item)
 {
-  const uint16_t barrel_id = table_select_barrel(item->hash);
+  const uint16_t barrel_id = table_select_barrel(item->hash, table->nr_barrels);
   struct Barrel * const barrel = &table->barrels[barrel_id];
   pthread_mutex_lock(&(table->ilocks[barrel_id % TABLE_ILOCKS_NR]));
   const uint16_t vol0 = barrel->volume;
-  barrel_insert(barrel, item);
+  struct Item * const victim = barrel_insert(barrel, item);
   const uint16_t vol1 = barrel->volume;
   __sync_add_and_fetch(&(table->volume), (vol1 - vol0));
+  __sync_add_and_fetch(&(table->over), table_barrel_over(table, vol1) - table_barrel_over(table, vol0));
   pthread_mutex_unlock(&(table->ilocks[barrel_id % TABLE_ILOCKS_NR]));
+  if (victim) __sync_add_and_fetch(&(table->nr_replaced), 1);
+  table_victim(table, victim);
 }
 
+// a table whose overflow does not fit in its free space takes no more: table_retain() would fail.
+// the caller retries with less input; unlike table_full(), neither the capacity nor a margin is kept
   static inline void
 table_insert_rawitem_mt(struct Table * const table, const struct RawItem * const ri, const uint8_t * const hash)
 {
+  if (table->over > table_space(table)) {
+    __sync_add_and_fetch(&(table->refused), item_volume(ri->klen, ri->vlen, ri->flags));
+    return;
+  }
   struct Item * const item = rawitem_to_item(ri, table->mempool, hash);
   assert(item);
   table_insert_item_mt(table, item);
@@ -592,9 +815,16 @@ table_insert_rawitem_mt(struct Table * const table, const struct RawItem * const
 // return false on full
   bool
 table_insert_kv_safe(struct Table * const table, const struct KeyValue * const kv)
+{
+  return table_insert_kv_hash_safe(table, kv, NULL);
+}
+
+// hash: SHA1 of the key, taken by the caller that needs it too
+  bool
+table_insert_kv_hash_safe(struct Table * const table, const struct KeyValue * const kv, const uint8_t * const hash)
 {
   if (table_full(table)) return false;
-  struct Item * const item = keyvalue_to_item(kv, table->mempool);
+  struct Item * const item = keyvalue_to_item(kv, table->mempool, hash);
   if (item == NULL) return false;
   table_insert_item(table, item);
   return true;
@@ -605,11 +835,11 @@ table_insert_kv_safe(struct Table * const table, const struct KeyValue * const k
 table_build_bloomtable(struct Table * const table)
 {
   assert(table->bt == NULL);
-  struct BloomFilter *bfs[TABLE_NR_BARRELS];
-  for (uint64_t i = 0; i < TABLE_NR_BARRELS; i++) {
+  struct BloomFilter *bfs[TABLE_LIMIT_BARRELS];
+  for (uint64_t i = 0; i < table->nr_barrels; i++) {
     bfs[i] = barrel_create_bf(&(table->barrels[i]), table->mempool);
   }
-  struct BloomTable * const bt = bloomtable_build(bfs, TABLE_NR_BARRELS);
+  struct BloomTable * const bt = bloomtable_build(bfs, table->nr_barrels);
   assert(bt);
   table->bt = bt;
   return true;
@@ -619,32 +849,28 @@ table_build_bloomtable(struct Table * const table)
 table_lookup(struct Table * const table, const uint16_t klen,
     const uint8_t * const pk, const uint8_t * const hash)
 {
-  const uint16_t bid = table_select_barrel(hash);
-  struct Item * const item = barrel_lookup(&(table->barrels[bid]), klen, pk, hash);
-  return item ? item_to_keyvalue(item) : NULL;
-}
-
-  static inline int
-__compare_volume(const void * const p1, const void * const p2)
-{
-  struct Barrel * const b1 = *((typeof(&b1))p1);
-  struct Barrel * const b2 = *((typeof(&b2))p2);
-  if (b1->volume < b2->volume) {
-    return -1;
-  } else if (b1->volume > b2->volume) {
-    return 1;
-  } else {
-    return 0;
-  }
-}
-
-  static void
-retaining_sort_barrels_by_volume(struct Table * const table, struct Barrel ** barrels)
-{
-  for (uint64_t i = 0; i < TABLE_NR_BARRELS; i++) {
-    barrels[i] = &(table->barrels[i]);
+  const uint16_t bid = table_select_barrel(hash, table->nr_barrels);
+  // a retained table may still be looked up before its dump is done:
+  // follow the overflow, and retry if table_retain() moved items meanwhile
+  while (true) {
+    __sync_synchronize();
+    const uint64_t seq = table->seq;
+    if (seq & 1u) { // the mover may need this cpu
+      sched_yield();
+      continue;
+    }
+    __sync_synchronize();
+    struct Barrel * barrel = &(table->barrels[bid]);
+    struct Item * item = barrel_lookup(barrel, klen, pk, hash);
+    while ((item == NULL) && (barrel->rid != barrel->id)) {
+      barrel = &(table->barrels[barrel->rid]);
+      item = barrel_lookup(barrel, klen, pk, hash);
+    }
+    struct KeyValue * const kv = item ? item_to_keyvalue(item) : NULL;
+    __sync_synchronize();
+    if (table->seq == seq) return kv;
+    if (kv) free(kv);
   }
-  qsort(barrels, TABLE_NR_BARRELS, sizeof(barrels[0]), __compare_volume);
 }
 
   static int
@@ -664,48 +890,188 @@ __compare_hash_order(const void * const p1, const void * const p2, void * const
   }
 }
 
-  static bool
-retaining_move_barrels(struct Barrel * const br, struct Barrel * const bl)
+// raw volume to shrink a barrel to before checking its size again
+  static uint64_t
+retaining_target(const struct Table * const table, const struct Barrel * const barrel)
+{
+  if (barrel->size < barrel->volume) { // compressed: guess from its ratio
+    return ((uint64_t)barrel->volume) * BARREL_CAP / barrel->size;
+  } else if ((table->codec != CODEC_NONE) && (barrel->volume > BARREL_RAW_MAX)) {
+    return BARREL_RAW_MAX;
+  } else {
+    return BARREL_CAP;
+  }
+}
+
+// the items of a barrel in its hash order, the first ones move out first
+  static uint16_t
+retaining_sort_items(struct Barrel * const br, struct Item ** const ir)
 {
-  struct Item *ir[BARREL_ALIGN] __attribute__((aligned(8)));
   const uint16_t nr_r = barrel_to_array(br, ir);
   qsort_r(ir, nr_r, sizeof(ir[0]), __compare_hash_order, &(br->id));
+  return nr_r;
+}
+
+// raw bytes of the first move out of a barrel
+  static uint64_t
+retaining_first_move(const struct Table * const table, const struct Barrel * const br,
+    struct Item * const * const ir, const uint16_t nr_r)
+{
+  const uint64_t target = retaining_target(table, br);
+  uint64_t volume = br->volume;
+  for (uint64_t i = 0; (i < nr_r) && (volume > target); i++) {
+    volume -= ir[i]->volume;
+  }
+  return br->volume - volume;
+}
+
+// ir: sorted by retaining_sort_items()
+  static bool
+retaining_move_barrels(struct Table * const table, struct Barrel * const br, struct Barrel * const bl,
+    struct Item * const * const ir, const uint16_t nr_r)
+{
+  // odd while moving, see table_lookup()
+  __sync_add_and_fetch(&(table->seq), 1);
   uint64_t i = 0;
-  while(br->volume > BARREL_CAP) {
-    if (i >= nr_r) return false;
-    barrel_erase(br, ir[i]);
-    barrel_insert(bl, ir[i]);
-    ir[i]->nr_moved++;
-    i++;
+  while (br->size > BARREL_CAP) {
+    const uint64_t target = retaining_target(table, br);
+    do {
+      if (i >= nr_r) {
+        __sync_add_and_fetch(&(table->seq), 1);
+        return false;
+      }
+      barrel_erase(br, ir[i]);
+      barrel_insert(bl, ir[i]);
+      ir[i]->nr_moved++;
+      i++;
+    } while (br->volume > target);
+    br->size = barrel_size(table, br);
   }
+  bl->size = barrel_size(table, bl);
   br->nr_out = i;
   br->rid = bl->id;
   assert(i < nr_r);
   br->min = item_hash_order(ir[i], br->id);
+  br->tie = (item_hash_order(ir[i - 1u], br->id) == br->min) ? true : false;
+  __sync_add_and_fetch(&(table->seq), 1);
   return true;
 }
 
+// receivers: the barrels that have not moved out and still fit, bucketed by size
+#define RETAIN_BUCKET_SHIFT ((6))
+#define RETAIN_NR_RECV ((((uint64_t)BARREL_CAP) >> RETAIN_BUCKET_SHIFT) + 1u)
+// donors are ordered by size, up to 64KB
+#define RETAIN_NR_DONOR ((((UINT64_C(1)) << 16) >> RETAIN_BUCKET_SHIFT))
+#define RETAIN_NONE ((UINT32_MAX))
+
+struct RetainRecv {
+  uint32_t heads[RETAIN_NR_RECV];
+  uint32_t * next; // by barrel id
+};
+
+  static void
+retaining_recv_put(struct RetainRecv * const recv, const struct Barrel * const barrel)
+{
+  const uint64_t b = barrel->size >> RETAIN_BUCKET_SHIFT;
+  recv->next[barrel->id] = recv->heads[b];
+  recv->heads[b] = barrel->id;
+}
+
+// best fit within a bucket: a receiver in the fullest bucket that takes bytes without moving out,
+// or else the emptiest one. only the top bucket can hold receivers too full for bytes; its head is
+// the one checked, so a take costs at most RETAIN_NR_RECV steps
+  static struct Barrel *
+retaining_recv_take(const struct Table * const table, struct RetainRecv * const recv, const uint64_t bytes)
+{
+  if (bytes <= BARREL_CAP) {
+    const uint64_t max = BARREL_CAP - bytes;
+    for (uint64_t b = (max >> RETAIN_BUCKET_SHIFT) + 1u; b > 0; b--) {
+      const uint32_t id = recv->heads[b - 1u];
+      if ((id != RETAIN_NONE) && (table->barrels[id].size <= max)) {
+        recv->heads[b - 1u] = recv->next[id];
+        return &(table->barrels[id]);
+      }
+    }
+  }
+  for (uint64_t b = 0; b < RETAIN_NR_RECV; b++) {
+    const uint32_t id = recv->heads[b];
+    if (id != RETAIN_NONE) {
+      recv->heads[b] = recv->next[id];
+      return &(table->barrels[id]);
+    }
+  }
+  return NULL;
+}
+
+// one pass: the largest donor first, each one to the best fitting receiver;
+// a receiver pushed over the cap becomes a donor itself, so every barrel moves out at most once
   static bool
-retaining_move_sorted(struct Barrel ** const barrels)
-{
-  uint16_t lid = 0;
-  uint16_t rid = TABLE_NR_BARRELS - 1;
-  while ((barrels[rid]->volume > BARREL_CAP) && (lid < rid)) {
-    assert(barrels[rid]->nr_out == 0);
-    while (barrels[lid]->nr_out > 0) lid++;
-    if (lid >= rid) {
+retaining_plan(struct Table * const table)
+{
+  const uint64_t nr = table->nr_barrels;
+  struct Barrel ** const donors = (typeof(donors))malloc(sizeof(donors[0]) * nr);
+  struct RetainRecv recv;
+  recv.next = (typeof(recv.next))malloc(sizeof(recv.next[0]) * nr);
+  uint32_t * const buckets = (typeof(buckets))calloc(RETAIN_NR_DONOR, sizeof(buckets[0]));
+  assert(donors && recv.next && buckets);
+  for (uint64_t b = 0; b < RETAIN_NR_RECV; b++) {
+    recv.heads[b] = RETAIN_NONE;
+  }
+  // counting sort of the donors, big -> small
+  uint64_t nr_donors = 0;
+  for (uint64_t i = 0; i < nr; i++) {
+    struct Barrel * const barrel = &(table->barrels[i]);
+    if (barrel->size > BARREL_CAP) {
+      buckets[(RETAIN_NR_DONOR - 1u) - (barrel->size >> RETAIN_BUCKET_SHIFT)]++;
+      nr_donors++;
+    } else {
+      retaining_recv_put(&recv, barrel);
+    }
+  }
+  uint32_t pos = 0;
+  for (uint64_t b = 0; b < RETAIN_NR_DONOR; b++) {
+    const uint32_t c = buckets[b];
+    buckets[b] = pos;
+    pos += c;
+  }
+  for (uint64_t i = 0; i < nr; i++) {
+    struct Barrel * const barrel = &(table->barrels[i]);
+    if (barrel->size > BARREL_CAP) {
+      donors[buckets[(RETAIN_NR_DONOR - 1u) - (barrel->size >> RETAIN_BUCKET_SHIFT)]++] = barrel;
+    }
+  }
+  free(buckets);
+
+  bool ok = true;
+  struct Item ** ir = NULL;
+  uint64_t nr_ir = 0;
+  for (uint64_t i = 0; i < nr_donors; i++) {
+    struct Barrel * const br = donors[i];
+    assert(br->nr_out == 0);
+    const uint16_t nr_items = barrel_count(br);
+    if (nr_items > nr_ir) {
+      free(ir);
+      nr_ir = nr_items;
+      ir = (typeof(ir))malloc(sizeof(ir[0]) * nr_ir);
+      assert(ir);
+    }
+    const uint16_t nr_r = retaining_sort_items(br, ir);
+    struct Barrel * const bl = retaining_recv_take(table, &recv, retaining_first_move(table, br, ir, nr_r));
+    if ((bl == NULL) || (retaining_move_barrels(table, br, bl, ir, nr_r) == false)) {
+      ok = false;
       break;
     }
-    struct Barrel * const br = barrels[rid];
-    struct Barrel * const bl = barrels[lid];
-    const bool rm = retaining_move_barrels(br, bl);
-
-    if (rm == false) return false;
-    rid--;
-    lid++;
+    if (bl->size > BARREL_CAP) {
+      assert(nr_donors < nr);
+      donors[nr_donors++] = bl;
+    } else {
+      retaining_recv_put(&recv, bl);
+    }
   }
-  if (barrels[rid]->volume > BARREL_CAP) return false;
-  else return true;
+  free(ir);
+  free(donors);
+  free(recv.next);
+  return ok;
 }
 
   static int
@@ -728,7 +1094,7 @@ retaining_nr_todo(struct Table * const table)
 {
   uint64_t nr_all = 0;
   uint64_t nr_out = 0;
-  for (uint64_t i = 0; i < TABLE_NR_BARRELS; i++) {
+  for (uint64_t i = 0; i < table->nr_barrels; i++) {
     nr_all += barrel_count_lookup(&(table->barrels[i]));
     nr_out += table->barrels[i].nr_out;
   }
@@ -755,23 +1121,26 @@ __compare_id(const void * const p1, const void * const p2)
   static void
 retaining_build_metaindex(struct Table * const table)
 {
-  struct Barrel * barrels[TABLE_MAX_BARRELS];
-  for (uint64_t i = 0; i < TABLE_NR_BARRELS; i++) {
+  struct Barrel * barrels[TABLE_LIMIT_BARRELS];
+  for (uint64_t i = 0; i < table->nr_barrels; i++) {
     barrels[i] = &(table->barrels[i]);
   }
   // sort by out, big->small
-  qsort(barrels, TABLE_NR_BARRELS, sizeof(barrels[0]), __compare_out);
+  qsort(barrels, table->nr_barrels, sizeof(barrels[0]), __compare_out);
   uint64_t nr_todo = (typeof(nr_todo))retaining_nr_todo(table);
-  struct MetaIndex mi_buf[TABLE_MAX_BARRELS];
-  bzero(mi_buf, sizeof(mi_buf[0]) * TABLE_MAX_BARRELS);
+  struct MetaIndex mi_buf[TABLE_LIMIT_BARRELS];
+  bzero(mi_buf, sizeof(mi_buf[0]) * table->nr_barrels);
   // copy index
   uint64_t nr_mi = 0;
-  for (uint64_t i = 0; i < METAINDEX_MAX_NR ; i++) {
+  const uint64_t max_mi = table->full_mi ? table->nr_barrels : (METAINDEX_MAX_NR * TABLE_UNITS(table->nr_barrels));
+  for (uint64_t i = 0; i < max_mi; i++) {
     struct Barrel * const barrel = barrels[i];
+    if (table->full_mi && (barrel->nr_out == 0)) break;
     mi_buf[i].id = barrel->id;
-    mi_buf[i].rid = barrel->rid;
+    mi_buf[i].rid = barrel->tie ? (barrel->rid | METAINDEX_TIE) : barrel->rid;
     mi_buf[i].min = barrel->min;
     nr_mi++;
+    if (table->full_mi) continue;
     if (barrel->nr_out >= nr_todo) break;
     nr_todo -= barrel->nr_out;
   }
@@ -779,58 +1148,202 @@ retaining_build_metaindex(struct Table * const table)
   qsort(mi_buf, nr_mi, sizeof(mi_buf[0]), __compare_id);
   // set to table
   table->nr_mi = nr_mi;
-  struct MetaIndex * const mis = (typeof(mis))mempool_alloc(table->mempool, sizeof(mis[0]) * nr_mi);
-  assert(mis);
-  memcpy(mis, mi_buf, sizeof(mis[0]) * nr_mi);
-  table->mis = mis;
+  table->mis = NULL;
+  if (nr_mi) {
+    struct MetaIndex * const mis = (typeof(mis))mempool_alloc(table->mempool, sizeof(mis[0]) * nr_mi);
+    assert(mis);
+    memcpy(mis, mi_buf, sizeof(mis[0]) * nr_mi);
+    table->mis = mis;
+  }
 }
 
+// every item back in the barrel it hashes to, as before a failed retaining_plan()
+  static void
+retaining_undo(struct Table * const table)
+{
+  // odd while moving, see table_lookup()
+  __sync_add_and_fetch(&(table->seq), 1);
+  struct Item ** ir = NULL;
+  uint64_t nr_ir = 0;
+  for (uint64_t i = 0; i < table->nr_barrels; i++) {
+    struct Barrel * const barrel = &(table->barrels[i]);
+    const uint16_t nr_items = barrel_count(barrel);
+    if (nr_items > nr_ir) {
+      free(ir);
+      nr_ir = nr_items;
+      ir = (typeof(ir))malloc(sizeof(ir[0]) * nr_ir);
+      assert(ir);
+    }
+    const uint16_t nr = barrel_to_array(barrel, ir);
+    for (uint64_t j = 0; j < nr; j++) {
+      const uint16_t bid = table_select_barrel(ir[j]->hash, table->nr_barrels);
+      if (bid != barrel->id) {
+        barrel_erase(barrel, ir[j]);
+        barrel_insert(&(table->barrels[bid]), ir[j]);
+      }
+      ir[j]->nr_moved = 0;
+    }
+  }
+  free(ir);
+  for (uint64_t i = 0; i < table->nr_barrels; i++) {
+    struct Barrel * const barrel = &(table->barrels[i]);
+    barrel->rid = barrel->id;
+    barrel->nr_out = 0;
+    barrel->min = 0;
+    barrel->tie = false;
+  }
+  __sync_add_and_fetch(&(table->seq), 1);
+}
+
+// on failure the table is left as it was, see table_spill()
   bool
 table_retain(struct Table * const table)
 {
-  uint64_t count = 0;
-  while (true) {
-    if (count >= 100) return false;
-    struct Barrel *barrels[TABLE_NR_BARRELS];
-    retaining_sort_barrels_by_volume(table, barrels);
-    if (barrels[TABLE_NR_BARRELS-1]->volume <= BARREL_CAP) break; // done
-    const bool rr = retaining_move_sorted(barrels);
-    count++;
-    if (rr == false) return false;
+  // an overflowing barrel is compressed first and only moves out what still does not fit
+  for (uint64_t i = 0; i < table->nr_barrels; i++) {
+    table->barrels[i].size = barrel_size(table, &(table->barrels[i]));
+  }
+  if (retaining_plan(table) == false) {
+    retaining_undo(table);
+    return false;
+  }
+  table->zvolume = 0;
+  table->zsize = 0;
+  for (uint64_t i = 0; i < table->nr_barrels; i++) {
+    if (table->barrels[i].volume > BARREL_CAP) {
+      table->zvolume += table->barrels[i].volume;
+      table->zsize += table->barrels[i].size;
+    }
   }
   retaining_build_metaindex(table);
   return true;
 }
 
-  uint64_t
-table_dump_barrels(struct Table * const table, const int fd, const uint64_t off)
+  static struct Item *
+item_copy(const struct Item * const item, struct Mempool * const mempool)
+{
+  const size_t msize = sizeof(struct Item) + item->klen + item->vlen;
+  struct Item * const copy = (typeof(copy))mempool_alloc(mempool, msize);
+  assert(copy);
+  memcpy(copy, item, msize);
+  copy->next = NULL;
+  copy->nr_moved = 0;
+  return copy;
+}
+
+// for a table that failed table_retain(): what each barrel holds over its cap moves to a new table
+// of the same kind, returned (NULL if nothing is over). the table then retains without moving any
+// item; its BloomTable, if built, is built again
+  struct Table *
+table_spill(struct Table * const table)
+{
+  assert(table->mis == NULL);
+  struct Table * spill = NULL;
+  struct Item ** ir = NULL;
+  uint64_t nr_ir = 0;
+  for (uint64_t i = 0; i < table->nr_barrels; i++) {
+    struct Barrel * const barrel = &(table->barrels[i]);
+    barrel->size = barrel_size(table, barrel);
+    if (barrel->size <= BARREL_CAP) continue;
+    if (spill == NULL) {
+      const double cap_percent = ((double)table->capacity) / ((double)(table->nr_barrels * BARREL_CAP));
+      spill = table_alloc_new(table->nr_barrels, cap_percent, 1.0);
+      spill->codec = table->codec;
+      spill->dict = table->dict;
+      spill->full_mi = table->full_mi;
+      spill->wlimit = table->wlimit;
+      table_set_vdrop(spill, table->vdrop, table->vdrop_arg);
+    }
+    const uint16_t nr_items = barrel_count(barrel);
+    if (nr_items > nr_ir) {
+      free(ir);
+      nr_ir = nr_items;
+      ir = (typeof(ir))malloc(sizeof(ir[0]) * nr_ir);
+      assert(ir);
+    }
+    // the same order as a move out in table_retain()
+    const uint16_t nr_r = retaining_sort_items(barrel, ir);
+    const uint16_t vol0 = barrel->volume;
+    uint64_t j = 0;
+    while (barrel->size > BARREL_CAP) {
+      const uint64_t target = retaining_target(table, barrel);
+      do {
+        assert(j < nr_r);
+        barrel_erase(barrel, ir[j]);
+        table_insert_item(spill, item_copy(ir[j], spill->mempool));
+        j++;
+      } while (barrel->volume > target);
+      barrel->size = barrel_size(table, barrel);
+    }
+    table->volume -= (vol0 - barrel->volume);
+    table->over -= table_barrel_over(table, vol0) - table_barrel_over(table, barrel->volume);
+  }
+  free(ir);
+  if (spill && table->bt) {
+    bloomtable_free(table->bt);
+    table->bt = NULL;
+    table_build_bloomtable(table);
+  }
+  return spill;
+}
+
+// the tail (if any) follows the last barrel in the same write
+  static uint64_t
+table_dump_barrels_tail(struct Table * const table, const int fd, const uint64_t off,
+    const uint8_t * const tail, const uint64_t tail_bytes)
 {
   uint64_t nr_all_items = 0;
-  for (uint64_t j = 0; j < TABLE_NR_BARRELS; j += TABLE_NR_IO) {
-    const uint64_t nr_dump = ((j + TABLE_NR_IO) > TABLE_NR_BARRELS)?(TABLE_NR_BARRELS - j):TABLE_NR_IO;
+  const uint64_t nr_barrels = table->nr_barrels;
+  table->usec_write = 0;
+  for (uint64_t j = 0; j < nr_barrels; j += TABLE_NR_IO) {
+    const uint64_t nr_dump = ((j + TABLE_NR_IO) > nr_barrels)?(nr_barrels - j):TABLE_NR_IO;
     for (uint64_t i = 0; i < nr_dump; i++) {
       uint8_t * const ptr = &(table->io_buffer[BARREL_ALIGN * i]);
-      const uint64_t nr_items = barrel_dump_buffer(&(table->barrels[j+i]), ptr);
+      const uint64_t nr_items = barrel_dump_buffer(table, &(table->barrels[j+i]), ptr);
       nr_all_items += nr_items;
     }
+    if (table->image) {
+      memcpy(table->image + (BARREL_ALIGN * j), table->io_buffer, BARREL_ALIGN * nr_dump);
+    }
+    const uint64_t off_j = off + (BARREL_ALIGN * j);
+    if (table->wlimit) {
+      const uint64_t nr_tail = ((nr_dump < TABLE_NR_IO) && tail) ? tail_bytes : 0;
+      ratelimit_take(table->wlimit, (BARREL_ALIGN * TABLE_NR_IO) + nr_tail);
+    }
+    if ((nr_dump < TABLE_NR_IO) && tail) {
+      struct iovec iov[2];
+      iov[0].iov_base = table->io_buffer;
+      iov[0].iov_len = BARREL_ALIGN * nr_dump;
+      iov[1].iov_base = (void *)tail;
+      iov[1].iov_len = tail_bytes;
+      const uint64_t usec0 = debug_time_usec();
+      const ssize_t nw = pwritev(fd, iov, 2, (off_t)off_j);
+      table->usec_write += debug_time_usec() - usec0;
+      assert(nw == ((ssize_t)(iov[0].iov_len + iov[1].iov_len)));
+      continue;
+    }
     if (nr_dump < TABLE_NR_IO) {
       bzero(&(table->io_buffer[BARREL_ALIGN * nr_dump]), BARREL_ALIGN * (TABLE_NR_IO - nr_dump));
     }
     const size_t nr_bytes = (size_t)(TABLE_NR_IO * BARREL_ALIGN);
-    const uint64_t off_j = off + (BARREL_ALIGN * j);
+    const uint64_t usec0 = debug_time_usec();
     const ssize_t nw = pwrite(fd, table->io_buffer, nr_bytes, (off_t)(off_j));
+    table->usec_write += debug_time_usec() - usec0;
     assert(nw == ((ssize_t)nr_bytes));
   }
   return nr_all_items;
 }
 
-  bool
-table_dump_meta(struct Table *const table, const char * const metafn, const uint64_t off)
+  uint64_t
+table_dump_barrels(struct Table * const table, const int fd, const uint64_t off)
 {
-  FILE * const fo = fopen(metafn, "wb");
-  if (fo == NULL) { return false; }
+  return table_dump_barrels_tail(table, fd, off, NULL, 0);
+}
 
-  // dump header
+// format: MetaFileHeader, MetaIndex[nr_mi], BloomTable
+  static bool
+table_dump_meta_stream(struct Table * const table, FILE * const fo, const uint64_t off)
+{
   struct MetaFileHeader mfh;
   mfh.off = off;
   mfh.volume = table->volume;
@@ -844,10 +1357,54 @@ table_dump_meta(struct Table *const table, const char * const metafn, const uint
 
   // dump BloomTable
   bloomtable_dump(table->bt, fo);
-  fclose(fo);
   return true;
 }
 
+  bool
+table_dump_meta(struct Table *const table, const char * const metafn, const uint64_t off)
+{
+  FILE * const fo = fopen(metafn, "wb");
+  assert(fo);
+  const bool r = table_dump_meta_stream(table, fo, off);
+  // the manifest will refer to it
+  fflush(fo);
+  fsync(fileno(fo));
+  fclose(fo);
+  return r;
+}
+
+// bytes of metadata, see table_dump_meta_stream()
+  uint64_t
+table_meta_size(const struct Table * const table)
+{
+  assert(table->bt);
+  return sizeof(struct MetaFileHeader) + (sizeof(table->mis[0]) * table->nr_mi)
+    + sizeof(table->bt->nr_bytes) + table->bt->nr_bytes;
+}
+
+// barrels and metadata in one write; metadata right after the last barrel
+// meta_cap: space after the barrels, must be a multiple of BARREL_ALIGN
+  uint64_t
+table_dump_packed(struct Table * const table, const int fd, const uint64_t off, const uint64_t meta_cap)
+{
+  assert((meta_cap % BARREL_ALIGN) == 0);
+  const uint64_t meta_size = table_meta_size(table);
+  assert(meta_size <= meta_cap);
+  const uint64_t nr_bytes = (meta_size + BARREL_ALIGN - 1u) / BARREL_ALIGN * BARREL_ALIGN;
+  uint8_t * image = NULL;
+  const int ra = posix_memalign((void **)(&image), BARREL_ALIGN, nr_bytes);
+  assert((ra == 0) && image);
+  bzero(image, nr_bytes);
+  FILE * const fo = fmemopen(image, nr_bytes, "wb");
+  assert(fo);
+  const bool rd = table_dump_meta_stream(table, fo, off);
+  assert(rd);
+  fclose(fo);
+  const uint64_t nr_items = table_dump_barrels_tail(table, fd, off, image, nr_bytes);
+  free(image);
+  return nr_items;
+}
+
   void
 table_analysis_verbose(struct Table * const table, FILE * const out)
 {
@@ -864,7 +1421,7 @@ table_analysis_verbose(struct Table * const table, FILE * const out)
   uint64_t x_volume_all = 0;
   uint64_t count_lookup = 0;
   uint64_t count_items = 0;
-  for (uint64_t bid = 0; bid < TABLE_NR_BARRELS; bid++) {
+  for (uint64_t bid = 0; bid < table->nr_barrels; bid++) {
     struct Barrel * const barrel = &(table->barrels[bid]);
     uint16_t volume = 0;
     for (uint64_t hid = 0; hid < BARREL_NR_HT; hid++) {
@@ -921,12 +1478,12 @@ table_analysis_short(struct Table * const table, char * const buffer)
   if (table->nr_mi) {
     assert(table->mis);
   }
-  const double vp = ((double)table->volume) * 100.0 / ((double)TABLE_ALIGN);
+  const double vp = ((double)table->volume) * 100.0 / ((double)(BARREL_ALIGN * (table->nr_barrels + 1u)));
   const double ik = ((double)(table->nr_mi * sizeof(table->mis[0])))/1024.0;
   const uint32_t bt_bytes = table->bt?table->bt->nr_bytes:0u;
   const double bk = table->bt?(((double)(table->bt->nr_bytes))/1024.0):0.0;
-  sprintf(buffer, "%8lu (%5.2lf%%) %4lu (%.1lfKB) %7u (%.1lfKB)",
-      table->volume, vp, table->nr_mi, ik, bt_bytes, bk);
+  sprintf(buffer, "%8lu (%5.2lf%%) %4lu (%.1lfKB%s) %7u (%.1lfKB)",
+      table->volume, vp, table->nr_mi, ik, table->full_mi ? " full" : "", bt_bytes, bk);
 }
 
   void
@@ -935,16 +1492,57 @@ table_show(struct Table * const table, FILE * const fo)
   char buffer[1024];
   table_analysis_short(table, buffer);
   fprintf(fo, "%s\n", buffer);
-  for (uint64_t i = 0; i < TABLE_NR_BARRELS; i++) {
+  for (uint64_t i = 0; i < table->nr_barrels; i++) {
     barrel_show(&(table->barrels[i]), fo);
   }
 }
 
-  static struct KeyValue *
-raw_barrel_lookup(const uint64_t klen0, const uint8_t * const key0, const uint8_t * const raw)
+  static bool
+raw_barrel_zip(const uint8_t * const buf)
+{
+  const struct MetaIndex * const mi = (typeof(mi))(buf + BARREL_CAP);
+  return (mi->id & METAINDEX_ZIP) ? true : false;
+}
+
+// items of a barrel: in place, or decompressed into out (BARREL_RAW_MAX bytes)
+// return the length of the items
+  static uint64_t
+raw_barrel_items(const struct CodecDict * const dict, const uint8_t * const raw, uint8_t * const out,
+    const uint8_t ** const pitems)
 {
+  if (raw_barrel_zip(raw) == false) {
+    *pitems = raw;
+    return BARREL_CAP;
+  }
+  uint16_t clen = 0, rlen = 0;
+  memcpy(&clen, raw + 1, sizeof(clen));
+  memcpy(&rlen, raw + 3, sizeof(rlen));
+  assert(((BARREL_ZHDR + clen) <= BARREL_CAP) && (rlen <= BARREL_RAW_MAX));
+  const int codec = raw[0] & (~BARREL_ZDICT);
+  const bool use_dict = (raw[0] & BARREL_ZDICT) ? true : false;
+  assert(codec_available(codec) && ((use_dict == false) || dict));
+  const uint64_t len = codec_decompress(codec, use_dict ? dict : NULL, raw + BARREL_ZHDR, clen, out, BARREL_RAW_MAX);
+  assert(len == rlen);
+  *pitems = out;
+  return len;
+}
+
+  static struct KeyValue *
+raw_barrel_lookup(struct MetaTable * const mt, const uint64_t klen0, const uint8_t * const key0,
+    const uint8_t * const raw)
+{
+  struct Stat * const stat = mt->stat;
+  uint8_t out[BARREL_RAW_MAX];
+  const uint8_t * items = NULL;
+  const bool zip = raw_barrel_zip(raw);
+  const uint64_t usec0 = zip ? debug_time_usec() : 0;
+  const uint64_t len = raw_barrel_items(mt->dict, raw, out, &items);
+  if (zip && stat) {
+    stat_hot_inc(&(stat->nr_decompress));
+    stat_hot_inc_n(&(stat->usec_decompress), debug_diff_usec(usec0));
+  }
   struct RawItem ri;
-  if (rawitem_init(&ri, raw) == false) {
+  if (rawitem_init(&ri, items, len) == false) {
     return NULL;
   }
 
@@ -962,15 +1560,113 @@ raw_barrel_lookup(const uint64_t klen0, const uint8_t * const key0, const uint8_
   static bool
 raw_barrel_fetch(struct MetaTable * const mt, const uint64_t barrel_id, uint8_t * const buf)
 {
+  const uint8_t * const image = mt->image;
+  if (image) {
+    memcpy(buf, image + (barrel_id * BARREL_ALIGN), BARREL_ALIGN);
+    if (mt->stat) {
+      stat_hot_inc(&(mt->stat->nr_fetch_image));
+      stat_hot_inc(&(mt->stat->nr_table_read[mt->start_bit]));
+    }
+    return true;
+  }
   const uint64_t off_barrel = (barrel_id * BARREL_ALIGN) + mt->mfh.off;
+  const uint64_t usec0 = (STAT_HOT && mt->stat) ? debug_time_usec() : 0;
   const ssize_t r = pread(mt->raw_fd, buf, BARREL_ALIGN, (off_t)off_barrel);
 
   if (mt->stat) {
-    __sync_add_and_fetch(&(mt->stat->nr_fetch_barrel), 1);
-  }   
+    stat_hot_inc(&(mt->stat->nr_fetch_barrel));
+    stat_hot_inc(&(mt->stat->nr_table_read[mt->start_bit]));
+    if (STAT_HOT) stat_lat_since(mt->stat, STAT_LAT_FETCH_BARREL, usec0);
+  }
   return (r == BARREL_ALIGN)?true:false;
 }
 
+// a native AIO context for each thread, see raw_barrel_fetch_pair()
+static pthread_key_t table_aio_key;
+static pthread_once_t table_aio_once = PTHREAD_ONCE_INIT;
+static __thread aio_context_t table_aio_ctx = 0;
+static __thread bool table_aio_failed = false;
+
+  static void
+table_aio_destroy(void * const p)
+{
+  (void)p;
+  syscall(SYS_io_destroy, table_aio_ctx);
+}
+
+  static void
+table_aio_key_create(void)
+{
+  pthread_key_create(&table_aio_key, table_aio_destroy);
+}
+
+// 0 if native AIO is not available
+  static aio_context_t
+table_aio_context(void)
+{
+  if (table_aio_ctx || table_aio_failed) return table_aio_ctx;
+  pthread_once(&table_aio_once, table_aio_key_create);
+  aio_context_t ctx = 0;
+  if (syscall(SYS_io_setup, 2, &ctx) != 0) {
+    table_aio_failed = true;
+    return 0;
+  }
+  table_aio_ctx = ctx;
+  pthread_setspecific(table_aio_key, (void *)1);
+  return ctx;
+}
+
+// two barrels with one wait, for a key that may be in either. only with O_DIRECT: on buffered I/O io_submit()
+// reads the pages itself before it returns, so it is two preads with more syscalls
+  static bool
+raw_barrel_fetch_pair(struct MetaTable * const mt, const uint64_t id0, uint8_t * const buf0,
+    const uint64_t id1, uint8_t * const buf1)
+{
+  const aio_context_t ctx = ((mt->image == NULL) && mt->direct) ? table_aio_context() : 0;
+  if (ctx == 0) {
+    return raw_barrel_fetch(mt, id0, buf0) && raw_barrel_fetch(mt, id1, buf1);
+  }
+  const uint64_t usec0 = (STAT_HOT && mt->stat) ? debug_time_usec() : 0;
+  struct iocb cbs[2];
+  bzero(cbs, sizeof(cbs));
+  const uint64_t ids[2] = {id0, id1};
+  uint8_t * const bufs[2] = {buf0, buf1};
+  struct iocb * pcbs[2];
+  for (uint64_t i = 0; i < 2; i++) {
+    cbs[i].aio_fildes = (uint32_t)mt->raw_fd;
+    cbs[i].aio_lio_opcode = IOCB_CMD_PREAD;
+    cbs[i].aio_buf = (uint64_t)bufs[i];
+    cbs[i].aio_nbytes = BARREL_ALIGN;
+    cbs[i].aio_offset = (int64_t)((ids[i] * BARREL_ALIGN) + mt->mfh.off);
+    pcbs[i] = &(cbs[i]);
+  }
+  const long nr_sub = syscall(SYS_io_submit, ctx, 2, pcbs);
+  if (nr_sub <= 0) { // as if no native AIO
+    return raw_barrel_fetch(mt, id0, buf0) && raw_barrel_fetch(mt, id1, buf1);
+  }
+  struct io_event evs[2];
+  long nr_done = 0;
+  while (nr_done < nr_sub) {
+    const long r = syscall(SYS_io_getevents, ctx, nr_sub - nr_done, nr_sub - nr_done, evs + nr_done, NULL);
+    if ((r < 0) && (errno == EINTR)) continue;
+    assert(r > 0);
+    nr_done += r;
+  }
+  bool ok = true;
+  for (long i = 0; i < nr_done; i++) {
+    if (evs[i].res != BARREL_ALIGN) ok = false;
+  }
+  if (mt->stat) {
+    stat_hot_inc_n(&(mt->stat->nr_fetch_barrel), (uint64_t)nr_sub);
+    stat_hot_inc_n(&(mt->stat->nr_table_read[mt->start_bit]), (uint64_t)nr_sub);
+    if (STAT_HOT) stat_lat_since(mt->stat, STAT_LAT_FETCH_BARREL, usec0);
+  }
+  if (nr_sub == 1) { // the second was not taken
+    return ok && raw_barrel_fetch(mt, id1, buf1);
+  }
+  return ok;
+}
+
   static bool
 raw_barrel_fetch_multiple(struct MetaTable * const mt, const uint64_t start_id,
     const uint64_t nbarrels, uint8_t *const buf)
@@ -978,49 +1674,58 @@ raw_barrel_fetch_multiple(struct MetaTable * const mt, const uint64_t start_id,
   const uint64_t off_barrel = (start_id * BARREL_ALIGN) + mt->mfh.off;
   const size_t bytes = BARREL_ALIGN * nbarrels;
   const ssize_t r = pread(mt->raw_fd, buf, bytes, (off_t)off_barrel);
-  return (r == BARREL_ALIGN)?true:false;
+  return (r == ((ssize_t)bytes))?true:false;
 }
 
-  static const struct MetaIndex *
+// without METAINDEX_ZIP; the rid may carry METAINDEX_TIE
+  static struct MetaIndex
 raw_barrel_metaindex(const uint8_t * const buf)
 {
-  const uint8_t * const pmi = (typeof(pmi))(buf + BARREL_CAP);
-  const struct MetaIndex * const mi = (typeof(mi))pmi;
+  struct MetaIndex mi;
+  memcpy(&mi, buf + BARREL_CAP, sizeof(mi));
+  mi.id &= (~METAINDEX_ZIP);
   return mi;
 }
 
   static bool
-raw_barrel_feed_to_tables(uint8_t * const raw, struct Table * const * const tables,
-    uint64_t (*select_table)(const uint8_t * const, const uint64_t), const uint64_t arg2)
+raw_barrel_feed_to_tables(const struct CodecDict * const dict, uint8_t * const raw,
+    struct Table * const * const tables, uint64_t (*select_table)(const uint8_t * const, const uint64_t),
+    const uint64_t arg2)
 {
+  uint8_t out[BARREL_RAW_MAX];
+  const uint8_t * items = NULL;
+  const uint64_t len = raw_barrel_items(dict, raw, out, &items);
   struct RawItem ri;
   uint8_t hash[HASHBYTES] __attribute__((aligned(8)));
-  const bool r = rawitem_init(&ri, raw);
-  if (r == false) return false;
+  const bool r = rawitem_init(&ri, items, len);
+  // a sparse table may have empty barrels: a zero key length first
+  if (r == false) return (len && (items[0] == 0)) ? true : false;
   do {
     SHA1(ri.pk, ri.klen, hash);
     const uint64_t tid = select_table(hash, arg2);
-    table_insert_rawitem_mt(tables[tid], &ri, hash);
+    // tables not in memory are filled by another pass
+    if (tables[tid]) {
+      table_insert_rawitem_mt(tables[tid], &ri, hash);
+    }
   } while (rawitem_next(&ri));
   return true;
 }
 
 // input -> MetaTable
-  struct MetaTable *
-metatable_load(const char * const metafn, const int raw_fd, const bool load_bf, struct Stat * const stat)
+  static struct MetaTable *
+metatable_load_stream(FILE * const fi, const int raw_fd, const uint64_t nr_barrels, const bool load_bf,
+    struct Stat * const stat)
 {
-  FILE * fi = fopen(metafn, "rb");
-  if (fi == NULL) { return NULL; }
-
   // load header
   struct MetaTable * const mt = (typeof(mt))malloc(sizeof(*mt));
   bzero(mt, sizeof(*mt));
   assert(mt);
   const size_t nh = fread(&(mt->mfh), sizeof(mt->mfh), 1, fi);
   assert(nh == 1);
+  mt->nr_barrels = nr_barrels;
   // load overflowner metadata
   const uint64_t nr_mi = mt->mfh.nr_mi;
-  assert(nr_mi <= TABLE_NR_BARRELS);
+  assert(nr_mi <= nr_barrels);
   if (nr_mi) {
     struct MetaIndex * const mis = (typeof(mis))malloc(sizeof(*mis) * nr_mi);
     assert(mis);
@@ -1032,7 +1737,7 @@ metatable_load(const char * const metafn, const int raw_fd, const bool load_bf,
   // load bloom-filter
   if (load_bf) {
     struct BloomTable * const bt = bloomtable_load(fi);
-    assert(bt);
+    assert(bt && (bt->nr_bf == nr_barrels));
     mt->bt = bt;
   } else {
     mt->bt = NULL;
@@ -1040,37 +1745,101 @@ metatable_load(const char * const metafn, const int raw_fd, const bool load_bf,
 
   // set raw_fd
   mt->raw_fd = raw_fd;
+  const int fl = fcntl(raw_fd, F_GETFL);
+  mt->direct = ((fl != -1) && (fl & O_DIRECT)) ? true : false;
   mt->stat = stat;
+  return mt;
+}
+
+  struct MetaTable *
+metatable_load(const char * const metafn, const int raw_fd, const uint64_t nr_barrels, const bool load_bf,
+    struct Stat * const stat)
+{
+  FILE * fi = fopen(metafn, "rb");
+  if (fi == NULL) { return NULL; }
+  struct MetaTable * const mt = metatable_load_stream(fi, raw_fd, nr_barrels, load_bf, stat);
   fclose(fi);
   return mt;
 }
 
+// one read; without bloom-filter only the header and MetaIndex are read
+  struct MetaTable *
+metatable_load_packed(const int raw_fd, const uint64_t off, const uint64_t nr_barrels, const uint64_t meta_cap,
+    const bool load_bf, struct Stat * const stat)
+{
+  const uint64_t head0 = sizeof(struct MetaFileHeader) + (sizeof(struct MetaIndex) * nr_barrels);
+  const uint64_t head = (head0 + BARREL_ALIGN - 1u) / BARREL_ALIGN * BARREL_ALIGN;
+  const uint64_t nr_bytes = (load_bf || (head > meta_cap))?meta_cap:head;
+  uint8_t * image = NULL;
+  const int ra = posix_memalign((void **)(&image), BARREL_ALIGN, nr_bytes);
+  assert((ra == 0) && image);
+  // may be short at the end of a regular file
+  const ssize_t nr = pread(raw_fd, image, nr_bytes, (off_t)(off + (BARREL_ALIGN * nr_barrels)));
+  if (nr < ((ssize_t)sizeof(struct MetaFileHeader))) {
+    free(image);
+    return NULL;
+  }
+  FILE * const fi = fmemopen(image, (size_t)nr, "rb");
+  assert(fi);
+  struct MetaTable * const mt = metatable_load_stream(fi, raw_fd, nr_barrels, load_bf, stat);
+  fclose(fi);
+  free(image);
+  assert(mt->mfh.off == off);
+  mt->packed = true;
+  return mt;
+}
+
+// stage: STAT_STAGE_FETCH_BARREL for the first barrel, STAT_STAGE_FETCH_OVERFLOW for the others.
+// buf holds two barrels; with prefetched, the first already holds barrel bid
   static struct KeyValue *
 metatable_recursive_lookup(struct MetaTable * const mt, const uint16_t bid, uint8_t * const buf,
-    const uint16_t klen, const uint8_t * const key, const uint8_t * const hash)
+    const uint16_t klen, const uint8_t * const key, const uint8_t * const hash, const enum StatStage stage,
+    const bool prefetched)
 {
-  assert(bid < TABLE_NR_BARRELS);
+  assert(bid < mt->nr_barrels);
   const uint32_t hash32 = __hash_order(hash, bid);
 
   const struct MetaIndex * const mi0 = __find_metaindex(mt->mfh.nr_mi, mt->mis, bid);
-  const bool fetch0 = (mi0 == NULL) || (hash32 >= mi0->min);
+  // at a tie: the key may be in either barrel, both are read at once
+  if ((prefetched == false) && mi0 && (hash32 == mi0->min) && (mi0->rid & METAINDEX_TIE)) {
+    const uint16_t rid0 = mi0->rid & (~METAINDEX_TIE);
+    const uint64_t t0 = stat_stage_begin();
+    const bool rf = raw_barrel_fetch_pair(mt, bid, buf, rid0, buf + BARREL_ALIGN);
+    assert(rf);
+    stat_stage_end(stage, t0);
+    const uint64_t t1 = stat_stage_begin();
+    struct KeyValue * const kv = raw_barrel_lookup(mt, klen, key, buf);
+    stat_stage_end(STAT_STAGE_PARSE, t1);
+    if (kv) return kv;
+    memcpy(buf, buf + BARREL_ALIGN, BARREL_ALIGN);
+    return metatable_recursive_lookup(mt, rid0, buf, klen, key, hash, STAT_STAGE_FETCH_OVERFLOW, true);
+  }
+  const bool fetch0 = (prefetched == false) && ((mi0 == NULL) || (hash32 >= mi0->min));
   if (fetch0) {
+    const uint64_t t0 = stat_stage_begin();
     const bool rf = raw_barrel_fetch(mt, bid, buf);
     assert(rf);
+    stat_stage_end(stage, t0);
   }
-  const struct MetaIndex * const mi = mi0?mi0:raw_barrel_metaindex(buf);
-  if (hash32 < mi->min) { // mast be in another barrel
-    assert(mi->id != mi->rid);
-    return metatable_recursive_lookup(mt, mi->rid, buf, klen, key, hash);
+  const struct MetaIndex mi = mi0?(*mi0):raw_barrel_metaindex(buf);
+  const uint16_t rid = mi.rid & (~METAINDEX_TIE);
+  if (hash32 < mi.min) { // mast be in another barrel
+    assert(mi.id != rid);
+    return metatable_recursive_lookup(mt, rid, buf, klen, key, hash, STAT_STAGE_FETCH_OVERFLOW, false);
   }
 
-  if (fetch0 == false) {
+  if ((fetch0 == false) && (prefetched == false)) {
+    const uint64_t t0 = stat_stage_begin();
     const bool rf = raw_barrel_fetch(mt, bid, buf);
     assert(rf);
+    stat_stage_end(stage, t0);
   }
-  struct KeyValue * const kv = raw_barrel_lookup(klen, key, buf);
-  if ((kv == NULL) && (hash32 == mi->min) && (mi->id != mi->rid)) {// maybe in another barrel
-    return metatable_recursive_lookup(mt, mi->rid, buf, klen, key, hash);
+  const uint64_t t1 = stat_stage_begin();
+  struct KeyValue * const kv = raw_barrel_lookup(mt, klen, key, buf);
+  stat_stage_end(STAT_STAGE_PARSE, t1);
+  // tables written before METAINDEX_TIE may have a tie without the flag
+  if ((kv == NULL) && (hash32 == mi.min) && (mi.id != rid)) {// maybe in another barrel
+    return metatable_recursive_lookup(mt, rid, buf, klen, key, hash, STAT_STAGE_FETCH_OVERFLOW, false);
   } else { // must in current barrel
     return kv;
   }
@@ -1080,25 +1849,29 @@ metatable_recursive_lookup(struct MetaTable * const mt, const uint16_t bid, uint
 metatable_lookup(struct MetaTable * const mt, const uint16_t klen,
     const uint8_t * const key, const uint8_t * const hash)
 {
-  const uint16_t bid = table_select_barrel(hash);
+  const uint16_t bid = table_select_barrel(hash, mt->nr_barrels);
   if (mt->bt) {
+    const uint64_t t0 = stat_stage_begin();
     const uint64_t hv = __hash_bf(hash);
     const bool exist = bloomtable_match(mt->bt, bid, hv);
+    stat_stage_end(STAT_STAGE_BLOOM, t0);
     if (exist == false) {
       if (mt->stat) {
-        __sync_add_and_fetch(&(mt->stat->nr_true_negative), 1);
+        stat_hot_inc(&(mt->stat->nr_true_negative));
       }
       return NULL;
     }
   }
-  uint8_t * buf = aligned_alloc(BARREL_ALIGN, BARREL_ALIGN);
-  struct KeyValue * const kv = metatable_recursive_lookup(mt, bid, buf, klen, key, hash);
+  if (mt->stat) stat_hot_inc(&(mt->stat->nr_table_lookup[mt->start_bit]));
+  uint8_t * buf = aligned_alloc(BARREL_ALIGN, BARREL_ALIGN * 2u);
+  struct KeyValue * const kv = metatable_recursive_lookup(mt, bid, buf, klen, key, hash, STAT_STAGE_FETCH_BARREL,
+      false);
   free(buf);
   if (mt->stat) {
     if (kv) {
-      __sync_add_and_fetch(&(mt->stat->nr_true_positive), 1);
+      stat_hot_inc(&(mt->stat->nr_true_positive));
     } else {
-      __sync_add_and_fetch(&(mt->stat->nr_false_positive), 1);
+      stat_hot_inc(&(mt->stat->nr_false_positive));
     }
   }
   return kv;
@@ -1113,19 +1886,59 @@ metatable_free(struct MetaTable * const mt)
   if (mt->mis) {
     free(mt->mis);
   }
+  if (mt->image) {
+    huge_free(mt->image, BARREL_ALIGN * (mt->nr_barrels + 1u));
+  }
   free(mt);
 }
 
+// barrels read at a time by metatable_walk_vptrs()
+#define METATABLE_WALK_NR ((UINT64_C(256)))
+
+// fn on the ValuePtr of every separated value of the table, reading all its barrels
+  bool
+metatable_walk_vptrs(struct MetaTable * const mt, void (*fn)(void * const, const struct ValuePtr * const),
+    void * const arg)
+{
+  uint8_t * const arena = (typeof(arena))aligned_alloc(BARREL_ALIGN, BARREL_ALIGN * METATABLE_WALK_NR);
+  assert(arena);
+  uint8_t out[BARREL_RAW_MAX];
+  bool ok = true;
+  for (uint64_t j = 0; ok && (j < mt->nr_barrels); j += METATABLE_WALK_NR) {
+    const uint64_t nr = ((j + METATABLE_WALK_NR) > mt->nr_barrels) ? (mt->nr_barrels - j) : METATABLE_WALK_NR;
+    if (raw_barrel_fetch_multiple(mt, j, nr, arena) == false) {
+      ok = false;
+      break;
+    }
+    for (uint64_t i = 0; i < nr; i++) {
+      const uint8_t * items = NULL;
+      const uint64_t len = raw_barrel_items(mt->dict, &(arena[i * BARREL_ALIGN]), out, &items);
+      struct RawItem ri;
+      if (rawitem_init(&ri, items, len) == false) continue; // empty
+      do {
+        if (ri.flags & KV_FLAG_VPTR) {
+          struct ValuePtr vp;
+          assert(ri.vlen == sizeof(vp));
+          memcpy(&vp, ri.pv, sizeof(vp));
+          fn(arg, &vp);
+        }
+      } while (rawitem_next(&ri));
+    }
+  }
+  free(arena);
+  return ok;
+}
+
   bool
 metatable_feed_barrels_to_tables(struct MetaTable * const mt, const uint16_t start,
     const uint16_t nr, uint8_t * const arena, struct Table * const * const tables,
     uint64_t (*select_table)(const uint8_t * const, const uint64_t), const uint64_t arg2)
 {
-  assert((start + nr) <= TABLE_NR_BARRELS);
+  assert((start + nr) <= mt->nr_barrels);
   raw_barrel_fetch_multiple(mt, start, nr, arena);
   for (uint64_t i = 0; i < nr; i++) {
     uint8_t * const raw = &(arena[i * BARREL_ALIGN]);
-    const bool rf = raw_barrel_feed_to_tables(raw, tables, select_table, arg2);
+    const bool rf = raw_barrel_feed_to_tables(mt->dict, raw, tables, select_table, arg2);
     assert(rf);
   }
   return true;
@@ -11,15 +11,30 @@
 #include "stat.h"
 #include "bloom.h"
 #include "mempool.h"
+#include "codec.h"
+#include "ratelimit.h"
 
 struct KeyValue {
   uint16_t klen;
-  uint16_t vlen;
+  uint16_t flags; // KV_FLAG_*: ignored by db_insert(), which sets them; a table insert keeps KV_FLAG_VPTR
+  uint32_t vlen;
   uint8_t * pk;
   uint8_t * pv;
   uint8_t kv[]; // don't access it
 };
 
+// pv points to a struct ValuePtr
+#define KV_FLAG_VPTR ((1u))
+// a reference to a copy in the row cache, see rowcache.h and db_release()
+#define KV_FLAG_CACHED ((2u))
+
+// a value separated into the value log, see vlog.h
+struct ValuePtr {
+  uint32_t dev;   // index of the storage device in cm_conf
+  uint32_t len;
+  uint64_t off;   // device offset
+} __attribute__ ((packed));
+
 #define HASHBYTES ((20))
 
 #define TABLE_MAX_BARRELS ((UINT64_C(8192)))
@@ -31,10 +46,19 @@ struct KeyValue {
 #define TABLE_ALIGN       ((BARREL_ALIGN * TABLE_MAX_BARRELS))
 // 8MB
 #define TABLE_NR_IO       ((UINT64_C(2048)))
+// packed metadata follows the last barrel (of a one-unit table)
+#define TABLE_META_OFF    ((BARREL_ALIGN * TABLE_NR_BARRELS))
+// a larger table spans up to 4 adjacent 32MB units;
+// barrel ids stay below 0x8000, see METAINDEX_ZIP in table.c
+#define TABLE_MAX_SCALE   ((UINT64_C(4)))
+#define TABLE_SCALE_BARRELS(scale) ((TABLE_MAX_BARRELS * (scale)) - 1u)
+#define TABLE_UNITS(nr_barrels)    (((nr_barrels) + 1u) / TABLE_MAX_BARRELS)
+#define TABLE_LIMIT_BARRELS ((TABLE_MAX_BARRELS * TABLE_MAX_SCALE))
 
 #define TABLE_ILOCKS_NR ((UINT64_C(64)))
 
 struct Table {
+  uint64_t nr_barrels; // TABLE_SCALE_BARRELS()
   uint64_t volume;
   uint64_t capacity;
   struct Mempool * mempool; // store items
@@ -44,6 +68,21 @@ struct Table {
   struct MetaIndex * mis;
   struct BloomTable *bt;
   pthread_mutex_t ilocks[TABLE_ILOCKS_NR]; // used for parallel compaction feed
+  // called on each overwritten value-log pointer, see table_set_vdrop()
+  void (*vdrop)(void * const, const struct ValuePtr * const);
+  void * vdrop_arg;
+  int codec;          // CODEC_*: barrels over 4KB are compressed to fit
+  uint64_t zvolume;   // raw bytes of the compressed barrels, set by table_retain()
+  uint64_t zsize;     // their compressed bytes
+  struct CodecDict * dict; // shared by other tables, not owned
+  struct RateLimit * wlimit; // taken before each write of the dump, NULL: unlimited
+  uint64_t nr_replaced; // items dropped for a newer version
+  uint64_t over;        // bytes over the cap in the barrels, kept by the inserts, see table_full()
+  bool full_mi;         // a MetaIndex for every overflown barrel, see table_set_full_metaindex()
+  uint64_t seq;         // odd while table_retain() moves items, see table_lookup()
+  uint8_t * image;      // the dump copies the barrels here too, see table_set_image()
+  uint64_t usec_write;  // in the writes of the last dump, without the pacing by wlimit
+  uint64_t refused;     // bytes the compaction feed turned away, see table_insert_rawitem_mt()
 };
 
 struct MetaFileHeader {
@@ -54,29 +93,68 @@ struct MetaFileHeader {
 
 struct MetaTable {
   struct MetaFileHeader mfh;
+  uint64_t nr_barrels; // given by the owner at loading
   int raw_fd;
   uint64_t mtid;
   struct MetaIndex * mis;
   struct BloomTable * bt;
-  struct Stat * stat;
+  struct Stat * stat; // the first of STAT_NR_SHARDS, see stat_inc()
+  bool packed; // metadata stored right after the last barrel
+  bool direct; // raw_fd bypasses the page cache, see raw_barrel_fetch_pair()
+  uint64_t dict_id;        // dictionary of the compressed barrels, 0: none
+  struct CodecDict * dict; // set by the owner before reading barrels
+  uint64_t start_bit;  // of its level, for the counters by level in stat; set by the owner
+  uint8_t * image;    // the barrels in memory, read instead of raw_fd; huge_alloc()ed, freed with the MetaTable
 };
 
 // ----Table
 uint16_t
-table_select_barrel(const uint8_t * const hash);
+table_select_barrel(const uint8_t * const hash, const uint64_t nr_barrels);
 
 bool
 table_retain(struct Table * const table);
 
 struct Table *
-table_alloc_new(const double cap_percent, const double mempool_factor);
+table_spill(struct Table * const table);
+
+struct Table *
+table_alloc_new(const uint64_t nr_barrels, const double cap_percent, const double mempool_factor);
 
 struct Table *
 table_alloc_default(const double mempool_factor);
 
+struct Table *
+table_alloc_codec(const int codec, const uint64_t nr_barrels, const double fill, const double mempool_factor);
+
+void
+table_set_vdrop(struct Table * const table, void (*vdrop)(void * const, const struct ValuePtr * const),
+    void * const arg);
+
+void
+table_set_rate_limit(struct Table * const table, struct RateLimit * const wlimit);
+
+void
+table_set_full_metaindex(struct Table * const table, const bool full);
+
+void
+table_set_image(struct Table * const table, uint8_t * const image);
+
+bool
+table_kv_fits(const struct KeyValue * const kv);
+
+void
+table_set_dict(struct Table * const table, struct CodecDict * const dict);
+
+uint64_t
+table_sample_items(struct Table * const table, const uint64_t stride, uint8_t * const buf,
+    const uint64_t cap, uint64_t * const sizes, const uint64_t max);
+
 bool
 table_insert_kv_safe(struct Table * const table, const struct KeyValue * const kv);
 
+bool
+table_insert_kv_hash_safe(struct Table * const table, const struct KeyValue * const kv, const uint8_t * const hash);
+
 bool
 table_full(const struct Table *const table);
 
@@ -93,6 +171,12 @@ table_dump_meta(struct Table *const table, const char * const metafn, const uint
 uint64_t
 table_dump_barrels(struct Table * const table, const int fd, const uint64_t off);
 
+uint64_t
+table_meta_size(const struct Table * const table);
+
+uint64_t
+table_dump_packed(struct Table * const table, const int fd, const uint64_t off, const uint64_t meta_cap);
+
 void
 table_free(struct Table * const table);
 
@@ -107,7 +191,12 @@ table_show(struct Table * const table, FILE * const fo);
 
 // ----MetaTable
 struct MetaTable *
-metatable_load(const char * const metafn, const int raw_fd, const bool load_bf, struct Stat * const stat);
+metatable_load(const char * const metafn, const int raw_fd, const uint64_t nr_barrels, const bool load_bf,
+    struct Stat * const stat);
+
+struct MetaTable *
+metatable_load_packed(const int raw_fd, const uint64_t off, const uint64_t nr_barrels, const uint64_t meta_cap,
+    const bool load_bf, struct Stat * const stat);
 
 struct KeyValue *
 metatable_lookup(struct MetaTable * const mt, const uint16_t klen,
@@ -116,6 +205,11 @@ metatable_lookup(struct MetaTable * const mt, const uint16_t klen,
 void
 metatable_free(struct MetaTable * const mt);
 
+bool
+metatable_walk_vptrs(struct MetaTable * const mt, void (*fn)(void * const, const struct ValuePtr * const),
+    void * const arg);
+
+// items selected to a NULL table are skipped
 bool
 metatable_feed_barrels_to_tables(struct MetaTable * const mt, const uint16_t start,
     const uint16_t nr, uint8_t * const arena, struct Table * const * const tables,
@@ -21,14 +21,16 @@
 #include <string.h>
 #include <openssl/sha.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "debug.h"
 #include "table.h"
 #include "generator.h"
 #include "stat.h"
 
+// scale: units of the table, see TABLE_SCALE_BARRELS()
   static void
-table_test(const uint64_t max_value_size)
+table_test(const uint64_t scale, const uint64_t max_value_size)
 {
   srandom(debug_time_usec());
   const double t0 = debug_time_sec();
@@ -36,10 +38,13 @@ table_test(const uint64_t max_value_size)
   uint8_t hash[HASHBYTES] __attribute__((aligned(8)));
   uint8_t value[1024] __attribute__((aligned(8)));
   bzero(value, 1024);
-  struct Table * const table = table_alloc_default(1.5);
+  const uint64_t nr_barrels = TABLE_SCALE_BARRELS(scale);
+  struct Table * const table = (scale == 1) ? table_alloc_default(1.5) :
+    table_alloc_codec(CODEC_NONE, nr_barrels, 1.0, 1.5);
   struct GenInfo * const gi = generator_new_uniform(1, max_value_size);
   struct KeyValue kv;
   kv.klen = 16;
+  kv.flags = 0;
   kv.pk = key;
   kv.pv = value;
   uint64_t count = 0;
@@ -86,9 +91,9 @@ table_test(const uint64_t max_value_size)
   //metatable
   assert(rdm);
   const int fd_in = open("/tmp/raw", O_RDONLY | O_LARGEFILE, 00666);
-  struct Stat stat;
-  bzero(&stat, sizeof(stat));
-  struct MetaTable * const mt = metatable_load("/tmp/meta", fd_in, true, &stat);
+  struct Stat stat[STAT_NR_SHARDS];
+  stat_initial(stat);
+  struct MetaTable * const mt = metatable_load("/tmp/meta", fd_in, nr_barrels, true, stat);
   assert(mt);
   const double t5 = debug_time_sec();
   uint64_t found2 = 0;
@@ -102,7 +107,34 @@ table_test(const uint64_t max_value_size)
     }
   }
   const double t6 = debug_time_sec();
-  stat_show(&stat, stdout);
+  // packed: metadata after the barrels
+  {
+    const uint64_t meta_cap = ((TABLE_ALIGN + (UINT64_C(2) << 20)) * scale) - (BARREL_ALIGN * nr_barrels);
+    assert(table_meta_size(table) <= meta_cap);
+    const int fd_out = open("/tmp/raw_packed", O_CREAT | O_WRONLY | O_LARGEFILE, 00666);
+    const uint64_t nr_dump = table_dump_packed(table, fd_out, 0, meta_cap);
+    assert(nr_dump == count);
+    close(fd_out);
+    const int fd_pin = open("/tmp/raw_packed", O_RDONLY | O_LARGEFILE, 00666);
+    struct MetaTable * const mtp = metatable_load_packed(fd_pin, 0, nr_barrels, meta_cap, true, NULL);
+    assert(mtp && mtp->packed);
+    assert(mtp->mfh.nr_mi == mt->mfh.nr_mi);
+    assert(mtp->bt->nr_bytes == mt->bt->nr_bytes);
+    uint64_t found3 = 0;
+    for (uint64_t i = 0; i < count; i++) {
+      sprintf((char *)key, "%016lx", i);
+      SHA1(key, 16, hash);
+      struct KeyValue * const kv = metatable_lookup(mtp, 16, key, hash);
+      if (kv) {
+        found3++;
+        free(kv);
+      }
+    }
+    assert(found3 == found2);
+    metatable_free(mtp);
+    close(fd_pin);
+  }
+  stat_show(stat, stdout);
   table_analysis_verbose(table, stdout);
   char buffer[1024];
   table_analysis_short(table, buffer);
@@ -115,6 +147,333 @@ table_test(const uint64_t max_value_size)
   printf("lookup %lf\n", t6-t5);
   table_free(table);
   metatable_free(mt);
+  stat_destroy(stat);
+}
+
+// compressed barrels hold twice the raw capacity
+  static void
+table_zip_test(const int codec, const bool use_dict, const uint64_t max_value_size)
+{
+  uint8_t key[64] __attribute__((aligned(8)));
+  uint8_t hash[HASHBYTES] __attribute__((aligned(8)));
+  uint8_t value[1024] __attribute__((aligned(8)));
+  for (uint64_t i = 0; i < 1024; i++) {
+    value[i] = (uint8_t)("{\"name\":\"lsm-trie\",\"id\":"[i % 24]);
+  }
+  struct Table * const table = table_alloc_codec(codec, TABLE_NR_BARRELS, 2.0, 1.5);
+  struct GenInfo * const gi = generator_new_uniform(1, max_value_size);
+  struct KeyValue kv;
+  kv.klen = 16;
+  kv.flags = 0;
+  kv.pk = key;
+  kv.pv = value;
+  uint64_t count = 0;
+  while (true) {
+    sprintf((char *)key, "%016lx", count);
+    kv.vlen = gi->next(gi);
+    const bool ri = table_insert_kv_safe(table, &kv);
+    if (ri == false) {
+      break;
+    }
+    count++;
+  }
+  free(gi);
+  struct CodecDict * dict = NULL;
+  if (use_dict) {
+    uint8_t * const samples = (typeof(samples))malloc(1u << 20);
+    uint64_t * const sizes = (typeof(sizes))malloc(sizeof(sizes[0]) * 65536);
+    const uint64_t nr = table_sample_items(table, 61, samples, 1u << 20, sizes, 65536);
+    dict = codec_dict_train(codec, 1, samples, sizes, nr, 16384);
+    assert(dict);
+    table_set_dict(table, dict);
+    free(samples);
+    free(sizes);
+  }
+  const bool rbt = table_build_bloomtable(table);
+  assert(rbt == true);
+  const bool rre = table_retain(table);
+  assert(rre == true);
+  assert(table->zsize && (table->zvolume > table->zsize));
+  const int fd_out = open("/tmp/raw_zip", O_CREAT | O_WRONLY | O_LARGEFILE, 00666);
+  const uint64_t nr_dump = table_dump_barrels(table, fd_out, 0);
+  assert(nr_dump == count);
+  close(fd_out);
+  const bool rdm = table_dump_meta(table, "/tmp/meta_zip", 0);
+  assert(rdm);
+  const int fd_in = open("/tmp/raw_zip", O_RDONLY | O_LARGEFILE, 00666);
+  struct Stat stat[STAT_NR_SHARDS];
+  stat_initial(stat);
+  struct MetaTable * const mt = metatable_load("/tmp/meta_zip", fd_in, TABLE_NR_BARRELS, true, stat);
+  assert(mt);
+  mt->dict = dict;
+  for (uint64_t i = 0; i < count; i++) {
+    sprintf((char *)key, "%016lx", i);
+    SHA1(key, 16, hash);
+    struct KeyValue * const kv1 = metatable_lookup(mt, 16, key, hash);
+    assert(kv1 && (memcmp(kv1->pv, value, kv1->vlen) == 0));
+    free(kv1);
+  }
+  struct Stat sum;
+  stat_sum(stat, &sum);
+  assert(sum.nr_decompress);
+  printf("%s%s: %lu items, ratio %.2lf, %lu decompress %lu usec\n", codec_name(codec), use_dict?"+dict":"",
+      count, ((double)table->zvolume) / ((double)table->zsize), sum.nr_decompress, sum.usec_decompress);
+  table_free(table);
+  metatable_free(mt);
+  if (dict) {
+    codec_dict_free(dict);
+  }
+  close(fd_in);
+  stat_destroy(stat);
+}
+
+// with every overflown barrel indexed, each lookup of an item reads one barrel
+  static void
+table_full_mi_test(const uint64_t max_value_size)
+{
+  uint8_t key[64] __attribute__((aligned(8)));
+  uint8_t hash[HASHBYTES] __attribute__((aligned(8)));
+  uint8_t value[1024] __attribute__((aligned(8)));
+  bzero(value, sizeof(value));
+  struct Table * const table = table_alloc_default(1.5);
+  table_set_full_metaindex(table, true);
+  struct GenInfo * const gi = generator_new_uniform(1, max_value_size);
+  struct KeyValue kv;
+  kv.klen = 16;
+  kv.flags = 0;
+  kv.pk = key;
+  kv.pv = value;
+  uint64_t count = 0;
+  while (true) {
+    sprintf((char *)key, "%016lx", count);
+    kv.vlen = gi->next(gi);
+    if (table_insert_kv_safe(table, &kv) == false) break;
+    count++;
+  }
+  free(gi);
+  const bool rbt = table_build_bloomtable(table);
+  assert(rbt == true);
+  const bool rre = table_retain(table);
+  assert(rre == true);
+  const int fd_out = open("/tmp/raw_full", O_CREAT | O_WRONLY | O_LARGEFILE, 00666);
+  const uint64_t nr_dump = table_dump_barrels(table, fd_out, 0);
+  assert(nr_dump == count);
+  close(fd_out);
+  const bool rdm = table_dump_meta(table, "/tmp/meta_full", 0);
+  assert(rdm);
+  const int fd_in = open("/tmp/raw_full", O_RDONLY | O_LARGEFILE, 00666);
+  struct Stat stat[STAT_NR_SHARDS];
+  stat_initial(stat);
+  struct MetaTable * const mt = metatable_load("/tmp/meta_full", fd_in, TABLE_NR_BARRELS, true, stat);
+  assert(mt && (mt->mfh.nr_mi == table->nr_mi));
+  for (uint64_t i = 0; i < count; i++) {
+    sprintf((char *)key, "%016lx", i);
+    SHA1(key, 16, hash);
+    struct KeyValue * const kv1 = metatable_lookup(mt, 16, key, hash);
+    assert(kv1);
+    free(kv1);
+  }
+  struct Stat sum;
+  stat_sum(stat, &sum);
+  assert((STAT_HOT == 0) || (sum.nr_table_read[0] == sum.nr_table_lookup[0]));
+  char buffer[1024];
+  table_analysis_short(table, buffer);
+  printf("full metaindex: %lu items, %lu reads for %lu lookups, %s\n", count, sum.nr_table_read[0],
+      sum.nr_table_lookup[0], buffer);
+  table_free(table);
+  metatable_free(mt);
+  close(fd_in);
+  stat_destroy(stat);
+}
+
+  static uint64_t
+table_spill_dump(struct Table * const table, const char * const raw, const char * const meta,
+    struct Stat * const stat, struct MetaTable ** const pmt)
+{
+  const int fd_out = open(raw, O_CREAT | O_TRUNC | O_WRONLY | O_LARGEFILE, 00666);
+  const uint64_t nr_dump = table_dump_barrels(table, fd_out, 0);
+  close(fd_out);
+  const bool rdm = table_dump_meta(table, meta, 0);
+  assert(rdm);
+  const int fd_in = open(raw, O_RDONLY | O_LARGEFILE, 00666);
+  struct MetaTable * const mt = metatable_load(meta, fd_in, TABLE_NR_BARRELS, true, stat);
+  assert(mt);
+  *pmt = mt;
+  return nr_dump;
+}
+
+// a skewed table filled up to fill of its barrels with values of 1 to max_value_size bytes: retained
+// as it is, or with what it spilled next to it; every item is found in one of the two.
+// past_full: the overflow is not checked, as if inserts raced past table_full()
+  static void
+table_spill_test(const double fill, const uint64_t max_value_size, const bool past_full, const bool spill_first)
+{
+  uint8_t key[64] __attribute__((aligned(8)));
+  uint8_t hash[HASHBYTES] __attribute__((aligned(8)));
+  uint8_t value[2048] __attribute__((aligned(8)));
+  bzero(value, sizeof(value));
+  assert(max_value_size <= sizeof(value));
+  struct Table * const table = table_alloc_new(TABLE_NR_BARRELS, fill, 1.5);
+  struct GenInfo * const gi = generator_new_uniform(1, max_value_size);
+  struct KeyValue kv;
+  kv.klen = 16;
+  kv.flags = 0;
+  kv.pk = key;
+  kv.pv = value;
+  uint64_t count = 0;
+  while (true) {
+    sprintf((char *)key, "%016lx", count);
+    kv.vlen = gi->next(gi);
+    const uint64_t over0 = past_full ? table->over : 0;
+    table->over -= over0;
+    const bool ri = table_insert_kv_safe(table, &kv);
+    table->over += over0;
+    if (ri == false) break;
+    count++;
+  }
+  free(gi);
+  const double full = ((double)table->volume) / ((double)(table->nr_barrels * BARREL_ALIGN));
+  const uint64_t over = table->over;
+  const bool rbt = table_build_bloomtable(table);
+  assert(rbt == true);
+  struct Table * spill = NULL;
+  const bool rre = spill_first ? false : table_retain(table);
+  if (rre == false) {
+    // left as it was: every item is still found in its own barrel
+    for (uint64_t i = 0; i < count; i += 7) {
+      sprintf((char *)key, "%016lx", i);
+      SHA1(key, 16, hash);
+      struct KeyValue * const kv1 = table_lookup(table, 16, key, hash);
+      assert(kv1);
+      free(kv1);
+    }
+    spill = table_spill(table);
+    assert(spill && (table->over == 0) && table->bt);
+    const bool rre1 = table_retain(table);
+    assert(rre1);
+    const bool rbt2 = table_build_bloomtable(spill);
+    assert(rbt2);
+    const bool rre2 = table_retain(spill);
+    assert(rre2);
+  }
+  struct Stat stat[STAT_NR_SHARDS];
+  stat_initial(stat);
+  struct MetaTable * mt = NULL;
+  struct MetaTable * mt2 = NULL;
+  uint64_t nr_dump = table_spill_dump(table, "/tmp/raw_spill", "/tmp/meta_spill", stat, &mt);
+  if (spill) {
+    nr_dump += table_spill_dump(spill, "/tmp/raw_spill2", "/tmp/meta_spill2", stat, &mt2);
+  }
+  assert(nr_dump == count);
+  for (uint64_t i = 0; i < count; i++) {
+    sprintf((char *)key, "%016lx", i);
+    SHA1(key, 16, hash);
+    struct KeyValue * const kv1 = metatable_lookup(mt, 16, key, hash);
+    struct KeyValue * const kv2 = mt2 ? metatable_lookup(mt2, 16, key, hash) : NULL;
+    assert((kv1 == NULL) != (kv2 == NULL));
+    free(kv1 ? kv1 : kv2);
+  }
+  printf("spill: %lu items, %.1lf%% full, %lu over, %s, %lu bytes spilled\n", count, full * 100.0, over,
+      spill_first ? "spilled first" : (rre ? "retained" : "not retained"), spill ? spill->volume : 0);
+  table_free(table);
+  close(mt->raw_fd);
+  metatable_free(mt);
+  if (spill) {
+    table_free(spill);
+    close(mt2->raw_fd);
+    metatable_free(mt2);
+  }
+  stat_destroy(stat);
+}
+
+#define TABLE_TEST_NR_LOOKERS ((4))
+
+struct TableTestShared {
+  struct Table * table;
+  uint64_t count;
+  uint64_t stop;
+  uint64_t nr_lookups;
+};
+
+// the value of key i: its length and its bytes follow from i
+  static uint16_t
+table_test_vlen(const uint64_t i, const uint64_t max_value_size)
+{
+  return (uint16_t)(1u + ((i * UINT64_C(7919)) % max_value_size));
+}
+
+  static void *
+table_test_looker(void * const ptr)
+{
+  struct TableTestShared * const shared = (typeof(shared))ptr;
+  uint8_t key[64] __attribute__((aligned(8)));
+  uint8_t hash[HASHBYTES] __attribute__((aligned(8)));
+  uint64_t nr = 0;
+  uint64_t i = (uint64_t)random();
+  while (__sync_fetch_and_add(&(shared->stop), 0) == 0) {
+    i = (i * UINT64_C(6364136223846793005)) + UINT64_C(1442695040888963407);
+    const uint64_t k = (i >> 16) % shared->count;
+    sprintf((char *)key, "%016lx", k);
+    SHA1(key, 16, hash);
+    struct KeyValue * const kv = table_lookup(shared->table, 16, key, hash);
+    assert(kv && (kv->vlen == table_test_vlen(k, 2000)));
+    assert((kv->pv[0] == (uint8_t)k) && (kv->pv[kv->vlen - 1u] == (uint8_t)k));
+    free(kv);
+    nr++;
+  }
+  __sync_fetch_and_add(&(shared->nr_lookups), nr);
+  pthread_exit(NULL);
+}
+
+// lookups of every key go on while table_retain() moves items, or fails and moves them back;
+// a failed one is tried again and again for more of the lookups to run into the moves
+  static void
+table_retain_lookup_test(const bool past_full)
+{
+  uint8_t key[64] __attribute__((aligned(8)));
+  uint8_t value[2048] __attribute__((aligned(8)));
+  struct Table * const table = table_alloc_new(TABLE_NR_BARRELS, past_full ? 1.0 : 0.85, 1.5);
+  struct KeyValue kv;
+  kv.klen = 16;
+  kv.flags = 0;
+  kv.pk = key;
+  kv.pv = value;
+  uint64_t count = 0;
+  while (true) {
+    sprintf((char *)key, "%016lx", count);
+    kv.vlen = table_test_vlen(count, 2000);
+    memset(value, (uint8_t)count, kv.vlen);
+    const uint64_t over0 = past_full ? table->over : 0;
+    table->over -= over0;
+    const bool ri = table_insert_kv_safe(table, &kv);
+    table->over += over0;
+    if (ri == false) break;
+    count++;
+  }
+  struct TableTestShared shared = {.table = table, .count = count};
+  pthread_t ths[TABLE_TEST_NR_LOOKERS];
+  for (uint64_t i = 0; i < TABLE_TEST_NR_LOOKERS; i++) {
+    pthread_create(&(ths[i]), NULL, table_test_looker, &shared);
+  }
+  usleep(10000);
+  const double t0 = debug_time_sec();
+  bool rre = false;
+  uint64_t nr_retain = 0;
+  do {
+    rre = table_retain(table);
+    nr_retain++;
+  } while ((rre == false) && (nr_retain < 50));
+  const double t1 = debug_time_sec();
+  usleep(10000);
+  __sync_fetch_and_add(&(shared.stop), 1);
+  for (uint64_t i = 0; i < TABLE_TEST_NR_LOOKERS; i++) {
+    pthread_join(ths[i], NULL);
+  }
+  assert(rre != past_full);
+  assert(shared.nr_lookups);
+  printf("retain with lookups: %lu items, %s %lu times in %.3lf s, %lu lookups\n", count,
+      rre ? "retained" : "not retained", nr_retain, t1 - t0, shared.nr_lookups);
+  table_free(table);
 }
 
   int
@@ -122,10 +481,24 @@ main(int argc, char ** argv)
 {
   (void)argc;
   (void)argv;
-  table_test(200);
-  table_test(300);
-  table_test(400);
-  table_test(500);
-  table_test(600);
+  table_test(1, 200);
+  table_test(1, 300);
+  table_test(1, 400);
+  table_test(1, 500);
+  table_test(1, 600);
+  table_test(2, 300);
+  table_test(4, 300);
+  table_full_mi_test(600);
+  table_spill_test(0.85, 2000, false, false);
+  table_spill_test(0.85, 2000, false, true);
+  table_spill_test(1.0, 2000, true, false);
+  table_retain_lookup_test(false);
+  table_retain_lookup_test(true);
+  for (int codec = CODEC_ZLIB; codec < CODEC_NR; codec++) {
+    if (codec_available(codec)) {
+      table_zip_test(codec, false, 300);
+      table_zip_test(codec, true, 300);
+    }
+  }
   return 0;
 }
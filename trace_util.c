@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+// write amplification of the subtrees at a level, from the "out" events of a TRACE file:
+// what the level above (or the memtable) writes into a subtree is its input,
+// what is written anywhere in the subtree, merges included, is its output
+
+struct Window {
+  uint64_t * ingest; // bytes by subtree
+  uint64_t * written;
+};
+
+  static void
+window_show(const struct Window * const w, const uint64_t nr, const uint64_t level, const double sec0,
+    const double sec1)
+{
+  uint64_t all_ingest = 0;
+  uint64_t all_written = 0;
+  for (uint64_t i = 0; i < nr; i++) {
+    if (w->written[i] == 0) continue;
+    all_ingest += w->ingest[i];
+    all_written += w->written[i];
+    printf("%10.1lf %10.1lf L%lu %8lx %10lu %10lu %8.2lf\n", sec0, sec1, level, i, w->ingest[i] >> 20,
+        w->written[i] >> 20, w->ingest[i] ? (((double)w->written[i]) / ((double)w->ingest[i])) : 0.0);
+  }
+  if (all_written) {
+    printf("%10.1lf %10.1lf L%lu %8s %10lu %10lu %8.2lf\n", sec0, sec1, level, "all", all_ingest >> 20,
+        all_written >> 20, all_ingest ? (((double)all_written) / ((double)all_ingest)) : 0.0);
+  }
+  bzero(w->ingest, sizeof(w->ingest[0]) * nr);
+  bzero(w->written, sizeof(w->written[0]) * nr);
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc < 2) {
+    printf("usage: %s <TRACE> [<level> [<window seconds>]]\n", argv[0]);
+    printf("  level: the subtrees rooted at the containers of this level, default 1\n");
+    printf("  window: a report for every window, default 0 (the whole trace)\n");
+    exit(0);
+  }
+  FILE * const fi = fopen(argv[1], "r");
+  assert(fi);
+  const uint64_t level = (argc > 2) ? strtoull(argv[2], NULL, 10) : 1;
+  const double window = (argc > 3) ? strtod(argv[3], NULL) : 0.0;
+  assert(level < 8);
+  const uint64_t nr = UINT64_C(1) << (level * 3u);
+  struct Window w;
+  w.ingest = (typeof(w.ingest))calloc(nr, sizeof(w.ingest[0]));
+  w.written = (typeof(w.written))calloc(nr, sizeof(w.written[0]));
+  assert(w.ingest && w.written);
+
+  printf("%10s %10s %2s %8s %10s %10s %8s\n", "[from]", "[to]", "", "[path]", "[in MB]", "[out MB]", "[WA]");
+  char buf[4096];
+  double sec0 = 0.0;
+  double sec1 = 0.0;
+  while (fgets(buf, sizeof(buf), fi)) {
+    uint64_t id, l, path, mtid, bytes;
+    double sec;
+    char kind[16];
+    if (sscanf(buf, "{\"ev\":\"out\",\"id\":%lu,\"sec\":%lf,\"kind\":\"%15[a-z]\",\"level\":%lu,\"path\":\"%lx\","
+          "\"mtid\":%lu,\"bytes\":%lu}", &id, &sec, kind, &l, &path, &mtid, &bytes) != 7) {
+      continue;
+    }
+    if ((window > 0.0) && (sec >= (sec0 + window))) {
+      window_show(&w, nr, level, sec0, sec1);
+      while (sec >= (sec0 + window)) sec0 += window;
+    }
+    sec1 = sec;
+    if (l < level) continue;
+    const uint64_t sub = path >> ((l - level) * 3u);
+    assert(sub < nr);
+    w.written[sub] += bytes;
+    if ((l == level) && (strcmp(kind, "leaf") != 0)) {
+      w.ingest[sub] += bytes;
+    }
+  }
+  fclose(fi);
+  window_show(&w, nr, level, sec0, sec1);
+  free(w.ingest);
+  free(w.written);
+  return 0;
+}
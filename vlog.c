@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "table.h"
+#include "cmap.h"
+#include "manifest.h"
+#include "vlog.h"
+
+// values are gathered in 1MB and written in 4KB blocks (O_DIRECT friendly)
+#define VLOG_BUF_SIZE ((UINT64_C(1) << 20))
+#define VLOG_ALIGN    ((BARREL_ALIGN))
+#define VLOG_NONE     ((UINT64_MAX))
+
+  static inline uint64_t
+vlog_round_up(const uint64_t x)
+{
+  return (x + VLOG_ALIGN - 1) & (~(VLOG_ALIGN - 1));
+}
+
+  static inline struct VLogSeg *
+vlog_seg(struct VLog * const vlog, const uint64_t off)
+{
+  const uint64_t id = off / vlog->cm->unit_size;
+  assert(id < vlog->nr_segs);
+  return &(vlog->segs[id]);
+}
+
+  struct VLog *
+vlog_create(struct ContainerMap * const cm, const uint32_t dev, const uint64_t threshold)
+{
+  assert(cm);
+  struct VLog * const vlog = (typeof(vlog))malloc(sizeof(*vlog));
+  assert(vlog);
+  bzero(vlog, sizeof(*vlog));
+  vlog->cm = cm;
+  vlog->dev = dev;
+  vlog->threshold = threshold;
+  pthread_mutex_init(&(vlog->mutex), NULL);
+  vlog->seg_off = VLOG_NONE;
+  vlog->buf = (typeof(vlog->buf))aligned_alloc(VLOG_ALIGN, VLOG_BUF_SIZE);
+  assert(vlog->buf);
+  vlog->nr_segs = cm->nr_units;
+  vlog->segs = (typeof(vlog->segs))calloc(vlog->nr_segs, sizeof(vlog->segs[0]));
+  assert(vlog->segs);
+  return vlog;
+}
+
+// write buf[0, len) to buf_off, len is aligned; must hold the mutex
+  static void
+vlog_write_buf(struct VLog * const vlog, const uint64_t len)
+{
+  assert((len % VLOG_ALIGN) == 0);
+  const ssize_t nw = pwrite(vlog->cm->raw_fd, vlog->buf, len, (off_t)vlog->buf_off);
+  assert(nw == ((ssize_t)len));
+}
+
+// write the partial block (zero padded) but keep it in buf; must hold the mutex
+  static void
+vlog_write_tail(struct VLog * const vlog)
+{
+  if (vlog->buf_len == 0) return;
+  const uint64_t len = vlog_round_up(vlog->buf_len);
+  bzero(vlog->buf + vlog->buf_len, len - vlog->buf_len);
+  vlog_write_buf(vlog, len);
+  const uint64_t full = vlog->buf_len & (~(VLOG_ALIGN - 1));
+  if (full) {
+    memmove(vlog->buf, vlog->buf + full, vlog->buf_len - full);
+    vlog->buf_off += full;
+    vlog->buf_len -= full;
+  }
+}
+
+// must hold the mutex
+  static void
+vlog_seal_locked(struct VLog * const vlog)
+{
+  if (vlog->seg_off == VLOG_NONE) return;
+  vlog_write_tail(vlog);
+  struct VLogSeg * const seg = vlog_seg(vlog, vlog->seg_off);
+  seg->state = seg->live ? VLOG_SEG_SEALED : VLOG_SEG_DEAD;
+  seg->dirty = true;
+  vlog->seg_off = VLOG_NONE;
+  vlog->buf_len = 0;
+}
+
+// must hold the mutex
+  static bool
+vlog_open_locked(struct VLog * const vlog)
+{
+  const uint64_t off = containermap_alloc(vlog->cm);
+  if (off >= vlog->cm->total_cap) return false;
+  struct VLogSeg * const seg = vlog_seg(vlog, off);
+  assert(seg->state == VLOG_SEG_FREE);
+  seg->state = VLOG_SEG_OPEN;
+  seg->live = 0;
+  seg->dirty = true;
+  vlog->seg_off = off;
+  vlog->seg_used = 0;
+  vlog->buf_off = off;
+  vlog->buf_len = 0;
+  return true;
+}
+
+// the value is readable on return, and durable after vlog_flush()
+  bool
+vlog_append(struct VLog * const vlog, const uint8_t * const value, const uint32_t len,
+    struct ValuePtr * const vp)
+{
+  if (len > vlog->cm->unit_size) return false;
+  pthread_mutex_lock(&(vlog->mutex));
+  if ((vlog->seg_off == VLOG_NONE) || ((vlog->seg_used + len) > vlog->cm->unit_size)) {
+    vlog_seal_locked(vlog);
+    if (vlog_open_locked(vlog) == false) {
+      pthread_mutex_unlock(&(vlog->mutex));
+      return false;
+    }
+  }
+  vp->dev = vlog->dev;
+  vp->len = len;
+  vp->off = vlog->seg_off + vlog->seg_used;
+  uint64_t done = 0;
+  while (done < len) {
+    const uint64_t room = VLOG_BUF_SIZE - vlog->buf_len;
+    const uint64_t nr = ((len - done) < room) ? (len - done) : room;
+    memcpy(vlog->buf + vlog->buf_len, value + done, nr);
+    vlog->buf_len += nr;
+    done += nr;
+    if (vlog->buf_len == VLOG_BUF_SIZE) {
+      vlog_write_buf(vlog, VLOG_BUF_SIZE);
+      vlog->buf_off += VLOG_BUF_SIZE;
+      vlog->buf_len = 0;
+    }
+  }
+  vlog->seg_used += len;
+  vlog_seg(vlog, vlog->seg_off)->live += len;
+  vlog->nr_append++;
+  vlog->bytes_append += len;
+  pthread_mutex_unlock(&(vlog->mutex));
+  return true;
+}
+
+// make all appended values durable
+  void
+vlog_flush(struct VLog * const vlog)
+{
+  pthread_mutex_lock(&(vlog->mutex));
+  if (vlog->seg_off != VLOG_NONE) {
+    vlog_write_tail(vlog);
+  }
+  fdatasync(vlog->cm->raw_fd);
+  pthread_mutex_unlock(&(vlog->mutex));
+}
+
+// flush and close the open segment
+  void
+vlog_seal(struct VLog * const vlog)
+{
+  pthread_mutex_lock(&(vlog->mutex));
+  vlog_seal_locked(vlog);
+  fdatasync(vlog->cm->raw_fd);
+  pthread_mutex_unlock(&(vlog->mutex));
+}
+
+  bool
+vlog_read(struct VLog * const vlog, const struct ValuePtr * const vp, uint8_t * const out)
+{
+  assert(vp->dev == vlog->dev);
+  const uint64_t end = vp->off + vp->len;
+  uint64_t dev_end = end;
+  // the unwritten part is copied from buf
+  pthread_mutex_lock(&(vlog->mutex));
+  if ((vlog->seg_off != VLOG_NONE) && (end > vlog->buf_off) && (vp->off < (vlog->buf_off + vlog->buf_len))) {
+    const uint64_t from = (vp->off > vlog->buf_off) ? vp->off : vlog->buf_off;
+    assert(end <= (vlog->buf_off + vlog->buf_len));
+    memcpy(out + (from - vp->off), vlog->buf + (from - vlog->buf_off), end - from);
+    dev_end = from;
+  }
+  vlog->nr_read++;
+  pthread_mutex_unlock(&(vlog->mutex));
+
+  if (dev_end > vp->off) {
+    const uint64_t a0 = vp->off & (~(VLOG_ALIGN - 1));
+    const uint64_t a1 = vlog_round_up(dev_end);
+    uint8_t * const tmp = (typeof(tmp))aligned_alloc(VLOG_ALIGN, a1 - a0);
+    assert(tmp);
+    const ssize_t nr = pread(vlog->cm->raw_fd, tmp, a1 - a0, (off_t)a0);
+    if (nr < ((ssize_t)(dev_end - a0))) {
+      free(tmp);
+      return false;
+    }
+    memcpy(out, tmp + (vp->off - a0), dev_end - vp->off);
+    free(tmp);
+  }
+  return true;
+}
+
+  struct VLogDrops *
+vlog_drops_new(struct VLog * const vlog)
+{
+  const size_t size = sizeof(struct VLogDrops) + (sizeof(uint64_t) * vlog->nr_segs);
+  struct VLogDrops * const drops = (typeof(drops))malloc(size);
+  assert(drops);
+  bzero(drops, size);
+  drops->vlog = vlog;
+  return drops;
+}
+
+// thread-safe; can be used as a Table's vdrop
+  void
+vlog_drops_add(void * const ptr, const struct ValuePtr * const vp)
+{
+  struct VLogDrops * const drops = (typeof(drops))ptr;
+  const uint64_t id = vp->off / drops->vlog->cm->unit_size;
+  assert(id < drops->vlog->nr_segs);
+  __sync_add_and_fetch(&(drops->dropped[id]), vp->len);
+}
+
+// only after the edit that dropped the pointers is committed.
+// live counts are not logged: after a crash they can only be larger than the truth.
+  void
+vlog_drops_apply(struct VLog * const vlog, struct VLogDrops * const drops)
+{
+  pthread_mutex_lock(&(vlog->mutex));
+  for (uint64_t i = 0; i < vlog->nr_segs; i++) {
+    if (drops->dropped[i] == 0) continue;
+    const uint64_t nr = __sync_fetch_and_and(&(drops->dropped[i]), 0);
+    struct VLogSeg * const seg = &(vlog->segs[i]);
+    seg->live = (seg->live > nr) ? (seg->live - nr) : 0;
+    if ((seg->live == 0) && (seg->state == VLOG_SEG_SEALED)) {
+      seg->state = VLOG_SEG_DEAD;
+      seg->dirty = true;
+    }
+  }
+  pthread_mutex_unlock(&(vlog->mutex));
+}
+
+// fill at most max MANIFEST_VLOG records from *cursor.
+// all == false: changed segments only; all == true: every segment in use (for a checkpoint)
+  uint64_t
+vlog_records(struct VLog * const vlog, struct ManifestRecord * const recs, const uint64_t max,
+    uint64_t * const cursor, const bool all)
+{
+  uint64_t nr = 0;
+  pthread_mutex_lock(&(vlog->mutex));
+  while ((*cursor < vlog->nr_segs) && (nr < max)) {
+    struct VLogSeg * const seg = &(vlog->segs[*cursor]);
+    const bool emit = all ? ((seg->state == VLOG_SEG_OPEN) || (seg->state == VLOG_SEG_SEALED)) : seg->dirty;
+    if (emit) {
+      struct ManifestRecord * const rec = &(recs[nr]);
+      bzero(rec, sizeof(*rec));
+      rec->type = MANIFEST_VLOG;
+      rec->dev = vlog->dev;
+      rec->off = (*cursor) * vlog->cm->unit_size;
+      rec->arg = (seg->state == VLOG_SEG_DEAD) ? VLOG_SEG_FREE : seg->state;
+      rec->mtid = seg->live;
+      nr++;
+    }
+    seg->dirty = false;
+    (*cursor)++;
+  }
+  pthread_mutex_unlock(&(vlog->mutex));
+  return nr;
+}
+
+// release the dead segments whose state has been logged
+  void
+vlog_release_dead(struct VLog * const vlog)
+{
+  pthread_mutex_lock(&(vlog->mutex));
+  for (uint64_t i = 0; i < vlog->nr_segs; i++) {
+    struct VLogSeg * const seg = &(vlog->segs[i]);
+    if ((seg->state == VLOG_SEG_DEAD) && (seg->dirty == false)) {
+      containermap_release(vlog->cm, i * vlog->cm->unit_size);
+      seg->state = VLOG_SEG_FREE;
+      seg->live = 0;
+      vlog->nr_freed++;
+    }
+  }
+  pthread_mutex_unlock(&(vlog->mutex));
+}
+
+// replay a MANIFEST_VLOG record
+  void
+vlog_restore(struct VLog * const vlog, const uint64_t off, const uint8_t state, const uint64_t live)
+{
+  assert(state <= VLOG_SEG_SEALED);
+  struct VLogSeg * const seg = vlog_seg(vlog, off);
+  seg->state = state;
+  seg->live = live;
+}
+
+// after replay: the live bytes of a segment open at the last run also count values lost with the
+// memtable; it is sealed with no live bytes and recounted from the tables with vlog_recount_add().
+// return the number of such segments; vlog_recount_done() must follow
+  uint64_t
+vlog_restore_done(struct VLog * const vlog)
+{
+  uint64_t nr_recount = 0;
+  for (uint64_t i = 0; i < vlog->nr_segs; i++) {
+    struct VLogSeg * const seg = &(vlog->segs[i]);
+    if (seg->state == VLOG_SEG_FREE) continue;
+    if (seg->state == VLOG_SEG_OPEN) {
+      seg->state = VLOG_SEG_SEALED;
+      seg->live = 0;
+      seg->recount = true;
+      seg->dirty = true;
+      nr_recount++;
+    }
+    const bool rm = containermap_mark_used(vlog->cm, i * vlog->cm->unit_size);
+    assert(rm);
+  }
+  return nr_recount;
+}
+
+// a ValuePtr found in a table, for the segments being recounted; see metatable_walk_vptrs()
+  void
+vlog_recount_add(void * const ptr, const struct ValuePtr * const vp)
+{
+  struct VLog * const vlog = (typeof(vlog))ptr;
+  if (vp->dev != vlog->dev) return;
+  struct VLogSeg * const seg = vlog_seg(vlog, vp->off);
+  if (seg->recount) seg->live += vp->len;
+}
+
+  void
+vlog_recount_done(struct VLog * const vlog)
+{
+  for (uint64_t i = 0; i < vlog->nr_segs; i++) {
+    struct VLogSeg * const seg = &(vlog->segs[i]);
+    seg->recount = false;
+    if ((seg->state == VLOG_SEG_SEALED) && (seg->live == 0)) {
+      seg->state = VLOG_SEG_DEAD;
+      seg->dirty = true;
+    }
+  }
+}
+
+  void
+vlog_show(struct VLog * const vlog, FILE * const fo)
+{
+  uint64_t nr_used = 0;
+  for (uint64_t i = 0; i < vlog->nr_segs; i++) {
+    if (vlog->segs[i].state != VLOG_SEG_FREE) nr_used++;
+  }
+  fprintf(fo, "vlog append %lu (%luMB) read %lu segments %lu freed %lu\n",
+      vlog->nr_append, vlog->bytes_append >> 20, vlog->nr_read, nr_used, vlog->nr_freed);
+}
+
+// the open segment must have been sealed
+  void
+vlog_destroy(struct VLog * const vlog)
+{
+  free(vlog->buf);
+  free(vlog->segs);
+  free(vlog);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "table.h"
+#include "cmap.h"
+#include "manifest.h"
+
+// append-only value log in units of a ContainerMap.
+// a segment is freed when compaction has dropped all the pointers to it.
+enum VLogSegState {
+  VLOG_SEG_FREE = 0,
+  VLOG_SEG_OPEN,     // being appended
+  VLOG_SEG_SEALED,
+  VLOG_SEG_DEAD,     // sealed and no live value, to be released
+};
+
+struct VLogSeg {
+  uint64_t live;     // bytes of values still referenced by tables
+  uint8_t state;     // VLOG_SEG_*
+  bool dirty;        // state not yet in the manifest
+  bool recount;      // live bytes being recounted at load, see vlog_restore_done()
+};
+
+struct VLog {
+  struct ContainerMap * cm;
+  uint32_t dev;
+  uint64_t threshold;      // values larger than this are separated
+  pthread_mutex_t mutex;
+  uint64_t seg_off;        // the open segment, UINT64_MAX: none
+  uint64_t seg_used;
+  uint8_t * buf;           // unwritten tail of the open segment
+  uint64_t buf_off;        // device offset of buf[0]
+  uint64_t buf_len;
+  uint64_t nr_segs;
+  struct VLogSeg * segs;   // by unit index of cm
+  // stat
+  uint64_t nr_append;
+  uint64_t nr_read;
+  uint64_t bytes_append;
+  uint64_t nr_freed;
+};
+
+// dropped bytes per segment, collected until the edit is committed
+struct VLogDrops {
+  struct VLog * vlog;
+  uint64_t dropped[];
+};
+
+  struct VLog *
+vlog_create(struct ContainerMap * const cm, const uint32_t dev, const uint64_t threshold);
+
+  bool
+vlog_append(struct VLog * const vlog, const uint8_t * const value, const uint32_t len,
+    struct ValuePtr * const vp);
+
+  void
+vlog_flush(struct VLog * const vlog);
+
+  void
+vlog_seal(struct VLog * const vlog);
+
+  bool
+vlog_read(struct VLog * const vlog, const struct ValuePtr * const vp, uint8_t * const out);
+
+  struct VLogDrops *
+vlog_drops_new(struct VLog * const vlog);
+
+  void
+vlog_drops_add(void * const ptr, const struct ValuePtr * const vp);
+
+  void
+vlog_drops_apply(struct VLog * const vlog, struct VLogDrops * const drops);
+
+  uint64_t
+vlog_records(struct VLog * const vlog, struct ManifestRecord * const recs, const uint64_t max,
+    uint64_t * const cursor, const bool all);
+
+  void
+vlog_release_dead(struct VLog * const vlog);
+
+  void
+vlog_restore(struct VLog * const vlog, const uint64_t off, const uint8_t state, const uint64_t live);
+
+  uint64_t
+vlog_restore_done(struct VLog * const vlog);
+
+  void
+vlog_recount_add(void * const ptr, const struct ValuePtr * const vp);
+
+  void
+vlog_recount_done(struct VLog * const vlog);
+
+  void
+vlog_show(struct VLog * const vlog, FILE * const fo);
+
+  void
+vlog_destroy(struct VLog * const vlog);
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2014  Wu, Xingbo <wuxb45@gmail.com>
+ *
+ * All rights reserved. No warranty, explicit or implicit, provided.
+ */
+
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "cmap.h"
+#include "vlog.h"
+
+#define NR_VALUES ((UINT64_C(900)))
+
+  static uint32_t
+value_len(const uint64_t i)
+{
+  return (uint32_t)(((i * 7919) % 200000) + 1);
+}
+
+  static void
+value_fill(const uint64_t i, uint8_t * const buf)
+{
+  const uint32_t len = value_len(i);
+  for (uint32_t j = 0; j < len; j++) {
+    buf[j] = (uint8_t)(i + (j * 13));
+  }
+}
+
+  static void
+vlog_test(void)
+{
+  const char * const raw_fn = "/tmp/vlog_test";
+  const uint64_t cap = UINT64_C(1024 * 1024) * 32 * 8;
+  struct ContainerMap * const cm = containermap_create(raw_fn, cap);
+  assert(cm);
+  struct VLog * const vlog = vlog_create(cm, 0, 1024);
+  assert(vlog);
+  uint8_t * const buf = (typeof(buf))malloc(200000);
+  uint8_t * const out = (typeof(out))malloc(200000);
+  struct ValuePtr vps[NR_VALUES];
+
+  // append: readable before and after flush
+  for (uint64_t i = 0; i < NR_VALUES; i++) {
+    value_fill(i, buf);
+    const bool ra = vlog_append(vlog, buf, value_len(i), &(vps[i]));
+    assert(ra);
+    assert(vps[i].len == value_len(i));
+    const bool rr = vlog_read(vlog, &(vps[i]), out);
+    assert(rr && (memcmp(buf, out, value_len(i)) == 0));
+  }
+  vlog_flush(vlog);
+  for (uint64_t i = 0; i < NR_VALUES; i++) {
+    value_fill(i, buf);
+    const bool rr = vlog_read(vlog, &(vps[i]), out);
+    assert(rr && (memcmp(buf, out, value_len(i)) == 0));
+  }
+  const uint64_t seg0 = vps[0].off / cm->unit_size;
+  assert(vlog->segs[seg0].state == VLOG_SEG_SEALED);
+  const uint64_t nr_used = cm->nr_used;
+
+  // drop everything in the first segment
+  struct VLogDrops * const drops = vlog_drops_new(vlog);
+  for (uint64_t i = 0; i < NR_VALUES; i++) {
+    if ((vps[i].off / cm->unit_size) == seg0) {
+      vlog_drops_add(drops, &(vps[i]));
+    }
+  }
+  vlog_drops_apply(vlog, drops);
+  assert(vlog->segs[seg0].state == VLOG_SEG_DEAD);
+  // not released before its state is logged
+  vlog_release_dead(vlog);
+  assert(cm->nr_used == nr_used);
+  struct ManifestRecord recs[16];
+  uint64_t cursor = 0;
+  const uint64_t nr = vlog_records(vlog, recs, 16, &cursor, false);
+  bool logged = false;
+  for (uint64_t i = 0; i < nr; i++) {
+    assert(recs[i].type == MANIFEST_VLOG);
+    if (recs[i].off == (seg0 * cm->unit_size)) {
+      assert(recs[i].arg == VLOG_SEG_FREE);
+      logged = true;
+    }
+  }
+  assert(logged);
+  vlog_release_dead(vlog);
+  assert(vlog->segs[seg0].state == VLOG_SEG_FREE);
+  assert(vlog->nr_freed == 1);
+
+  vlog_seal(vlog);
+  free(drops);
+  free(buf);
+  free(out);
+  vlog_destroy(vlog);
+  containermap_destroy(cm);
+  unlink(raw_fn);
+  printf("vlog_test passed\n");
+}
+
+// segments open at a crash get their live bytes from the tables
+  static void
+vlog_restore_test(void)
+{
+  const char * const raw_fn = "/tmp/vlog_test";
+  const uint64_t cap = UINT64_C(1024 * 1024) * 32 * 8;
+  struct ContainerMap * const cm = containermap_create(raw_fn, cap);
+  assert(cm);
+  struct VLog * const vlog = vlog_create(cm, 0, 1024);
+  assert(vlog);
+  const uint64_t unit = cm->unit_size;
+  // as replayed: segment 0 sealed, 1 and 2 open, with live bytes that include lost values
+  vlog_restore(vlog, 0, VLOG_SEG_SEALED, 1000);
+  vlog_restore(vlog, unit, VLOG_SEG_OPEN, 9000);
+  vlog_restore(vlog, unit * 2, VLOG_SEG_OPEN, 7000);
+  assert(vlog_restore_done(vlog) == 2);
+  assert(cm->nr_used == 3);
+  // the tables refer to 3000 bytes of segment 1 and none of segment 2
+  const struct ValuePtr vps[3] = {{0, 1000, 0}, {0, 1000, unit}, {0, 2000, unit + 1000}};
+  for (uint64_t i = 0; i < 3; i++) {
+    vlog_recount_add(vlog, &(vps[i]));
+  }
+  vlog_recount_done(vlog);
+  assert((vlog->segs[0].state == VLOG_SEG_SEALED) && (vlog->segs[0].live == 1000));
+  assert((vlog->segs[1].state == VLOG_SEG_SEALED) && (vlog->segs[1].live == 3000));
+  assert(vlog->segs[2].state == VLOG_SEG_DEAD);
+  // segment 2 is freed once logged
+  struct ManifestRecord recs[16];
+  uint64_t cursor = 0;
+  vlog_records(vlog, recs, 16, &cursor, false);
+  vlog_release_dead(vlog);
+  assert((vlog->segs[2].state == VLOG_SEG_FREE) && (cm->nr_used == 2));
+
+  vlog_destroy(vlog);
+  containermap_destroy(cm);
+  unlink(raw_fn);
+  printf("vlog_restore_test passed\n");
+}
+
+int
+main(int argc, char ** argv)
+{
+  (void)argc;
+  (void)argv;
+  vlog_test();
+  vlog_restore_test();
+  return 0;
+}